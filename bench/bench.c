@@ -0,0 +1,450 @@
+/**
+ * Benchmark suite measuring Rig SCP throughput and latency.
+ *
+ * An emulated machine (see emulator.h) is run on the local host and a series
+ * of one-factor-at-a-time sweeps are made around a baseline configuration,
+ * varying the window size (n_outstanding), transfer size, scp_data_length,
+ * packet loss rate and response latency. For each configuration, back-to-back
+ * rs_read, rs_write and (small) rs_send_scp requests are made for a fixed
+ * amount of work or time.
+ *
+ * Once compiled, run using `make bench` or directly:
+ *
+ *     ./bench_rig_scp [max_seconds_per_point]
+ *
+ * Results are printed to stdout as CSV with one row per configuration:
+ *
+ * * op -- read, write or scp
+ * * window, length, scp_data_length, loss, latency_us -- the configuration
+ * * depth -- the number of requests kept queued at once
+ * * n_ops, n_failed -- the number of requests completed and the number of
+ *   those which failed
+ * * seconds -- wall-clock duration
+ * * mb_per_s -- read/write payload throughput (10^6 bytes/sec)
+ * * packets_per_s -- packets sent per second (including retransmissions)
+ * * n_retransmissions -- total retransmissions
+ * * cpu_ns_per_packet -- CPU time consumed by the thread running Rig SCP per
+ *   packet sent (the emulator runs in a separate thread and is not included)
+ * * p50_us, p90_us, p99_us, max_us -- request latency percentiles, measured
+ *   from queueing the request to its callback
+ *
+ * Losses are generated by a fixed-seed PRNG so that runs are repeatable.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <uv.h>
+
+#include <rs.h>
+
+#include "emulator.h"
+
+
+// Default maximum time (seconds) spent on each configuration
+#define BENCH_DEFAULT_MAX_SECONDS 2.0
+
+// Amount of data transferred by read/write configurations and the number of
+// round trips made by SCP configurations (unless the time limit is reached
+// first)
+#define BENCH_RW_BYTES (16 * 1024 * 1024)
+#define BENCH_N_SCP 50000
+
+// Number of rs_read/rs_write requests kept queued at once (enough that the
+// window never drains between requests)
+#define BENCH_RW_DEPTH 2
+
+// Maximum number of requests kept queued at once
+#define BENCH_MAX_DEPTH 64
+
+// Number of transmission attempts made per packet
+#define BENCH_N_TRIES 5
+
+// The address read from and written to
+#define BENCH_ADDRESS 0x60000000
+
+#define BENCH_MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define BENCH_MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define BENCH_N(a) (sizeof(a) / sizeof((a)[0]))
+
+
+/******************************************************************************
+ * Benchmark driver
+ ******************************************************************************/
+
+typedef enum {
+	BENCH_OP_READ,
+	BENCH_OP_WRITE,
+	BENCH_OP_SCP,
+} bench_op_t;
+
+static const char *bench_op_names[] = {"read", "write", "scp"};
+
+
+/**
+ * A benchmark configuration.
+ */
+typedef struct {
+	bench_op_t op;
+	unsigned int window;
+	size_t length;
+	size_t scp_data_length;
+	double loss;
+	uint64_t latency;  // usec
+} bench_config_t;
+
+
+typedef struct bench_run bench_run_t;
+
+/**
+ * A request slot: each is used by one request at a time and is re-used as
+ * soon as its request completes.
+ */
+typedef struct {
+	bench_run_t *run;
+	
+	// The time (uv_hrtime) the current request was queued
+	uint64_t queued_time;
+	
+	// The buffer read into/written from
+	uv_buf_t data;
+} bench_slot_t;
+
+
+/**
+ * The state of a single benchmark run.
+ */
+struct bench_run {
+	const bench_config_t *config;
+	uv_loop_t *loop;
+	rs_conn_t *conn;
+	
+	// Stop queueing new requests after this many or this time (uv_hrtime)
+	uint64_t max_ops;
+	uint64_t deadline;
+	
+	// Requests queued, completed and failed
+	uint64_t n_queued;
+	uint64_t n_ops;
+	uint64_t n_failed;
+	unsigned int n_in_flight;
+	
+	// Wall-clock and CPU time (nsec) at the start and end of the run
+	uint64_t start_time;
+	uint64_t end_time;
+	uint64_t start_cpu;
+	uint64_t end_cpu;
+	
+	// Connection statistics at the end of the run
+	rs_stats_t stats;
+	
+	// Latencies (nsec) of every completed request
+	uint64_t *latencies;
+	
+	unsigned int depth;
+	bench_slot_t slots[BENCH_MAX_DEPTH];
+};
+
+
+/**
+ * CPU time consumed by the calling thread (nsec).
+ */
+static uint64_t
+bench_cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static void bench_queue(bench_slot_t *slot);
+
+
+/**
+ * Common completion handling for all request types.
+ */
+static void
+bench_complete(bench_slot_t *slot, int error)
+{
+	bench_run_t *run = slot->run;
+	
+	run->latencies[run->n_ops++] = uv_hrtime() - slot->queued_time;
+	if (error)
+		run->n_failed++;
+	
+	if (run->n_queued < run->max_ops && uv_hrtime() < run->deadline) {
+		bench_queue(slot);
+		return;
+	}
+	
+	if (--run->n_in_flight)
+		return;
+	
+	// All requests complete
+	run->end_time = uv_hrtime();
+	run->end_cpu = bench_cpu_time();
+	uv_stop(run->loop);
+}
+
+
+static void
+bench_rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+            void *cb_data)
+{
+	bench_complete((bench_slot_t *)cb_data, error);
+}
+
+
+static void
+bench_scp_cb(rs_conn_t *conn, int error, uint16_t cmd_rc,
+             unsigned int n_args, uint32_t arg1, uint32_t arg2, uint32_t arg3,
+             uv_buf_t data, void *cb_data)
+{
+	bench_complete((bench_slot_t *)cb_data, error);
+}
+
+
+/**
+ * Queue a request using the given slot. Aborts on failure.
+ */
+static void
+bench_queue(bench_slot_t *slot)
+{
+	bench_run_t *run = slot->run;
+	int error = 0;
+	
+	run->n_queued++;
+	slot->queued_time = uv_hrtime();
+	switch (run->config->op) {
+		case BENCH_OP_READ:
+			error = rs_read(run->conn, 0, 0, BENCH_ADDRESS, slot->data,
+			                bench_rw_cb, slot);
+			break;
+		
+		case BENCH_OP_WRITE:
+			error = rs_write(run->conn, 0, 0, BENCH_ADDRESS, slot->data,
+			                 bench_rw_cb, slot);
+			break;
+		
+		case BENCH_OP_SCP:
+			// A CMD_VER-sized request with no arguments or data (the slot's
+			// buffer is empty)
+			error = rs_send_scp(run->conn, 0, 0, 0, 0, 0, 0, 0, 0,
+			                    slot->data, 0, bench_scp_cb, slot);
+			break;
+	}
+	if (error) abort();
+}
+
+
+static int
+bench_compare_u64(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a;
+	uint64_t vb = *(const uint64_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+
+/**
+ * Get a percentile (usec) of a sorted array of latencies.
+ */
+static double
+bench_percentile(const uint64_t *latencies, uint64_t n, double percentile)
+{
+	if (!n)
+		return 0.0;
+	uint64_t i = (uint64_t)(percentile / 100.0 * (n - 1) + 0.5);
+	return latencies[i] / 1000.0;
+}
+
+
+static void
+bench_print_header(void)
+{
+	printf("op,window,length,scp_data_length,loss,latency_us,depth,"
+	       "n_ops,n_failed,seconds,mb_per_s,packets_per_s,n_retransmissions,"
+	       "cpu_ns_per_packet,p50_us,p90_us,p99_us,max_us\n");
+}
+
+
+/**
+ * Run a single benchmark configuration and print its results.
+ */
+static void
+bench_run(uv_loop_t *loop, const bench_config_t *config, double max_seconds)
+{
+	bench_run_t run;
+	run.config = config;
+	run.loop = loop;
+	
+	if (config->op == BENCH_OP_SCP) {
+		run.max_ops = BENCH_N_SCP;
+		run.depth = BENCH_MIN(2 * config->window, BENCH_MAX_DEPTH);
+	} else {
+		run.max_ops = BENCH_RW_BYTES / config->length;
+		run.depth = BENCH_RW_DEPTH;
+	}
+	run.max_ops = BENCH_MAX(run.max_ops, run.depth);
+	run.latencies = malloc(run.max_ops * sizeof(uint64_t));
+	if (!run.latencies) abort();
+	
+	em_chip_config_t chip_config = {
+		.latency = config->latency,
+		.loss = config->loss,
+	};
+	em_t *em = em_init(&chip_config, 0, 1);
+	if (!em) abort();
+	struct sockaddr_in addr;
+	em_getsockname(em, &addr);
+	em_start(em);
+	
+	// Allow for the latency when choosing the retransmission timeout (msec)
+	uint64_t timeout = 2 * (config->latency / 1000) + 10;
+	run.conn = rs_init(loop, (struct sockaddr *)&addr,
+	                   config->scp_data_length, timeout, BENCH_N_TRIES,
+	                   config->window);
+	if (!run.conn) abort();
+	
+	unsigned int i;
+	for (i = 0; i < run.depth; i++) {
+		run.slots[i].run = &run;
+		run.slots[i].data.len = (config->op == BENCH_OP_SCP) ? 0 : config->length;
+		run.slots[i].data.base = calloc(1, BENCH_MAX(run.slots[i].data.len, 1));
+		if (!run.slots[i].data.base) abort();
+	}
+	
+	run.n_queued = 0;
+	run.n_ops = 0;
+	run.n_failed = 0;
+	run.n_in_flight = run.depth;
+	run.start_time = uv_hrtime();
+	run.start_cpu = bench_cpu_time();
+	run.deadline = run.start_time + (uint64_t)(max_seconds * 1e9);
+	for (i = 0; i < run.depth; i++)
+		bench_queue(&(run.slots[i]));
+	
+	// Runs until the last request completes
+	uv_run(loop, UV_RUN_DEFAULT);
+	
+	rs_get_stats(run.conn, &(run.stats));
+	rs_free(run.conn, NULL, NULL);
+	uv_run(loop, UV_RUN_DEFAULT);
+	
+	em_free(em);
+	for (i = 0; i < run.depth; i++)
+		free(run.slots[i].data.base);
+	
+	// Report the results
+	double seconds = (run.end_time - run.start_time) / 1e9;
+	uint64_t n_bytes = run.stats.read.n_bytes + run.stats.write.n_bytes;
+	uint64_t n_packets = run.stats.scp_packet.n_packets_sent +
+	                     run.stats.read.n_packets_sent +
+	                     run.stats.write.n_packets_sent;
+	qsort(run.latencies, run.n_ops, sizeof(uint64_t), bench_compare_u64);
+	
+	printf("%s,%u,%zu,%zu,%g,%llu,%u,"
+	       "%llu,%llu,%.6f,%.3f,%.1f,%llu,"
+	       "%.1f,%.1f,%.1f,%.1f,%.1f\n",
+	       bench_op_names[config->op], config->window,
+	       (config->op == BENCH_OP_SCP) ? 0 : config->length,
+	       config->scp_data_length, config->loss,
+	       (unsigned long long)config->latency, run.depth,
+	       (unsigned long long)run.n_ops, (unsigned long long)run.n_failed,
+	       seconds, n_bytes / seconds / 1e6, n_packets / seconds,
+	       (unsigned long long)run.stats.n_retransmissions,
+	       n_packets ? (double)(run.end_cpu - run.start_cpu) / n_packets : 0.0,
+	       bench_percentile(run.latencies, run.n_ops, 50.0),
+	       bench_percentile(run.latencies, run.n_ops, 90.0),
+	       bench_percentile(run.latencies, run.n_ops, 99.0),
+	       bench_percentile(run.latencies, run.n_ops, 100.0));
+	fflush(stdout);
+	
+	free(run.latencies);
+}
+
+
+/**
+ * The baseline configuration around which each parameter is swept.
+ */
+static const bench_config_t bench_baseline = {
+	.op = BENCH_OP_READ,
+	.window = 8,
+	.length = 64 * 1024,
+	.scp_data_length = 256,
+	.loss = 0.0,
+	.latency = 0,
+};
+
+static const unsigned int bench_windows[] = {1, 2, 4, 8, 16, 32};
+static const size_t bench_lengths[] = {256, 4096, 64 * 1024, 1024 * 1024};
+static const size_t bench_scp_data_lengths[] = {32, 64, 128, 256};
+static const double bench_losses[] = {0.0, 0.001, 0.01, 0.05};
+static const uint64_t bench_latencies[] = {0, 100, 1000, 5000, 20000};
+
+
+int
+main(int argc, char *argv[])
+{
+	double max_seconds = BENCH_DEFAULT_MAX_SECONDS;
+	if (argc > 2 || (argc == 2 && (max_seconds = atof(argv[1])) <= 0.0)) {
+		fprintf(stderr, "Usage: %s [max_seconds_per_point]\n", argv[0]);
+		return 1;
+	}
+	
+	uv_loop_t *loop = uv_default_loop();
+	
+	bench_print_header();
+	
+	bench_op_t op;
+	for (op = BENCH_OP_READ; op <= BENCH_OP_SCP; op++) {
+		bench_config_t config = bench_baseline;
+		config.op = op;
+		size_t i;
+		
+		for (i = 0; i < BENCH_N(bench_windows); i++) {
+			config.window = bench_windows[i];
+			bench_run(loop, &config, max_seconds);
+		}
+		config.window = bench_baseline.window;
+		
+		// The SCP benchmark sends no data so is not affected by these
+		if (op != BENCH_OP_SCP) {
+			for (i = 0; i < BENCH_N(bench_lengths); i++) {
+				config.length = bench_lengths[i];
+				bench_run(loop, &config, max_seconds);
+			}
+			config.length = bench_baseline.length;
+			
+			for (i = 0; i < BENCH_N(bench_scp_data_lengths); i++) {
+				config.scp_data_length = bench_scp_data_lengths[i];
+				bench_run(loop, &config, max_seconds);
+			}
+			config.scp_data_length = bench_baseline.scp_data_length;
+		}
+		
+		for (i = 0; i < BENCH_N(bench_losses); i++) {
+			config.loss = bench_losses[i];
+			bench_run(loop, &config, max_seconds);
+		}
+		config.loss = bench_baseline.loss;
+		
+		for (i = 0; i < BENCH_N(bench_latencies); i++) {
+			config.latency = bench_latencies[i];
+			bench_run(loop, &config, max_seconds);
+		}
+		config.latency = bench_baseline.latency;
+	}
+	
+	uv_loop_close(loop);
+	
+	return 0;
+}
@@ -0,0 +1,954 @@
+/**
+ * SpiNNaker machine emulator implementation.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <uv.h>
+
+#include <rs__scp.h>
+
+#include "emulator.h"
+
+
+/**
+ * On Linux, datagrams are received and sent in batches using recvmmsg and
+ * sendmmsg.
+ */
+#if defined(__linux__)
+#define EM__BATCHING
+#endif
+
+// Maximum number of datagrams received or sent per system call
+#define EM__BATCH_SIZE 64
+
+// Maximum number of receive system calls made each time the socket becomes
+// readable (such that responses are still sent promptly under heavy load)
+#define EM__MAX_RECV_PER_POLL 16
+
+// Size of request and response datagrams (including the two padding bytes)
+#define EM__MAX_PACKET (2 + RS__SIZEOF_SCP_PACKET(3, EM_SCP_DATA_LENGTH))
+
+// Size of the socket buffers requested
+#define EM__SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Memory page size (bytes)
+#define EM__PAGE_BITS 12
+#define EM__PAGE_SIZE (1u << EM__PAGE_BITS)
+
+// Initial number of entries in each chip's page table (a power of two)
+#define EM__INITIAL_PAGE_TABLE_SIZE 64
+
+// Number of chips addressable
+#define EM__N_CHIPS 65536
+
+#define EM__NS_PER_US 1000ull
+#define EM__NS_PER_MS 1000000ull
+
+#define EM__MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define EM__MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Offsets of fields within a datagram (after the two padding bytes)
+#define EM__DEST_ADDR_OFFSET (2 + 4)
+#define EM__CMD_RC_OFFSET (2 + RS__SDP_HEADER_LENGTH)
+#define EM__ARG_OFFSET(n) \
+	(2 + RS__SDP_HEADER_LENGTH + RS__SCP_HEADER_LENGTH((n) - 1))
+
+
+/**
+ * A page of a chip's memory.
+ */
+typedef struct {
+	// Page number (address >> EM__PAGE_BITS)
+	uint32_t number;
+	
+	char data[EM__PAGE_SIZE];
+} em__page_t;
+
+
+/**
+ * The state of a simulated chip.
+ */
+typedef struct {
+	em_chip_config_t config;
+	
+	// The time (uv_hrtime) at which the chip will have processed all requests
+	// received so far (when rate limited)
+	uint64_t busy_until;
+	
+	// Open-addressed (linear probing) hash table of allocated pages. The size
+	// is a power of two and is kept at least twice the number of pages.
+	em__page_t **pages;
+	size_t n_pages;
+	size_t pages_size;
+} em__chip_t;
+
+
+typedef struct em__resp em__resp_t;
+
+/**
+ * A response waiting to be sent.
+ */
+struct em__resp {
+	// The time (uv_hrtime) at which the response is due to be sent
+	uint64_t due;
+	
+	// The address to send the response to
+	struct sockaddr_in addr;
+	
+	// Next entry in the free list
+	em__resp_t *next;
+	
+	size_t len;
+	char packet[EM__MAX_PACKET];
+};
+
+
+struct em {
+	// The emulator's event loop, the thread running it and whether it is
+	// running
+	uv_loop_t loop;
+	uv_thread_t thread;
+	bool running;
+	
+	// The emulator's socket and the address bound
+	int fd;
+	struct sockaddr_in addr;
+	
+	// Handles used to wait for incoming packets, for the next response to
+	// become due (sleeping or spinning) and to stop the emulator
+	uv_poll_t poll_handle;
+	uv_timer_t timer_handle;
+	uv_idle_t idle_handle;
+	uv_async_t stop_handle;
+	
+	// State of the (xorshift64*) PRNG
+	uint64_t rand_state;
+	
+	// Configuration of chips not yet created
+	em_chip_config_t default_config;
+	
+	// Chips, created on first use
+	em__chip_t *chips[EM__N_CHIPS];
+	
+	// Binary min-heap (ordered by due time) of responses waiting to be sent
+	em__resp_t **heap;
+	size_t heap_len;
+	size_t heap_size;
+	
+	// Response structures not currently in use
+	em__resp_t *free_resps;
+	
+	em_stats_t stats;
+	
+	// Buffers into which datagrams are received
+	char recv_bufs[EM__BATCH_SIZE][EM__MAX_PACKET];
+};
+
+
+/******************************************************************************
+ * Utilities
+ ******************************************************************************/
+
+static uint16_t
+em__get16(const char *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+static uint32_t
+em__get32(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+static void
+em__set16(char *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+
+/**
+ * Get the next 64-bit pseudo-random number.
+ */
+static uint64_t
+em__rand(em_t *em)
+{
+	em->rand_state ^= em->rand_state >> 12;
+	em->rand_state ^= em->rand_state << 25;
+	em->rand_state ^= em->rand_state >> 27;
+	return em->rand_state * 2685821657736338717ull;
+}
+
+
+/**
+ * Return true with the given probability.
+ */
+static bool
+em__chance(em_t *em, double probability)
+{
+	if (probability <= 0.0)
+		return false;
+	return (em__rand(em) >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
+
+/******************************************************************************
+ * Chips and memory
+ ******************************************************************************/
+
+/**
+ * Get a chip, creating it with the default configuration if required.
+ *
+ * @returns NULL if out of memory.
+ */
+static em__chip_t *
+em__get_chip(em_t *em, uint16_t chip_id)
+{
+	em__chip_t *chip = em->chips[chip_id];
+	if (chip)
+		return chip;
+	
+	chip = malloc(sizeof(em__chip_t));
+	if (!chip)
+		return NULL;
+	chip->pages = calloc(EM__INITIAL_PAGE_TABLE_SIZE, sizeof(em__page_t *));
+	if (!chip->pages) {
+		free(chip);
+		return NULL;
+	}
+	chip->config = em->default_config;
+	chip->busy_until = 0;
+	chip->n_pages = 0;
+	chip->pages_size = EM__INITIAL_PAGE_TABLE_SIZE;
+	
+	em->chips[chip_id] = chip;
+	return chip;
+}
+
+
+/**
+ * Find the entry in a chip's page table for the given page number: either the
+ * entry holding that page or the empty entry where it would be inserted.
+ */
+static em__page_t **
+em__page_entry(em__chip_t *chip, uint32_t number)
+{
+	size_t mask = chip->pages_size - 1;
+	size_t i = (number * 2654435761u) & mask;
+	while (chip->pages[i] && chip->pages[i]->number != number)
+		i = (i + 1) & mask;
+	return &(chip->pages[i]);
+}
+
+
+/**
+ * Get a page of a chip's memory.
+ *
+ * @param create If true, allocate (zeroed) pages which don't exist.
+ * @returns NULL if the page doesn't exist (or is out of memory).
+ */
+static em__page_t *
+em__get_page(em_t *em, em__chip_t *chip, uint32_t number, bool create)
+{
+	em__page_t **entry = em__page_entry(chip, number);
+	if (*entry || !create)
+		return *entry;
+	
+	// Double the table size when it becomes half full
+	if (2 * (chip->n_pages + 1) > chip->pages_size) {
+		em__page_t **old_pages = chip->pages;
+		size_t old_size = chip->pages_size;
+		chip->pages = calloc(2 * old_size, sizeof(em__page_t *));
+		if (!chip->pages) {
+			chip->pages = old_pages;
+			return NULL;
+		}
+		chip->pages_size = 2 * old_size;
+		
+		size_t i;
+		for (i = 0; i < old_size; i++)
+			if (old_pages[i])
+				*em__page_entry(chip, old_pages[i]->number) = old_pages[i];
+		free(old_pages);
+		
+		entry = em__page_entry(chip, number);
+	}
+	
+	em__page_t *page = calloc(1, sizeof(em__page_t));
+	if (!page)
+		return NULL;
+	page->number = number;
+	*entry = page;
+	chip->n_pages++;
+	em->stats.n_pages++;
+	
+	return page;
+}
+
+
+/**
+ * Read from a chip's memory.
+ */
+static void
+em__read(em_t *em, em__chip_t *chip, uint32_t address, char *data,
+         size_t length)
+{
+	while (length) {
+		uint32_t offset = address & (EM__PAGE_SIZE - 1);
+		size_t n = EM__MIN(length, EM__PAGE_SIZE - offset);
+		
+		em__page_t *page = em__get_page(em, chip, address >> EM__PAGE_BITS,
+		                                false);
+		if (page)
+			memcpy(data, page->data + offset, n);
+		else
+			memset(data, 0, n);
+		
+		address += n;
+		data += n;
+		length -= n;
+	}
+}
+
+
+/**
+ * Write to a chip's memory.
+ *
+ * @returns 0 on success or -1 if out of memory.
+ */
+static int
+em__write(em_t *em, em__chip_t *chip, uint32_t address, const char *data,
+          size_t length)
+{
+	while (length) {
+		uint32_t offset = address & (EM__PAGE_SIZE - 1);
+		size_t n = EM__MIN(length, EM__PAGE_SIZE - offset);
+		
+		em__page_t *page = em__get_page(em, chip, address >> EM__PAGE_BITS,
+		                                true);
+		if (!page)
+			return -1;
+		memcpy(page->data + offset, data, n);
+		
+		address += n;
+		data += n;
+		length -= n;
+	}
+	
+	return 0;
+}
+
+
+/******************************************************************************
+ * Response queue
+ ******************************************************************************/
+
+static em__resp_t *
+em__alloc_resp(em_t *em)
+{
+	em__resp_t *resp = em->free_resps;
+	if (resp) {
+		em->free_resps = resp->next;
+		return resp;
+	}
+	return malloc(sizeof(em__resp_t));
+}
+
+
+static void
+em__free_resp(em_t *em, em__resp_t *resp)
+{
+	resp->next = em->free_resps;
+	em->free_resps = resp;
+}
+
+
+/**
+ * Add a response to the heap.
+ *
+ * @returns 0 on success or -1 if out of memory.
+ */
+static int
+em__heap_push(em_t *em, em__resp_t *resp)
+{
+	if (em->heap_len == em->heap_size) {
+		size_t size = EM__MAX(2 * em->heap_size, 64);
+		em__resp_t **heap = realloc(em->heap, size * sizeof(em__resp_t *));
+		if (!heap)
+			return -1;
+		em->heap = heap;
+		em->heap_size = size;
+	}
+	
+	// Sift up
+	size_t i = em->heap_len++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (em->heap[parent]->due <= resp->due)
+			break;
+		em->heap[i] = em->heap[parent];
+		i = parent;
+	}
+	em->heap[i] = resp;
+	
+	return 0;
+}
+
+
+/**
+ * Remove the response due soonest from the (non-empty) heap.
+ */
+static em__resp_t *
+em__heap_pop(em_t *em)
+{
+	em__resp_t *top = em->heap[0];
+	em__resp_t *last = em->heap[--em->heap_len];
+	
+	// Sift the last entry down from the root
+	size_t i = 0;
+	size_t n = em->heap_len;
+	while (2 * i + 1 < n) {
+		size_t child = 2 * i + 1;
+		if (child + 1 < n && em->heap[child + 1]->due < em->heap[child]->due)
+			child++;
+		if (last->due <= em->heap[child]->due)
+			break;
+		em->heap[i] = em->heap[child];
+		i = child;
+	}
+	if (n)
+		em->heap[i] = last;
+	
+	return top;
+}
+
+
+/**
+ * Send a batch of responses, returning them to the free list.
+ */
+static void
+em__send(em_t *em, em__resp_t **resps, unsigned int n)
+{
+	unsigned int n_sent = 0;
+
+#ifdef EM__BATCHING
+	struct mmsghdr msgs[EM__BATCH_SIZE];
+	struct iovec iov[EM__BATCH_SIZE];
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = resps[i]->packet;
+		iov[i].iov_len = resps[i]->len;
+		memset(&(msgs[i].msg_hdr), 0, sizeof(struct msghdr));
+		msgs[i].msg_hdr.msg_name = &(resps[i]->addr);
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &(iov[i]);
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	while (n_sent < n) {
+		int r = sendmmsg(em->fd, msgs + n_sent, n - n_sent, MSG_DONTWAIT);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		n_sent += r;
+	}
+#else
+	while (n_sent < n) {
+		ssize_t r = sendto(em->fd, resps[n_sent]->packet, resps[n_sent]->len,
+		                   MSG_DONTWAIT, (struct sockaddr *)&(resps[n_sent]->addr),
+		                   sizeof(struct sockaddr_in));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		n_sent++;
+	}
+#endif
+
+	// Responses which couldn't be sent are simply lost (as they would be by a
+	// congested network)
+	em->stats.n_responses += n_sent;
+	em->stats.n_send_failed += n - n_sent;
+	
+	unsigned int j;
+	for (j = 0; j < n; j++)
+		em__free_resp(em, resps[j]);
+}
+
+
+static void em__timer_cb(uv_timer_t *handle);
+static void em__idle_cb(uv_idle_t *handle);
+
+
+/**
+ * Send all responses which are due and arrange to be woken when the next
+ * becomes due.
+ */
+static void
+em__flush(em_t *em)
+{
+	uint64_t now = uv_hrtime();
+	
+	em__resp_t *batch[EM__BATCH_SIZE];
+	unsigned int n = 0;
+	while (em->heap_len && em->heap[0]->due <= now) {
+		batch[n++] = em__heap_pop(em);
+		if (n == EM__BATCH_SIZE) {
+			em__send(em, batch, n);
+			n = 0;
+		}
+	}
+	if (n)
+		em__send(em, batch, n);
+	
+	if (!em->heap_len) {
+		uv_timer_stop(&(em->timer_handle));
+		uv_idle_stop(&(em->idle_handle));
+		return;
+	}
+	
+	// Libuv timers only have millisecond resolution (and may fire up to a
+	// millisecond late) so sleep until shortly before the right time and then
+	// spin (the idle handle makes the event loop poll without blocking).
+	uint64_t delay = em->heap[0]->due - now;
+	if (delay < 2 * EM__NS_PER_MS) {
+		uv_timer_stop(&(em->timer_handle));
+		uv_idle_start(&(em->idle_handle), em__idle_cb);
+	} else {
+		uv_idle_stop(&(em->idle_handle));
+		uv_timer_start(&(em->timer_handle), em__timer_cb,
+		               delay / EM__NS_PER_MS - 1, 0);
+	}
+}
+
+
+static void
+em__timer_cb(uv_timer_t *handle)
+{
+	em__flush((em_t *)handle->data);
+}
+
+
+static void
+em__idle_cb(uv_idle_t *handle)
+{
+	em__flush((em_t *)handle->data);
+}
+
+
+/**
+ * Fill a word-aligned block of a chip's memory with a repeated word.
+ *
+ * @returns 0 on success or -1 if out of memory.
+ */
+static int
+em__fill(em_t *em, em__chip_t *chip, uint32_t address, uint32_t word,
+         size_t length)
+{
+	// The word in the machine's byte order, repeated to fill a page at a time
+	char pattern[EM__PAGE_SIZE];
+	size_t i;
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = (char)((word >> (8 * (i & 3))) & 0xFF);
+	
+	while (length) {
+		size_t n = EM__MIN(length, sizeof(pattern));
+		if (em__write(em, chip, address, pattern, n))
+			return -1;
+		
+		address += n;
+		length -= n;
+	}
+	
+	return 0;
+}
+
+
+/******************************************************************************
+ * Request processing
+ ******************************************************************************/
+
+/**
+ * Generate the response to a request.
+ *
+ * @returns false if the request should be dropped.
+ */
+static bool
+em__respond(em_t *em, em__chip_t *chip, const char *packet, size_t len,
+            em__resp_t *resp)
+{
+	uint16_t cmd_rc = em__get16(packet + EM__CMD_RC_OFFSET);
+	bool rw = (cmd_rc == RS__SCP_CMD_READ || cmd_rc == RS__SCP_CMD_WRITE ||
+	           cmd_rc == RS__SCP_CMD_FILL) &&
+	          len >= 2 + RS__SIZEOF_SCP_PACKET(3, 0);
+	
+	if (!rw) {
+		// Echo back unchanged
+		memcpy(resp->packet, packet, len);
+		resp->len = len;
+		return true;
+	}
+	
+	uint32_t address = em__get32(packet + EM__ARG_OFFSET(1));
+	uint32_t length = em__get32(packet + EM__ARG_OFFSET(2));
+	size_t data_len = len - (2 + RS__SIZEOF_SCP_PACKET(3, 0));
+	
+	// The response consists of the request's header with no arguments
+	memcpy(resp->packet, packet, 2 + RS__SIZEOF_SCP_PACKET(0, 0));
+	resp->len = 2 + RS__SIZEOF_SCP_PACKET(0, 0);
+	
+	uint16_t rc = RS__SCP_CMD_OK;
+	if (cmd_rc == RS__SCP_CMD_FILL) {
+		// Fills give the word as arg2 and the length as arg3
+		uint32_t word = length;
+		length = em__get32(packet + EM__ARG_OFFSET(3));
+		if ((address | length) & 3)
+			rc = EM_RC_ARG;
+		else if (em__fill(em, chip, address, word, length))
+			return false;
+	} else if (length > EM_SCP_DATA_LENGTH) {
+		rc = EM_RC_LEN;
+	} else if (cmd_rc == RS__SCP_CMD_READ) {
+		em__read(em, chip, address, resp->packet + resp->len, length);
+		resp->len += length;
+	} else if (length > data_len) {
+		rc = EM_RC_LEN;
+	} else if (em__write(em, chip, address,
+	                     packet + 2 + RS__SIZEOF_SCP_PACKET(3, 0), length)) {
+		return false;
+	}
+	em__set16(resp->packet + EM__CMD_RC_OFFSET, rc);
+	
+	return true;
+}
+
+
+/**
+ * Handle a single arriving datagram.
+ */
+static void
+em__process(em_t *em, const char *packet, size_t len, bool truncated,
+            const struct sockaddr_in *addr, uint64_t now)
+{
+	em->stats.n_received++;
+	
+	if (truncated || len < 2 + RS__SIZEOF_SCP_PACKET(0, 0)) {
+		em->stats.n_malformed++;
+		return;
+	}
+	
+	em__chip_t *chip = em__get_chip(em, em__get16(packet +
+	                                              EM__DEST_ADDR_OFFSET));
+	if (!chip) {
+		em->stats.n_lost++;
+		return;
+	}
+	const em_chip_config_t *config = &(chip->config);
+	
+	if (em__chance(em, config->loss)) {
+		em->stats.n_lost++;
+		return;
+	}
+	
+	// Requests are processed one at a time when rate limited: drop requests
+	// arriving when too many are waiting
+	uint64_t done = now;
+	if (config->service_time) {
+		uint64_t service_time = config->service_time * EM__NS_PER_US;
+		uint64_t start = EM__MAX(now, chip->busy_until);
+		if ((start - now) / service_time >= config->max_queue) {
+			em->stats.n_overflowed++;
+			return;
+		}
+		chip->busy_until = done = start + service_time;
+	}
+	
+	em__resp_t *resp = em__alloc_resp(em);
+	if (!resp) {
+		em->stats.n_lost++;
+		return;
+	}
+	if (!em__respond(em, chip, packet, len, resp)) {
+		em->stats.n_lost++;
+		em__free_resp(em, resp);
+		return;
+	}
+	
+	resp->addr = *addr;
+	resp->due = done + config->latency * EM__NS_PER_US;
+	if (config->jitter)
+		resp->due += em__rand(em) % (config->jitter * EM__NS_PER_US + 1);
+	if (em__chance(em, config->reorder))
+		resp->due += config->reorder_delay * EM__NS_PER_US;
+	
+	if (em__heap_push(em, resp)) {
+		em->stats.n_lost++;
+		em__free_resp(em, resp);
+	}
+}
+
+
+/**
+ * Receive and process a batch of datagrams.
+ *
+ * @returns false if no more datagrams are waiting.
+ */
+static bool
+em__recv(em_t *em)
+{
+	struct sockaddr_in addrs[EM__BATCH_SIZE];
+	int n_recv;
+
+#ifdef EM__BATCHING
+	struct mmsghdr msgs[EM__BATCH_SIZE];
+	struct iovec iov[EM__BATCH_SIZE];
+	unsigned int i;
+	for (i = 0; i < EM__BATCH_SIZE; i++) {
+		iov[i].iov_base = em->recv_bufs[i];
+		iov[i].iov_len = EM__MAX_PACKET;
+		memset(&(msgs[i].msg_hdr), 0, sizeof(struct msghdr));
+		msgs[i].msg_hdr.msg_name = &(addrs[i]);
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &(iov[i]);
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	
+	do {
+		n_recv = recvmmsg(em->fd, msgs, EM__BATCH_SIZE, MSG_DONTWAIT, NULL);
+	} while (n_recv < 0 && errno == EINTR);
+	if (n_recv <= 0)
+		return false;
+	
+	uint64_t now = uv_hrtime();
+	int j;
+	for (j = 0; j < n_recv; j++)
+		em__process(em, em->recv_bufs[j], msgs[j].msg_len,
+		            msgs[j].msg_hdr.msg_flags & MSG_TRUNC, &(addrs[j]), now);
+#else
+	for (n_recv = 0; n_recv < EM__BATCH_SIZE; n_recv++) {
+		socklen_t addr_len = sizeof(struct sockaddr_in);
+		ssize_t nread;
+		do {
+			nread = recvfrom(em->fd, em->recv_bufs[0], EM__MAX_PACKET,
+			                 MSG_DONTWAIT | MSG_TRUNC,
+			                 (struct sockaddr *)&(addrs[0]), &addr_len);
+		} while (nread < 0 && errno == EINTR);
+		if (nread < 0)
+			break;
+		em__process(em, em->recv_bufs[0], EM__MIN(nread, EM__MAX_PACKET),
+		            nread > EM__MAX_PACKET, &(addrs[0]), uv_hrtime());
+	}
+	if (!n_recv)
+		return false;
+#endif
+
+	return n_recv == EM__BATCH_SIZE;
+}
+
+
+static void
+em__poll_cb(uv_poll_t *handle, int status, int events)
+{
+	em_t *em = (em_t *)handle->data;
+	
+	int i;
+	for (i = 0; i < EM__MAX_RECV_PER_POLL; i++)
+		if (!em__recv(em))
+			break;
+	
+	em__flush(em);
+}
+
+
+static void
+em__stop_cb(uv_async_t *handle)
+{
+	em_t *em = (em_t *)handle->data;
+	
+	uv_close((uv_handle_t *)&(em->poll_handle), NULL);
+	uv_close((uv_handle_t *)&(em->timer_handle), NULL);
+	uv_close((uv_handle_t *)&(em->idle_handle), NULL);
+	uv_close((uv_handle_t *)&(em->stop_handle), NULL);
+}
+
+
+static void
+em__thread(void *arg)
+{
+	em_t *em = (em_t *)arg;
+	uv_run(&(em->loop), UV_RUN_DEFAULT);
+}
+
+
+/******************************************************************************
+ * Public interface
+ ******************************************************************************/
+
+em_t *
+em_init(const em_chip_config_t *config, uint16_t port, uint64_t seed)
+{
+	em_t *em = calloc(1, sizeof(em_t));
+	if (!em)
+		return NULL;
+	
+	em->default_config = *config;
+	em->rand_state = seed ? seed : 1;  // Xorshift state must be non-zero
+	
+	em->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (em->fd < 0) {
+		free(em);
+		return NULL;
+	}
+	
+	// Best effort: large buffers absorb bursts of packets while responding
+	int size = EM__SOCKET_BUFFER_SIZE;
+	setsockopt(em->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(em->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	
+	socklen_t addr_len = sizeof(em->addr);
+	if (uv_ip4_addr("127.0.0.1", port, &(em->addr)) ||
+	    bind(em->fd, (struct sockaddr *)&(em->addr), sizeof(em->addr)) ||
+	    getsockname(em->fd, (struct sockaddr *)&(em->addr), &addr_len)) {
+		close(em->fd);
+		free(em);
+		return NULL;
+	}
+	
+	return em;
+}
+
+
+int
+em_set_chip_config(em_t *em, uint16_t chip_id, const em_chip_config_t *config)
+{
+	em__chip_t *chip = em__get_chip(em, chip_id);
+	if (!chip)
+		return -1;
+	chip->config = *config;
+	return 0;
+}
+
+
+void
+em_getsockname(em_t *em, struct sockaddr_in *addr)
+{
+	*addr = em->addr;
+}
+
+
+void
+em_start(em_t *em)
+{
+	if (uv_loop_init(&(em->loop))) abort();
+	
+	if (uv_poll_init_socket(&(em->loop), &(em->poll_handle), em->fd)) abort();
+	if (uv_timer_init(&(em->loop), &(em->timer_handle))) abort();
+	if (uv_idle_init(&(em->loop), &(em->idle_handle))) abort();
+	if (uv_async_init(&(em->loop), &(em->stop_handle), em__stop_cb)) abort();
+	em->poll_handle.data = em;
+	em->timer_handle.data = em;
+	em->idle_handle.data = em;
+	em->stop_handle.data = em;
+	
+	if (uv_poll_start(&(em->poll_handle), UV_READABLE, em__poll_cb)) abort();
+	
+	if (uv_thread_create(&(em->thread), em__thread, em)) abort();
+	em->running = true;
+}
+
+
+void
+em_stop(em_t *em)
+{
+	if (!em->running)
+		return;
+	
+	uv_async_send(&(em->stop_handle));
+	uv_thread_join(&(em->thread));
+	uv_loop_close(&(em->loop));
+	em->running = false;
+	
+	// Discard responses not yet sent
+	while (em->heap_len)
+		em__free_resp(em, em__heap_pop(em));
+}
+
+
+int
+em_write(em_t *em, uint16_t chip_id, uint32_t address,
+         const void *data, size_t length)
+{
+	em__chip_t *chip = em__get_chip(em, chip_id);
+	if (!chip)
+		return -1;
+	return em__write(em, chip, address, data, length);
+}
+
+
+void
+em_read(em_t *em, uint16_t chip_id, uint32_t address,
+        void *data, size_t length)
+{
+	em__chip_t *chip = em->chips[chip_id];
+	if (chip)
+		em__read(em, chip, address, data, length);
+	else
+		memset(data, 0, length);
+}
+
+
+void
+em_get_stats(em_t *em, em_stats_t *stats)
+{
+	*stats = em->stats;
+}
+
+
+void
+em_free(em_t *em)
+{
+	em_stop(em);
+	
+	size_t i;
+	for (i = 0; i < EM__N_CHIPS; i++) {
+		em__chip_t *chip = em->chips[i];
+		if (!chip)
+			continue;
+		
+		size_t j;
+		for (j = 0; j < chip->pages_size; j++)
+			free(chip->pages[j]);
+		free(chip->pages);
+		free(chip);
+	}
+	
+	while (em->free_resps) {
+		em__resp_t *resp = em->free_resps;
+		em->free_resps = resp->next;
+		free(resp);
+	}
+	free(em->heap);
+	
+	close(em->fd);
+	free(em);
+}
@@ -0,0 +1,173 @@
+/**
+ * A configurable SpiNNaker machine emulator for benchmarking and load testing.
+ *
+ * Unlike the mock machine used by the tests, the emulator is designed to keep
+ * up with Rig SCP at realistic rates. It runs in its own thread (with its own
+ * libuv event loop) and responds to SCP packets sent to a local UDP socket:
+ *
+ * * CMD_READ and CMD_WRITE access a sparse memory model with a separate 4 GB
+ *   address space per chip. Memory is allocated in pages on first write and
+ *   reads of memory never written return zeros. Requests of more than
+ *   EM_SCP_DATA_LENGTH bytes fail with EM_RC_LEN.
+ * * CMD_FILL fills word-aligned blocks of memory with a repeated word, failing
+ *   with EM_RC_ARG if the address or length is not word aligned.
+ * * All other commands are echoed back unchanged.
+ *
+ * Each chip (i.e. SDP dest_addr) may be given its own latency, jitter, loss,
+ * reordering and SC&MP-like rate limit (see em_chip_config_t). Responses are
+ * delayed with microsecond precision: when a response is due within a couple
+ * of milliseconds the emulator's thread spins rather than sleeping.
+ *
+ * Usage: em_init, optionally em_set_chip_config, em_start, ..., em_stop and
+ * finally em_free. Configuration may only be changed and statistics read while
+ * the emulator is stopped.
+ */
+
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+
+/**
+ * The data field length supported by the emulator (as SC&MP).
+ */
+#define EM_SCP_DATA_LENGTH 256
+
+/**
+ * Return code sent in response to reads/writes longer than EM_SCP_DATA_LENGTH
+ * (SC&MP's RC_LEN).
+ */
+#define EM_RC_LEN 0x81
+
+/**
+ * Return code sent in response to fills which are not word aligned (SC&MP's
+ * RC_ARG).
+ */
+#define EM_RC_ARG 0x83
+
+
+struct em;
+typedef struct em em_t;
+
+
+/**
+ * Behaviour of a simulated chip. All times are in microseconds.
+ */
+typedef struct {
+	// The fixed delay added to every response and the maximum additional
+	// (uniformly distributed) random delay.
+	uint64_t latency;
+	uint64_t jitter;
+	
+	// Probability that a request is dropped
+	double loss;
+	
+	// Probability that a response is held back by reorder_delay so that later
+	// responses overtake it
+	double reorder;
+	uint64_t reorder_delay;
+	
+	// SC&MP-like rate limit: the chip processes requests one at a time, taking
+	// service_time each, and drops requests which arrive while max_queue
+	// requests are already waiting to be processed. A service_time of 0
+	// disables the limit.
+	uint64_t service_time;
+	unsigned int max_queue;
+} em_chip_config_t;
+
+
+/**
+ * Counters describing the emulator's activity.
+ */
+typedef struct {
+	// Datagrams received (including those dropped) and responses sent
+	uint64_t n_received;
+	uint64_t n_responses;
+	
+	// Requests which were malformed, dropped at random or dropped because the
+	// chip's queue was full
+	uint64_t n_malformed;
+	uint64_t n_lost;
+	uint64_t n_overflowed;
+	
+	// Responses which could not be sent because the socket buffer was full
+	uint64_t n_send_failed;
+	
+	// Number of pages of memory allocated
+	uint64_t n_pages;
+} em_stats_t;
+
+
+/**
+ * Allocate an emulator and bind its socket to a local UDP port.
+ *
+ * @param config The configuration of every chip not configured using
+ *               em_set_chip_config.
+ * @param port The port to bind to on 127.0.0.1 or 0 to choose any free port
+ *             (see em_getsockname).
+ * @param seed Seed for the PRNG used to generate loss, jitter and reordering
+ *             such that runs are repeatable.
+ * @returns NULL on failure.
+ */
+em_t *em_init(const em_chip_config_t *config, uint16_t port, uint64_t seed);
+
+
+/**
+ * Override the configuration of a single chip.
+ *
+ * @returns 0 on success or -1 if out of memory.
+ */
+int em_set_chip_config(em_t *em, uint16_t chip, const em_chip_config_t *config);
+
+
+/**
+ * Get the address bound by the emulator.
+ */
+void em_getsockname(em_t *em, struct sockaddr_in *addr);
+
+
+/**
+ * Start responding to packets in a new thread. Aborts on failure.
+ */
+void em_start(em_t *em);
+
+
+/**
+ * Stop responding to packets and wait for the emulator's thread to exit.
+ * Responses not yet sent are discarded.
+ */
+void em_stop(em_t *em);
+
+
+/**
+ * Directly read or write a chip's memory (e.g. to pre-load or check its
+ * contents). Must not be used while the emulator is running.
+ *
+ * @returns 0 on success or -1 if out of memory (writes only).
+ */
+int em_write(em_t *em, uint16_t chip, uint32_t address,
+             const void *data, size_t length);
+void em_read(em_t *em, uint16_t chip, uint32_t address,
+             void *data, size_t length);
+
+
+/**
+ * Get the emulator's counters. Must not be used while the emulator is running.
+ */
+void em_get_stats(em_t *em, em_stats_t *stats);
+
+
+/**
+ * Free all resources used by a stopped emulator.
+ */
+void em_free(em_t *em);
+
+
+#endif
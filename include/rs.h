@@ -21,6 +21,53 @@ struct rs_conn;
 typedef struct rs_conn rs_conn_t;
 
 
+/**
+ * Identifies a request (or an operation made up of many requests) queued on a
+ * connection or a pool (see rs_get_handle and rs_pool_get_handle). A
+ * connection never reuses a handle and zero is never a valid handle.
+ */
+typedef uint64_t rs_handle_t;
+
+
+struct rs_transport;
+/**
+ * Holds the state associated with a UDP socket shared by many SCP connections
+ * (see rs_transport_init).
+ */
+typedef struct rs_transport rs_transport_t;
+
+
+struct rs_pacer;
+/**
+ * Holds the state of a token-bucket rate limiter which paces the transmissions
+ * of one or more connections (see rs_pacer_init).
+ */
+typedef struct rs_pacer rs_pacer_t;
+
+
+struct rs_pool;
+/**
+ * Holds the state associated with a pool of SCP connections to the Ethernet
+ * chips of a multi-board machine.
+ */
+typedef struct rs_pool rs_pool_t;
+
+
+struct rs_stream;
+/**
+ * Holds the state associated with a streaming read (see rs_read_stream).
+ */
+typedef struct rs_stream rs_stream_t;
+
+
+struct rs_cb_queue;
+/**
+ * A queue of completion callbacks to be run on a particular thread (see
+ * rs_cb_queue_run).
+ */
+typedef struct rs_cb_queue rs_cb_queue_t;
+
+
 /**
  * Callback function type for rs_send_scp commands.
  *
@@ -76,6 +123,71 @@ typedef void (*rs_rw_cb)(rs_conn_t *conn,
                          void *cb_data);
 
 
+/**
+ * A segment of a vectored read or write (see rs_readv and rs_writev).
+ */
+typedef struct {
+	// The chip and CPU to read from/write to
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	
+	// The address to read from/write to and the buffer to read into/write from.
+	// The buffer must remain valid until the callback function is called.
+	uint32_t address;
+	uv_buf_t data;
+	
+	// Set on completion: the error (and cmd_rc, if the error is RS_EBAD_RC)
+	// encountered reading/writing this segment, as for rs_rw_cb.
+	int error;
+	uint16_t cmd_rc;
+} rs_rw_seg_t;
+
+
+/**
+ * Callback function type for rs_readv/rs_writev command completion.
+ *
+ * @param conn The SCP connection through which the packets were sent.
+ * @param error 0 if every segment completed successfully, otherwise the error
+ *              of the first segment to fail (see the segments' error fields
+ *              for the others).
+ * @param segs The array of segments supplied (with error fields filled in).
+ * @param n_segs The number of segments.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_rwv_cb)(rs_conn_t *conn,
+                          int error,
+                          rs_rw_seg_t *segs,
+                          unsigned int n_segs,
+                          void *cb_data);
+
+
+/**
+ * Callback function type for delivering the data of a streaming read (see
+ * rs_read_stream).
+ *
+ * @param conn The SCP connection through which the packets were sent.
+ * @param stream The stream the data belongs to.
+ * @param error 0 if the chunk was read successfully. Otherwise the stream has
+ *              failed, data is empty and no further callbacks will be made.
+ * @param cmd_rc If error is RS_EBAD_RC, the cmd_rc returned in the first bad
+ *               reply to arrive. Otherwise undefined.
+ * @param address The address the chunk was read from.
+ * @param data The chunk of data read. The buffer is owned by the stream and
+ *             must be returned using rs_stream_release once the data has been
+ *             consumed (not required if error is non-zero).
+ * @param last Is this the final callback of the stream?
+ * @param cb_data The pointer supplied when starting the stream.
+ */
+typedef void (*rs_stream_cb)(rs_conn_t *conn,
+                             rs_stream_t *stream,
+                             int error,
+                             uint16_t cmd_rc,
+                             uint32_t address,
+                             uv_buf_t data,
+                             bool last,
+                             void *cb_data);
+
+
 /**
  * Callback function type for rs_free completion.
  *
@@ -84,6 +196,147 @@ typedef void (*rs_rw_cb)(rs_conn_t *conn,
 typedef void (*rs_free_cb)(void *cb_data);
 
 
+/**
+ * Request priorities (see rs_send_scp_priority).
+ */
+typedef enum {
+	// Requests are handled in the order they are made
+	RS_PRIORITY_NORMAL = 0,
+	
+	// Requests are handled before any normal-priority requests (including the
+	// remaining packets of partially sent bulk reads/writes)
+	RS_PRIORITY_HIGH,
+} rs_priority_t;
+
+
+/**
+ * Counters describing the system calls used to send and receive packets,
+ * useful for checking the effectiveness of batching (see rs_set_batching).
+ */
+typedef struct {
+	// Number of system calls made to send packets and the number of packets they
+	// sent.
+	uint64_t n_send_syscalls;
+	uint64_t n_send_packets;
+	
+	// Number of system calls made to receive packets and the number of packets
+	// they received.
+	uint64_t n_recv_syscalls;
+	uint64_t n_recv_packets;
+} rs_batch_stats_t;
+
+
+/**
+ * The number of buckets in the round-trip time histogram of rs_stats_t.
+ */
+#define RS_N_RTT_BUCKETS 24
+
+
+/**
+ * Counters describing the packets sent and responses received on behalf of one
+ * type of request.
+ */
+typedef struct {
+	// Number of packets sent (including retransmissions)
+	uint64_t n_packets_sent;
+	
+	// Number of responses received
+	uint64_t n_responses;
+	
+	// Number of bytes of read/write data successfully transferred (always zero
+	// for SCP packets)
+	uint64_t n_bytes;
+} rs_traffic_stats_t;
+
+
+/**
+ * Statistics describing the activity of a connection (see rs_get_stats).
+ */
+typedef struct {
+	// Traffic broken down by request type
+	rs_traffic_stats_t scp_packet;
+	rs_traffic_stats_t read;
+	rs_traffic_stats_t write;
+	
+	// Number of retransmissions and response timeouts (including the final
+	// timeout of packets which then failed)
+	uint64_t n_retransmissions;
+	uint64_t n_timeouts;
+	
+	// Number of the retransmissions made without waiting for a timeout (see
+	// rs_set_fast_retransmit)
+	uint64_t n_fast_retransmissions;
+	
+	// Number of times sending new packets was postponed to stay within the rate
+	// limit of a pacer (see rs_set_pacer)
+	uint64_t n_pacing_delays;
+	
+	// Number of requests which failed after being sent (for any reason)
+	uint64_t n_failed;
+	
+	// Number of datagrams received which were dropped for being too short or
+	// long to be a valid response and the number dropped for not matching any
+	// packet awaiting a response (e.g. duplicate or late responses).
+	uint64_t n_dropped_malformed;
+	uint64_t n_dropped_unmatched;
+	
+	// A histogram of round-trip times for packets responded to on their first
+	// attempt. Bucket 0 counts round-trip times under 2 usec, bucket i counts
+	// those in [2^i, 2^(i+1)) usec and the last bucket also counts any longer
+	// times. The minimum, maximum and total round-trip times are also recorded
+	// (in nsec) allowing the mean to be computed.
+	uint64_t rtt_histogram[RS_N_RTT_BUCKETS];
+	uint64_t n_rtt_samples;
+	uint64_t rtt_min;
+	uint64_t rtt_max;
+	uint64_t rtt_total;
+	
+	// System call counters (as rs_get_batch_stats)
+	rs_batch_stats_t syscalls;
+	
+	// The current state of the connection (not reset by rs_reset_stats): the
+	// number of requests queued (not yet completely sent), the number of packets
+	// in flight and the current window size.
+	unsigned int queue_depth;
+	unsigned int n_in_flight;
+	unsigned int window;
+} rs_stats_t;
+
+
+/**
+ * Parameters chosen for a connection by rs_init_auto, along with the
+ * measurements they were based on.
+ */
+typedef struct {
+	// The parameters passed to rs_init
+	size_t scp_data_length;
+	uint64_t timeout;
+	unsigned int n_outstanding;
+	
+	// The mean round-trip time (nsec) of the pings and the throughput
+	// (bytes/sec) measured using the window size chosen
+	uint64_t rtt;
+	uint64_t throughput;
+} rs_auto_params_t;
+
+
+/**
+ * Callback function type for rs_init_auto completion.
+ *
+ * @param conn The newly created connection or NULL if probing failed.
+ * @param error 0 on success or RS_ETIMEOUT, RS_EBAD_RC (if CMD_VER is
+ *              rejected), UV_EPROTO (if its response is malformed) or another
+ *              error encountered while probing.
+ * @param params The parameters chosen (only valid during the callback) or NULL
+ *               if probing failed.
+ * @param cb_data The pointer supplied when registering the callback.
+ */
+typedef void (*rs_init_auto_cb)(rs_conn_t *conn,
+                                int error,
+                                const rs_auto_params_t *params,
+                                void *cb_data);
+
+
 /**
  * Allocate and initialise a new connection to an SCP endpoint.
  *
@@ -104,7 +357,9 @@ typedef void (*rs_free_cb)(void *cb_data);
  * @param n_tries Number of transmission attempts to make (including initial
  *                attempt) before giving up on a request. Must be at least 1.
  * @param n_outstanding Number of packets which may be simultaneously awaiting
- *                      responses.
+ *                      responses. When congestion control is enabled (see
+ *                      rs_set_congestion_control), this is the maximum size
+ *                      of the congestion window.
  */
 rs_conn_t *rs_init(uv_loop_t *loop,
                    const struct sockaddr *addr,
@@ -113,6 +368,256 @@ rs_conn_t *rs_init(uv_loop_t *loop,
                    unsigned int n_tries,
                    unsigned int n_outstanding);
 
+/**
+ * Allocate and initialise a new connection to an SCP endpoint, choosing its
+ * parameters by probing the machine.
+ *
+ * The data field length supported by the chip is found using CMD_VER, the
+ * timeout is chosen based on the round-trip times of a few CMD_VER pings and
+ * the number of packets which may be outstanding is found by reading using
+ * increasing window sizes until throughput stops improving appreciably (or
+ * packets start being retransmitted). The connection is then created with the
+ * parameters chosen, which are also reported such that they may be cached and
+ * passed directly to rs_init on later occasions.
+ *
+ * @param loop The libuv event loop in which the connection will run.
+ * @param addr The socket address of the remote machine. Must remain valid for
+ *             the lifetime of the connection (as for rs_init).
+ * @param dest_addr The address of the chip to probe (normally the chip attached
+ *                  to the Ethernet connection).
+ * @param probe_address An address on that chip which may be safely read
+ *                      (several kilobytes are read from it while choosing the
+ *                      window size).
+ * @param n_tries Number of transmission attempts to make (as for rs_init).
+ * @param max_outstanding The largest number of packets which may be
+ *                        simultaneously awaiting responses to consider.
+ * @param cb A callback function which will be called once the connection has
+ *           been created or probing fails.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if probing was started, non-zero otherwise.
+ */
+int rs_init_auto(uv_loop_t *loop,
+                 const struct sockaddr *addr,
+                 uint16_t dest_addr,
+                 uint32_t probe_address,
+                 unsigned int n_tries,
+                 unsigned int max_outstanding,
+                 rs_init_auto_cb cb,
+                 void *cb_data);
+
+/**
+ * Create a UDP socket which may be shared by many connections.
+ *
+ * Connections made with rs_init each use their own socket. On a machine with
+ * many boards the connections to each board may instead share a single socket
+ * (and a single receive callback) by being created with rs_init_shared.
+ * Arriving responses are passed to the connection whose remote address they
+ * came from.
+ *
+ * Returns NULL on failure.
+ *
+ * @param loop The libuv event loop in which the transport and all connections
+ *             using it will run.
+ * @param family The address family of the machines to be connected to (AF_INET
+ *               or AF_INET6).
+ */
+rs_transport_t *rs_transport_init(uv_loop_t *loop, int family);
+
+/**
+ * Create a new SCP connection which uses a shared transport, otherwise as
+ * rs_init.
+ *
+ * Received datagrams are passed to connections according to their source
+ * address. If several connections using the same transport are made to the
+ * same address, datagrams are passed to whichever of the connections is
+ * awaiting a response with the datagram's sequence number.
+ *
+ * Since receiving is shared between connections, responses are always copied
+ * from a receive buffer rather than being received directly into the user's
+ * buffer and batching (see rs_set_batching) only applies to sending.
+ */
+rs_conn_t *rs_init_shared(rs_transport_t *transport,
+                          const struct sockaddr *addr,
+                          size_t scp_data_length,
+                          uint64_t timeout,
+                          unsigned int n_tries,
+                          unsigned int n_outstanding);
+
+/**
+ * Free a transport.
+ *
+ * If any connections using the transport have not yet been completely freed
+ * (see rs_free), the transport's socket is closed once they have been. No new
+ * connections may be made using the transport once this function has been
+ * called.
+ *
+ * @param cb A callback to call when the transport has been freed or NULL if no
+ *           callback is required.
+ * @param cb_data A user-defined pointer to be passed to the callback function.
+ */
+void rs_transport_free(rs_transport_t *transport, rs_free_cb cb, void *cb_data);
+
+/**
+ * Enable or disable batching of system calls on a connection.
+ *
+ * When enabled, all packets made ready for transmission together (e.g. when
+ * a window of outstanding slots is refilled) are sent using a single system
+ * call and several arriving responses may be received by a single system call.
+ * Batching is disabled by default.
+ *
+ * @returns 0 on success or UV_ENOTSUP if batching is not supported on this
+ *          platform.
+ */
+int rs_set_batching(rs_conn_t *conn, bool enable);
+
+/**
+ * Send and receive a connection's packets using io_uring rather than libuv's
+ * UDP API (Linux only).
+ *
+ * All packets made ready for transmission together are submitted using a
+ * single system call (as with rs_set_batching) and arriving responses are
+ * received by a single multishot receive into buffers registered with the
+ * kernel, such that no system call is made per packet received. The ring runs
+ * within the connection's event loop (via an eventfd). Once enabled, io_uring
+ * remains in use until the connection is freed.
+ *
+ * Support must be enabled at compile time by defining RS_IO_URING (e.g. via the
+ * RS_IO_URING CMake option) and requires Linux 6.0 or later.
+ *
+ * @returns 0 on success, UV_ENOTSUP if io_uring is not supported (or the
+ *          connection uses a shared transport), UV_EBUSY if any packets are in
+ *          flight or another libuv error code.
+ */
+int rs_enable_io_uring(rs_conn_t *conn);
+
+/**
+ * Get the system call counters for a connection.
+ */
+void rs_get_batch_stats(rs_conn_t *conn, rs_batch_stats_t *stats);
+
+/**
+ * Get the statistics for a connection.
+ */
+void rs_get_stats(rs_conn_t *conn, rs_stats_t *stats);
+
+/**
+ * Reset all counters of a connection's statistics (including its system call
+ * counters) to zero.
+ */
+void rs_reset_stats(rs_conn_t *conn);
+
+/**
+ * Enable or disable adaptive retransmission timeouts on a connection.
+ *
+ * When enabled, the round-trip time of responses is measured and the timeout
+ * used before retransmitting a packet is derived from a smoothed estimate of
+ * the round-trip time and its variance (in the style of RFC 6298). The timeout
+ * doubles (up to max_timeout) each time a packet times out until a new
+ * round-trip time is measured. When disabled (the default), the fixed timeout
+ * given to rs_init is always used.
+ *
+ * Enabling adaptive timeouts resets any existing round-trip time estimate;
+ * until the first round-trip time is measured, the fixed timeout is used.
+ *
+ * @param min_timeout The smallest timeout (msec) which may be used.
+ * @param max_timeout The largest timeout (msec) which may be used. Must be no
+ *                    smaller than min_timeout.
+ */
+void rs_set_adaptive_timeout(rs_conn_t *conn, bool enable,
+                             uint64_t min_timeout, uint64_t max_timeout);
+
+/**
+ * Get the number of msec which will be waited for a response to a newly sent
+ * packet before it is retransmitted.
+ */
+uint64_t rs_get_timeout(rs_conn_t *conn);
+
+/**
+ * Enable or disable congestion control on a connection.
+ *
+ * When enabled, the number of packets simultaneously awaiting responses is
+ * limited by a congestion window which is adjusted using an additive-increase,
+ * multiplicative-decrease (AIMD) scheme: the window grows by one packet for
+ * every window's worth of responses received to packets which did not require
+ * retransmission and halves (down to a minimum of one) when a packet times out.
+ * The window never exceeds the n_outstanding value given to rs_init. When
+ * disabled (the default), n_outstanding packets may always be awaiting
+ * responses.
+ *
+ * @param initial_window The initial size of the congestion window (clamped to
+ *                       between 1 and n_outstanding).
+ */
+void rs_set_congestion_control(rs_conn_t *conn, bool enable,
+                               unsigned int initial_window);
+
+/**
+ * Get the number of packets which may currently be simultaneously awaiting
+ * responses on a connection (i.e. the congestion window size when congestion
+ * control is enabled, n_outstanding otherwise).
+ */
+unsigned int rs_get_window(rs_conn_t *conn);
+
+/**
+ * Enable or disable fast retransmission on a connection.
+ *
+ * SC&MP handles the requests sent to a chip largely in order so responses
+ * arriving to packets sent after one still awaiting a response suggest that it
+ * (or its response) was lost. When enabled, a packet is retransmitted once
+ * responses have arrived to threshold packets sent to the same chip after it,
+ * rather than waiting for it to time out, reducing the stall caused by a lost
+ * packet from a timeout to roughly a round-trip time. Fast retransmissions
+ * count towards the n_tries limit and, when congestion control is enabled,
+ * shrink the window as a timeout would. A packet's final attempt is always left
+ * to time out. Fast retransmission is disabled by default.
+ *
+ * @param threshold The number of responses to later packets after which a
+ *                  packet is retransmitted or zero to disable fast
+ *                  retransmission.
+ */
+void rs_set_fast_retransmit(rs_conn_t *conn, unsigned int threshold);
+
+/**
+ * Create a token-bucket rate limiter which may pace the transmissions of one or
+ * more connections (see rs_set_pacer).
+ *
+ * SC&MP's receive buffers are small and bursts of packets sent back-to-back
+ * may overflow them, each dropped packet costing a full timeout. A pacer holds
+ * up to burst tokens and gains rate tokens per second. Every packet sent
+ * (including retransmissions) via a connection using the pacer consumes one
+ * token or, when counting bytes, one token per byte of the datagram. Once the
+ * tokens run out, new packets wait in the request queue until more tokens have
+ * been gained. Connections whose traffic shares a bottleneck (e.g. the Ethernet
+ * chip of a board, a host NIC or a switch uplink) may share a pacer.
+ *
+ * Returns NULL on failure.
+ *
+ * @param loop The libuv event loop in which the pacer and all connections
+ *             using it will run.
+ * @param rate The number of tokens gained per second. Must be at least 1.
+ * @param burst The maximum number of tokens held (and thus the largest burst
+ *              which may be sent back-to-back). Must be at least 1.
+ * @param bytes If true, tokens are bytes, otherwise packets.
+ */
+rs_pacer_t *rs_pacer_init(uv_loop_t *loop, uint64_t rate, uint64_t burst,
+                          bool bytes);
+
+/**
+ * Free a pacer. Every connection using the pacer must first either stop using
+ * it (see rs_set_pacer) or be freed (see rs_free).
+ *
+ * @param cb A callback to call when the pacer has been freed or NULL if no
+ *           callback is required.
+ * @param cb_data A user-defined pointer to be passed to the callback function.
+ */
+void rs_pacer_free(rs_pacer_t *pacer, rs_free_cb cb, void *cb_data);
+
+/**
+ * Pace the transmissions of a connection using a pacer (see rs_pacer_init) or,
+ * if pacer is NULL, stop pacing them. Connections are not paced by default.
+ */
+void rs_set_pacer(rs_conn_t *conn, rs_pacer_t *pacer);
+
 /**
  * Queue up an SCP packet to be sent via an SCP connection.
  *
@@ -158,6 +663,36 @@ int rs_send_scp(rs_conn_t *conn,
                 rs_send_scp_cb cb,
                 void *cb_data);
 
+/**
+ * Queue up an SCP packet with the given priority, as rs_send_scp.
+ *
+ * High-priority packets are sent ahead of all queued normal-priority requests
+ * and may use any slot in the window, including those reserved using
+ * rs_set_priority_reserve.
+ */
+int rs_send_scp_priority(rs_conn_t *conn,
+                         rs_priority_t priority,
+                         uint16_t dest_addr,
+                         uint8_t dest_cpu,
+                         uint16_t cmd_rc,
+                         unsigned int n_args_send,
+                         unsigned int n_args_recv,
+                         uint32_t arg1,
+                         uint32_t arg2,
+                         uint32_t arg3,
+                         uv_buf_t data,
+                         size_t data_max_len,
+                         rs_send_scp_cb cb,
+                         void *cb_data);
+
+/**
+ * Reserve a number of slots in the window of outstanding packets for
+ * high-priority requests such that normal-priority traffic (e.g. bulk reads
+ * and writes) cannot exhaust the window. At least one slot always remains
+ * available to normal-priority requests. No slots are reserved by default.
+ */
+void rs_set_priority_reserve(rs_conn_t *conn, unsigned int n_reserved);
+
 /**
  * Write a large block of data to a machine using SCP CMD_WRITE packets.
  *
@@ -180,6 +715,22 @@ int rs_write(rs_conn_t *conn,
              rs_rw_cb cb,
              void *cb_data);
 
+/**
+ * Enable or disable coalescing of writes on a connection.
+ *
+ * When enabled, a write (see rs_write) issued while the previous request is a
+ * write still waiting in the request queue, to the same chip and CPU and ending
+ * at the address the new write starts at, is merged into it. Many small writes
+ * to adjacent memory are then sent using as few full-size packets as possible,
+ * with each packet's data gathered directly from the writes' own buffers.
+ * Writes are only waiting in the queue while all outstanding slots are in use
+ * so coalescing never delays a write. Once every packet of a coalesced write
+ * has been responded to, or if any fails, the callbacks of the writes merged
+ * into it are called in the order the writes were made with the same result.
+ * Coalescing is disabled by default.
+ */
+void rs_set_write_coalescing(rs_conn_t *conn, bool enable);
+
 /**
  * Read a large block of data from a machine using SCP CMD_READ packets.
  *
@@ -203,6 +754,260 @@ int rs_read(rs_conn_t *conn,
             rs_rw_cb cb,
             void *cb_data);
 
+/**
+ * Fill a block of a machine's memory with a repeated word.
+ *
+ * The word-aligned part of the block is filled using a single SC&MP CMD_FILL
+ * packet while any unaligned bytes at either end are written using CMD_WRITE:
+ * a fill requires at most three packets regardless of its length. Memory is
+ * left as if the word had been written to every word-aligned address in (and
+ * around) the block, i.e. an unaligned byte takes the value of the
+ * corresponding byte of the word in the machine's (little-endian) byte order.
+ * Fills are counted in the write statistics (see rs_get_stats).
+ *
+ * @param conn The connection to send the request down.
+ * @param dest_addr The address of the chip to send the packet to.
+ * @param dest_cpu The CPU number to send the packet to.
+ * @param addr The address of the start of the block to fill.
+ * @param word The word to fill the block with.
+ * @param length The length of the block in bytes.
+ * @param cb A callback function which will be called when the fill completes.
+ *           The data buffer passed to the callback has a NULL base and the
+ *           length of the block.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully queued, non-zero otherwise.
+ */
+int rs_fill(rs_conn_t *conn,
+            uint16_t dest_addr,
+            uint8_t dest_cpu,
+            uint32_t address,
+            uint32_t word,
+            size_t length,
+            rs_rw_cb cb,
+            void *cb_data);
+
+/**
+ * Write many (small) blocks of data to a machine, calling a single callback
+ * once all have completed.
+ *
+ * Consecutive segments which write adjacent address ranges of the same chip
+ * and CPU are merged and written using full-size packets. Where the segments'
+ * buffers are not themselves adjacent, their data is copied into a temporary
+ * buffer when this function is called.
+ *
+ * @param conn The connection to send the request down.
+ * @param segs An array of n_segs segments to write. Must remain valid until the
+ *             callback function is called.
+ * @param n_segs The number of segments. Must be at least 1.
+ * @param cb A callback function which will be called when all writes complete.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully queued, non-zero otherwise.
+ */
+int rs_writev(rs_conn_t *conn,
+              rs_rw_seg_t *segs,
+              unsigned int n_segs,
+              rs_rwv_cb cb,
+              void *cb_data);
+
+/**
+ * Read many (small) blocks of data from a machine, calling a single callback
+ * once all have completed.
+ *
+ * Consecutive segments which read adjacent address ranges of the same chip
+ * and CPU are merged and read using full-size packets. Where the segments'
+ * buffers are not themselves adjacent, the data is read into a temporary
+ * buffer and copied into the segments' buffers on completion.
+ *
+ * @param conn The connection to send the request down.
+ * @param segs An array of n_segs segments to read. Must remain valid until the
+ *             callback function is called.
+ * @param n_segs The number of segments. Must be at least 1.
+ * @param cb A callback function which will be called when all reads complete.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if successfully queued, non-zero otherwise.
+ */
+int rs_readv(rs_conn_t *conn,
+             rs_rw_seg_t *segs,
+             unsigned int n_segs,
+             rs_rwv_cb cb,
+             void *cb_data);
+
+/**
+ * Read a large block of data from a machine, delivering it in order in
+ * fixed-size chunks as it arrives.
+ *
+ * Chunks are read into a ring of n_bufs buffers owned by the stream. Each
+ * chunk is passed to the callback as soon as it and all preceding chunks have
+ * been read and its buffer is reused once returned with rs_stream_release. No
+ * further chunks are read while every buffer is in use, bounding the memory
+ * required regardless of the total length.
+ *
+ * The stream frees itself once its last callback has been made and every
+ * buffer has been released.
+ *
+ * @param conn The connection to send the packets via.
+ * @param dest_addr The address of the chip to read from.
+ * @param dest_cpu The CPU number to send the packets to.
+ * @param address The address to start reading from.
+ * @param length The number of bytes to read. Must be non-zero.
+ * @param chunk_size The size of each chunk (and buffer) or 0 to use the size of
+ *                   the connection's window of packets.
+ * @param n_bufs The number of buffers. At least two are required to keep
+ *               reading while the consumer holds a chunk.
+ * @param cb A callback function which will be called with each chunk.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if the stream was started, non-zero otherwise. Chunks which
+ *          cannot be queued later fail the stream with UV_ENOMEM.
+ */
+int rs_read_stream(rs_conn_t *conn,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint32_t address,
+                   size_t length,
+                   size_t chunk_size,
+                   unsigned int n_bufs,
+                   rs_stream_cb cb,
+                   void *cb_data);
+
+/**
+ * Return a buffer delivered by a streaming read's callback such that it may be
+ * reused. May be called from within the callback.
+ */
+void rs_stream_release(rs_stream_t *stream, uv_buf_t data);
+
+/**
+ * Read a large block of data from a machine directly into a file.
+ *
+ * The block is read in chunks the size of the connection's window of packets
+ * (as rs_read_stream) and each chunk is written to the file using libuv's
+ * file system API as soon as it arrives. Since only a few chunks are buffered
+ * at once, reading from the machine and writing to the file overlap and the
+ * memory used is bounded regardless of the length of the block.
+ *
+ * @param conn The connection to send the packets via.
+ * @param dest_addr The address of the chip to read from.
+ * @param dest_cpu The CPU number to send the packets to.
+ * @param address The address to start reading from.
+ * @param length The number of bytes to read. Must be non-zero.
+ * @param fd The file to write the data to. Must remain open until the callback
+ *           function is called.
+ * @param offset The offset within the file to write the block to.
+ * @param cb A callback function which will be called once the whole block has
+ *           been written to the file (or an error occurs). The data buffer
+ *           passed to the callback has a NULL base and the length of the
+ *           block. The error is a (negative) libuv error code if accessing the
+ *           file failed.
+ * @param cb_data User-supplied data that will be passed to the callback
+ *                function.
+ * @returns 0 if the transfer was started, non-zero otherwise.
+ */
+int rs_read_to_fd(rs_conn_t *conn,
+                  uint16_t dest_addr,
+                  uint8_t dest_cpu,
+                  uint32_t address,
+                  size_t length,
+                  uv_file fd,
+                  int64_t offset,
+                  rs_rw_cb cb,
+                  void *cb_data);
+
+/**
+ * Write a large block of data from a file to a machine, as rs_read_to_fd.
+ *
+ * The error passed to the callback is UV_EOF if the file ends before the end of
+ * the block.
+ */
+int rs_write_from_fd(rs_conn_t *conn,
+                     uint16_t dest_addr,
+                     uint8_t dest_cpu,
+                     uint32_t address,
+                     size_t length,
+                     uv_file fd,
+                     int64_t offset,
+                     rs_rw_cb cb,
+                     void *cb_data);
+
+/**
+ * The maximum number of read/write requests which may be interleaved (see
+ * rs_set_interleave).
+ */
+#define RS_MAX_INTERLEAVE 16
+
+/**
+ * Interleave the packets of several queued reads and writes.
+ *
+ * By default, the packets of a read or write are all sent before those of the
+ * next queued request, leaving requests to different chips unable to overlap.
+ * When interleaving is enabled, slots are instead assigned round-robin across
+ * the first n_requests reads/writes in the queue (in addition to any queued
+ * SCP packets, which are still sent in order).
+ *
+ * @param n_requests The number of reads/writes to interleave (clamped between 1
+ *                   and RS_MAX_INTERLEAVE). 1 (the default) disables
+ *                   interleaving.
+ * @param max_per_dest The maximum number of read/write packets in flight to
+ *                     any one chip at once (including those of requests with
+ *                     nothing left to send) before the interleaved requests
+ *                     to it must wait, or 0 (the default) for no limit (beyond
+ *                     the window).
+ */
+void rs_set_interleave(rs_conn_t *conn, unsigned int n_requests,
+                       unsigned int max_per_dest);
+
+/**
+ * Get a handle to the request most recently queued on a connection by
+ * rs_send_scp, rs_send_scp_priority, rs_write, rs_read or rs_fill, for use
+ * with rs_cancel and rs_set_deadline. A write merged with one already queued
+ * (see rs_set_write_coalescing) shares the handle of the write it was merged
+ * with.
+ *
+ * Following rs_readv, rs_writev, rs_read_stream, rs_read_to_fd or
+ * rs_write_from_fd, the handle instead covers the whole operation: every
+ * request it queues (including those queued later, e.g. as a stream's buffers
+ * are released) shares the handle. Cancelling the handle fails the operation
+ * with RS_ECANCELLED via its usual callback, called once, and a deadline
+ * applies to all of its requests. Requests submitted using the *_threadsafe
+ * functions and via pools have handles of their own (see
+ * rs_send_scp_threadsafe and rs_pool_get_handle).
+ *
+ * @returns The handle or zero if no request has been queued.
+ */
+rs_handle_t rs_get_handle(rs_conn_t *conn);
+
+/**
+ * Cancel a request, calling its callback with the error RS_ECANCELLED.
+ *
+ * Any of the request's packets awaiting responses are forgotten (late
+ * responses are ignored) and its remaining packets are never sent, freeing
+ * their outstanding slots for other requests. Cancelling a coalesced write
+ * cancels every write merged into it and cancelling an operation made up of
+ * many requests (see rs_get_handle) cancels all of them.
+ *
+ * @returns 0 if the request was cancelled or non-zero if it has already
+ *          completed (or the handle is otherwise unknown).
+ */
+int rs_cancel(rs_conn_t *conn, rs_handle_t handle);
+
+/**
+ * Set an absolute deadline by which a request must complete.
+ *
+ * Once the deadline has passed, the request fails with the error RS_EDEADLINE
+ * as if cancelled (see rs_cancel). Packets awaiting responses give up at the
+ * deadline rather than being retransmitted while requests yet to send any
+ * packets fail as they reach the head of the request queue. Requests have no
+ * deadline by default.
+ *
+ * @param deadline The time (according to uv_now) by which the request must
+ *                 complete or zero for no deadline.
+ * @returns 0 on success or non-zero if the request has already completed (or
+ *          the handle is otherwise unknown).
+ */
+int rs_set_deadline(rs_conn_t *conn, rs_handle_t handle, uint64_t deadline);
+
 /**
  * Free any resources used by an SCP connection.
  *
@@ -219,6 +1024,247 @@ int rs_read(rs_conn_t *conn,
  */
 void rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data);
 
+/**
+ * Queue up an SCP packet from any thread, as rs_send_scp_priority.
+ *
+ * Unlike the other functions in this library, this function (along with
+ * rs_write_threadsafe and rs_read_threadsafe) may be called from threads other
+ * than the one running the connection's event loop. Requests are passed to the
+ * loop thread via a lock-free queue and those submitted between two iterations
+ * of the event loop are handled together. Requests are not handled unless the
+ * event loop is running and must not be submitted once rs_free has been
+ * called.
+ *
+ * @param cb_queue If NULL, the callback is called on the event loop thread.
+ *                 Otherwise, the callback is placed in the supplied queue to be
+ *                 called by the thread running the queue (e.g. the submitting
+ *                 thread), see rs_cb_queue_init.
+ * @param handle_out If non-NULL, set to the request's handle when it is
+ *                   submitted. The handle may be passed to rs_cancel and
+ *                   rs_set_deadline which, like every other function on the
+ *                   connection, must be called on the event loop thread (the
+ *                   request need not have been handled by the loop yet).
+ * @returns 0 if successfully submitted, non-zero otherwise. Requests which
+ *          cannot subsequently be queued fail with UV_ENOMEM.
+ */
+int rs_send_scp_threadsafe(rs_conn_t *conn,
+                           rs_cb_queue_t *cb_queue,
+                           rs_priority_t priority,
+                           uint16_t dest_addr,
+                           uint8_t dest_cpu,
+                           uint16_t cmd_rc,
+                           unsigned int n_args_send,
+                           unsigned int n_args_recv,
+                           uint32_t arg1,
+                           uint32_t arg2,
+                           uint32_t arg3,
+                           uv_buf_t data,
+                           size_t data_max_len,
+                           rs_send_scp_cb cb,
+                           void *cb_data,
+                           rs_handle_t *handle_out);
+
+/**
+ * Write a large block of data to a machine from any thread, as rs_write. See
+ * rs_send_scp_threadsafe.
+ */
+int rs_write_threadsafe(rs_conn_t *conn,
+                        rs_cb_queue_t *cb_queue,
+                        uint16_t dest_addr,
+                        uint8_t dest_cpu,
+                        uint32_t address,
+                        uv_buf_t data,
+                        rs_rw_cb cb,
+                        void *cb_data,
+                        rs_handle_t *handle_out);
+
+/**
+ * Read a large block of data from a machine from any thread, as rs_read. See
+ * rs_send_scp_threadsafe.
+ */
+int rs_read_threadsafe(rs_conn_t *conn,
+                       rs_cb_queue_t *cb_queue,
+                       uint16_t dest_addr,
+                       uint8_t dest_cpu,
+                       uint32_t address,
+                       uv_buf_t data,
+                       rs_rw_cb cb,
+                       void *cb_data,
+                       rs_handle_t *handle_out);
+
+/**
+ * Allocate a queue of completion callbacks for requests submitted using the
+ * *_threadsafe functions. Returns NULL on failure.
+ *
+ * @param loop If non-NULL, an event loop (run by the thread the callbacks are
+ *             to be called on, not necessarily the connection's loop) which
+ *             runs the queue automatically whenever callbacks are placed in
+ *             it. The queue keeps the loop alive until it is freed. If NULL,
+ *             the queue must instead be run explicitly using rs_cb_queue_run or
+ *             rs_cb_queue_wait.
+ */
+rs_cb_queue_t *rs_cb_queue_init(uv_loop_t *loop);
+
+/**
+ * Call (on the calling thread) every callback placed in a queue since it was
+ * last run. The callbacks may submit further requests using the *_threadsafe
+ * functions but must not call any other function on their connection.
+ *
+ * This function never blocks. The queue may be run by only one thread at a
+ * time and must not be run explicitly if it belongs to an event loop.
+ *
+ * @returns The number of callbacks called.
+ */
+unsigned int rs_cb_queue_run(rs_cb_queue_t *cb_queue);
+
+/**
+ * Block until at least one callback has been placed in a queue and then run the
+ * queue, as rs_cb_queue_run. Must not be used on a queue belonging to an event
+ * loop.
+ *
+ * @returns The number of callbacks called (at least one).
+ */
+unsigned int rs_cb_queue_wait(rs_cb_queue_t *cb_queue);
+
+/**
+ * Free a queue of completion callbacks. Every request using the queue must have
+ * completed and its callback been run.
+ *
+ * If the queue belongs to an event loop, this must be called from the thread
+ * running that loop and the queue is freed once the loop next runs.
+ */
+void rs_cb_queue_free(rs_cb_queue_t *cb_queue);
+
+/**
+ * Allocate and initialise a pool of connections, one per Ethernet-attached
+ * board of a machine.
+ *
+ * Requests made via the pool are routed through the connection to the
+ * Ethernet chip nearest (in hops on the hexagonal chip mesh, ignoring
+ * wrap-around links) to its destination. Large reads and writes are
+ * additionally striped across several connections (see rs_pool_set_striping)
+ * such that their throughput is not limited by a single board's Ethernet link.
+ *
+ * Returns NULL on failure.
+ *
+ * @param loop The libuv event loop in which the connections will run.
+ * @param n_conns The number of connections (Ethernet chips) in the pool. Must
+ *                be at least 1.
+ * @param addrs An array of n_conns socket addresses, one per Ethernet chip.
+ *              These must remain valid until the pool is freed.
+ * @param eth_addrs An array of n_conns chip addresses ((x << 8) | y) giving the
+ *                  position of each Ethernet chip in the machine.
+ * @param scp_data_length As for rs_init.
+ * @param timeout As for rs_init.
+ * @param n_tries As for rs_init.
+ * @param n_outstanding As for rs_init (per connection).
+ */
+rs_pool_t *rs_pool_init(uv_loop_t *loop,
+                        unsigned int n_conns,
+                        const struct sockaddr **addrs,
+                        const uint16_t *eth_addrs,
+                        size_t scp_data_length,
+                        uint64_t timeout,
+                        unsigned int n_tries,
+                        unsigned int n_outstanding);
+
+/**
+ * Create a pool of connections which all use a shared transport (see
+ * rs_init_shared), otherwise as rs_pool_init.
+ */
+rs_pool_t *rs_pool_init_shared(rs_transport_t *transport,
+                               unsigned int n_conns,
+                               const struct sockaddr **addrs,
+                               const uint16_t *eth_addrs,
+                               size_t scp_data_length,
+                               uint64_t timeout,
+                               unsigned int n_tries,
+                               unsigned int n_outstanding);
+
+/**
+ * Set how reads and writes made via a pool are striped across connections.
+ *
+ * Reads and writes are divided into stripes of stripe_size bytes which are
+ * sent round-robin via the max_conns connections nearest to their
+ * destination. By default, stripes are n_outstanding packets long and may use
+ * every connection in the pool.
+ *
+ * @param max_conns The maximum number of connections to stripe a single
+ *                  request over. Setting this to 1 disables striping.
+ * @param stripe_size The number of bytes per stripe (must be non-zero).
+ */
+void rs_pool_set_striping(rs_pool_t *pool, unsigned int max_conns,
+                          size_t stripe_size);
+
+/**
+ * Get the connection in a pool nearest to a given chip, e.g. for use with
+ * rs_send_scp.
+ */
+rs_conn_t *rs_pool_get_conn(rs_pool_t *pool, uint16_t dest_addr);
+
+/**
+ * Queue a bulk write via a pool, as rs_write.
+ *
+ * The callback is called once when every stripe of the write has completed
+ * with the connection nearest the destination and, if any stripe failed, the
+ * error from the first stripe to fail.
+ */
+int rs_pool_write(rs_pool_t *pool,
+                  uint16_t dest_addr,
+                  uint8_t dest_cpu,
+                  uint32_t address,
+                  uv_buf_t data,
+                  rs_rw_cb cb,
+                  void *cb_data);
+
+/**
+ * Queue a bulk read via a pool, as rs_read.
+ *
+ * The callback is called as for rs_pool_write.
+ */
+int rs_pool_read(rs_pool_t *pool,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint32_t address,
+                 uv_buf_t data,
+                 rs_rw_cb cb,
+                 void *cb_data);
+
+/**
+ * Get a handle to the read or write most recently queued via a pool (covering
+ * all of its stripes), as rs_get_handle. Pool handles are only meaningful to
+ * rs_pool_cancel and rs_pool_set_deadline.
+ *
+ * @returns The handle or zero if no request has been queued.
+ */
+rs_handle_t rs_pool_get_handle(rs_pool_t *pool);
+
+/**
+ * Cancel a read or write queued via a pool, as rs_cancel, cancelling each of
+ * its stripes on whichever connection it was queued.
+ *
+ * @returns 0 if the request was cancelled or non-zero if it has already
+ *          completed (or the handle is otherwise unknown).
+ */
+int rs_pool_cancel(rs_pool_t *pool, rs_handle_t handle);
+
+/**
+ * Set a deadline for a read or write queued via a pool, as rs_set_deadline.
+ *
+ * @returns 0 on success or non-zero if the request has already completed (or
+ *          the handle is otherwise unknown).
+ */
+int rs_pool_set_deadline(rs_pool_t *pool, rs_handle_t handle,
+                         uint64_t deadline);
+
+/**
+ * Free a pool and all of its connections, as rs_free.
+ *
+ * @param cb A callback to call when every connection has been freed or NULL if
+ *           no callback is required.
+ */
+void rs_pool_free(rs_pool_t *pool, rs_free_cb cb, void *cb_data);
+
 
 /**
  * Error number returned when a read or write command receives a bad response
@@ -239,6 +1285,19 @@ void rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data);
 #define RS_EFREE 3
 
 
+/**
+ * Error number returned when a request has been cancelled by rs_cancel.
+ */
+#define RS_ECANCELLED 4
+
+
+/**
+ * Error number returned when a request has not completed by its deadline (see
+ * rs_set_deadline).
+ */
+#define RS_EDEADLINE 5
+
+
 /**
  * Returns the error message for the given error code.
  */
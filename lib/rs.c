@@ -17,13 +17,45 @@
 #include <rs__scp.h>
 
 
-rs_conn_t *
-rs_init(uv_loop_t *loop,
-        const struct sockaddr *addr,
-        size_t scp_data_length,
-        uint64_t timeout,
-        unsigned int n_tries,
-        unsigned int n_outstanding)
+/**
+ * Close callback for the handles opened by a failed rs__init, freeing the
+ * connection once the last of them has closed.
+ */
+static void
+rs__init_failed_closed_cb(uv_handle_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	if (!--conn->n_init_handles_closing)
+		free(conn);
+}
+
+
+/**
+ * Begin closing one of the handles opened by a failed rs__init.
+ */
+static void
+rs__init_failed_close(rs_conn_t *conn, uv_handle_t *handle)
+{
+	conn->n_init_handles_closing++;
+	uv_close(handle, rs__init_failed_closed_cb);
+}
+
+
+/**
+ * Create a connection (see rs_init) which uses either its own socket or, if
+ * transport is not NULL, the socket of a shared transport.
+ *
+ * On failure, any handles already opened are closed and the connection is
+ * freed once they have (or immediately if there are none).
+ */
+static rs_conn_t *
+rs__init(uv_loop_t *loop,
+         rs_transport_t *transport,
+         const struct sockaddr *addr,
+         size_t scp_data_length,
+         uint64_t timeout,
+         unsigned int n_tries,
+         unsigned int n_outstanding)
 {
 	rs_conn_t *conn = malloc(sizeof(rs_conn_t));
 	if (!conn) return NULL;
@@ -33,6 +65,7 @@ rs_init(uv_loop_t *loop,
 	conn->addr = addr;
 	conn->scp_data_length = scp_data_length;
 	conn->timeout = timeout;
+	conn->adaptive_timeout = false;
 	conn->n_tries = n_tries;
 	conn->n_outstanding = n_outstanding;
 	
@@ -43,88 +76,271 @@ rs_init(uv_loop_t *loop,
 	
 	// Initialise counters
 	conn->next_seq_num = 0;
-	conn->next_rw_id = 0;
+	conn->n_init_handles_closing = 0;
 	
-	// Initialise the socket
-	if (uv_udp_init(conn->loop, &(conn->udp_handle))) {
-		// Socket init failed!
-		free(conn);
-		return NULL;
+	// Initialise the socket (unless the transport's socket is used instead)
+	conn->transport = transport;
+	conn->transport_next = NULL;
+	conn->transport_sibling = conn;
+	if (transport) {
+		conn->send_handle = &(transport->udp_handle);
+		conn->udp_handle_closed = true;
+	} else {
+		if (uv_udp_init(conn->loop, &(conn->udp_handle)))
+			goto fail_udp;
+		conn->send_handle = &(conn->udp_handle);
+		conn->udp_handle_closed = false;
+		
+		// Pass a pointer to the SCP connection whenever UDP data arrives
+		conn->udp_handle.data = (void *)conn;
 	}
-	conn->udp_handle_closed = false;
 	
-	// Pass a pointer to the SCP connection whenever UDP data arrives
-	conn->udp_handle.data = (void *)conn;
+	// Initialise the timer used for all packet timeouts
+	if (uv_timer_init(conn->loop, &(conn->timer_handle)))
+		goto fail_timer;
+	conn->timer_handle.data = (void *)conn;
+	conn->timer_handle_closed = false;
+	conn->timers_head = NULL;
+	conn->timers_tail = NULL;
 	
-	// Start listening for incoming packets
-	if (uv_udp_recv_start(&(conn->udp_handle),
-	                      rs__udp_recv_alloc_cb,
-	                      rs__udp_recv_cb)) {
-		// Listening failed
-		// XXX: Doesn't close UDP handle before freeing!
-		free(conn);
-		return NULL;
-	}
+	// Initialise the async handle used to receive requests from other threads.
+	// This should not keep the event loop running on its own.
+	if (uv_async_init(conn->loop, &(conn->async_handle), rs__async_cb))
+		goto fail_async;
+	uv_unref((uv_handle_t *)&(conn->async_handle));
+	conn->async_handle.data = (void *)conn;
+	conn->async_handle_closed = false;
+	conn->ts_reqs = NULL;
 	
+	// Start listening for incoming packets (connections using a transport
+	// receive via the transport once fully initialised)
+	conn->expected_seq_num = 0;
+	if (!transport && rs__recv_start(conn))
+		goto fail_recv;
 	
-	// Create a queue for requests to be placed in
+	
+	// Create queues for normal- and high-priority requests to be placed in
 	conn->request_queue = rs__q_init(sizeof(rs__req_t));
-	if (!conn->request_queue) {
-		// Queue allocation failed!
-		// XXX: Doesn't close UDP handle before freeing!
-		free(conn);
-		return NULL;
-	}
+	if (!conn->request_queue)
+		goto fail_recv;
+	conn->hp_request_queue = rs__q_init(sizeof(rs__req_t));
+	if (!conn->hp_request_queue)
+		goto fail_hp_request_queue;
+	conn->n_reserved_slots = 0;
+	
+	// Interleaving is disabled by default
+	conn->n_active_rws = 0;
+	conn->next_active_rw = 0;
+	conn->interleave = 1;
+	conn->max_per_dest = 0;
+	conn->n_hp_slots_in_use = 0;
+	
+	// All per-slot state, the sequence number table, read/write states, the
+	// batch array and the receive buffers live in a single allocation (the
+	// arena), each starting on a cache line boundary. The slot array comes first
+	// and is not interleaved with the (large and rarely touched) UDP send
+	// requests and packet buffers of each slot.
+	size_t seq_num_table_size = 1;
+	while (seq_num_table_size < conn->n_outstanding)
+		seq_num_table_size <<= 1;
+	size_t n_rw_states = conn->n_outstanding + RS_MAX_INTERLEAVE;
+	conn->recv_buf_size =
+		RS__CACHE_LINE_ROUND(RS__SIZEOF_SCP_PACKET(3, conn->scp_data_length) + 2);
+	
+	// Packet buffers must also be able to hold a reasonable number of buffers
+	// to gather coalesced writes from
+	size_t packet_buf_size =
+		MAX(conn->recv_buf_size,
+		    RS__CACHE_LINE_ROUND(RS__GATHER_OFFSET +
+		                         (RS__MIN_GATHER * sizeof(uv_buf_t))));
+	conn->max_gather = (packet_buf_size - RS__GATHER_OFFSET) / sizeof(uv_buf_t);
+	
+	size_t outstanding_offset = 0;
+	size_t seq_num_table_offset = outstanding_offset +
+		(conn->n_outstanding * RS__OUTSTANDING_STRIDE);
+	size_t rw_states_offset = seq_num_table_offset +
+		RS__CACHE_LINE_ROUND(seq_num_table_size * sizeof(rs__outstanding_t *));
+	size_t dest_counts_offset = rw_states_offset +
+		RS__CACHE_LINE_ROUND(n_rw_states * sizeof(rs__rw_state_t));
+	size_t batch_offset = dest_counts_offset +
+		RS__CACHE_LINE_ROUND(2 * seq_num_table_size * sizeof(rs__dest_count_t));
+	size_t send_reqs_offset = batch_offset +
+		RS__CACHE_LINE_ROUND(conn->n_outstanding * sizeof(rs__outstanding_t *));
+	size_t packet_bufs_offset = send_reqs_offset +
+		RS__CACHE_LINE_ROUND(conn->n_outstanding * sizeof(uv_udp_send_t));
+	size_t recv_bufs_offset = packet_bufs_offset +
+		(conn->n_outstanding * packet_buf_size);
+	size_t arena_size = recv_bufs_offset +
+		(RS__N_RECV_BUFS * conn->recv_buf_size);
+	
+	conn->arena = malloc(arena_size + RS__CACHE_LINE_SIZE - 1);
+	if (!conn->arena)
+		goto fail_arena;
+	char *arena = (char *)RS__CACHE_LINE_ROUND((uintptr_t)conn->arena);
+	
+	// Zero the slots, sequence number table, read/write states and per-chip
+	// in-flight counts
+	memset(arena, 0, batch_offset);
 	
 	// Set up the outstanding slots
-	conn->outstanding = calloc(conn->n_outstanding, sizeof(rs__outstanding_t));
-	if (!conn->outstanding) {
-		rs__q_free(conn->request_queue);
-		// XXX: Doesn't close UDP handle before freeing!
-		free(conn);
-		return NULL;
-	}
+	conn->outstanding = (rs__outstanding_t *)(arena + outstanding_offset);
+	
+	// Set up the sequence number lookup table with a power-of-two number of
+	// entries no smaller than the number of outstanding slots.
+	conn->seq_num_mask = seq_num_table_size - 1;
+	conn->seq_num_table = (rs__outstanding_t **)(arena + seq_num_table_offset);
+	
+	// Set up the pool of read/write states, one per outstanding slot plus one for
+	// each request which may be interleaved.
+	conn->rw_states = (rs__rw_state_t *)(arena + rw_states_offset);
+	conn->free_rw_states = NULL;
 	int i;
+	for (i = 0; i < n_rw_states; i++)
+		rs__free_rw_state(conn, &(conn->rw_states[i]));
+	
+	// Set up the (initially empty) table counting read/write packets in flight
+	// to each chip, kept no more than half full.
+	conn->dest_counts = (rs__dest_count_t *)(arena + dest_counts_offset);
+	conn->dest_counts_mask = (2 * seq_num_table_size) - 1;
+	
+	// Set up the pool of receive buffers, each large enough for any SCP packet
+	// (and its two padding bytes) and aligned to a cache line.
+	conn->recv_bufs = arena + recv_bufs_offset;
+	for (i = 0; i < RS__N_RECV_BUFS; i++)
+		conn->free_recv_bufs[i] = conn->recv_bufs + (i * conn->recv_buf_size);
+	conn->n_free_recv_bufs = RS__N_RECV_BUFS;
+	
+	// Set up the (initially disabled) system call batching
+	conn->batching = false;
+	conn->batch_open = false;
+	conn->n_batch = 0;
+	memset(&(conn->batch_stats), 0, sizeof(conn->batch_stats));
+	memset(&(conn->stats), 0, sizeof(conn->stats));
+	conn->batch = (rs__outstanding_t **)(arena + batch_offset);
+	
+#ifdef RS__IO_URING
+	// io_uring is not used unless enabled
+	conn->uring = NULL;
+#endif
+	
+	conn->free_outstanding = NULL;
+	uv_udp_send_t *send_reqs = (uv_udp_send_t *)(arena + send_reqs_offset);
 	for (i = 0; i < conn->n_outstanding; i++) {
-		conn->outstanding[i].conn = conn;
+		rs__outstanding_t *os = RS__OUTSTANDING(conn, i);
+		os->conn = conn;
+		
+		os->active = false;
+		os->send_req_active = false;
+		os->cancelled = false;
+		os->rw_template_valid = false;
 		
-		conn->outstanding[i].active = false;
-		conn->outstanding[i].send_req_active = false;
-		conn->outstanding[i].cancelled = false;
+		// Each slot's packet buffer is sufficient to buffer SCP packet data (and
+		// two empty padding bytes required when transmitting SCP over UDP).
+		os->packet.base = arena + packet_bufs_offset + (i * packet_buf_size);
 		
-		// Allocate sufficient space to buffer SCP packet data (and two empty
-		// padding bytes required when transmitting SCP over UDP).
-		conn->outstanding[i].packet.base =
-			malloc(RS__SIZEOF_SCP_PACKET(3, conn->scp_data_length) + 2);
-		if (!conn->outstanding[i].packet.base) {
-			while (--i >= 0)
-				free(conn->outstanding[i].packet.base);
-			rs__q_free(conn->request_queue);
-			free(conn);
-			return NULL;
-		}
 		// Zero the two included padding bytes
-		memset(conn->outstanding[i].packet.base, 0, 2);
+		memset(os->packet.base, 0, 2);
 		
-		// Initialise the timer
-		if (uv_timer_init(conn->loop, &(conn->outstanding[i].timer_handle))) {
-			// Timer init failed, cleanup
-			while (i >= 0)
-				// XXX: Doesn't close timer handles before freeing!
-				free(conn->outstanding[i--].packet.base);
-			rs__q_free(conn->request_queue);
-			free(conn);
-			return NULL;
-		}
-		conn->outstanding[i].timer_handle_closed = false;
+		os->timer_armed = false;
+		os->high_priority = false;
 		
-		// Set the user data for UDP requests and timer ticks.
-		conn->outstanding[i].send_req.data = (void *)&(conn->outstanding[i]);
-		conn->outstanding[i].timer_handle.data =
-			(void *)&(conn->outstanding[i]);
+		// Set the user data for UDP requests
+		os->send_req = &(send_reqs[i]);
+		os->send_req->data = (void *)os;
+	}
+	
+	// Place all slots in the free list such that the first slot is used first
+	for (i = conn->n_outstanding - 1; i >= 0; i--)
+		rs__free_outstanding(conn, RS__OUTSTANDING(conn, i));
+	conn->n_slots_in_use = 0;
+	
+	// Handles are allocated from 1 (0 is never a valid handle)
+	conn->next_handle = 1;
+	conn->last_handle = 0;
+	conn->next_group = NULL;
+	conn->groups = NULL;
+	
+	// Congestion control is disabled by default
+	conn->congestion_control = false;
+	
+	// As are fast retransmission and pacing
+	conn->fast_retransmit = 0;
+	conn->pacer = NULL;
+	conn->pacer_waiting = false;
+	conn->pacer_next = NULL;
+	
+	// And write coalescing
+	conn->coalesce_writes = false;
+	
+	if (transport) {
+		transport->n_users++;
+		rs__transport_add(transport, conn);
 	}
 	
 	return conn;
+	
+	// Undo the above in reverse order
+fail_arena:
+	rs__q_free(conn->hp_request_queue);
+fail_hp_request_queue:
+	rs__q_free(conn->request_queue);
+fail_recv:
+	if (!transport)
+		conn->n_init_handles_closing += rs__recv_abort(conn,
+		                                               rs__init_failed_closed_cb);
+	rs__init_failed_close(conn, (uv_handle_t *)&(conn->async_handle));
+fail_async:
+	rs__init_failed_close(conn, (uv_handle_t *)&(conn->timer_handle));
+fail_timer:
+	if (!transport)
+		rs__init_failed_close(conn, (uv_handle_t *)&(conn->udp_handle));
+fail_udp:
+	if (!conn->n_init_handles_closing)
+		free(conn);
+	return NULL;
+}
+
+
+rs_conn_t *
+rs_init(uv_loop_t *loop,
+        const struct sockaddr *addr,
+        size_t scp_data_length,
+        uint64_t timeout,
+        unsigned int n_tries,
+        unsigned int n_outstanding)
+{
+	return rs__init(loop, NULL, addr, scp_data_length,
+	                timeout, n_tries, n_outstanding);
+}
+
+
+rs_conn_t *
+rs_init_shared(rs_transport_t *transport,
+               const struct sockaddr *addr,
+               size_t scp_data_length,
+               uint64_t timeout,
+               unsigned int n_tries,
+               unsigned int n_outstanding)
+{
+	return rs__init(transport->loop, transport, addr, scp_data_length,
+	                timeout, n_tries, n_outstanding);
+}
+
+
+/**
+ * Give a request being queued via the API the handle and deadline of the group
+ * it is part of or, if none, a new handle of its own.
+ */
+static void
+rs__req_init_handle(rs_conn_t *conn, rs__group_t *group, rs__req_t *req)
+{
+	if (group) {
+		req->handle = group->handle;
+		req->deadline = group->deadline;
+	} else {
+		req->handle = conn->last_handle = rs__new_handle(conn);
+		req->deadline = 0;
+	}
 }
 
 
@@ -143,7 +359,33 @@ rs_send_scp(rs_conn_t *conn,
             rs_send_scp_cb cb,
             void *cb_data)
 {
-	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
+	return rs_send_scp_priority(conn, RS_PRIORITY_NORMAL,
+	                            dest_addr, dest_cpu, cmd_rc,
+	                            n_args_send, n_args_recv, arg1, arg2, arg3,
+	                            data, data_max_len, cb, cb_data);
+}
+
+
+int
+rs_send_scp_priority(rs_conn_t *conn,
+                     rs_priority_t priority,
+                     uint16_t dest_addr,
+                     uint8_t dest_cpu,
+                     uint16_t cmd_rc,
+                     unsigned int n_args_send,
+                     unsigned int n_args_recv,
+                     uint32_t arg1,
+                     uint32_t arg2,
+                     uint32_t arg3,
+                     uv_buf_t data,
+                     size_t data_max_len,
+                     rs_send_scp_cb cb,
+                     void *cb_data)
+{
+	rs__group_t *group = rs__group_take(conn);
+	rs__q_t *queue = (priority == RS_PRIORITY_HIGH) ? conn->hp_request_queue
+	                                                : conn->request_queue;
+	rs__req_t *req = (rs__req_t *)rs__q_insert(queue);
 	if (!req)
 		return -1;
 	
@@ -161,6 +403,7 @@ rs_send_scp(rs_conn_t *conn,
 	req->data.scp_packet.data_max_len = data_max_len;
 	req->data.scp_packet.cb = cb;
 	req->cb_data = cb_data;
+	rs__req_init_handle(conn, group, req);
 	
 	rs__process_request_queue(conn);
 	
@@ -168,6 +411,13 @@ rs_send_scp(rs_conn_t *conn,
 }
 
 
+void
+rs_set_priority_reserve(rs_conn_t *conn, unsigned int n_reserved)
+{
+	conn->n_reserved_slots = n_reserved;
+}
+
+
 int
 rs_write(rs_conn_t *conn,
          uint16_t dest_addr,
@@ -177,6 +427,14 @@ rs_write(rs_conn_t *conn,
          rs_rw_cb cb,
          void *cb_data)
 {
+	rs__group_t *group = rs__group_take(conn);
+	
+	// Small writes may be merged with one already waiting to be sent
+	if (conn->coalesce_writes &&
+	    rs__coalesce_write(conn, group, dest_addr, dest_cpu, address, data,
+	                       cb, cb_data))
+		return 0;
+	
 	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
 	if (!req)
 		return -1;
@@ -185,12 +443,14 @@ rs_write(rs_conn_t *conn,
 	req->type = RS__REQ_WRITE;
 	req->dest_addr = dest_addr;
 	req->dest_cpu = dest_cpu;
-	req->data.rw.id = conn->next_rw_id++;
+	req->data.rw.state = NULL;
 	req->data.rw.address = address;
 	req->data.rw.data = data;
 	req->data.rw.orig_data = data;
+	req->data.rw.coalesced = NULL;
 	req->data.rw.cb = cb;
 	req->cb_data = cb_data;
+	rs__req_init_handle(conn, group, req);
 	
 	rs__process_request_queue(conn);
 	
@@ -207,6 +467,7 @@ rs_read(rs_conn_t *conn,
         rs_rw_cb cb,
         void *cb_data)
 {
+	rs__group_t *group = rs__group_take(conn);
 	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
 	if (!req)
 		return -1;
@@ -215,12 +476,14 @@ rs_read(rs_conn_t *conn,
 	req->type = RS__REQ_READ;
 	req->dest_addr = dest_addr;
 	req->dest_cpu = dest_cpu;
-	req->data.rw.id = conn->next_rw_id++;
+	req->data.rw.state = NULL;
 	req->data.rw.address = address;
 	req->data.rw.data = data;
 	req->data.rw.orig_data = data;
+	req->data.rw.coalesced = NULL;
 	req->data.rw.cb = cb;
 	req->cb_data = cb_data;
+	rs__req_init_handle(conn, group, req);
 	
 	rs__process_request_queue(conn);
 	
@@ -228,6 +491,55 @@ rs_read(rs_conn_t *conn,
 }
 
 
+int
+rs_fill(rs_conn_t *conn,
+        uint16_t dest_addr,
+        uint8_t dest_cpu,
+        uint32_t address,
+        uint32_t word,
+        size_t length,
+        rs_rw_cb cb,
+        void *cb_data)
+{
+	rs__group_t *group = rs__group_take(conn);
+	rs__req_t *req = (rs__req_t *)rs__q_insert(conn->request_queue);
+	if (!req)
+		return -1;
+	
+	// Queue up the supplied request. Fills have no buffer, only a length.
+	req->type = RS__REQ_FILL;
+	req->dest_addr = dest_addr;
+	req->dest_cpu = dest_cpu;
+	req->data.rw.state = NULL;
+	req->data.rw.address = address;
+	req->data.rw.data.base = NULL;
+	req->data.rw.data.len = length;
+	req->data.rw.orig_data = req->data.rw.data;
+	req->data.rw.coalesced = NULL;
+	req->data.rw.word = word;
+	req->data.rw.cb = cb;
+	req->cb_data = cb_data;
+	rs__req_init_handle(conn, group, req);
+	
+	rs__process_request_queue(conn);
+	
+	return 0;
+}
+
+
+void
+rs_set_interleave(rs_conn_t *conn, unsigned int n_requests,
+                  unsigned int max_per_dest)
+{
+	// Requests already active remain so even if the number is reduced
+	conn->interleave = MIN(MAX(n_requests, 1), RS_MAX_INTERLEAVE);
+	conn->max_per_dest = max_per_dest;
+	
+	// More requests may now be started
+	rs__process_request_queue(conn);
+}
+
+
 void
 rs__udp_handle_closed_cb(uv_handle_t *handle)
 {
@@ -240,9 +552,18 @@ rs__udp_handle_closed_cb(uv_handle_t *handle)
 void
 rs__timer_handle_closed_cb(uv_handle_t *handle)
 {
-	rs__outstanding_t *os = (rs__outstanding_t *)handle->data;
-	os->timer_handle_closed = true;
-	rs_free(os->conn, NULL, NULL);
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	conn->timer_handle_closed = true;
+	rs_free(conn, NULL, NULL);
+}
+
+
+void
+rs__async_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	conn->async_handle_closed = true;
+	rs_free(conn, NULL, NULL);
 }
 
 
@@ -262,53 +583,80 @@ rs_free(rs_conn_t *conn, rs_free_cb cb, void *cb_data)
 		conn->free_cb_data = cb_data;
 	}
 	
-	// Stop receiving data
-	uv_udp_recv_stop(&(conn->udp_handle));
+	// Stop receiving data and close the UDP handle (if the connection has one)
+	if (conn->transport) {
+		rs__transport_remove(conn->transport, conn);
+	} else {
+		rs__recv_stop(conn);
+		if (!uv_is_closing((uv_handle_t *)&(conn->udp_handle)))
+			uv_close((uv_handle_t *)&(conn->udp_handle), rs__udp_handle_closed_cb);
+	}
 	
-	// Close the UDP handle
-	if (!uv_is_closing((uv_handle_t *)&(conn->udp_handle)))
-		uv_close((uv_handle_t *)&(conn->udp_handle), rs__udp_handle_closed_cb);
+	// Stop waiting for the pacer (if any)
+	rs__pacer_remove(conn);
 	
-	for (i = 0; i < conn->n_outstanding; i++) {
-		// Cancel all outstanding requests
-		rs__cancel_outstanding(conn, &(conn->outstanding[i]), RS_EFREE, -1);
-		
-		// Close the timer handles
-		if (!uv_is_closing((uv_handle_t *)&(conn->outstanding[i].timer_handle)))
-			uv_close((uv_handle_t *)&(conn->outstanding[i].timer_handle),
-			         rs__timer_handle_closed_cb);
-	}
+	// Close the timer handle
+	if (!uv_is_closing((uv_handle_t *)&(conn->timer_handle)))
+		uv_close((uv_handle_t *)&(conn->timer_handle), rs__timer_handle_closed_cb);
+	
+	// Close the async handle
+	if (!uv_is_closing((uv_handle_t *)&(conn->async_handle)))
+		uv_close((uv_handle_t *)&(conn->async_handle), rs__async_handle_closed_cb);
+	
+	// Operations made up of many requests stop queueing more (doing so before
+	// their requests' callbacks are called below)
+	rs__group_free_all(conn, RS_EFREE);
+	
+	// Cancel all outstanding requests
+	for (i = 0; i < conn->n_outstanding; i++)
+		rs__cancel_outstanding(conn, RS__OUTSTANDING(conn, i), RS_EFREE, -1);
 	
 	// Cancel all remaining queued requests
 	rs__req_t *req;
+	while ((req = rs__q_remove(conn->hp_request_queue)))
+		rs__cancel_queued(conn, req, RS_EFREE);
 	while ((req = rs__q_remove(conn->request_queue)))
 		rs__cancel_queued(conn, req, RS_EFREE);
 	
-	// Check whether any UDP send requests are active or timer handle closures
-	// (which require us to postpone the free since their handles would get freed
-	// too!)
-	for (i = 0; i < conn->n_outstanding; i++) {
-		if (conn->outstanding[i].send_req_active)
-			return;
-		if (!conn->outstanding[i].timer_handle_closed)
-			return;
+	// And any not yet queued having been submitted from another thread
+	rs__cancel_threadsafe(conn, RS_EFREE);
+	
+	// Along with any active reads/writes with no packets in flight
+	while (conn->n_active_rws) {
+		rs__req_t active = conn->active_rws[0];
+		rs__remove_active_rw(conn, active.data.rw.state);
+		rs__free_rw_state(conn, active.data.rw.state);
+		rs__cancel_queued(conn, &active, RS_EFREE);
 	}
 	
-	// Likewise with the UDP handle
-	if (!conn->udp_handle_closed)
+	// Check whether any UDP send requests are active (which require us to
+	// postpone the free since their handles would get freed too!)
+	for (i = 0; i < conn->n_outstanding; i++)
+		if (RS__OUTSTANDING(conn, i)->send_req_active)
+			return;
+	
+	// Likewise with the UDP, timer and async handles and any handles used for
+	// receiving
+	if (!conn->udp_handle_closed || !conn->timer_handle_closed ||
+	    !conn->async_handle_closed ||
+	    (!conn->transport && !rs__recv_closed(conn)))
 		return;
 	
 	// Everything has shut down, free all resources now!
-	for (i = 0; i < conn->n_outstanding; i++)
-		free(conn->outstanding[i].packet.base);
-	free(conn->outstanding);
+	free(conn->arena);
 	rs__q_free(conn->request_queue);
+	rs__q_free(conn->hp_request_queue);
 	
 	// Just before freeing the main struct, take a copy of the callback function
 	cb = conn->free_cb;
 	cb_data = conn->free_cb_data;
+	rs_transport_t *transport = conn->transport;
 	free(conn);
 	
+	// The transport may now be freed too
+	if (transport)
+		rs__transport_conn_freed(transport);
+	
 	// Call the callback (if defined)
 	if (cb)
 		cb(cb_data);
@@ -324,15 +672,23 @@ static const char RS__ETIMEOUT_MSG[] = "SCP command timed out";
 static const char RS__EFREE_NAME[] = "RS_EFREE";
 static const char RS__EFREE_MSG[] = "SCP connection was closed/freed";
 
+static const char RS__ECANCELLED_NAME[] = "RS_ECANCELLED";
+static const char RS__ECANCELLED_MSG[] = "SCP request was cancelled";
+
+static const char RS__EDEADLINE_NAME[] = "RS_EDEADLINE";
+static const char RS__EDEADLINE_MSG[] = "SCP request missed its deadline";
+
 
 const char *
 rs_strerror(int err)
 {
 	switch (err) {
-		case RS_EBAD_RC:  return RS__EBAD_RC_MSG;
-		case RS_ETIMEOUT: return RS__ETIMEOUT_MSG;
-		case RS_EFREE:    return RS__EFREE_MSG;
-		default:          return uv_strerror(err);
+		case RS_EBAD_RC:    return RS__EBAD_RC_MSG;
+		case RS_ETIMEOUT:   return RS__ETIMEOUT_MSG;
+		case RS_EFREE:      return RS__EFREE_MSG;
+		case RS_ECANCELLED: return RS__ECANCELLED_MSG;
+		case RS_EDEADLINE:  return RS__EDEADLINE_MSG;
+		default:            return uv_strerror(err);
 	}
 }
 
@@ -341,9 +697,11 @@ const char *
 rs_err_name(int err)
 {
 	switch (err) {
-		case RS_EBAD_RC:  return RS__EBAD_RC_NAME;
-		case RS_ETIMEOUT: return RS__ETIMEOUT_NAME;
-		case RS_EFREE:    return RS__EFREE_NAME;
-		default:          return uv_err_name(err);
+		case RS_EBAD_RC:    return RS__EBAD_RC_NAME;
+		case RS_ETIMEOUT:   return RS__ETIMEOUT_NAME;
+		case RS_EFREE:      return RS__EFREE_NAME;
+		case RS_ECANCELLED: return RS__ECANCELLED_NAME;
+		case RS_EDEADLINE:  return RS__EDEADLINE_NAME;
+		default:            return uv_err_name(err);
 	}
 }
@@ -0,0 +1,340 @@
+/**
+ * Creation of connections whose parameters are chosen by probing the machine
+ * (see rs_init_auto).
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * The state of a connection being set up by rs_init_auto.
+ */
+typedef struct {
+	// The arguments supplied
+	uv_loop_t *loop;
+	const struct sockaddr *addr;
+	uint16_t dest_addr;
+	uint32_t probe_address;
+	unsigned int n_tries;
+	unsigned int max_outstanding;
+	rs_init_auto_cb cb;
+	void *cb_data;
+	
+	// The connection currently being used to probe the machine
+	rs_conn_t *conn;
+	
+	// The parameters chosen so far
+	rs_auto_params_t params;
+	
+	// The number of CMD_VER responses received and the buffer for their data
+	unsigned int n_pings;
+	char ver_data[RS__AUTO_PROBE_DATA_LENGTH];
+	
+	// The window size being measured, and the size and throughput of the last
+	// one measured. The number of retransmissions and the time (nsec) when the
+	// measurement started and the buffer read into.
+	unsigned int window;
+	unsigned int prev_window;
+	uint64_t prev_throughput;
+	uint64_t n_retransmissions;
+	uint64_t start_time;
+	char *ramp_buf;
+} rs__auto_t;
+
+
+/**
+ * Free the connection currently being used to probe the machine.
+ *
+ * Freeing a connection cancels anything it has outstanding (including any
+ * request whose callback is currently running) and so the connection is
+ * forgotten first such that the resulting callbacks are ignored.
+ */
+static void
+rs__auto_free_conn(rs__auto_t *a)
+{
+	rs_conn_t *conn = a->conn;
+	a->conn = NULL;
+	if (conn)
+		rs_free(conn, NULL, NULL);
+}
+
+
+/**
+ * Abandon probing, reporting the error to the user.
+ */
+static void
+rs__auto_fail(rs__auto_t *a, int error)
+{
+	rs__auto_free_conn(a);
+	
+	a->cb(NULL, error, NULL, a->cb_data);
+	
+	free(a->ramp_buf);
+	free(a);
+}
+
+
+/**
+ * Create the final connection using the window size chosen.
+ */
+static void
+rs__auto_finish(rs__auto_t *a, unsigned int window, uint64_t throughput)
+{
+	rs__auto_free_conn(a);
+	
+	a->params.n_outstanding = window;
+	a->params.throughput = throughput;
+	
+	rs_conn_t *conn = rs_init(a->loop, a->addr,
+	                          a->params.scp_data_length,
+	                          a->params.timeout,
+	                          a->n_tries,
+	                          a->params.n_outstanding);
+	if (!conn) {
+		rs__auto_fail(a, UV_ENOMEM);
+		return;
+	}
+	
+	a->cb(conn, 0, &(a->params), a->cb_data);
+	
+	free(a->ramp_buf);
+	free(a);
+}
+
+
+static void rs__auto_ramp_cb(rs_conn_t *conn, int error, uint16_t cmd_rc,
+                             uv_buf_t data, void *cb_data);
+
+
+/**
+ * Measure the throughput of reads using the current window size.
+ */
+static void
+rs__auto_ramp(rs__auto_t *a)
+{
+	// The window is limited by the number of packets allowed in flight to one
+	// chip
+	rs_set_interleave(a->conn, 1, a->window);
+	
+	rs_stats_t stats;
+	rs_get_stats(a->conn, &stats);
+	a->n_retransmissions = stats.n_retransmissions;
+	
+	uv_buf_t data;
+	data.base = a->ramp_buf;
+	data.len = RS__AUTO_RAMP_ROUNDS * a->window * a->params.scp_data_length;
+	a->start_time = uv_hrtime();
+	if (rs_read(a->conn, a->dest_addr, 0, a->probe_address, data,
+	            rs__auto_ramp_cb, a))
+		rs__auto_fail(a, UV_ENOMEM);
+}
+
+
+/**
+ * Callback on completion of a read measuring a window size: moves on to the
+ * next size or settles on the best size found.
+ */
+static void
+rs__auto_ramp_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+                 void *cb_data)
+{
+	rs__auto_t *a = (rs__auto_t *)cb_data;
+	
+	// Requests cancelled by freeing the connection are of no interest
+	if (conn != a->conn)
+		return;
+	
+	if (error) {
+		rs__auto_fail(a, error);
+		return;
+	}
+	
+	uint64_t elapsed = MAX(uv_hrtime() - a->start_time, 1);
+	uint64_t throughput = (data.len * 1000000000ull) / elapsed;
+	
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	bool retransmitted = stats.n_retransmissions != a->n_retransmissions;
+	
+	// Once a larger window stops paying off (or overwhelms the machine), the
+	// previous size is used
+	if (a->prev_window &&
+	    (retransmitted ||
+	     throughput * 100 < a->prev_throughput * (100 + RS__AUTO_MIN_GAIN))) {
+		rs__auto_finish(a, a->prev_window, a->prev_throughput);
+	} else if (a->window == a->max_outstanding) {
+		rs__auto_finish(a, a->window, throughput);
+	} else {
+		a->prev_window = a->window;
+		a->prev_throughput = throughput;
+		a->window = MIN(a->window * 2, a->max_outstanding);
+		rs__auto_ramp(a);
+	}
+}
+
+
+/**
+ * Create the connection used to choose the window size once the data field
+ * length and timeout are known.
+ */
+static void
+rs__auto_start_ramp(rs__auto_t *a)
+{
+	rs__auto_free_conn(a);
+	a->conn = rs_init(a->loop, a->addr,
+	                  a->params.scp_data_length,
+	                  a->params.timeout,
+	                  a->n_tries,
+	                  a->max_outstanding);
+	a->ramp_buf = malloc(RS__AUTO_RAMP_ROUNDS * a->max_outstanding *
+	                     a->params.scp_data_length);
+	if (!a->conn || !a->ramp_buf) {
+		rs__auto_fail(a, UV_ENOMEM);
+		return;
+	}
+	
+	a->window = 1;
+	a->prev_window = 0;
+	a->prev_throughput = 0;
+	rs__auto_ramp(a);
+}
+
+
+static void rs__auto_ver_cb(rs_conn_t *conn, int error, uint16_t cmd_rc,
+                            unsigned int n_args,
+                            uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                            uv_buf_t data, void *cb_data);
+
+
+/**
+ * Send a CMD_VER to the chip being probed.
+ *
+ * @returns 0 if successfully queued, non-zero otherwise.
+ */
+static int
+rs__auto_send_ver(rs__auto_t *a)
+{
+	uv_buf_t data;
+	data.base = a->ver_data;
+	data.len = 0;
+	return rs_send_scp(a->conn, a->dest_addr, 0,
+	                   RS__SCP_CMD_VER,
+	                   3, 3, // CMD_VER takes three (unused) arguments
+	                   0, 0, 0,
+	                   data, sizeof(a->ver_data),
+	                   rs__auto_ver_cb, a);
+}
+
+
+/**
+ * Callback on the response to a CMD_VER: the first gives the data field
+ * length, the rest are used to measure the round-trip time.
+ */
+static void
+rs__auto_ver_cb(rs_conn_t *conn, int error, uint16_t cmd_rc,
+                unsigned int n_args,
+                uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                uv_buf_t data, void *cb_data)
+{
+	rs__auto_t *a = (rs__auto_t *)cb_data;
+	
+	// Requests cancelled by freeing the connection are of no interest
+	if (conn != a->conn)
+		return;
+	
+	if (error) {
+		rs__auto_fail(a, error);
+		return;
+	}
+	if (cmd_rc != RS__SCP_CMD_OK) {
+		rs__auto_fail(a, RS_EBAD_RC);
+		return;
+	}
+	
+	// The lower half of arg2 gives the size of SC&MP's SDP buffers
+	if (!a->n_pings) {
+		a->params.scp_data_length = arg2 & 0xFFFF;
+		if (n_args < 3 || !a->params.scp_data_length) {
+			rs__auto_fail(a, UV_EPROTO);
+			return;
+		}
+	}
+	
+	if (++a->n_pings < RS__AUTO_N_PINGS) {
+		if (rs__auto_send_ver(a))
+			rs__auto_fail(a, UV_ENOMEM);
+		return;
+	}
+	
+	// Allow for a few times the slowest round-trip time seen (or stick with the
+	// probing timeout if every ping needed retransmitting)
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	if (stats.n_rtt_samples) {
+		uint64_t rtt_max_ms = (stats.rtt_max + 999999) / 1000000;
+		a->params.rtt = stats.rtt_total / stats.n_rtt_samples;
+		a->params.timeout = MAX(rtt_max_ms * RS__AUTO_TIMEOUT_FACTOR,
+		                        RS__AUTO_MIN_TIMEOUT);
+	} else {
+		a->params.rtt = RS__AUTO_PROBE_TIMEOUT * 1000000ull;
+		a->params.timeout = RS__AUTO_PROBE_TIMEOUT;
+	}
+	
+	rs__auto_start_ramp(a);
+}
+
+
+int
+rs_init_auto(uv_loop_t *loop,
+             const struct sockaddr *addr,
+             uint16_t dest_addr,
+             uint32_t probe_address,
+             unsigned int n_tries,
+             unsigned int max_outstanding,
+             rs_init_auto_cb cb,
+             void *cb_data)
+{
+	if (!n_tries || !max_outstanding)
+		return -1;
+	
+	rs__auto_t *a = malloc(sizeof(rs__auto_t));
+	if (!a)
+		return -1;
+	
+	a->loop = loop;
+	a->addr = addr;
+	a->dest_addr = dest_addr;
+	a->probe_address = probe_address;
+	a->n_tries = n_tries;
+	a->max_outstanding = max_outstanding;
+	a->cb = cb;
+	a->cb_data = cb_data;
+	a->n_pings = 0;
+	a->ramp_buf = NULL;
+	
+	// Probing starts with a connection able to receive any CMD_VER response
+	a->conn = rs_init(loop, addr, RS__AUTO_PROBE_DATA_LENGTH,
+	                  RS__AUTO_PROBE_TIMEOUT, n_tries, 1);
+	if (!a->conn) {
+		free(a);
+		return -1;
+	}
+	
+	if (rs__auto_send_ver(a)) {
+		rs_free(a->conn, NULL, NULL);
+		free(a);
+		return -1;
+	}
+	
+	return 0;
+}
@@ -0,0 +1,233 @@
+/**
+ * Internal functions for sending batches of packets with a single system call.
+ */
+
+#include <sys/socket.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+#ifdef RS__BATCHING
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#endif
+
+
+bool
+rs__batch_begin(rs_conn_t *conn)
+{
+	// Packets sent using io_uring are always submitted in batches
+	bool batching = conn->batching;
+#ifdef RS__IO_URING
+	batching |= conn->uring != NULL;
+#endif
+	
+	if (!batching || conn->batch_open)
+		return false;
+	
+	conn->batch_open = true;
+	return true;
+}
+
+
+bool
+rs__batch_add(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->batch_open)
+		return false;
+	
+	// The slot is treated as having a send pending until the batch is sent
+	os->send_req_active = true;
+	conn->batch[conn->n_batch++] = os;
+	return true;
+}
+
+
+#ifdef RS__BATCHING
+/**
+ * Send as many of the supplied packets as possible using a single sendmmsg
+ * call.
+ *
+ * @returns The number of packets sent (which may be zero).
+ */
+static unsigned int
+rs__sendmmsg(rs_conn_t *conn, rs__outstanding_t **oss, unsigned int n)
+{
+	struct mmsghdr msgs[RS__SEND_BATCH_SIZE];
+	struct iovec iov[RS__SEND_BATCH_SIZE][2];
+	
+	n = MIN(n, RS__SEND_BATCH_SIZE);
+	
+	socklen_t addr_len = (conn->addr->sa_family == AF_INET6)
+	                     ? sizeof(struct sockaddr_in6)
+	                     : sizeof(struct sockaddr_in);
+	
+	unsigned int i;
+	for (i = 0; i < n; i++) {
+		rs__outstanding_t *os = oss[i];
+		memset(&(msgs[i]), 0, sizeof(msgs[i]));
+		iov[i][0].iov_base = os->packet.base;
+		iov[i][0].iov_len = os->packet.len;
+		iov[i][1].iov_base = os->payload.base;
+		iov[i][1].iov_len = os->payload.len;
+		msgs[i].msg_hdr.msg_name = (void *)conn->addr;
+		msgs[i].msg_hdr.msg_namelen = addr_len;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+		msgs[i].msg_hdr.msg_iovlen = os->payload.len ? 2 : 1;
+		
+		// Coalesced writes are sent from their gather array (libuv's uv_buf_t
+		// has the same layout as struct iovec on Unix)
+		if (os->n_gather) {
+			msgs[i].msg_hdr.msg_iov = (struct iovec *)os->gather;
+			msgs[i].msg_hdr.msg_iovlen = os->n_gather;
+		}
+	}
+	
+	uv_os_fd_t fd;
+	if (uv_fileno((uv_handle_t *)conn->send_handle, &fd))
+		return 0;
+	
+	int n_sent;
+	do {
+		n_sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+	} while (n_sent < 0 && errno == EINTR);
+	
+	conn->batch_stats.n_send_syscalls++;
+	if (n_sent < 0)
+		return 0;
+	conn->batch_stats.n_send_packets += n_sent;
+	return n_sent;
+}
+#endif
+
+
+/**
+ * Deal with a packet in a batch whose transmission has completed (or was never
+ * attempted): mirrors rs__udp_send_cb.
+ */
+static void
+rs__batch_sent(rs_conn_t *conn, rs__outstanding_t *os, bool sent)
+{
+	os->send_req_active = false;
+	
+	if (os->active && os->cancelled) {
+		// Cancelled while waiting for the batch to be sent
+		os->active = false;
+		os->cancelled = false;
+		rs__free_outstanding(conn, os);
+	} else if (!os->active) {
+		rs__free_outstanding(conn, os);
+	} else if (sent) {
+		rs__timer_start_rto(conn, os);
+	} else {
+		// Fall back on sending the packet individually (e.g. if the socket's
+		// send buffer was full)
+		rs__send_packet(conn, os);
+	}
+}
+
+
+void
+rs__batch_end(rs_conn_t *conn)
+{
+	bool freed_slots = false;
+	bool batch_failed = false;
+#ifdef RS__IO_URING
+	unsigned int n_queued = 0;
+#endif
+	
+	// The batch remains open while it is being sent: any packets sent as a
+	// side effect (e.g. by callbacks of requests cancelled due to send errors)
+	// are appended and sent by this loop.
+	while (conn->n_batch) {
+		rs__outstanding_t *chunk[RS__SEND_BATCH_SIZE];
+		unsigned int n = MIN(conn->n_batch, RS__SEND_BATCH_SIZE);
+		memcpy(chunk, conn->batch, n * sizeof(*chunk));
+		conn->n_batch -= n;
+		memmove(conn->batch, conn->batch + n, conn->n_batch * sizeof(*chunk));
+		
+		unsigned int i;
+		
+		// If the connection is being freed, nothing more is sent (the free can
+		// complete once no slots have pending sends).
+		if (conn->free) {
+			for (i = 0; i < n; i++)
+				chunk[i]->send_req_active = false;
+			continue;
+		}
+		
+#ifdef RS__IO_URING
+		// Packets are queued on the io_uring and submitted together below. Their
+		// completions are dealt with as they arrive.
+		if (conn->uring) {
+			for (i = 0; i < n; i++) {
+				if (chunk[i]->active && !chunk[i]->cancelled) {
+					rs__uring_queue_send(conn, chunk[i]);
+					n_queued++;
+				} else {
+					freed_slots = true;
+					rs__batch_sent(conn, chunk[i], false);
+				}
+			}
+			continue;
+		}
+#endif
+		
+		unsigned int n_sent = 0;
+#ifdef RS__BATCHING
+		if (!batch_failed)
+			n_sent = rs__sendmmsg(conn, chunk, n);
+#endif
+		
+		// If the socket won't accept any packets, don't keep trying to send
+		// batches: send the remaining packets individually.
+		batch_failed |= n_sent == 0;
+		
+		for (i = 0; i < n; i++) {
+			freed_slots |= !chunk[i]->active || chunk[i]->cancelled;
+			rs__batch_sent(conn, chunk[i], i < n_sent);
+		}
+	}
+	
+#ifdef RS__IO_URING
+	if (n_queued) {
+		rs__uring_submit(conn);
+		conn->batch_stats.n_send_syscalls++;
+	}
+#endif
+	
+	conn->batch_open = false;
+	
+	if (conn->free) {
+		rs_free(conn, NULL, NULL);
+	} else if (freed_slots) {
+		// Slots freed by cancellation may now be used by queued requests
+		rs__process_request_queue(conn);
+	}
+}
+
+
+int
+rs_set_batching(rs_conn_t *conn, bool enable)
+{
+#ifdef RS__BATCHING
+	conn->batching = enable;
+	return 0;
+#else
+	return enable ? UV_ENOTSUP : 0;
+#endif
+}
+
+
+void
+rs_get_batch_stats(rs_conn_t *conn, rs_batch_stats_t *stats)
+{
+	*stats = conn->batch_stats;
+}
@@ -4,6 +4,7 @@
 
 #include <sys/socket.h>
 
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -14,19 +15,19 @@
 #include <rs__scp.h>
 
 
-void
-rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
-                       int error, uint16_t cmd_rc)
+/**
+ * Mark a single outstanding slot as no longer awaiting a response.
+ *
+ * If a send request is pending, the slot cannot be re-used until it completes,
+ * in which case the cancelled flag is set and rs__udp_send_cb finishes the job.
+ */
+static void
+rs__deactivate_outstanding(rs_conn_t *conn, rs__outstanding_t *os)
 {
-	int i;
-	
-	// Don't bother if the request has already been cancelled
-	if (!os->active || os->cancelled)
-		return;
-	
 	// Indicate that this request has been cancelled
 	if (!os->send_req_active) {
 		os->active = false;
+		rs__free_outstanding(conn, os);
 	} else {
 		// We can't mark this slot as inactive until the send request completes
 		// (otherwise it would be reused too soon). As a result the cancelled flag
@@ -36,98 +37,412 @@ rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
 	}
 	
 	// Kill the timeout timer (if running)
-	if (uv_is_active((uv_handle_t *)&(os->timer_handle)))
-		uv_timer_stop(&(os->timer_handle));
-	
-	// This flag is set if this cancellation also requires that another
-	// outstanding slot must also be cancelled(i.e. in the case of reads and
-	// writes).
-	bool others_to_cancel = false;
-	// If this is a read/write, several things may require cancelling
-	if (os->type == RS__REQ_READ || os->type == RS__REQ_WRITE) {
-		// Find the other outstanding slots which are performing the same
-		// read/write request which must be cancelled too.
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *other_os = conn->outstanding + i;
-			if (// Skip things which have already been cancelled
-			    other_os->active && !other_os->cancelled &&
-			    // Skip things that aren't reads or writes (they won't have anything
-			    // to do with this request)
-			    other_os->type == os->type &&
-			    // Skip reads/writes which aren't part of the same request
-			    other_os->data.rw.id == os->data.rw.id) {
-				others_to_cancel = true;
-			}
-		}
-	}
+	rs__timer_stop(conn, os);
+}
+
+
+/**
+ * Deactivate every outstanding slot of the request using a slot, copying the
+ * details needed to call its callback into req (the slot may be re-used as soon
+ * as it is deactivated).
+ */
+static void
+rs__detach_outstanding(rs_conn_t *conn, rs__outstanding_t *os, rs__req_t *req)
+{
+	conn->stats.n_failed++;
 	
-	// Send the user callback indicating failiure. If this is a read/write
-	// request, multiple outstanding slots may be cancelled and to prevent the
-	// user callback being called multiple times, only the last one to be
-	// cancelled will raise the callback.
-	if (!others_to_cancel) {
-		switch (os->type) {
-			case RS__REQ_SCP_PACKET:
-				os->data.scp_packet.cb(conn, error,
-				                       cmd_rc, 0, 0, 0, 0, os->data.scp_packet.data,
-				                       os->cb_data);
-				break;
-			
-			case RS__REQ_READ:
-			case RS__REQ_WRITE:
-				os->data.rw.cb(conn, error,
-				               cmd_rc, os->data.rw.orig_data,
-				               os->cb_data);
-				break;
-		}
-	}
+	req->type = os->type;
+	req->handle = os->handle;
+	req->cb_data = os->cb_data;
 	
-	// If this is a read/write, several things may require cancelling
-	if (os->type == RS__REQ_READ || os->type == RS__REQ_WRITE) {
-		// Find the other outstanding slots which are performing the same read/write
-		// request and cancel them too.
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *other_os = conn->outstanding + i;
-			if (// Skip things which have already been cancelled
-			    other_os->active && !other_os->cancelled &&
-			    // Skip things that aren't reads or writes (they won't have anything
-			    // to do with this request)
-			    other_os->type == os->type &&
-			    // Skip reads/writes which aren't part of the same request
-			    other_os->data.rw.id == os->data.rw.id) {
-				rs__cancel_outstanding(conn, other_os, error, cmd_rc);
-			}
+	if (req->type == RS__REQ_SCP_PACKET) {
+		req->data.scp_packet.cb = os->data.scp_packet.cb;
+		req->data.scp_packet.data = os->data.scp_packet.data;
+		
+		rs__deactivate_outstanding(conn, os);
+	} else {
+		req->data.rw.cb = os->data.rw.cb;
+		req->data.rw.orig_data = os->data.rw.orig_data;
+		
+		// Cancel all outstanding slots which are performing the same read/write
+		// request (including this one).
+		rs__rw_state_t *state = os->data.rw.state;
+		while (state->slots) {
+			rs__outstanding_t *other_os = state->slots;
+			rs__rw_state_remove(state, other_os);
+			rs__deactivate_outstanding(conn, other_os);
 		}
 		
-		// If this read/write request is still in the request queue, remove it
-		rs__req_t *req = rs__q_peek(conn->request_queue);
-		if (req && req->type == os->type && req->data.rw.id == os->data.rw.id)
-			rs__q_remove(conn->request_queue);
+		// If this read/write request still has packets to send, forget it
+		if (state->queued)
+			rs__remove_active_rw(conn, state);
+		
+		rs__free_rw_state(conn, state);
 	}
-	
-	// We have possibly cleared an outstanding packet, attempt to queue a new
-	// packet in its place
-	rs__process_request_queue(conn);
 }
 
 
-void
-rs__cancel_queued(rs_conn_t *conn, rs__req_t *req, int error)
+/**
+ * Call the callback of a request with an error status.
+ */
+static void
+rs__cancel_cb(rs_conn_t *conn, rs__req_t *req, int error, uint16_t cmd_rc)
 {
-	// Just raise the associated callback with an error status. The caller will
-	// handle the removing of the request from the queue
 	switch (req->type) {
 		case RS__REQ_SCP_PACKET:
 			req->data.scp_packet.cb(conn, error,
-			                        0, 0, 0, 0, 0, req->data.scp_packet.data,
+			                        cmd_rc, 0, 0, 0, 0, req->data.scp_packet.data,
 			                        req->cb_data);
 			break;
 		
 		case RS__REQ_READ:
 		case RS__REQ_WRITE:
+		case RS__REQ_FILL:
 			req->data.rw.cb(conn, error,
-			                0, req->data.rw.orig_data,
+			                cmd_rc, req->data.rw.orig_data,
 			                req->cb_data);
 			break;
 	}
 }
+
+
+void
+rs__cancel_outstanding(rs_conn_t *conn, rs__outstanding_t *os,
+                       int error, uint16_t cmd_rc)
+{
+	// Don't bother if the request has already been cancelled
+	if (!os->active || os->cancelled)
+		return;
+	
+	rs__req_t req;
+	rs__detach_outstanding(conn, os, &req);
+	
+	// Send the user callback indicating failiure. Since all outstanding slots of
+	// a read/write request are cancelled together, the callback is only called
+	// once.
+	rs__cancel_cb(conn, &req, error, cmd_rc);
+	
+	// We have possibly cleared an outstanding packet, attempt to queue a new
+	// packet in its place
+	rs__process_request_queue(conn);
+}
+
+
+void
+rs__cancel_queued(rs_conn_t *conn, rs__req_t *req, int error)
+{
+	// Just raise the associated callback with an error status. The caller will
+	// handle the removing of the request from the queue
+	rs__cancel_cb(conn, req, error, 0);
+}
+
+
+/**
+ * The number of requests in a queue with a given handle.
+ */
+static size_t
+rs__count_handle_queued(rs__q_t *queue, rs_handle_t handle)
+{
+	size_t n = 0;
+	size_t i;
+	rs__req_t *req;
+	for (i = 0; (req = (rs__req_t *)rs__q_peek_at(queue, i)); i++)
+		if (req->handle == handle)
+			n++;
+	return n;
+}
+
+
+static bool
+rs__req_has_handle(void *entry, void *data)
+{
+	return ((rs__req_t *)entry)->handle == *(rs_handle_t *)data;
+}
+
+
+/**
+ * Cancel the first request found with a given handle.
+ *
+ * @returns False if no such request exists.
+ */
+static bool
+rs__cancel_handle_once(rs_conn_t *conn, rs_handle_t handle, int error)
+{
+	unsigned int i;
+	
+	// Requests with packets awaiting responses (cancelling all of them)
+	for (i = 0; i < conn->n_outstanding; i++) {
+		rs__outstanding_t *os = RS__OUTSTANDING(conn, i);
+		if (os->active && !os->cancelled && os->handle == handle) {
+			rs__cancel_outstanding(conn, os, error, -1);
+			return true;
+		}
+	}
+	
+	// Active reads/writes with no packets in flight
+	for (i = 0; i < conn->n_active_rws; i++) {
+		if (conn->active_rws[i].handle == handle) {
+			rs__req_t active = conn->active_rws[i];
+			rs__remove_active_rw(conn, active.data.rw.state);
+			rs__free_rw_state(conn, active.data.rw.state);
+			rs__cancel_queued(conn, &active, error);
+			return true;
+		}
+	}
+	
+	// Requests yet to send anything
+	rs__q_t *queues[] = {conn->hp_request_queue, conn->request_queue};
+	for (i = 0; i < 2; i++) {
+		size_t j;
+		rs__req_t *req;
+		for (j = 0; (req = (rs__req_t *)rs__q_peek_at(queues[i], j)); j++) {
+			if (req->handle == handle) {
+				// Copy the request since removing it overwrites it
+				rs__req_t cancelled = *req;
+				rs__q_remove_at(queues[i], j);
+				rs__cancel_queued(conn, &cancelled, error);
+				return true;
+			}
+		}
+	}
+	
+	return false;
+}
+
+
+bool
+rs__cancel_handle(rs_conn_t *conn, rs_handle_t handle, int error)
+{
+	// Marking the group first stops its operation replacing the requests
+	// cancelled below (from their callbacks) with new ones
+	bool found = false;
+	rs__group_t *group = rs__group_find(conn, handle);
+	if (group && !group->error) {
+		group->error = error;
+		found = true;
+	}
+	
+	// Any other handle belongs to exactly one request (which, when its deadline
+	// passes, is usually at the head of a queue)
+	if (!(handle & RS__HANDLE_GROUP))
+		return rs__cancel_handle_once(conn, handle, error);
+	
+	// Every request of a group shares its handle and a group may have many
+	// thousands queued. Since the callbacks of those cancelled may cancel or
+	// queue other requests, every request is first removed (in a single sweep
+	// of each place a request may be) into a list and the callbacks are only
+	// called afterwards.
+	size_t n_max = rs__count_handle_queued(conn->hp_request_queue, handle) +
+	               rs__count_handle_queued(conn->request_queue, handle) +
+	               conn->n_active_rws;
+	unsigned int i;
+	for (i = 0; i < conn->n_outstanding; i++)
+		if (RS__OUTSTANDING(conn, i)->handle == handle)
+			n_max++;
+	if (!n_max)
+		return found;
+	
+	rs__req_t *reqs = malloc(n_max * sizeof(rs__req_t));
+	if (!reqs) {
+		// Fall back on (slowly) cancelling them one at a time
+		while (rs__cancel_handle_once(conn, handle, error))
+			found = true;
+		return found;
+	}
+	
+	// Requests with packets awaiting responses (cancelling all of their slots)
+	size_t n = 0;
+	for (i = 0; i < conn->n_outstanding; i++) {
+		rs__outstanding_t *os = RS__OUTSTANDING(conn, i);
+		if (os->active && !os->cancelled && os->handle == handle)
+			rs__detach_outstanding(conn, os, &(reqs[n++]));
+	}
+	size_t n_outstanding = n;
+	
+	// Active reads/writes with no packets in flight
+	for (i = 0; i < conn->n_active_rws;) {
+		if (conn->active_rws[i].handle == handle) {
+			reqs[n] = conn->active_rws[i];
+			rs__remove_active_rw(conn, reqs[n].data.rw.state);
+			rs__free_rw_state(conn, reqs[n].data.rw.state);
+			n++;
+		} else {
+			i++;
+		}
+	}
+	
+	// Requests yet to send anything
+	n += rs__q_remove_if(conn->hp_request_queue, rs__req_has_handle, &handle,
+	                     &(reqs[n]));
+	n += rs__q_remove_if(conn->request_queue, rs__req_has_handle, &handle,
+	                     &(reqs[n]));
+	
+	size_t j;
+	for (j = 0; j < n; j++)
+		rs__cancel_cb(conn, &(reqs[j]), error, j < n_outstanding ? -1 : 0);
+	
+	free(reqs);
+	return found || n;
+}
+
+
+rs_handle_t
+rs__new_handle(rs_conn_t *conn)
+{
+	return __atomic_fetch_add(&(conn->next_handle), 1, __ATOMIC_RELAXED);
+}
+
+
+void
+rs__group_init(rs_conn_t *conn, rs__group_t *group)
+{
+	group->handle = conn->last_handle = rs__new_handle(conn) | RS__HANDLE_GROUP;
+	group->deadline = 0;
+	group->error = 0;
+	group->registered = false;
+	group->next = NULL;
+}
+
+
+void
+rs__group_register(rs_conn_t *conn, rs__group_t *group)
+{
+	group->registered = true;
+	group->next = conn->groups;
+	conn->groups = group;
+}
+
+
+void
+rs__group_unregister(rs_conn_t *conn, rs__group_t *group)
+{
+	if (!group->registered)
+		return;
+	
+	rs__group_t **prev = &(conn->groups);
+	while (*prev != group)
+		prev = &((*prev)->next);
+	*prev = group->next;
+	group->registered = false;
+}
+
+
+rs__group_t *
+rs__group_find(rs_conn_t *conn, rs_handle_t handle)
+{
+	// Only handles with the group bit set can belong to a group
+	if (!(handle & RS__HANDLE_GROUP))
+		return NULL;
+	
+	rs__group_t *group;
+	for (group = conn->groups; group; group = group->next)
+		if (group->handle == handle)
+			return group;
+	return NULL;
+}
+
+
+rs__group_t *
+rs__group_take(rs_conn_t *conn)
+{
+	rs__group_t *group = conn->next_group;
+	conn->next_group = NULL;
+	return group;
+}
+
+
+void
+rs__group_free_all(rs_conn_t *conn, int error)
+{
+	// The operations may outlive the connection (e.g. waiting on the
+	// consumer of a stream) and so must no longer refer to its list
+	while (conn->groups) {
+		rs__group_t *group = conn->groups;
+		conn->groups = group->next;
+		group->registered = false;
+		if (!group->error)
+			group->error = error;
+	}
+}
+
+
+rs_handle_t
+rs_get_handle(rs_conn_t *conn)
+{
+	return conn->last_handle;
+}
+
+
+int
+rs_cancel(rs_conn_t *conn, rs_handle_t handle)
+{
+	if (!handle)
+		return -1;
+	
+	// The request may have been submitted from another thread and not yet
+	// queued
+	rs__queue_threadsafe(conn);
+	
+	if (!rs__cancel_handle(conn, handle, RS_ECANCELLED))
+		return -1;
+	
+	// The request may have been holding up those behind it
+	rs__process_request_queue(conn);
+	return 0;
+}
+
+
+int
+rs_set_deadline(rs_conn_t *conn, rs_handle_t handle, uint64_t deadline)
+{
+	if (!handle)
+		return -1;
+	
+	rs__queue_threadsafe(conn);
+	
+	// Requests a group queues later are given its deadline
+	bool found = false;
+	rs__group_t *group = rs__group_find(conn, handle);
+	if (group && !group->error) {
+		group->deadline = deadline;
+		found = true;
+	}
+	
+	unsigned int i;
+	
+	// Packets awaiting responses give up at the deadline if it is sooner than
+	// their current timeout
+	uint64_t now = uv_now(conn->loop);
+	for (i = 0; i < conn->n_outstanding; i++) {
+		rs__outstanding_t *os = RS__OUTSTANDING(conn, i);
+		if (!os->active || os->cancelled || os->handle != handle)
+			continue;
+		
+		found = true;
+		os->req_deadline = deadline;
+		if (deadline && os->timer_armed && deadline < os->deadline)
+			rs__timer_start(conn, os, (deadline > now) ? deadline - now : 0);
+	}
+	
+	// Any remaining packets are sent with the deadline
+	for (i = 0; i < conn->n_active_rws; i++) {
+		if (conn->active_rws[i].handle == handle) {
+			conn->active_rws[i].deadline = deadline;
+			found = true;
+		}
+	}
+	
+	rs__q_t *queues[2] = {conn->hp_request_queue, conn->request_queue};
+	rs__req_t *req;
+	size_t j;
+	for (i = 0; i < 2; i++) {
+		for (j = 0; (req = (rs__req_t *)rs__q_peek_at(queues[i], j)); j++) {
+			if (req->handle == handle) {
+				req->deadline = deadline;
+				found = true;
+			}
+		}
+	}
+	
+	return found ? 0 : -1;
+}
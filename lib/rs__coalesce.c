@@ -0,0 +1,202 @@
+/**
+ * Coalescing of small writes to adjacent memory into as few packets as
+ * possible.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * One of the writes merged into a coalesced write.
+ */
+typedef struct {
+	// The data to write and the user's callback and data
+	uv_buf_t data;
+	rs_rw_cb cb;
+	void *cb_data;
+} rs__coalesce_part_t;
+
+
+/**
+ * The writes merged into a single write request, in address order.
+ */
+struct rs__coalesce {
+	// The part holding the next byte to be packed into a packet and that byte's
+	// offset within the part's data
+	unsigned int next_part;
+	size_t next_offset;
+	
+	// The number of parts and the number space is allocated for
+	unsigned int n_parts;
+	unsigned int max_parts;
+	rs__coalesce_part_t parts[];
+};
+
+
+/**
+ * Callback on completion of a coalesced write: completes each of the writes
+ * merged into it.
+ */
+static void
+rs__coalesce_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+                void *cb_data)
+{
+	rs__coalesce_t *co = (rs__coalesce_t *)cb_data;
+	
+	unsigned int i;
+	for (i = 0; i < co->n_parts; i++)
+		co->parts[i].cb(conn, error, cmd_rc,
+		                co->parts[i].data,
+		                co->parts[i].cb_data);
+	
+	free(co);
+}
+
+
+bool
+rs__coalesce_write(rs_conn_t *conn,
+                   rs__group_t *group,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint32_t address,
+                   uv_buf_t data,
+                   rs_rw_cb cb,
+                   void *cb_data)
+{
+	// Only merge with a write still waiting in the queue which ends where this
+	// write starts. Since merged writes share a handle, writes which are part of
+	// a group are only merged with others of the same group.
+	rs__req_t *req = (rs__req_t *)rs__q_peek_newest(conn->request_queue);
+	if (!req || req->type != RS__REQ_WRITE ||
+	    (group ? req->handle != group->handle
+	           : (req->handle & RS__HANDLE_GROUP) != 0) ||
+	    req->dest_addr != dest_addr ||
+	    req->dest_cpu != dest_cpu ||
+	    !data.len || !req->data.rw.data.len ||
+	    (uint64_t)req->data.rw.address + req->data.rw.data.len != address)
+		return false;
+	
+	// Make room for another part, converting the queued request into a coalesced
+	// write if it is not one already
+	rs__coalesce_t *co = req->data.rw.coalesced;
+	if (!co || co->n_parts == co->max_parts) {
+		unsigned int max_parts = co ? co->max_parts * 2 : RS__COALESCE_MIN_PARTS;
+		rs__coalesce_t *new_co = realloc(co, sizeof(rs__coalesce_t) +
+		                                     (max_parts *
+		                                      sizeof(rs__coalesce_part_t)));
+		if (!new_co)
+			return false;
+		
+		if (!co) {
+			new_co->next_part = 0;
+			new_co->next_offset = 0;
+			new_co->n_parts = 1;
+			new_co->parts[0].data = req->data.rw.data;
+			new_co->parts[0].cb = req->data.rw.cb;
+			new_co->parts[0].cb_data = req->cb_data;
+			
+			req->data.rw.cb = rs__coalesce_cb;
+			req->data.rw.data.base = NULL;
+		}
+		new_co->max_parts = max_parts;
+		
+		co = new_co;
+		req->data.rw.coalesced = co;
+		req->cb_data = (void *)co;
+	}
+	
+	co->parts[co->n_parts].data = data;
+	co->parts[co->n_parts].cb = cb;
+	co->parts[co->n_parts].cb_data = cb_data;
+	co->n_parts++;
+	
+	req->data.rw.data.len += data.len;
+	req->data.rw.orig_data = req->data.rw.data;
+	
+	// The merged write shares the handle of the write it was merged with
+	if (!group)
+		conn->last_handle = req->handle;
+	
+	return true;
+}
+
+
+/**
+ * Fill gather buffers with up to length bytes of the parts starting from the
+ * given cursor, advancing the cursor. Returns the number of bytes gathered.
+ */
+static size_t
+rs__coalesce_walk(rs__coalesce_t *co, rs__outstanding_t *os,
+                  unsigned int max_gather, size_t length,
+                  unsigned int *next_part, size_t *next_offset)
+{
+	size_t remaining = length;
+	while (remaining && os->n_gather < max_gather) {
+		rs__coalesce_part_t *part = &(co->parts[*next_part]);
+		size_t len = MIN(part->data.len - *next_offset, remaining);
+		
+		os->gather[os->n_gather].base = part->data.base + *next_offset;
+		os->gather[os->n_gather].len = len;
+		os->n_gather++;
+		
+		remaining -= len;
+		*next_offset += len;
+		if (*next_offset == part->data.len) {
+			(*next_part)++;
+			*next_offset = 0;
+		}
+	}
+	
+	return length - remaining;
+}
+
+
+void
+rs__coalesce_gather(rs_conn_t *conn, rs__coalesce_t *co,
+                    rs__outstanding_t *os)
+{
+	// The first buffer is the read/write header in the packet buffer
+	os->gather = (uv_buf_t *)(os->packet.base + RS__GATHER_OFFSET);
+	os->gather[0].base = os->packet.base;
+	os->gather[0].len = RS__SIZEOF_SCP_PACKET(3, 0) + 2;
+	os->n_gather = 1;
+	
+	// Followed by the parts of as many writes as fit in the packet (or gather
+	// array)
+	unsigned int next_part = co->next_part;
+	size_t next_offset = co->next_offset;
+	size_t len = rs__coalesce_walk(co, os, conn->max_gather,
+	                               os->data.rw.data.len,
+	                               &next_part, &next_offset);
+	
+	// A chunk cut short by the gather array is trimmed to a whole number of
+	// words so that the chunks which follow remain word-aligned
+	if (len < os->data.rw.data.len && len > 4 && (len & 3)) {
+		os->n_gather = 1;
+		next_part = co->next_part;
+		next_offset = co->next_offset;
+		len = rs__coalesce_walk(co, os, conn->max_gather, len & ~(size_t)3,
+		                        &next_part, &next_offset);
+	}
+	
+	co->next_part = next_part;
+	co->next_offset = next_offset;
+	os->data.rw.data.len = len;
+}
+
+
+void
+rs_set_write_coalescing(rs_conn_t *conn, bool enable)
+{
+	conn->coalesce_writes = enable;
+}
@@ -0,0 +1,87 @@
+/**
+ * Internal functions implementing AIMD congestion control.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+bool
+rs__cwnd_available(rs_conn_t *conn, bool high_priority)
+{
+	unsigned int window = rs_get_window(conn);
+	if (high_priority)
+		return conn->n_slots_in_use < window;
+	
+	// Normal-priority requests may not use the reserved slots (though at least
+	// one slot is always usable so that they are never starved completely).
+	unsigned int n_usable = (window > conn->n_reserved_slots)
+	                        ? window - conn->n_reserved_slots
+	                        : 1;
+	return conn->n_slots_in_use - conn->n_hp_slots_in_use < n_usable &&
+	       conn->n_slots_in_use < window;
+}
+
+
+void
+rs__cwnd_response(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->congestion_control)
+		return;
+	
+	// Responses to retransmitted packets are not evidence of a clean path
+	if (os->n_tries != 1)
+		return;
+	
+	// Additive increase: grow by one slot per window's worth of responses
+	if (++conn->cwnd_n_acks >= conn->cwnd) {
+		conn->cwnd_n_acks = 0;
+		if (conn->cwnd < conn->n_outstanding)
+			conn->cwnd++;
+	}
+}
+
+
+void
+rs__cwnd_timeout(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->congestion_control)
+		return;
+	
+	// Multiplicative decrease. When a burst of packets is lost, many will time
+	// out together: only shrink once for those sent before the last decrease.
+	if (os->send_time < conn->cwnd_decrease_time)
+		return;
+	
+	conn->cwnd = MAX(conn->cwnd / 2, 1);
+	conn->cwnd_n_acks = 0;
+	conn->cwnd_decrease_time = uv_hrtime();
+}
+
+
+void
+rs_set_congestion_control(rs_conn_t *conn, bool enable,
+                          unsigned int initial_window)
+{
+	conn->congestion_control = enable;
+	conn->cwnd = MIN(MAX(initial_window, 1), conn->n_outstanding);
+	conn->cwnd_n_acks = 0;
+	conn->cwnd_decrease_time = 0;
+	
+	// The window may have grown
+	rs__process_request_queue(conn);
+}
+
+
+unsigned int
+rs_get_window(rs_conn_t *conn)
+{
+	return conn->congestion_control ? conn->cwnd : conn->n_outstanding;
+}
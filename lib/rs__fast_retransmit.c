@@ -0,0 +1,69 @@
+/**
+ * Internal functions implementing fast retransmission of packets presumed lost.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+rs__outstanding_t *
+rs__fast_retransmit_response(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->fast_retransmit || !os->timer_armed)
+		return NULL;
+	
+	// Packets sent before this one have (unless the timeout has since shrunk)
+	// earlier deadlines and so are found at the start of the timeout list. Slots
+	// not in the list have either not yet been sent or are being retransmitted.
+	rs__outstanding_t *lost = NULL;
+	rs__outstanding_t *other;
+	for (other = conn->timers_head;
+	     other && other->deadline <= os->deadline;
+	     other = other->timer_next) {
+		if (other->dest_addr != os->dest_addr ||
+		    other->send_time >= os->send_time)
+			continue;
+		
+		// The final attempt is always left to time out such that a packet is
+		// never given up on early.
+		if (++other->n_later_responses >= conn->fast_retransmit &&
+		    other->n_tries < conn->n_tries &&
+		    !lost)
+			lost = other;
+	}
+	
+	return lost;
+}
+
+
+void
+rs__fast_retransmit(rs_conn_t *conn, rs__outstanding_t *os, uint16_t seq_num)
+{
+	// Nothing to do if the packet has since been retransmitted, cancelled or
+	// responded to (all of which remove it from the timeout list). The slot may
+	// also have been given a new packet (e.g. by a callback which cancelled the
+	// original request and queued another) which, though armed, was only just
+	// sent and so has not been lost.
+	if (conn->free || !os->timer_armed || !os->active || os->cancelled ||
+	    os->seq_num != seq_num)
+		return;
+	
+	conn->stats.n_fast_retransmissions++;
+	rs__timer_stop(conn, os);
+	rs__cwnd_timeout(conn, os);
+	rs__attempt_transmission(conn, os);
+}
+
+
+void
+rs_set_fast_retransmit(rs_conn_t *conn, unsigned int threshold)
+{
+	conn->fast_retransmit = threshold;
+}
@@ -0,0 +1,464 @@
+/**
+ * Bulk transfers between a machine's memory and a file descriptor, overlapping
+ * file and network I/O using a bounded number of chunk buffers.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+struct rs__file;
+
+
+/**
+ * A chunk of a transfer which is being read from or written to the file.
+ */
+typedef struct {
+	uv_fs_t req;
+	struct rs__file *file;
+	
+	// Is the buffer in use?
+	bool busy;
+	
+	// The address of the chunk in the machine's memory, its data and the number
+	// of bytes of it transferred to/from the file so far (file accesses may
+	// complete partially)
+	uint32_t address;
+	uv_buf_t data;
+	size_t done;
+} rs__file_buf_t;
+
+
+/**
+ * The state of a transfer between a machine and a file.
+ */
+typedef struct rs__file {
+	rs_conn_t *conn;
+	
+	// The group the transfer's requests (including those of its stream) are part
+	// of, registered until the transfer completes
+	rs__group_t group;
+	
+	// The chip, CPU, address and length of the memory being transferred
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint32_t address;
+	size_t length;
+	
+	// The file and the offset within it corresponding with address
+	uv_file fd;
+	int64_t offset;
+	
+	// Is data being read from the machine into the file (see rs_read_to_fd)? If
+	// so, the reads are performed by a stream (known once it makes its first
+	// callback). Set once the stream has made its final callback.
+	bool to_fd;
+	rs_stream_t *stream;
+	bool stream_done;
+	
+	// Writes to the machine (see rs_write_from_fd) are made in chunks of
+	// chunk_size bytes from buf_data. The number of bytes of the block whose
+	// chunks have been started.
+	char *buf_data;
+	size_t chunk_size;
+	size_t next_offset;
+	
+	// The number of buffers in use
+	unsigned int n_busy;
+	
+	// The first error encountered (after which no further chunks are started)
+	int error;
+	uint16_t cmd_rc;
+	
+	rs_rw_cb cb;
+	void *cb_data;
+	
+	rs__file_buf_t bufs[RS__FILE_N_BUFS];
+} rs__file_t;
+
+
+/**
+ * Record an error (unless one has already occurred).
+ */
+static void
+rs__file_fail(rs__file_t *file, int error, uint16_t cmd_rc)
+{
+	if (!file->error) {
+		file->error = error;
+		file->cmd_rc = cmd_rc;
+	}
+}
+
+
+/**
+ * Fail the transfer if its group has been cancelled (or its connection freed)
+ * while waiting for the file.
+ */
+static void
+rs__file_check_cancelled(rs__file_t *file)
+{
+	if (file->group.error)
+		rs__file_fail(file, file->group.error, 0);
+}
+
+
+/**
+ * Call the user's callback and free the transfer once all of its chunks are
+ * finished with.
+ */
+static void
+rs__file_complete(rs__file_t *file)
+{
+	rs__file_check_cancelled(file);
+	
+	bool finished = file->to_fd ? file->stream_done
+	                            : (file->error ||
+	                               file->next_offset == file->length);
+	if (!finished || file->n_busy)
+		return;
+	
+	rs__group_unregister(file->conn, &(file->group));
+	
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = file->length;
+	file->cb(file->conn, file->error, file->cmd_rc, data, file->cb_data);
+	
+	free(file->buf_data);
+	free(file);
+}
+
+
+/**
+ * Get a buffer which is not in use (one always exists while a chunk is waiting
+ * to be transferred).
+ */
+static rs__file_buf_t *
+rs__file_get_buf(rs__file_t *file)
+{
+	unsigned int i;
+	for (i = 0; i < RS__FILE_N_BUFS; i++)
+		if (!file->bufs[i].busy)
+			return &(file->bufs[i]);
+	return NULL;
+}
+
+
+static void rs__file_write_cb(uv_fs_t *req);
+
+
+/**
+ * Write the remainder of a chunk read from the machine to the file.
+ */
+static void
+rs__file_write(rs__file_t *file, rs__file_buf_t *buf)
+{
+	uv_buf_t remaining;
+	remaining.base = buf->data.base + buf->done;
+	remaining.len = buf->data.len - buf->done;
+	int err = uv_fs_write(file->conn->loop, &(buf->req), file->fd,
+	                      &remaining, 1,
+	                      file->offset + (buf->address - file->address) +
+	                      buf->done,
+	                      rs__file_write_cb);
+	if (err) {
+		rs__file_fail(file, err, 0);
+		buf->busy = false;
+		file->n_busy--;
+		rs_stream_release(file->stream, buf->data);
+	}
+}
+
+
+/**
+ * Callback on completion of (part of) a write of a chunk to the file.
+ */
+static void
+rs__file_write_cb(uv_fs_t *req)
+{
+	rs__file_buf_t *buf = (rs__file_buf_t *)req->data;
+	rs__file_t *file = buf->file;
+	ssize_t result = req->result;
+	uv_fs_req_cleanup(req);
+	
+	if (result > 0 && buf->done + result < buf->data.len) {
+		buf->done += result;
+		rs__file_write(file, buf);
+	} else {
+		if (result < 0)
+			rs__file_fail(file, (int)result, 0);
+		buf->busy = false;
+		file->n_busy--;
+		rs_stream_release(file->stream, buf->data);
+	}
+	
+	rs__file_complete(file);
+}
+
+
+/**
+ * Streaming read callback: writes each chunk to the file as it arrives.
+ */
+static void
+rs__file_stream_cb(rs_conn_t *conn, rs_stream_t *stream,
+                   int error, uint16_t cmd_rc,
+                   uint32_t address, uv_buf_t data, bool last,
+                   void *cb_data)
+{
+	rs__file_t *file = (rs__file_t *)cb_data;
+	
+	file->stream = stream;
+	file->stream_done = last;
+	rs__file_check_cancelled(file);
+	
+	if (error) {
+		rs__file_fail(file, error, cmd_rc);
+	} else if (file->error) {
+		// Once the transfer has failed, the remaining chunks are discarded
+		rs_stream_release(stream, data);
+	} else {
+		rs__file_buf_t *buf = rs__file_get_buf(file);
+		buf->req.data = (void *)buf;
+		buf->busy = true;
+		buf->address = address;
+		buf->data = data;
+		buf->done = 0;
+		file->n_busy++;
+		rs__file_write(file, buf);
+	}
+	
+	rs__file_complete(file);
+}
+
+
+static void rs__file_process(rs__file_t *file);
+
+
+static void rs__file_read_cb(uv_fs_t *req);
+
+
+/**
+ * Read the remainder of a chunk to be written to the machine from the file.
+ */
+static void
+rs__file_read(rs__file_t *file, rs__file_buf_t *buf)
+{
+	uv_buf_t remaining;
+	remaining.base = buf->data.base + buf->done;
+	remaining.len = buf->data.len - buf->done;
+	int err = uv_fs_read(file->conn->loop, &(buf->req), file->fd,
+	                     &remaining, 1,
+	                     file->offset + (buf->address - file->address) +
+	                     buf->done,
+	                     rs__file_read_cb);
+	if (err) {
+		rs__file_fail(file, err, 0);
+		buf->busy = false;
+		file->n_busy--;
+	}
+}
+
+
+/**
+ * Callback on completion of a chunk's write to the machine.
+ */
+static void
+rs__file_rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+               void *cb_data)
+{
+	rs__file_buf_t *buf = (rs__file_buf_t *)cb_data;
+	rs__file_t *file = buf->file;
+	
+	if (error)
+		rs__file_fail(file, error, cmd_rc);
+	buf->busy = false;
+	file->n_busy--;
+	
+	rs__file_process(file);
+}
+
+
+/**
+ * Callback on completion of (part of) a read of a chunk from the file: once
+ * the whole chunk has been read, it is written to the machine.
+ */
+static void
+rs__file_read_cb(uv_fs_t *req)
+{
+	rs__file_buf_t *buf = (rs__file_buf_t *)req->data;
+	rs__file_t *file = buf->file;
+	ssize_t result = req->result;
+	uv_fs_req_cleanup(req);
+	rs__file_check_cancelled(file);
+	
+	// Reaching the end of the file before the end of the block is an error
+	if (result > 0 && buf->done + result < buf->data.len) {
+		buf->done += result;
+		rs__file_read(file, buf);
+	} else if (result <= 0 || file->error) {
+		if (result <= 0)
+			rs__file_fail(file, result ? (int)result : UV_EOF, 0);
+		buf->busy = false;
+		file->n_busy--;
+	} else {
+		file->conn->next_group = &(file->group);
+		if (rs_write(file->conn, file->dest_addr, file->dest_cpu,
+		             buf->address, buf->data, rs__file_rw_cb, buf)) {
+			rs__file_fail(file, UV_ENOMEM, 0);
+			buf->busy = false;
+			file->n_busy--;
+		}
+	}
+	
+	rs__file_process(file);
+}
+
+
+/**
+ * Start reading as many chunks from the file as there are free buffers
+ * (completing the transfer once every chunk has been written or an error has
+ * occurred).
+ */
+static void
+rs__file_process(rs__file_t *file)
+{
+	rs__file_check_cancelled(file);
+	
+	rs__file_buf_t *buf;
+	while (!file->error && file->next_offset < file->length &&
+	       (buf = rs__file_get_buf(file))) {
+		buf->busy = true;
+		buf->address = file->address + file->next_offset;
+		buf->data.base = file->buf_data +
+		                 ((buf - file->bufs) * file->chunk_size);
+		buf->data.len = MIN(file->chunk_size,
+		                    file->length - file->next_offset);
+		buf->done = 0;
+		file->next_offset += buf->data.len;
+		file->n_busy++;
+		rs__file_read(file, buf);
+	}
+	
+	rs__file_complete(file);
+}
+
+
+/**
+ * Allocate and initialise the state of a transfer.
+ */
+static rs__file_t *
+rs__file_init(rs_conn_t *conn,
+              uint16_t dest_addr,
+              uint8_t dest_cpu,
+              uint32_t address,
+              size_t length,
+              uv_file fd,
+              int64_t offset,
+              rs_rw_cb cb,
+              void *cb_data)
+{
+	rs__file_t *file = malloc(sizeof(rs__file_t));
+	if (!file)
+		return NULL;
+	
+	file->conn = conn;
+	file->dest_addr = dest_addr;
+	file->dest_cpu = dest_cpu;
+	file->address = address;
+	file->length = length;
+	file->fd = fd;
+	file->offset = offset;
+	file->to_fd = false;
+	file->stream = NULL;
+	file->stream_done = false;
+	file->buf_data = NULL;
+	file->chunk_size = conn->n_outstanding * conn->scp_data_length;
+	file->next_offset = 0;
+	file->n_busy = 0;
+	file->error = 0;
+	file->cmd_rc = 0;
+	file->cb = cb;
+	file->cb_data = cb_data;
+	rs__group_init(conn, &(file->group));
+	
+	unsigned int i;
+	for (i = 0; i < RS__FILE_N_BUFS; i++) {
+		file->bufs[i].req.data = (void *)&(file->bufs[i]);
+		file->bufs[i].file = file;
+		file->bufs[i].busy = false;
+	}
+	
+	return file;
+}
+
+
+int
+rs_read_to_fd(rs_conn_t *conn,
+              uint16_t dest_addr,
+              uint8_t dest_cpu,
+              uint32_t address,
+              size_t length,
+              uv_file fd,
+              int64_t offset,
+              rs_rw_cb cb,
+              void *cb_data)
+{
+	rs__file_t *file = rs__file_init(conn, dest_addr, dest_cpu, address, length,
+	                                 fd, offset, cb, cb_data);
+	if (!file)
+		return -1;
+	
+	// The stream's buffers are written to the file as they are delivered
+	file->to_fd = true;
+	rs__group_register(conn, &(file->group));
+	conn->next_group = &(file->group);
+	if (rs_read_stream(conn, dest_addr, dest_cpu, address, length,
+	                   file->chunk_size, RS__FILE_N_BUFS,
+	                   rs__file_stream_cb, file)) {
+		rs__group_unregister(conn, &(file->group));
+		free(file);
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+int
+rs_write_from_fd(rs_conn_t *conn,
+                 uint16_t dest_addr,
+                 uint8_t dest_cpu,
+                 uint32_t address,
+                 size_t length,
+                 uv_file fd,
+                 int64_t offset,
+                 rs_rw_cb cb,
+                 void *cb_data)
+{
+	if (!length)
+		return -1;
+	
+	rs__file_t *file = rs__file_init(conn, dest_addr, dest_cpu, address, length,
+	                                 fd, offset, cb, cb_data);
+	if (!file)
+		return -1;
+	
+	file->buf_data = malloc(RS__FILE_N_BUFS * file->chunk_size);
+	if (!file->buf_data) {
+		free(file);
+		return -1;
+	}
+	
+	rs__group_register(conn, &(file->group));
+	rs__file_process(file);
+	
+	return 0;
+}
@@ -5,19 +5,143 @@
 #ifndef RS__INTERNAL_H
 #define RS__INTERNAL_H
 
+#include <stddef.h>
+
 #include <uv.h>
 
 #include <rs.h>
 #include <rs__queue.h>
+#include <rs__scp.h>
 
 #ifndef MIN
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
 #ifndef MAX
-#define MAX(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+/**
+ * The size of a cache line (in bytes) to which performance-sensitive buffers
+ * are aligned.
+ */
+#define RS__CACHE_LINE_SIZE 64
+
+/**
+ * Round a size up to a whole number of cache lines.
+ */
+#define RS__CACHE_LINE_ROUND(size) \
+	((((size) + RS__CACHE_LINE_SIZE - 1) / RS__CACHE_LINE_SIZE) * \
+	 RS__CACHE_LINE_SIZE)
+
+/**
+ * The offset within a slot's packet buffer of the array of buffers from which
+ * the packet of a coalesced write is gathered (just beyond the read/write
+ * header, suitably aligned) and the minimum number of entries packet buffers
+ * are made large enough to hold (see rs_set_write_coalescing).
+ */
+#define RS__GATHER_OFFSET \
+	((RS__SIZEOF_SCP_PACKET(3, 0) + 2 + sizeof(uv_buf_t) - 1) & \
+	 ~(sizeof(uv_buf_t) - 1))
+#define RS__MIN_GATHER 8
+
+/**
+ * The number of writes space is initially allocated for when writes are first
+ * coalesced (doubling as required).
+ */
+#define RS__COALESCE_MIN_PARTS 8
+
+/**
+ * The number of chunk buffers used by transfers between a machine and a file
+ * (see rs_read_to_fd). While one chunk is on its way to or from the file
+ * another may be on its way across the network.
+ */
+#define RS__FILE_N_BUFS 4
+
+/**
+ * Parameters of the probing performed by rs_init_auto: the data field length
+ * and timeout (msec) used while probing, the number of CMD_VER pings used to
+ * measure the round-trip time and the bounds of the timeout chosen (msec) as a
+ * multiple of the largest round-trip time measured.
+ */
+#define RS__AUTO_PROBE_DATA_LENGTH 256
+#define RS__AUTO_PROBE_TIMEOUT 250
+#define RS__AUTO_N_PINGS 8
+#define RS__AUTO_TIMEOUT_FACTOR 4
+#define RS__AUTO_MIN_TIMEOUT 20
+
+/**
+ * Each window size tried by rs_init_auto is measured by reading this many
+ * windows' worth of packets. A larger window is only chosen if it improves
+ * throughput by at least RS__AUTO_MIN_GAIN percent.
+ */
+#define RS__AUTO_RAMP_ROUNDS 4
+#define RS__AUTO_MIN_GAIN 10
+
+/**
+ * The maximum number of datagrams received by a single system call when
+ * batching is enabled.
+ */
+#define RS__RECV_BATCH_SIZE 16
+
+/**
+ * The number of pre-allocated receive buffers per connection. At most one
+ * buffer per datagram received by a single system call is in use at once so
+ * only a small number are required; if these are exhausted, buffers are
+ * allocated using malloc.
+ */
+#define RS__N_RECV_BUFS RS__RECV_BATCH_SIZE
+
+/**
+ * On Linux, responses are received using recvmsg directly (rather than via
+ * libuv's UDP receive API) so that CMD_READ response payloads can be scattered
+ * directly into the user's buffer. Define RS_NO_ZERO_COPY_RECV to disable this
+ * and use the portable (copying) libuv receive path.
+ */
+#if defined(__linux__) && !defined(RS_NO_ZERO_COPY_RECV)
+#define RS__ZERO_COPY_RECV
+#include <sys/uio.h>
 #endif
 
+/**
+ * Maximum number of receive system calls made in response to a single poll
+ * event when using the zero-copy receive path (limits the time spent before
+ * control is returned to the event loop).
+ */
+#define RS__MAX_RECV_PER_POLL 32
+
+/**
+ * On Linux, batches of packets may be sent and received using the sendmmsg and
+ * recvmmsg system calls (see rs_set_batching). Define RS_NO_BATCHING to
+ * disable support.
+ */
+#if defined(__linux__) && !defined(RS_NO_BATCHING)
+#define RS__BATCHING
+#endif
+
+/**
+ * The maximum number of datagrams sent by a single system call when batching
+ * is enabled.
+ */
+#define RS__SEND_BATCH_SIZE 32
+
+/**
+ * On Linux, connections may optionally send and receive packets using io_uring
+ * (see rs_enable_io_uring). Support is only compiled in when RS_IO_URING is
+ * defined (e.g. using the RS_IO_URING CMake option) and relies on the
+ * zero-copy receive path's duplicated socket descriptor.
+ */
+#if defined(RS__ZERO_COPY_RECV) && defined(RS_IO_URING)
+#define RS__IO_URING
+#endif
+
+/**
+ * The number of receive buffers provided to the kernel by each connection using
+ * io_uring (must be a power of two). Multishot receives stop when every buffer
+ * holds a datagram not yet processed, and are restarted once they have been.
+ */
+#define RS__URING_N_RECV_BUFS 64
+
 
 /**
  * Indicates the type of request.
@@ -31,17 +155,31 @@ typedef enum {
 	
 	// Send a bulk write request
 	RS__REQ_WRITE,
+	
+	// Send a bulk fill request (a CMD_FILL with CMD_WRITEs for any unaligned
+	// bytes at either end)
+	RS__REQ_FILL,
 } rs__req_type_t;
 
 
+struct rs__outstanding;
+typedef struct rs__outstanding rs__outstanding_t;
+
+struct rs__rw_state;
+typedef struct rs__rw_state rs__rw_state_t;
+
+struct rs__coalesce;
+typedef struct rs__coalesce rs__coalesce_t;
+
+struct rs__uring;
+typedef struct rs__uring rs__uring_t;
+
+
 /**
  * Represents a request sent to a SpiNNaker machine which may be either a single
  * SCP packet or a bulk read/write.
  */
 typedef struct {
-	// Data required by the queue datastructure.
-	rs__q_entry_t _;
-	
 	// What type of request is this?
 	rs__req_type_t type;
 	
@@ -55,6 +193,12 @@ typedef struct {
 	// request
 	void *cb_data;
 	
+	// The handle identifying this request (see rs_get_handle) and the time
+	// (according to uv_now) by which it must complete or zero if it has no
+	// deadline (see rs_set_deadline).
+	rs_handle_t handle;
+	uint64_t deadline;
+	
 	// Type-specific request values
 	union {
 		// Data for SCP Packet requests
@@ -87,8 +231,9 @@ typedef struct {
 		
 		// Data for read/write requests
 		struct {
-			// A unique ID assigned to this read/write request.
-			unsigned int id;
+			// The in-flight state of this read/write request or NULL if it is not
+			// yet in the connection's set of active requests.
+			rs__rw_state_t *state;
 			
 			// The address to read/write to. This is advanced as the read/write
 			// process proceeds.
@@ -104,6 +249,15 @@ typedef struct {
 			// proceeds.
 			uv_buf_t orig_data;
 			
+			// If this write is the result of coalescing several writes, the
+			// buffers its data is gathered from (in which case data.base is NULL)
+			// or NULL otherwise (see rs_set_write_coalescing).
+			rs__coalesce_t *coalesced;
+			
+			// For fills (which have no buffer so data.base is NULL), the word to
+			// fill memory with.
+			uint32_t word;
+			
 			// Callback function on completion
 			rs_rw_cb cb;
 		} rw;
@@ -113,16 +267,179 @@ typedef struct {
 
 
 /**
- * State used by an outstanding transmission request.
+ * A request submitted from another thread via one of the *_threadsafe
+ * functions.
  */
-typedef struct {
-	// Pointer to the owning rs_conn_t, required since a pointer to this struct is
-	// used as the user-data for a number of callbacks.
+typedef struct rs__ts_req rs__ts_req_t;
+struct rs__ts_req {
+	// The next entry in the (lock-free) stack the request is in
+	rs__ts_req_t *next;
+	
+	// The request to queue. When completing via a callback queue, its callback
+	// and data are replaced with those which place this request in the queue.
+	rs__req_t req;
+	bool high_priority;
+	
+	// The queue to return the completed request to (or NULL to complete on the
+	// loop thread, in which case this request is freed once queued).
+	rs_cb_queue_t *cb_queue;
+	
+	// When completing via a callback queue: the user's callback and data and
+	// the arguments to pass to the callback.
+	union {
+		rs_send_scp_cb scp_packet;
+		rs_rw_cb rw;
+	} cb;
+	void *cb_data;
 	rs_conn_t *conn;
+	int error;
+	uint16_t cmd_rc;
+	unsigned int n_args;
+	uint32_t arg1;
+	uint32_t arg2;
+	uint32_t arg3;
+	uv_buf_t data;
+};
+
+
+/**
+ * Handles of requests queued as part of a group have this bit set and those of
+ * groups belonging to a pool (rather than one of its connections) also have
+ * RS__HANDLE_POOL set, keeping the three kinds of handle apart.
+ */
+#define RS__HANDLE_GROUP ((rs_handle_t)1 << 63)
+#define RS__HANDLE_POOL ((rs_handle_t)1 << 62)
+
+
+/**
+ * A group of requests queued by a composite operation (e.g. a vectored
+ * read/write or a stream) which share a single handle, such that the whole
+ * operation may be cancelled or given a deadline at once (see rs_get_handle).
+ *
+ * Operations which queue requests some time after they are started (e.g.
+ * waiting for buffers to be released) register their group with their
+ * connection until they finish, recording the deadline given to requests
+ * queued later and whether the group has since been cancelled.
+ */
+typedef struct rs__group rs__group_t;
+struct rs__group {
+	rs_handle_t handle;
+	uint64_t deadline;
+	
+	// The error the group was cancelled with (or 0), after which the operation
+	// must not queue any more requests.
+	int error;
+	
+	// Is the group in its connection's list of groups?
+	bool registered;
+	rs__group_t *next;
+};
+
+
+struct rs_cb_queue {
+	// A lock-free stack of completed requests (newest first)
+	rs__ts_req_t *completed;
+	
+	// If the queue belongs to an event loop, a handle used to run the queue on
+	// that loop whenever requests are completed. Otherwise, a condition
+	// variable (and its mutex) signalled to wake any thread blocked in
+	// rs_cb_queue_wait. Either way, wakeups are only made when the stack becomes
+	// non-empty.
+	bool has_async;
+	uv_async_t async_handle;
+	uv_mutex_t mutex;
+	uv_cond_t cond;
+};
+
+
+#ifdef RS__ZERO_COPY_RECV
+/**
+ * State of a single datagram being received via the zero-copy receive path.
+ */
+typedef struct {
+	// The outstanding CMD_READ slot (and its sequence number at the time of
+	// receiving) whose payload the datagram is expected to contain, or NULL if
+	// the datagram is received wholly into buf.
+	rs__outstanding_t *os;
+	uint16_t seq_num;
+	
+	// The receive buffer into which the datagram (or the part not scattered into
+	// the user's buffer) is received.
+	uv_buf_t buf;
+	
+	// The buffers the datagram is scattered into
+	struct iovec iov[3];
+	
+	// Scratch space into which the padding and SDP/SCP header of a CMD_READ
+	// response are received when its payload is received directly into the
+	// user's buffer.
+	char header[RS__SIZEOF_SCP_PACKET(0, 0) + 2];
+} rs__recv_msg_t;
+#endif
+
+
+/**
+ * An entry in a connection's table of the number of read/write packets in
+ * flight to each chip (see rs_conn_t). Entries with no packets in flight are
+ * unused.
+ */
+typedef struct {
+	uint16_t dest_addr;
+	unsigned int n_in_flight;
+} rs__dest_count_t;
+
+
+/**
+ * Book-keeping for a read/write request which has (or has had) packets placed
+ * in outstanding slots. These are allocated from a per-connection pool when the
+ * first packet of a read/write is sent and released when the request
+ * completes, allowing responses to determine whether they are the last packet
+ * of a request without searching all outstanding slots.
+ */
+struct rs__rw_state {
+	// The number of outstanding slots currently active on behalf of this request
+	unsigned int n_outstanding;
+	
+	// Is the remainder of this request still in the connection's set of active
+	// requests (i.e. are there packets yet to be sent)?
+	bool queued;
+	
+	// Doubly linked list of the outstanding slots currently active on behalf of
+	// this request (linked via their data.rw.next/prev fields).
+	rs__outstanding_t *slots;
 	
+	// The next entry in the connection's free list of read/write states (only
+	// meaningful while this state is not in use).
+	rs__rw_state_t *next_free;
+};
+
+
+/**
+ * State used by an outstanding transmission request.
+ *
+ * The fields examined whenever a response arrives or a slot is allocated are
+ * kept together at the start of the struct. Slots live in an array aligned to
+ * a cache line within the connection's arena (see rs_conn_t), each padded to a
+ * whole number of cache lines (see RS__OUTSTANDING) such that those fields
+ * share a single line, alongside their packet buffers and UDP send requests
+ * which are kept apart from this array since they are large and rarely
+ * touched.
+ */
+struct rs__outstanding {
 	// Is this outstanding slot currently awaiting a response?
 	bool active;
 	
+	// Is a UDP send request actually pending?
+	bool send_req_active;
+	
+	// If this outstanding request is cancelled while send_req_active, this flag
+	// indicates that the send_req callback should mark this outstanding slot as
+	// inactive.
+	bool cancelled;
+	
+	// Was the slot allocated to a high-priority request?
+	bool high_priority;
+	
 	// The type of request that is active
 	rs__req_type_t type;
 	
@@ -132,29 +449,70 @@ typedef struct {
 	// The number of attempts made to transmit the current packet
 	unsigned int n_tries;
 	
+	// The chip the packet is addressed to and the number of responses which have
+	// arrived to packets sent to the same chip since this packet was last
+	// transmitted (see rs_set_fast_retransmit).
+	uint16_t dest_addr;
+	unsigned int n_later_responses;
+	
+	// The handle and deadline (or zero) of the request the packet is part of
+	// (see rs__req_t)
+	rs_handle_t handle;
+	uint64_t req_deadline;
+	
+	// Pointer to the owning rs_conn_t, required since a pointer to this struct is
+	// used as the user-data for a number of callbacks.
+	rs_conn_t *conn;
+	
+	// The next slot in the connection's free list of idle outstanding slots
+	// (only meaningful while the slot is neither active nor has a send request
+	// pending).
+	rs__outstanding_t *next_free;
+	
 	// The raw packet value and its length (to be used for retransmission). The
 	// packet will have two null padding bytes at the start of the allocated
 	// packet buffer. (The padding bytes are required when passing SCP packets
 	// over UDP).
 	uv_buf_t packet;
 	
-	// The current UDP send request (or NULL if the send operation is complete)
-	uv_udp_send_t send_req;
+	// A payload to be transmitted immediately following the contents of the
+	// packet buffer, or a zero-length buffer if none. This is used by CMD_WRITE
+	// packets to send data directly from the user's buffer without copying it
+	// into the packet buffer.
+	uv_buf_t payload;
 	
-	// Is a UDP send request actually pending?
-	bool send_req_active;
+	// If non-zero, the packet is instead sent as the n_gather buffers in gather
+	// (the first of which is the packet buffer), used by coalesced writes to
+	// send data gathered from many users' buffers. The array lives in the
+	// packet buffer beyond the packet itself (see RS__GATHER_OFFSET).
+	uv_buf_t *gather;
+	unsigned int n_gather;
 	
-	// If this outstanding request is cancelled while send_req_active, this flag
-	// indicates that the send_req callback should mark this outstanding slot as
-	// inactive.
-	bool cancelled;
+	// The time (according to uv_hrtime) at which the packet was most recently
+	// transmitted, used to measure round-trip times when adaptive timeouts are
+	// enabled.
+	uint64_t send_time;
 	
-	// The timeout timer handle
-	uv_timer_t timer_handle;
+	// Is the slot in the connection's list of pending timeouts? If so, the time
+	// (according to uv_now) at which the packet times out and the neighbouring
+	// entries in the list.
+	bool timer_armed;
+	uint64_t deadline;
+	rs__outstanding_t *timer_next;
+	rs__outstanding_t *timer_prev;
 	
-	// Flag indicating that the timer handle has been closed (and thus freeing can
-	// occur)
-	bool timer_handle_closed;
+	// Does the packet buffer hold a read/write header template (see
+	// rs__pack_rw_template) for the given destination and command? If so, only
+	// the sequence number and arguments need to be packed for the next
+	// read/write packet with the same destination and command.
+	bool rw_template_valid;
+	uint8_t rw_template_dest_cpu;
+	uint16_t rw_template_dest_addr;
+	rs__req_type_t rw_template_type;
+	
+	// The UDP send request used to transmit the packet (which lives in the
+	// connection's arena)
+	uv_udp_send_t *send_req;
 	
 	// The data supplied to be supplied to the callback on completion of this
 	// request
@@ -181,8 +539,12 @@ typedef struct {
 		
 		// Data for read/write requests
 		struct {
-			// The ID of this read/write request.
-			unsigned int id;
+			// The state of the read/write request this packet is part of.
+			rs__rw_state_t *state;
+			
+			// Links in the rw_state's list of active outstanding slots.
+			rs__outstanding_t *next;
+			rs__outstanding_t *prev;
 			
 			// Buffer containing the data to send/the location to write the response
 			// data. The length of this buffer also indiciates the amount to
@@ -199,7 +561,43 @@ typedef struct {
 		} rw;
 	} data;
 	
-} rs__outstanding_t;
+};
+
+
+/**
+ * The distance between consecutive slots in a connection's array of slots: the
+ * size of a slot rounded up to a whole number of cache lines.
+ */
+#define RS__OUTSTANDING_STRIDE RS__CACHE_LINE_ROUND(sizeof(rs__outstanding_t))
+
+/**
+ * Get a pointer to the ith slot of a connection.
+ *
+ * @param rs_conn_t *conn
+ * @param size_t i
+ * @returns rs__outstanding_t *
+ */
+#define RS__OUTSTANDING(conn, i) \
+	((rs__outstanding_t *)((char *)(conn)->outstanding + \
+	                       ((size_t)(i) * RS__OUTSTANDING_STRIDE)))
+
+/**
+ * Get the index of a slot within its connection's array of slots.
+ *
+ * @param rs_conn_t *conn
+ * @param rs__outstanding_t *os
+ * @returns size_t
+ */
+#define RS__OUTSTANDING_INDEX(conn, os) \
+	((size_t)((char *)(os) - (char *)(conn)->outstanding) / \
+	 RS__OUTSTANDING_STRIDE)
+
+// Compile-time check that the fields at the start of a slot examined whenever
+// a response arrives or a slot is allocated (up to next_free) fit in the single
+// cache line each slot starts on.
+typedef char rs__outstanding_header_fits_check[
+	(offsetof(rs__outstanding_t, next_free) + sizeof(rs__outstanding_t *) <=
+	 RS__CACHE_LINE_SIZE) ? 1 : -1];
 
 
 struct rs_conn {
@@ -209,6 +607,20 @@ struct rs_conn {
 	// Number of msec to wait before retransmitting a packet
 	uint64_t timeout;
 	
+	// Adaptive retransmission timeout state (see rs_set_adaptive_timeout). The
+	// smoothed round-trip time and its variance are in nanoseconds while the
+	// current retransmission timeout (rto) and its limits are in msec.
+	bool adaptive_timeout;
+	bool have_rtt;
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t rto;
+	uint64_t min_rto;
+	uint64_t max_rto;
+	
+	// The time (according to uv_hrtime) at which the rto was last backed off
+	uint64_t rto_backoff_time;
+	
 	// Number of transmission attempts before giving up (including the initial
 	// attempt)
 	unsigned int n_tries;
@@ -229,21 +641,214 @@ struct rs_conn {
 	// freeing can occur)
 	bool udp_handle_closed;
 	
+	// The shared transport used by this connection (see rs_init_shared) or NULL
+	// if the connection uses udp_handle, and the next connection in the same
+	// bucket of the transport's table of connections.
+	rs_transport_t *transport;
+	rs_conn_t *transport_next;
+	
+	// A circular list of the connections on the transport sharing this
+	// connection's remote address (just this connection if there are none).
+	// Such connections are told apart only by the sequence numbers of their
+	// responses and so never have the same sequence number outstanding.
+	rs_conn_t *transport_sibling;
+	
+	// The UDP handle used to send packets (either udp_handle or that of the
+	// shared transport)
+	uv_udp_t *send_handle;
+	
+	// Packet timeouts are kept in a list of slots sorted by deadline, doubly
+	// linked such that timeouts can be cancelled in constant time. Since
+	// timeouts are mostly of equal length, new entries are almost always
+	// appended at the tail.
+	rs__outstanding_t *timers_head;
+	rs__outstanding_t *timers_tail;
+	
+	// A single timer is used for all packet timeouts. While running, it expires
+	// at timer_expiry (according to uv_now) which is no later than the deadline
+	// at the head of the list (it is not restarted when the head is removed so
+	// may expire before anything has timed out).
+	uv_timer_t timer_handle;
+	uint64_t timer_expiry;
+	
+	// Flag indicating that the timer handle has been closed (and thus freeing
+	// can occur)
+	bool timer_handle_closed;
+	
+	// Requests submitted from other threads (see rs_send_scp_threadsafe) are
+	// pushed onto this lock-free stack (newest first) and async_handle signalled
+	// to move them into the request queues on the loop thread.
+	rs__ts_req_t *ts_reqs;
+	uv_async_t async_handle;
+	bool async_handle_closed;
+	
+	// The size of each receive buffer: large enough for the largest SCP packet
+	// (plus padding bytes) which may be received, rounded up to a whole number of
+	// cache lines.
+	size_t recv_buf_size;
+	
+	// Should writes waiting in the request queue be coalesced (see
+	// rs_set_write_coalescing)? The maximum number of buffers (including the
+	// packet buffer) a packet may be gathered from given the size of the packet
+	// buffers.
+	bool coalesce_writes;
+	unsigned int max_gather;
+	
+	// A single allocation (see rs_init) holding every array below whose size
+	// depends on the connection's parameters: the outstanding slots (and their
+	// packet buffers and UDP send requests), the sequence number table,
+	// read/write states, per-chip in-flight counts, batch array and receive
+	// buffers.
+	void *arena;
+	
+	// The RS__N_RECV_BUFS receive buffers (within the arena)
+	char *recv_bufs;
+	
+	// A stack of receive buffers not currently in use by libuv.
+	char *free_recv_bufs[RS__N_RECV_BUFS];
+	unsigned int n_free_recv_bufs;
+	
+	// The sequence number of the response expected to arrive next (i.e. one more
+	// than the last response received). Responses usually arrive in order.
+	uint16_t expected_seq_num;
+	
+#ifdef RS__ZERO_COPY_RECV
+	// A duplicate of the UDP handle's socket file descriptor from which
+	// responses are received. A duplicate is used since libuv does not allow the
+	// UDP handle's own descriptor to be polled by another handle.
+	int recv_fd;
+	
+	// Poll handle which watches recv_fd for arriving responses
+	uv_poll_t recv_poll_handle;
+	
+	// Flag indicating that the poll handle has been closed (and thus freeing can
+	// occur)
+	bool recv_poll_handle_closed;
+	
+	// State of the datagrams being received by a receive system call
+	rs__recv_msg_t recv_msgs[RS__RECV_BATCH_SIZE];
+#endif
+	
+#ifdef RS__IO_URING
+	// The io_uring used to send and receive packets instead of libuv and
+	// recv_poll_handle (see rs_enable_io_uring) or NULL if not in use. Once
+	// freeing has begun, this becomes NULL only once the ring has been torn
+	// down.
+	rs__uring_t *uring;
+#endif
+	
+	// Is batching of system calls enabled?
+	bool batching;
+	
+	// While rs__process_request_queue is running with batching enabled, packets
+	// to be sent are accumulated in this array (of n_outstanding entries) and
+	// sent together when it finishes.
+	rs__outstanding_t **batch;
+	unsigned int n_batch;
+	bool batch_open;
+	
+	// System call counters
+	rs_batch_stats_t batch_stats;
+	
+	// Statistics counters (the current state fields are not used)
+	rs_stats_t stats;
+	
 	// Request queue containing rs__req_t entries representing SCP packets or bulk
 	// reads/writes which have not yet been handled.
 	rs__q_t *request_queue;
 	
-	// An array of n_outstanding outstanding packet transmission attempt states.
+	// Queue of high-priority requests (SCP packets only) which are always handled
+	// before those in request_queue.
+	rs__q_t *hp_request_queue;
+	
+	// Reads/writes removed from the head of request_queue which still have
+	// packets to send (n_active_rws entries, in queue order). Slots are assigned
+	// round-robin across these, starting from next_active_rw. At most interleave
+	// requests are active at once and at most max_per_dest (if non-zero) of
+	// their packets may be in flight to any one chip (see rs_set_interleave).
+	rs__req_t active_rws[RS_MAX_INTERLEAVE];
+	unsigned int n_active_rws;
+	unsigned int next_active_rw;
+	unsigned int interleave;
+	unsigned int max_per_dest;
+	
+	// The number of slots within the window reserved for high-priority requests
+	// and the number of slots currently in use by such requests.
+	unsigned int n_reserved_slots;
+	unsigned int n_hp_slots_in_use;
+	
+	// The handle to be given to the next request queued and the handle of the
+	// request most recently queued via the API (see rs_get_handle). Handles may
+	// also be allocated by other threads (see rs_send_scp_threadsafe) and so
+	// next_handle is only accessed atomically (see rs__new_handle).
+	rs_handle_t next_handle;
+	rs_handle_t last_handle;
+	
+	// The group the next request queued via the API is part of (or NULL), set
+	// by composite operations immediately before queueing each request, and
+	// the registered groups (see rs__group_t).
+	rs__group_t *next_group;
+	rs__group_t *groups;
+	
+	// An array of n_outstanding outstanding packet transmission attempt states,
+	// RS__OUTSTANDING_STRIDE bytes apart (use RS__OUTSTANDING to index it).
 	rs__outstanding_t *outstanding;
 	
+	// Singly linked list of outstanding slots which are neither active nor
+	// awaiting a send callback and thus may be used for new packets.
+	rs__outstanding_t *free_outstanding;
+	
+	// The number of outstanding slots not in the free list
+	unsigned int n_slots_in_use;
+	
+	// Congestion control state (see rs_set_congestion_control). When enabled,
+	// no more than cwnd slots are used at once. The window grows by one slot
+	// after cwnd clean responses (counted in cwnd_n_acks) and halves when a
+	// packet times out (at most once per cwnd_decrease_time).
+	bool congestion_control;
+	unsigned int cwnd;
+	unsigned int cwnd_n_acks;
+	uint64_t cwnd_decrease_time;
+	
+	// The number of responses to later packets to the same chip after which a
+	// packet still awaiting a response is retransmitted, or zero if fast
+	// retransmission is disabled (see rs_set_fast_retransmit).
+	unsigned int fast_retransmit;
+	
+	// The pacer limiting the rate of transmissions or NULL if not paced (see
+	// rs_set_pacer). While waiting for the pacer to gain tokens, the connection
+	// is in its queue of waiting connections (linked through pacer_next).
+	rs_pacer_t *pacer;
+	bool pacer_waiting;
+	rs_conn_t *pacer_next;
+	
+	// A table mapping sequence numbers (modulo seq_num_mask + 1) to the
+	// outstanding slot most recently allocated that sequence number. Sequence
+	// numbers are allocated such that no two active slots share an entry.
+	rs__outstanding_t **seq_num_table;
+	
+	// Mask applied to sequence numbers to index seq_num_table (the table size is
+	// a power of two no smaller than n_outstanding).
+	uint16_t seq_num_mask;
+	
+	// An array of n_outstanding + RS_MAX_INTERLEAVE read/write states
+	// (sufficient for one per active slot plus one per interleaved request) and
+	// the singly linked list of those not in use.
+	rs__rw_state_t *rw_states;
+	rs__rw_state_t *free_rw_states;
+	
+	// An open-addressed hash table (of dest_counts_mask + 1 entries, at least
+	// twice n_outstanding) counting the slots of reads/writes in flight to each
+	// chip, whether or not their request is still active, against which
+	// max_per_dest is checked.
+	rs__dest_count_t *dest_counts;
+	unsigned int dest_counts_mask;
+	
 	// Counter used to assign packet sequence numbers. Contains the next value to
-	// be assigned.
+	// be assigned. Connections using a transport use the transport's counter
+	// instead.
 	uint16_t next_seq_num;
 	
-	// Counter used to assign unique IDs to read/write requests. Contains the next
-	// value to be assigned.
-	unsigned int next_rw_id;
-	
 	// A flag which indicates that this structure should be freed as soon as
 	// possible.
 	bool free;
@@ -251,6 +856,10 @@ struct rs_conn {
 	// A callback function and data to call when the free operation completes
 	rs_free_cb free_cb;
 	void *free_cb_data;
+	
+	// If initialisation fails, the number of handles it had opened which have
+	// yet to finish closing (the structure is freed once none remain).
+	unsigned int n_init_handles_closing;
 };
 
 
@@ -298,105 +907,760 @@ void rs__cancel_queued(rs_conn_t *conn, rs__req_t *req, int error);
 
 
 /**
- * Used by rs__process_request_queue. Processes a single SCP packet request.
- *
- * Note: The caller should remove the request from the queue once this function
- * has returned.
+ * Cancel every request with a given handle wherever it is (an outstanding
+ * slot, the set of active reads/writes or either request queue), calling its
+ * callback with the given error. A registered group with the handle is marked
+ * as cancelled first such that its operation queues nothing further.
  *
- * The request must be of type RS__REQ_SCP_PACKET and the outstanding slot must
- * be inactive.
+ * @returns False if no such request or registered group exists.
  */
-void rs__process_queued_scp_packet(rs_conn_t *conn,
-                                   rs__req_t *req,
-                                   rs__outstanding_t *os);
+bool rs__cancel_handle(rs_conn_t *conn, rs_handle_t handle, int error);
 
 
 /**
- * Used by rs__process_request_queue. Processes a single read/write request.
- *
- * The request must be of type RS__REQ_READ or RS__REQ_WRITE and the outstanding
- * slot must be inactive.
- *
- * @returns true if this call transmitted the last packet required for this
- *          read/write and thus the request should be removed from the queue.
+ * Allocate a new handle on a connection (from any thread).
  */
-bool rs__process_queued_rw(rs_conn_t *conn,
-                           rs__req_t *req,
-                           rs__outstanding_t *os);
+rs_handle_t rs__new_handle(rs_conn_t *conn);
 
 
 /**
- * Callback function to allocate memory in advance of an SCP packet arriving.
+ * Initialise a group with a new handle, making it the handle returned by
+ * rs_get_handle. If the group's operation will queue requests after returning
+ * to the caller, it must also be registered using rs__group_register.
  */
-void rs__udp_recv_alloc_cb(uv_handle_t *handle,
-                           size_t suggested_size, uv_buf_t *buf);
+void rs__group_init(rs_conn_t *conn, rs__group_t *group);
 
 
 /**
- * Callback function when an SCP packet arrives.
- *
- * If an outstanding slot with a matching sequence number is found,
- * rs__process_response will be called with the response and the UDP data (which
- * will be freed as soon as rs__process_response returns).
+ * Add a group to its connection's list of groups until rs__group_unregister is
+ * called.
  */
-void rs__udp_recv_cb(uv_udp_t *handle,
-                     ssize_t nread, const uv_buf_t *buf,
-                     const struct sockaddr *addr,
-                     unsigned int flags);
+void rs__group_register(rs_conn_t *conn, rs__group_t *group);
 
 
 /**
- * Callback function when a timeout occurs on a packet.
- *
- * Simply attempts to retransmit the packet.
+ * Remove a group from its connection's list of groups (if it is still in it:
+ * freeing a connection empties its list).
  */
-void rs__timer_cb(uv_timer_t *handle);
+void rs__group_unregister(rs_conn_t *conn, rs__group_t *group);
 
 
 /**
- * Callback function on uv_udp_send() completion.
- *
- * Start the packet timeout timer. Also includes cleanup-code.
+ * Find a registered group by its handle (or NULL).
  */
-void rs__udp_send_cb(uv_udp_send_t *req, int status);
+rs__group_t *rs__group_find(rs_conn_t *conn, rs_handle_t handle);
 
 
 /**
- * Called by rs__udp_recv_cb. Process an incoming SCP response.
+ * Take the group the next request queued via the API is part of (see
+ * rs_conn_t.next_group), if any.
  */
-void rs__process_response(rs_conn_t *conn, rs__outstanding_t *os,
-                          uv_buf_t buf);
+rs__group_t *rs__group_take(rs_conn_t *conn);
 
 
 /**
- * Called by rs__process_response. Process an incoming SCP packet response.
+ * Cancel every registered group of a freeing connection and empty its list.
  */
-void rs__process_response_scp_packet(rs_conn_t *conn, rs__outstanding_t *os,
-                                     uv_buf_t buf);
+void rs__group_free_all(rs_conn_t *conn, int error);
 
 
 /**
- * Called by rs__process_response. Process an incoming read/write response.
+ * Take an idle outstanding slot from the free list.
+ *
+ * @returns NULL if no slots are idle.
  */
-void rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
-                             uv_buf_t buf);
+rs__outstanding_t *rs__alloc_outstanding(rs_conn_t *conn);
 
 
 /**
- * Callback on closing the UDP handle.
+ * Return an outstanding slot to the free list.
  *
- * Simply used to attempt to complete the freeing process once this handle has
- * been closed.
+ * Must be called exactly once each time a slot becomes both inactive and has no
+ * send request pending.
  */
-void rs__udp_handle_closed_cb(uv_handle_t *handle);
+void rs__free_outstanding(rs_conn_t *conn, rs__outstanding_t *os);
 
 
 /**
- * Callback on closing a timer handle.
+ * Allocate a sequence number to an outstanding slot and record it in the
+ * sequence number table.
  *
- * Simply used to attempt to complete the freeing process once this handle has
- * been closed.
+ * Sequence numbers are allocated in order except that numbers whose table entry
+ * is occupied by another active slot are skipped.
  */
-void rs__timer_handle_closed_cb(uv_handle_t *handle);
+void rs__assign_seq_num(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Find the active outstanding slot awaiting a response with the given sequence
+ * number.
+ *
+ * @returns NULL if no such slot exists.
+ */
+rs__outstanding_t *rs__find_outstanding(rs_conn_t *conn, uint16_t seq_num);
+
+
+/**
+ * Take an unused read/write state from the free list and initialise it.
+ *
+ * @returns NULL if none are available.
+ */
+rs__rw_state_t *rs__alloc_rw_state(rs_conn_t *conn);
+
+
+/**
+ * Return a read/write state to the free list.
+ */
+void rs__free_rw_state(rs_conn_t *conn, rs__rw_state_t *state);
+
+
+/**
+ * Add an outstanding slot to its read/write state's list of active slots,
+ * counting it as in flight to the slot's dest_addr (which must already be set).
+ */
+void rs__rw_state_add(rs__rw_state_t *state, rs__outstanding_t *os);
+
+
+/**
+ * Remove an outstanding slot from its read/write state's list of active slots
+ * (and from the count of those in flight to its dest_addr).
+ */
+void rs__rw_state_remove(rs__rw_state_t *state, rs__outstanding_t *os);
+
+
+/**
+ * The number of slots of reads/writes currently in flight to a given chip.
+ */
+unsigned int rs__dest_in_flight(rs_conn_t *conn, uint16_t dest_addr);
+
+
+/**
+ * Used by rs__process_request_queue. Processes a single SCP packet request.
+ *
+ * Note: The caller should remove the request from the queue once this function
+ * has returned.
+ *
+ * The request must be of type RS__REQ_SCP_PACKET and the outstanding slot must
+ * be inactive.
+ */
+void rs__process_queued_scp_packet(rs_conn_t *conn,
+                                   rs__req_t *req,
+                                   rs__outstanding_t *os);
+
+
+/**
+ * Used by rs__process_request_queue. Processes a single read/write request.
+ *
+ * The request must be of type RS__REQ_READ or RS__REQ_WRITE, must have been
+ * allocated a read/write state and the outstanding slot must be inactive.
+ *
+ * @returns true if this call transmitted the last packet required for this
+ *          read/write and thus the request should be removed from the set of
+ *          active requests.
+ */
+bool rs__process_queued_rw(rs_conn_t *conn,
+                           rs__req_t *req,
+                           rs__outstanding_t *os);
+
+
+/**
+ * Remove a read/write request from the set of active (interleaved) requests.
+ *
+ * @param state The read/write state of the request to remove.
+ */
+void rs__remove_active_rw(rs_conn_t *conn, rs__rw_state_t *state);
+
+
+/**
+ * Start receiving responses on the connection's socket.
+ *
+ * @returns 0 on success, a libuv error code otherwise.
+ */
+int rs__recv_start(rs_conn_t *conn);
+
+
+/**
+ * Stop receiving responses and begin closing any associated handles.
+ */
+void rs__recv_stop(rs_conn_t *conn);
+
+
+/**
+ * Undo rs__recv_start (whether or not it succeeded) when the connection's
+ * initialisation fails, closing any file descriptor it opened and beginning to
+ * close any handles it opened (other than the UDP handle) using close_cb.
+ *
+ * @returns The number of handles being closed.
+ */
+unsigned int rs__recv_abort(rs_conn_t *conn, uv_close_cb close_cb);
+
+
+/**
+ * Have all handles used for receiving responses been closed?
+ */
+bool rs__recv_closed(rs_conn_t *conn);
+
+
+/**
+ * Process a datagram received by the connection.
+ *
+ * If an outstanding slot with a matching sequence number is found,
+ * rs__process_response will be called with the response.
+ *
+ * @param buf The received datagram (including its two padding bytes) of which
+ *            the first nread bytes are valid.
+ */
+void rs__recv_datagram(rs_conn_t *conn, uv_buf_t buf, ssize_t nread);
+
+
+/**
+ * Callback function to allocate memory in advance of an SCP packet arriving.
+ *
+ * Buffers are taken from the connection's pool of receive buffers, falling
+ * back on malloc when the pool is empty.
+ */
+void rs__udp_recv_alloc_cb(uv_handle_t *handle,
+                           size_t suggested_size, uv_buf_t *buf);
+
+
+/**
+ * Return a buffer allocated by rs__udp_recv_alloc_cb to the pool (or free it
+ * if it was not taken from the pool).
+ */
+void rs__free_recv_buf(rs_conn_t *conn, char *base);
+
+
+/**
+ * Callback function when an SCP packet arrives via the libuv UDP receive API.
+ *
+ * The datagram is processed by rs__recv_datagram and then returned to the
+ * receive buffer pool.
+ */
+void rs__udp_recv_cb(uv_udp_t *handle,
+                     ssize_t nread, const uv_buf_t *buf,
+                     const struct sockaddr *addr,
+                     unsigned int flags);
+
+
+/**
+ * Callback on the async handle being signalled: queue the requests submitted
+ * from other threads.
+ */
+void rs__async_cb(uv_async_t *handle);
+
+
+/**
+ * Move every request submitted from other threads into the request queues
+ * (without processing them).
+ */
+void rs__queue_threadsafe(rs_conn_t *conn);
+
+
+/**
+ * Fail every request submitted from other threads which has not yet been moved
+ * into the request queues.
+ */
+void rs__cancel_threadsafe(rs_conn_t *conn, int error);
+
+
+struct rs_pool {
+	// The connections in the pool and the chip address of the Ethernet chip each
+	// connects to.
+	unsigned int n_conns;
+	rs_conn_t **conns;
+	uint16_t *eth_addrs;
+	
+	// The handle to be given to the next read/write queued via the pool and the
+	// handle of the one most recently queued (see rs_pool_get_handle)
+	rs_handle_t next_handle;
+	rs_handle_t last_handle;
+	
+	// Striping parameters (see rs_pool_set_striping)
+	unsigned int max_stripe_conns;
+	size_t stripe_size;
+	
+	// Number of connections still being freed by rs_pool_free and the callback
+	// to call when they are all freed.
+	unsigned int n_conns_freeing;
+	rs_free_cb free_cb;
+	void *free_cb_data;
+};
+
+
+/**
+ * The size of the receive buffer of a shared transport: large enough for any
+ * UDP datagram.
+ */
+#define RS__TRANSPORT_RECV_BUF_SIZE 65536
+
+/**
+ * The initial number of buckets in a transport's table of connections (a power
+ * of two).
+ */
+#define RS__TRANSPORT_MIN_BUCKETS 16
+
+struct rs_transport {
+	// The libuv event loop the transport lives in
+	uv_loop_t *loop;
+	
+	// The shared UDP socket
+	uv_udp_t udp_handle;
+	
+	// A hash table of the connections receiving via the transport keyed on their
+	// remote address. Each of the (power-of-two) buckets is a singly linked list
+	// through rs_conn_t.transport_next.
+	rs_conn_t **conns;
+	unsigned int conns_mask;
+	unsigned int n_conns;
+	
+	// Counter used to assign packet sequence numbers for every connection using
+	// the transport such that connections sharing an address rarely contend
+	// for the same sequence numbers.
+	uint16_t next_seq_num;
+	
+	// The number of connections made using the transport which have not yet
+	// been completely freed
+	unsigned int n_users;
+	
+	// The receive buffer. libuv always passes one received datagram to the
+	// receive callback before allocating a buffer for the next so only one is
+	// needed.
+	char *recv_buf;
+	
+	// Has rs_transport_free been called? If so, the callback to call once freed
+	bool free;
+	rs_free_cb free_cb;
+	void *free_cb_data;
+};
+
+
+/**
+ * Add a connection to a transport's table of connections such that it receives
+ * datagrams sent from its remote address.
+ */
+void rs__transport_add(rs_transport_t *transport, rs_conn_t *conn);
+
+
+/**
+ * Remove a connection from a transport's table of connections (if present).
+ */
+void rs__transport_remove(rs_transport_t *transport, rs_conn_t *conn);
+
+
+/**
+ * Called when a connection which used a transport has been completely freed,
+ * completing the freeing of the transport if it is the last.
+ */
+void rs__transport_conn_freed(rs_transport_t *transport);
+
+
+/**
+ * States of the buffers of a streaming read.
+ */
+typedef enum {
+	// Not in use
+	RS__STREAM_BUF_FREE,
+	
+	// A chunk is being read into the buffer
+	RS__STREAM_BUF_READING,
+	
+	// The chunk has been read (or failed) but preceding chunks have not yet been
+	// delivered
+	RS__STREAM_BUF_READY,
+	
+	// The chunk has been delivered and is yet to be released by the consumer
+	RS__STREAM_BUF_HELD,
+} rs__stream_buf_state_t;
+
+
+/**
+ * A buffer of a streaming read.
+ */
+typedef struct {
+	// The owning stream (the buffer is passed as the rs_read callback data)
+	rs_stream_t *stream;
+	
+	rs__stream_buf_state_t state;
+	
+	// The chunk of data read into this buffer, the address it was read from and
+	// the result of the read.
+	uv_buf_t data;
+	uint32_t address;
+	int error;
+	uint16_t cmd_rc;
+} rs__stream_buf_t;
+
+
+struct rs_stream {
+	rs_conn_t *conn;
+	
+	// The chip and CPU being read and the address and length of the data
+	uint16_t dest_addr;
+	uint8_t dest_cpu;
+	uint32_t address;
+	size_t length;
+	
+	// The ring of n_bufs buffers of chunk_size bytes each. Chunk n is always read
+	// into buffer n % n_bufs.
+	size_t chunk_size;
+	unsigned int n_bufs;
+	char *buf_data;
+	rs__stream_buf_t *bufs;
+	
+	// The total number of chunks, the next chunk to read and the next chunk to
+	// deliver.
+	size_t n_chunks;
+	size_t next_read;
+	size_t next_deliver;
+	
+	// The number of buffers being read into or held by the consumer
+	unsigned int n_reading;
+	unsigned int n_held;
+	
+	// Has the stream failed (and thus delivered its last callback)?
+	bool failed;
+	
+	// Is rs__stream_process running? (Guards against re-entry from callbacks.)
+	bool processing;
+	
+	// The group the stream's reads are part of: own_group unless the stream
+	// was started as part of another operation's group.
+	rs__group_t *group;
+	rs__group_t own_group;
+	
+	rs_stream_cb cb;
+	void *cb_data;
+};
+
+
+/**
+ * Get the traffic counters for the type of request in a slot.
+ */
+rs_traffic_stats_t *rs__stats_traffic(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Record a round-trip time sample (nsec).
+ */
+void rs__stats_rtt(rs_conn_t *conn, uint64_t rtt);
+
+
+/**
+ * Begin accumulating packets to send in a single batch.
+ *
+ * Does nothing if batching is not enabled or a batch is already being
+ * accumulated.
+ *
+ * @returns true if a new batch was started, in which case rs__batch_end must be
+ *          called to send it.
+ */
+bool rs__batch_begin(rs_conn_t *conn);
+
+
+/**
+ * Add a packet to the batch being accumulated.
+ *
+ * @returns false if no batch is being accumulated, in which case the caller
+ *          must send the packet itself.
+ */
+bool rs__batch_add(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Send all packets in the batch being accumulated (any which cannot be sent as
+ * part of the batch are sent individually).
+ */
+void rs__batch_end(rs_conn_t *conn);
+
+
+#ifdef RS__IO_URING
+/**
+ * Queue the transmission of the packet in an outstanding slot on the
+ * connection's io_uring. The packet is not sent until rs__uring_submit is
+ * called.
+ */
+void rs__uring_queue_send(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Submit all entries queued on the connection's io_uring using a single system
+ * call.
+ */
+void rs__uring_submit(rs_conn_t *conn);
+
+
+/**
+ * Begin tearing down the connection's io_uring (if it has one): the ring is
+ * closed once its multishot receive has been cancelled and all of its sends
+ * have completed.
+ */
+void rs__uring_stop(rs_conn_t *conn);
+
+
+/**
+ * Suspend receiving via recv_poll_handle while io_uring is used instead.
+ */
+void rs__recv_pause(rs_conn_t *conn);
+
+
+/**
+ * Resume receiving via recv_poll_handle (e.g. if the kernel turns out not to
+ * support the multishot receives used with io_uring).
+ */
+void rs__recv_resume(rs_conn_t *conn);
+#endif
+
+
+/**
+ * Send the packet in an outstanding slot using libuv (or io_uring).
+ *
+ * If sending fails the request is cancelled.
+ */
+void rs__send_packet(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Get the number of msec to wait for a response to a packet before
+ * retransmitting it.
+ */
+uint64_t rs__rto(rs_conn_t *conn);
+
+
+/**
+ * Record that the packet in a slot is about to be transmitted.
+ */
+void rs__rtt_sent(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Update the round-trip time estimate (and statistics) on the arrival of a
+ * response to the packet in a slot.
+ */
+void rs__rtt_response(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Back off the retransmission timeout following a timeout of the packet in a
+ * slot.
+ */
+void rs__rtt_timeout(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Can another outstanding slot be used without exceeding the congestion
+ * window?
+ *
+ * @param high_priority If false, the slots reserved for high-priority requests
+ *                      are excluded from the window.
+ */
+bool rs__cwnd_available(rs_conn_t *conn, bool high_priority);
+
+
+/**
+ * Update the congestion window on the arrival of a response to the packet in a
+ * slot.
+ */
+void rs__cwnd_response(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Shrink the congestion window following a timeout of the packet in a slot.
+ */
+void rs__cwnd_timeout(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Count the arrival of a response to the packet in a slot against the packets
+ * sent to the same chip before it.
+ *
+ * @returns A slot whose packet should be fast retransmitted (using
+ *          rs__fast_retransmit once the response has been dealt with) or NULL.
+ */
+rs__outstanding_t *rs__fast_retransmit_response(rs_conn_t *conn,
+                                                rs__outstanding_t *os);
+
+
+/**
+ * Retransmit the packet in a slot without waiting for it to time out (unless
+ * it is no longer awaiting a response).
+ *
+ * @param seq_num The sequence number the lost packet had when it was chosen by
+ *                rs__fast_retransmit_response: if the slot now holds a
+ *                different packet nothing is retransmitted.
+ */
+void rs__fast_retransmit(rs_conn_t *conn, rs__outstanding_t *os,
+                         uint16_t seq_num);
+
+
+/**
+ * A token-bucket rate limiter (see rs_pacer_init).
+ */
+struct rs_pacer {
+	// The timer used to wake waiting connections once tokens have been gained
+	uv_timer_t timer_handle;
+	
+	// Tokens gained per second and the maximum held. Each packet costs one
+	// token or, if bytes is true, one per byte.
+	uint64_t rate;
+	uint64_t burst;
+	bool bytes;
+	
+	// The number of tokens held in thousandths of a token (which may be negative
+	// after sending a packet costing more than was held) and the time (msec) at
+	// which they were last topped up.
+	int64_t milli_tokens;
+	uint64_t last_update;
+	
+	// Queue of connections waiting for tokens (linked through
+	// rs_conn_t.pacer_next)
+	rs_conn_t *waiting_head;
+	rs_conn_t *waiting_tail;
+	
+	// The callback to call once freed
+	rs_free_cb free_cb;
+	void *free_cb_data;
+};
+
+
+/**
+ * May a connection send another new packet without exceeding the rate limit of
+ * its pacer (if it has one)? If not, the connection's request queue is
+ * processed again once the pacer has gained tokens.
+ */
+bool rs__pacer_available(rs_conn_t *conn);
+
+
+/**
+ * Consume the tokens needed to send the packet in a slot from the connection's
+ * pacer (if it has one).
+ */
+void rs__pacer_sent(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Remove a connection from its pacer's queue of waiting connections (if
+ * present).
+ */
+void rs__pacer_remove(rs_conn_t *conn);
+
+
+/**
+ * Attempt to merge a write with the write at the tail of the request queue
+ * (see rs_set_write_coalescing). Writes are only merged with writes of the
+ * same group (or, if group is NULL, writes not part of any group).
+ *
+ * @returns True if the write was merged, false if it must be queued
+ *          separately.
+ */
+bool rs__coalesce_write(rs_conn_t *conn,
+                        rs__group_t *group,
+                        uint16_t dest_addr,
+                        uint8_t dest_cpu,
+                        uint32_t address,
+                        uv_buf_t data,
+                        rs_rw_cb cb,
+                        void *cb_data);
+
+
+/**
+ * Gather the payload of the next packet of a coalesced write into a slot's
+ * gather array, shortening os->data.rw.data.len if the data spans more
+ * buffers than fit in the array.
+ */
+void rs__coalesce_gather(rs_conn_t *conn, rs__coalesce_t *co,
+                         rs__outstanding_t *os);
+
+
+/**
+ * Start (or restart) the timeout for the packet in a slot.
+ *
+ * @param timeout Number of msec until rs__packet_timeout is called.
+ */
+void rs__timer_start(rs_conn_t *conn, rs__outstanding_t *os, uint64_t timeout);
+
+
+/**
+ * Start the timeout for a packet which has just been sent: the retransmission
+ * timeout (see rs__rto) or, if sooner, its request's deadline.
+ */
+void rs__timer_start_rto(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Cancel the timeout (if any) for the packet in a slot.
+ */
+void rs__timer_stop(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Callback function when the connection's timer expires.
+ *
+ * Calls rs__packet_timeout for every packet whose deadline has passed.
+ */
+void rs__timer_cb(uv_timer_t *handle);
+
+
+/**
+ * Called when a timeout occurs on a packet.
+ *
+ * Simply attempts to retransmit the packet.
+ */
+void rs__packet_timeout(rs_conn_t *conn, rs__outstanding_t *os);
+
+
+/**
+ * Callback function on uv_udp_send() completion.
+ *
+ * Start the packet timeout timer. Also includes cleanup-code.
+ */
+void rs__udp_send_cb(uv_udp_send_t *req, int status);
+
+
+/**
+ * Called by rs__udp_recv_cb. Process an incoming SCP response.
+ */
+void rs__process_response(rs_conn_t *conn, rs__outstanding_t *os,
+                          uv_buf_t buf);
+
+
+/**
+ * Called by rs__process_response. Process an incoming SCP packet response.
+ */
+void rs__process_response_scp_packet(rs_conn_t *conn, rs__outstanding_t *os,
+                                     uv_buf_t buf);
+
+
+/**
+ * Called by rs__process_response. Process an incoming read/write response.
+ *
+ * @returns True if the response indicated failure and the slot has already been
+ *          released (and possibly re-used by a request made by the callback).
+ */
+bool rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
+                             uv_buf_t buf);
+
+
+/**
+ * Callback on closing the UDP handle.
+ *
+ * Simply used to attempt to complete the freeing process once this handle has
+ * been closed.
+ */
+void rs__udp_handle_closed_cb(uv_handle_t *handle);
+
+
+/**
+ * Callback on closing the timer handle.
+ *
+ * Simply used to attempt to complete the freeing process once this handle has
+ * been closed.
+ */
+void rs__timer_handle_closed_cb(uv_handle_t *handle);
+
+
+/**
+ * Callback on closing the async handle, as rs__timer_handle_closed_cb.
+ */
+void rs__async_handle_closed_cb(uv_handle_t *handle);
 
 #endif
@@ -0,0 +1,233 @@
+/**
+ * Internal functions for managing outstanding slots, sequence numbers and
+ * read/write request states.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+rs__outstanding_t *
+rs__alloc_outstanding(rs_conn_t *conn)
+{
+	rs__outstanding_t *os = conn->free_outstanding;
+	if (os) {
+		conn->free_outstanding = os->next_free;
+		conn->n_slots_in_use++;
+	}
+	return os;
+}
+
+
+void
+rs__free_outstanding(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	os->next_free = conn->free_outstanding;
+	conn->free_outstanding = os;
+	conn->n_slots_in_use--;
+	
+	if (os->high_priority) {
+		os->high_priority = false;
+		conn->n_hp_slots_in_use--;
+	}
+}
+
+
+/**
+ * Is a sequence number awaiting a response (or the completion of its
+ * cancellation) on any other connection sharing this connection's address?
+ */
+static bool
+rs__seq_num_held_by_sibling(rs_conn_t *conn, uint16_t seq_num)
+{
+	rs_conn_t *sibling;
+	for (sibling = conn->transport_sibling;
+	     sibling != conn;
+	     sibling = sibling->transport_sibling) {
+		rs__outstanding_t *other =
+			sibling->seq_num_table[seq_num & sibling->seq_num_mask];
+		if (other && other->active && other->seq_num == seq_num)
+			return true;
+	}
+	
+	return false;
+}
+
+
+void
+rs__assign_seq_num(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	uint16_t *next_seq_num = conn->transport ? &(conn->transport->next_seq_num)
+	                                         : &(conn->next_seq_num);
+	
+	// Skip any sequence numbers whose table entry is still in use by another
+	// active slot. Entries are not cleared when a slot moves on to a new
+	// sequence number so an entry is only in use if its slot's current sequence
+	// number maps to it. Since the table has at least n_outstanding entries, a
+	// free entry will always be found.
+	//
+	// Sequence numbers outstanding on another connection sharing the address
+	// are skipped too since their responses could not be told apart. Short of a
+	// pathological number of packets outstanding to one address, a sequence
+	// number free on every connection is always found within one lap of the
+	// sequence number space. Should that not happen, only this connection's
+	// table entries are checked from then on.
+	unsigned int n_skipped = 0;
+	while (true) {
+		uint16_t entry = *next_seq_num & conn->seq_num_mask;
+		rs__outstanding_t *other = conn->seq_num_table[entry];
+		if ((!other || other == os || !other->active ||
+		     (other->seq_num & conn->seq_num_mask) != entry) &&
+		    (n_skipped > UINT16_MAX ||
+		     !rs__seq_num_held_by_sibling(conn, *next_seq_num)))
+			break;
+		(*next_seq_num)++;
+		n_skipped++;
+	}
+	
+	os->seq_num = (*next_seq_num)++;
+	conn->seq_num_table[os->seq_num & conn->seq_num_mask] = os;
+}
+
+
+rs__outstanding_t *
+rs__find_outstanding(rs_conn_t *conn, uint16_t seq_num)
+{
+	rs__outstanding_t *os = conn->seq_num_table[seq_num & conn->seq_num_mask];
+	
+	// Entries are not cleared when slots become inactive so the slot found must
+	// be checked to ensure it really is awaiting this sequence number.
+	if (os && os->active && !os->cancelled && os->seq_num == seq_num)
+		return os;
+	else
+		return NULL;
+}
+
+
+rs__rw_state_t *
+rs__alloc_rw_state(rs_conn_t *conn)
+{
+	rs__rw_state_t *state = conn->free_rw_states;
+	if (!state)
+		return NULL;
+	conn->free_rw_states = state->next_free;
+	
+	state->n_outstanding = 0;
+	state->queued = true;
+	state->slots = NULL;
+	
+	return state;
+}
+
+
+void
+rs__free_rw_state(rs_conn_t *conn, rs__rw_state_t *state)
+{
+	state->next_free = conn->free_rw_states;
+	conn->free_rw_states = state;
+}
+
+
+/**
+ * The index in the per-chip in-flight table at which a chip's entry is placed
+ * if free. The X and Y coordinates of the chip are mixed into its low bits.
+ */
+static unsigned int
+rs__dest_count_home(rs_conn_t *conn, uint16_t dest_addr)
+{
+	return (((uint32_t)dest_addr * 2654435769u) >> 16) & conn->dest_counts_mask;
+}
+
+
+/**
+ * Find the entry of the per-chip in-flight table for a chip or, if it has
+ * nothing in flight, the unused entry where it would be inserted.
+ */
+static rs__dest_count_t *
+rs__dest_count_find(rs_conn_t *conn, uint16_t dest_addr)
+{
+	unsigned int i = rs__dest_count_home(conn, dest_addr);
+	while (conn->dest_counts[i].n_in_flight &&
+	       conn->dest_counts[i].dest_addr != dest_addr)
+		i = (i + 1) & conn->dest_counts_mask;
+	return &(conn->dest_counts[i]);
+}
+
+
+unsigned int
+rs__dest_in_flight(rs_conn_t *conn, uint16_t dest_addr)
+{
+	return rs__dest_count_find(conn, dest_addr)->n_in_flight;
+}
+
+
+/**
+ * Remove a chip's (now unused) entry from the per-chip in-flight table,
+ * shuffling back any later entries which would then no longer be found.
+ */
+static void
+rs__dest_count_remove(rs_conn_t *conn, rs__dest_count_t *entry)
+{
+	unsigned int mask = conn->dest_counts_mask;
+	unsigned int i = entry - conn->dest_counts;
+	unsigned int j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		rs__dest_count_t *other = &(conn->dest_counts[j]);
+		if (!other->n_in_flight)
+			break;
+		
+		// Move the entry into the gap unless its home lies (cyclically) after the
+		// gap and no later than where it is now
+		unsigned int home = rs__dest_count_home(conn, other->dest_addr);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			conn->dest_counts[i] = *other;
+			other->n_in_flight = 0;
+			i = j;
+		}
+	}
+}
+
+
+void
+rs__rw_state_add(rs__rw_state_t *state, rs__outstanding_t *os)
+{
+	rs__dest_count_t *entry = rs__dest_count_find(os->conn, os->dest_addr);
+	entry->dest_addr = os->dest_addr;
+	entry->n_in_flight++;
+	
+	os->data.rw.state = state;
+	os->data.rw.prev = NULL;
+	os->data.rw.next = state->slots;
+	if (state->slots)
+		state->slots->data.rw.prev = os;
+	state->slots = os;
+	
+	state->n_outstanding++;
+}
+
+
+void
+rs__rw_state_remove(rs__rw_state_t *state, rs__outstanding_t *os)
+{
+	rs__dest_count_t *entry = rs__dest_count_find(os->conn, os->dest_addr);
+	if (!--entry->n_in_flight)
+		rs__dest_count_remove(os->conn, entry);
+	
+	if (os->data.rw.prev)
+		os->data.rw.prev->data.rw.next = os->data.rw.next;
+	else
+		state->slots = os->data.rw.next;
+	
+	if (os->data.rw.next)
+		os->data.rw.next->data.rw.prev = os->data.rw.prev;
+	
+	state->n_outstanding--;
+}
@@ -0,0 +1,222 @@
+/**
+ * Token-bucket pacing of the transmissions of one or more connections.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Top up a pacer's tokens according to the time elapsed since it was last
+ * topped up.
+ */
+static void
+rs__pacer_refill(rs_pacer_t *pacer)
+{
+	uint64_t now = uv_now(pacer->timer_handle.loop);
+	uint64_t elapsed = now - pacer->last_update;
+	pacer->last_update = now;
+	
+	// Large gaps are clamped before multiplying to avoid overflow
+	int64_t max_milli_tokens = (int64_t)(pacer->burst * 1000);
+	if (elapsed > pacer->burst * 1000 / pacer->rate)
+		pacer->milli_tokens = max_milli_tokens;
+	else
+		pacer->milli_tokens = MIN(pacer->milli_tokens +
+		                          (int64_t)(pacer->rate * elapsed),
+		                          max_milli_tokens);
+}
+
+
+/**
+ * Add a connection to the end of its pacer's queue of waiting connections.
+ */
+static void
+rs__pacer_add(rs_conn_t *conn)
+{
+	rs_pacer_t *pacer = conn->pacer;
+	
+	conn->pacer_waiting = true;
+	conn->pacer_next = NULL;
+	if (pacer->waiting_tail)
+		pacer->waiting_tail->pacer_next = conn;
+	else
+		pacer->waiting_head = conn;
+	pacer->waiting_tail = conn;
+}
+
+
+void
+rs__pacer_remove(rs_conn_t *conn)
+{
+	if (!conn->pacer_waiting)
+		return;
+	
+	rs_pacer_t *pacer = conn->pacer;
+	rs_conn_t *prev = NULL;
+	rs_conn_t *cur = pacer->waiting_head;
+	while (cur != conn) {
+		prev = cur;
+		cur = cur->pacer_next;
+	}
+	
+	if (prev)
+		prev->pacer_next = conn->pacer_next;
+	else
+		pacer->waiting_head = conn->pacer_next;
+	if (pacer->waiting_tail == conn)
+		pacer->waiting_tail = prev;
+	
+	conn->pacer_waiting = false;
+	conn->pacer_next = NULL;
+}
+
+
+/**
+ * Timer callback once a pacer has gained tokens: processes the request queue of
+ * each connection waiting at the time, in the order they started waiting.
+ * Connections which run out of tokens again rejoin the back of the queue.
+ */
+static void
+rs__pacer_timer_cb(uv_timer_t *handle)
+{
+	rs_pacer_t *pacer = (rs_pacer_t *)handle->data;
+	
+	unsigned int n_waiting = 0;
+	rs_conn_t *conn;
+	for (conn = pacer->waiting_head; conn; conn = conn->pacer_next)
+		n_waiting++;
+	
+	while (n_waiting-- && (conn = pacer->waiting_head)) {
+		rs__pacer_remove(conn);
+		rs__process_request_queue(conn);
+	}
+}
+
+
+bool
+rs__pacer_available(rs_conn_t *conn)
+{
+	rs_pacer_t *pacer = conn->pacer;
+	if (!pacer)
+		return true;
+	
+	// A packet may be sent while at least one token is held. When counting
+	// bytes, this means the last packet of a burst is sent partly on credit.
+	if (!conn->pacer_waiting) {
+		rs__pacer_refill(pacer);
+		if (pacer->milli_tokens >= 1000)
+			return true;
+		rs__pacer_add(conn);
+		conn->stats.n_pacing_delays++;
+	}
+	
+	// Wake up once a whole token is held
+	if (!uv_is_active((uv_handle_t *)&(pacer->timer_handle))) {
+		uint64_t deficit = (uint64_t)(1000 - pacer->milli_tokens);
+		uint64_t wait = MAX((deficit + pacer->rate - 1) / pacer->rate, 1);
+		uv_timer_start(&(pacer->timer_handle), rs__pacer_timer_cb, wait, 0);
+	}
+	
+	return false;
+}
+
+
+void
+rs__pacer_sent(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	rs_pacer_t *pacer = conn->pacer;
+	if (!pacer)
+		return;
+	
+	// The cost in bytes is the length of the whole datagram
+	uint64_t cost = 1;
+	if (pacer->bytes) {
+		if (os->n_gather) {
+			unsigned int i;
+			for (cost = 0, i = 0; i < os->n_gather; i++)
+				cost += os->gather[i].len;
+		} else {
+			cost = os->packet.len + os->payload.len;
+		}
+	}
+	
+	rs__pacer_refill(pacer);
+	pacer->milli_tokens -= (int64_t)(cost * 1000);
+}
+
+
+rs_pacer_t *
+rs_pacer_init(uv_loop_t *loop, uint64_t rate, uint64_t burst, bool bytes)
+{
+	rs_pacer_t *pacer = malloc(sizeof(rs_pacer_t));
+	if (!pacer)
+		return NULL;
+	
+	if (uv_timer_init(loop, &(pacer->timer_handle))) {
+		free(pacer);
+		return NULL;
+	}
+	pacer->timer_handle.data = (void *)pacer;
+	
+	pacer->rate = MAX(rate, 1);
+	pacer->burst = MAX(burst, 1);
+	pacer->bytes = bytes;
+	
+	// The bucket starts full
+	pacer->milli_tokens = (int64_t)(pacer->burst * 1000);
+	pacer->last_update = uv_now(loop);
+	
+	pacer->waiting_head = NULL;
+	pacer->waiting_tail = NULL;
+	pacer->free_cb = NULL;
+	pacer->free_cb_data = NULL;
+	
+	return pacer;
+}
+
+
+/**
+ * Callback once a pacer's timer has closed: frees the pacer.
+ */
+static void
+rs__pacer_timer_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_pacer_t *pacer = (rs_pacer_t *)handle->data;
+	
+	rs_free_cb cb = pacer->free_cb;
+	void *cb_data = pacer->free_cb_data;
+	free(pacer);
+	
+	if (cb)
+		cb(cb_data);
+}
+
+
+void
+rs_pacer_free(rs_pacer_t *pacer, rs_free_cb cb, void *cb_data)
+{
+	pacer->free_cb = cb;
+	pacer->free_cb_data = cb_data;
+	uv_close((uv_handle_t *)&(pacer->timer_handle),
+	         rs__pacer_timer_handle_closed_cb);
+}
+
+
+void
+rs_set_pacer(rs_conn_t *conn, rs_pacer_t *pacer)
+{
+	rs__pacer_remove(conn);
+	conn->pacer = pacer;
+	
+	// Packets held back by the old pacer may now be sendable
+	rs__process_request_queue(conn);
+}
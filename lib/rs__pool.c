@@ -0,0 +1,409 @@
+/**
+ * Connection pools which route and stripe requests across the Ethernet chips of
+ * a multi-board machine.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * State of a read/write striped across several connections.
+ */
+typedef struct {
+	// The number of stripes yet to complete
+	unsigned int n_pending;
+	
+	// The first error (and associated cmd_rc) reported by a stripe (or 0)
+	int error;
+	uint16_t cmd_rc;
+	
+	// The connection nearest the destination (passed to the callback)
+	rs_conn_t *conn;
+	
+	// The user's buffer, callback and callback data
+	uv_buf_t data;
+	rs_rw_cb cb;
+	void *cb_data;
+} rs__pool_rw_t;
+
+
+/**
+ * The number of hops between two chips on the hexagonal chip mesh (ignoring
+ * wrap-around links).
+ */
+static unsigned int
+rs__pool_distance(uint16_t a, uint16_t b)
+{
+	int dx = (int)(a >> 8) - (int)(b >> 8);
+	int dy = (int)(a & 0xFF) - (int)(b & 0xFF);
+	
+	// Moves along the diagonal link (+1, +1) cover both dimensions at once
+	if ((dx >= 0) == (dy >= 0))
+		return MAX(abs(dx), abs(dy));
+	else
+		return abs(dx) + abs(dy);
+}
+
+
+/**
+ * Find the (up to) n connections nearest to a chip.
+ *
+ * @param conns An array of at least n entries into which the connections are
+ *              written, nearest first.
+ * @returns The number of connections found.
+ */
+static unsigned int
+rs__pool_nearest(rs_pool_t *pool, uint16_t dest_addr,
+                 rs_conn_t **conns, unsigned int n)
+{
+	unsigned int distances[n];
+	unsigned int n_found = 0;
+	
+	// Insertion sort into the (short) output array
+	unsigned int i;
+	for (i = 0; i < pool->n_conns; i++) {
+		unsigned int distance = rs__pool_distance(dest_addr, pool->eth_addrs[i]);
+		
+		unsigned int j = n_found;
+		while (j > 0 && distances[j - 1] > distance) {
+			if (j < n) {
+				distances[j] = distances[j - 1];
+				conns[j] = conns[j - 1];
+			}
+			j--;
+		}
+		
+		if (j < n) {
+			distances[j] = distance;
+			conns[j] = pool->conns[i];
+			if (n_found < n)
+				n_found++;
+		}
+	}
+	
+	return n_found;
+}
+
+
+/**
+ * Create a pool (see rs_pool_init) whose connections each use their own socket
+ * or, if transport is not NULL, a shared transport.
+ */
+static rs_pool_t *
+rs__pool_init(uv_loop_t *loop,
+              rs_transport_t *transport,
+              unsigned int n_conns,
+              const struct sockaddr **addrs,
+              const uint16_t *eth_addrs,
+              size_t scp_data_length,
+              uint64_t timeout,
+              unsigned int n_tries,
+              unsigned int n_outstanding)
+{
+	rs_pool_t *pool = malloc(sizeof(rs_pool_t));
+	if (!pool)
+		return NULL;
+	
+	pool->n_conns = n_conns;
+	pool->next_handle = 1;
+	pool->last_handle = 0;
+	pool->max_stripe_conns = n_conns;
+	pool->stripe_size = n_outstanding * scp_data_length;
+	pool->conns = malloc(n_conns * sizeof(rs_conn_t *));
+	pool->eth_addrs = malloc(n_conns * sizeof(uint16_t));
+	if (!pool->conns || !pool->eth_addrs) {
+		free(pool->conns);
+		free(pool->eth_addrs);
+		free(pool);
+		return NULL;
+	}
+	
+	unsigned int i;
+	for (i = 0; i < n_conns; i++) {
+		pool->eth_addrs[i] = eth_addrs[i];
+		if (transport)
+			pool->conns[i] = rs_init_shared(transport, addrs[i], scp_data_length,
+			                                timeout, n_tries, n_outstanding);
+		else
+			pool->conns[i] = rs_init(loop, addrs[i], scp_data_length,
+			                         timeout, n_tries, n_outstanding);
+		if (!pool->conns[i]) {
+			// Free the connections created so far
+			pool->n_conns = i;
+			rs_pool_free(pool, NULL, NULL);
+			return NULL;
+		}
+	}
+	
+	return pool;
+}
+
+
+rs_pool_t *
+rs_pool_init(uv_loop_t *loop,
+             unsigned int n_conns,
+             const struct sockaddr **addrs,
+             const uint16_t *eth_addrs,
+             size_t scp_data_length,
+             uint64_t timeout,
+             unsigned int n_tries,
+             unsigned int n_outstanding)
+{
+	return rs__pool_init(loop, NULL, n_conns, addrs, eth_addrs,
+	                     scp_data_length, timeout, n_tries, n_outstanding);
+}
+
+
+rs_pool_t *
+rs_pool_init_shared(rs_transport_t *transport,
+                    unsigned int n_conns,
+                    const struct sockaddr **addrs,
+                    const uint16_t *eth_addrs,
+                    size_t scp_data_length,
+                    uint64_t timeout,
+                    unsigned int n_tries,
+                    unsigned int n_outstanding)
+{
+	return rs__pool_init(transport->loop, transport, n_conns, addrs, eth_addrs,
+	                     scp_data_length, timeout, n_tries, n_outstanding);
+}
+
+
+void
+rs_pool_set_striping(rs_pool_t *pool, unsigned int max_conns,
+                     size_t stripe_size)
+{
+	pool->max_stripe_conns = MAX(max_conns, 1);
+	pool->stripe_size = stripe_size;
+}
+
+
+rs_conn_t *
+rs_pool_get_conn(rs_pool_t *pool, uint16_t dest_addr)
+{
+	rs_conn_t *conn = NULL;
+	rs__pool_nearest(pool, dest_addr, &conn, 1);
+	return conn;
+}
+
+
+/**
+ * Callback on completion of a single stripe of a striped read/write.
+ */
+static void
+rs__pool_rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+               void *cb_data)
+{
+	rs__pool_rw_t *rw = (rs__pool_rw_t *)cb_data;
+	
+	if (error && !rw->error) {
+		rw->error = error;
+		rw->cmd_rc = cmd_rc;
+	}
+	
+	if (--rw->n_pending)
+		return;
+	
+	// All stripes complete: copy what is needed before freeing the state since
+	// the callback may make further requests.
+	rs__pool_rw_t done = *rw;
+	free(rw);
+	done.cb(done.conn, done.error, done.cmd_rc, done.data, done.cb_data);
+}
+
+
+/**
+ * Queue a read or write via a pool.
+ */
+static int
+rs__pool_rw(rs_pool_t *pool,
+            bool write,
+            uint16_t dest_addr,
+            uint8_t dest_cpu,
+            uint32_t address,
+            uv_buf_t data,
+            rs_rw_cb cb,
+            void *cb_data)
+{
+	int (*rw_fn)(rs_conn_t *, uint16_t, uint8_t, uint32_t, uv_buf_t,
+	             rs_rw_cb, void *) = write ? rs_write : rs_read;
+	
+	// Work out how many stripes and connections to use
+	size_t n_stripes = 1;
+	if (pool->stripe_size && data.len > pool->stripe_size)
+		n_stripes = (data.len + pool->stripe_size - 1) / pool->stripe_size;
+	unsigned int n_conns = MIN(n_stripes, pool->max_stripe_conns);
+	
+	rs_conn_t *conns[n_conns];
+	n_conns = rs__pool_nearest(pool, dest_addr, conns, n_conns);
+	
+	// Every stripe is queued as part of a group whose handle is allocated by the
+	// pool (and so is distinct from those of the connections' own requests)
+	rs__group_t group;
+	group.handle = pool->last_handle = (pool->next_handle++ |
+	                                    RS__HANDLE_GROUP | RS__HANDLE_POOL);
+	group.deadline = 0;
+	group.error = 0;
+	group.registered = false;
+	group.next = NULL;
+	
+	// Requests which don't need striping are passed straight through
+	if (n_conns == 1) {
+		conns[0]->next_group = &group;
+		return rw_fn(conns[0], dest_addr, dest_cpu, address, data, cb, cb_data);
+	}
+	
+	rs__pool_rw_t *rw = malloc(sizeof(rs__pool_rw_t));
+	if (!rw)
+		return -1;
+	rw->n_pending = 1; // Held until all stripes are queued
+	rw->error = 0;
+	rw->conn = conns[0];
+	rw->data = data;
+	rw->cb = cb;
+	rw->cb_data = cb_data;
+	
+	size_t i;
+	for (i = 0; i < n_stripes; i++) {
+		size_t offset = i * pool->stripe_size;
+		uv_buf_t stripe;
+		stripe.base = data.base + offset;
+		stripe.len = MIN(pool->stripe_size, data.len - offset);
+		
+		conns[i % n_conns]->next_group = &group;
+		if (rw_fn(conns[i % n_conns], dest_addr, dest_cpu, address + offset,
+		          stripe, rs__pool_rw_cb, rw)) {
+			// Couldn't queue any more stripes, fail once those queued complete
+			if (i == 0) {
+				free(rw);
+				return -1;
+			}
+			rw->error = UV_ENOMEM;
+			break;
+		}
+		rw->n_pending++;
+	}
+	
+	// Release the hold on completion
+	uv_buf_t unused = {0};
+	rs__pool_rw_cb(NULL, 0, 0, unused, rw);
+	
+	return 0;
+}
+
+
+int
+rs_pool_write(rs_pool_t *pool,
+              uint16_t dest_addr,
+              uint8_t dest_cpu,
+              uint32_t address,
+              uv_buf_t data,
+              rs_rw_cb cb,
+              void *cb_data)
+{
+	return rs__pool_rw(pool, true, dest_addr, dest_cpu, address, data,
+	                   cb, cb_data);
+}
+
+
+int
+rs_pool_read(rs_pool_t *pool,
+             uint16_t dest_addr,
+             uint8_t dest_cpu,
+             uint32_t address,
+             uv_buf_t data,
+             rs_rw_cb cb,
+             void *cb_data)
+{
+	return rs__pool_rw(pool, false, dest_addr, dest_cpu, address, data,
+	                   cb, cb_data);
+}
+
+
+rs_handle_t
+rs_pool_get_handle(rs_pool_t *pool)
+{
+	return pool->last_handle;
+}
+
+
+int
+rs_pool_cancel(rs_pool_t *pool, rs_handle_t handle)
+{
+	if (!(handle & RS__HANDLE_POOL))
+		return -1;
+	
+	// The stripes may be spread over any of the connections
+	bool cancelled = false;
+	unsigned int i;
+	for (i = 0; i < pool->n_conns; i++)
+		if (!rs_cancel(pool->conns[i], handle))
+			cancelled = true;
+	
+	return cancelled ? 0 : -1;
+}
+
+
+int
+rs_pool_set_deadline(rs_pool_t *pool, rs_handle_t handle, uint64_t deadline)
+{
+	if (!(handle & RS__HANDLE_POOL))
+		return -1;
+	
+	bool found = false;
+	unsigned int i;
+	for (i = 0; i < pool->n_conns; i++)
+		if (!rs_set_deadline(pool->conns[i], handle, deadline))
+			found = true;
+	
+	return found ? 0 : -1;
+}
+
+
+/**
+ * Callback on each connection being freed by rs_pool_free.
+ */
+static void
+rs__pool_free_cb(void *cb_data)
+{
+	rs_pool_t *pool = (rs_pool_t *)cb_data;
+	
+	if (--pool->n_conns_freeing)
+		return;
+	
+	rs_free_cb cb = pool->free_cb;
+	void *free_cb_data = pool->free_cb_data;
+	free(pool->conns);
+	free(pool->eth_addrs);
+	free(pool);
+	
+	if (cb)
+		cb(free_cb_data);
+}
+
+
+void
+rs_pool_free(rs_pool_t *pool, rs_free_cb cb, void *cb_data)
+{
+	pool->free_cb = cb;
+	pool->free_cb_data = cb_data;
+	
+	// Held until every connection's free has been started (a connection may
+	// never be freed synchronously but this keeps the count safe regardless)
+	pool->n_conns_freeing = pool->n_conns + 1;
+	
+	unsigned int i;
+	for (i = 0; i < pool->n_conns; i++)
+		rs_free(pool->conns[i], rs__pool_free_cb, pool);
+	
+	rs__pool_free_cb(pool);
+}
@@ -5,6 +5,7 @@
 #include <sys/socket.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -22,8 +23,11 @@ rs__process_queued_scp_packet(rs_conn_t *conn,
 {
 	os->active = true;
 	os->type = RS__REQ_SCP_PACKET;
-	os->seq_num = conn->next_seq_num++;
+	rs__assign_seq_num(conn, os);
 	os->n_tries = 0;
+	os->dest_addr = req->dest_addr;
+	os->handle = req->handle;
+	os->req_deadline = req->deadline;
 	
 	// Keep a pointer to the location to store the response
 	os->data.scp_packet.n_args_recv = req->data.scp_packet.n_args_recv;
@@ -38,7 +42,9 @@ rs__process_queued_scp_packet(rs_conn_t *conn,
 	uv_buf_t packet;
 	packet.base = os->packet.base + 2;
 	
-	// Pack the packet ready for transmission
+	// Pack the packet ready for transmission (overwriting any read/write header
+	// template)
+	os->rw_template_valid = false;
 	rs__pack_scp_packet(&packet,
 	                    conn->scp_data_length,
 	                    req->dest_addr,
@@ -51,9 +57,158 @@ rs__process_queued_scp_packet(rs_conn_t *conn,
 	                    req->data.scp_packet.arg3,
 	                    req->data.scp_packet.data);
 	
+	// Update the length of the outstanding packet (including the two padding
+	// bytes). The payload has been packed into the packet buffer.
+	os->packet.len = packet.len + 2;
+	os->payload.base = NULL;
+	os->payload.len = 0;
+	os->n_gather = 0;
+}
+
+
+/**
+ * Pack the packet for a chunk of a read or write into a slot.
+ */
+static void
+rs__pack_queued_rw(rs_conn_t *conn,
+                   rs__req_t *req,
+                   rs__outstanding_t *os,
+                   uint32_t address)
+{
+	// Work out the type of read/write request based on the address and length
+	rs__scp_rw_type_t req_type = rs__scp_rw_type(address, os->data.rw.data.len);
+	
+	// The packet is packed just after the initial null padding bytes. Only the
+	// sequence number and arguments differ between packets sent to the same
+	// place so the rest of the header is only packed when the slot was last used
+	// for something else.
+	char *packet = os->packet.base + 2;
+	if (!os->rw_template_valid ||
+	    os->rw_template_dest_addr != req->dest_addr ||
+	    os->rw_template_dest_cpu != req->dest_cpu ||
+	    os->rw_template_type != os->type) {
+		rs__pack_rw_template(packet,
+		                     req->dest_addr,
+		                     req->dest_cpu,
+		                     (os->type == RS__REQ_READ) ? RS__SCP_CMD_READ
+		                                                : RS__SCP_CMD_WRITE);
+		os->rw_template_valid = true;
+		os->rw_template_dest_addr = req->dest_addr;
+		os->rw_template_dest_cpu = req->dest_cpu;
+		os->rw_template_type = os->type;
+	}
+	rs__pack_rw_packet(packet,
+	                   os->seq_num,
+	                   address,
+	                   os->data.rw.data.len,
+	                   req_type);
+	
+	// Write data is not copied into the packet buffer but is instead sent
+	// directly from the user's buffer as the packet's payload.
+	if (os->type == RS__REQ_READ) {
+		os->payload.base = NULL;
+		os->payload.len = 0;
+	} else {
+		os->payload = os->data.rw.data;
+	}
+	
 	// Update the length of the outstanding packet (including the two padding
 	// bytes)
+	os->packet.len = RS__SIZEOF_SCP_PACKET(3, 0) + 2;
+}
+
+
+/**
+ * Get the length of the next chunk of a transfer such that only the unaligned
+ * bytes at either end are sent separately (as byte or short accesses) and every
+ * other chunk is a word-aligned whole number of words no longer than max_len.
+ */
+static size_t
+rs__aligned_chunk_len(uint32_t address, size_t length, size_t max_len)
+{
+	if (address & 3)
+		return MIN(4 - (address & 3), length);
+	else if (length < 4)
+		return length;
+	else
+		return MIN(length & ~(size_t)3, max_len);
+}
+
+
+/**
+ * Get the length of the next packet of a read or write. Transfers which fit in
+ * a single packet are sent as one, whatever their alignment, while longer
+ * transfers are split into aligned chunks since SC&MP serves word accesses far
+ * faster than byte or short ones.
+ */
+static size_t
+rs__rw_chunk_len(rs_conn_t *conn, rs__req_t *req)
+{
+	size_t length = req->data.rw.data.len;
+	size_t max_words = conn->scp_data_length & ~(size_t)3;
+	
+	if (req->data.rw.orig_data.len <= conn->scp_data_length || !max_words)
+		return MIN(length, conn->scp_data_length);
+	else
+		return rs__aligned_chunk_len(req->data.rw.address, length, max_words);
+}
+
+
+/**
+ * Pack the packet for a chunk of a fill (see rs__aligned_chunk_len) into a
+ * slot.
+ */
+static void
+rs__pack_queued_fill(rs_conn_t *conn,
+                     rs__req_t *req,
+                     rs__outstanding_t *os,
+                     uint32_t address)
+{
+	uint32_t word = req->data.rw.word;
+	size_t length = os->data.rw.data.len;
+	
+	// Fills are rarely sent and so are packed in full (overwriting any read/write
+	// header template)
+	os->rw_template_valid = false;
+	uv_buf_t packet;
+	packet.base = os->packet.base + 2;
+	
+	if (!(address & 3) && !(length & 3)) {
+		uv_buf_t no_data;
+		no_data.base = NULL;
+		no_data.len = 0;
+		rs__pack_scp_packet(&packet,
+		                    conn->scp_data_length,
+		                    req->dest_addr,
+		                    req->dest_cpu,
+		                    RS__SCP_CMD_FILL,
+		                    os->seq_num,
+		                    3, address, word, length,
+		                    no_data);
+	} else {
+		// Each unaligned byte takes the value of the corresponding byte of the
+		// (little-endian) word
+		char bytes[3];
+		size_t i;
+		for (i = 0; i < length; i++)
+			bytes[i] = (char)((word >> (8 * ((address + i) & 3))) & 0xFF);
+		
+		uv_buf_t data;
+		data.base = bytes;
+		data.len = length;
+		rs__pack_scp_packet(&packet,
+		                    conn->scp_data_length,
+		                    req->dest_addr,
+		                    req->dest_cpu,
+		                    RS__SCP_CMD_WRITE,
+		                    os->seq_num,
+		                    3, address, length, RS__RW_TYPE_BYTE,
+		                    data);
+	}
+	
 	os->packet.len = packet.len + 2;
+	os->payload.base = NULL;
+	os->payload.len = 0;
 }
 
 
@@ -64,110 +219,195 @@ rs__process_queued_rw(rs_conn_t *conn,
 {
 	os->active = true;
 	os->type = req->type;
-	os->seq_num = conn->next_seq_num++;
-	os->data.rw.id = req->data.rw.id;
+	rs__assign_seq_num(conn, os);
 	os->n_tries = 0;
+	os->dest_addr = req->dest_addr;
+	rs__rw_state_add(req->data.rw.state, os);
+	os->handle = req->handle;
+	os->req_deadline = req->deadline;
 	
-	// Slice off a chunk of the data as large as will fit in a packet
+	// Slice off a chunk of the data as large as will fit in a packet. The
+	// word-aligned body of a fill is sent as a single CMD_FILL.
 	uint32_t address = req->data.rw.address;
 	os->data.rw.orig_data = req->data.rw.orig_data;
 	os->data.rw.data = req->data.rw.data;
-	os->data.rw.data.len = MIN(os->data.rw.data.len, conn->scp_data_length);
+	if (os->type == RS__REQ_FILL)
+		os->data.rw.data.len = rs__aligned_chunk_len(address,
+		                                             os->data.rw.data.len,
+		                                             SIZE_MAX);
+	else
+		os->data.rw.data.len = rs__rw_chunk_len(conn, req);
+	
+	// The data of coalesced writes is gathered from many buffers (possibly
+	// shortening the chunk)
+	os->n_gather = 0;
+	if (req->data.rw.coalesced)
+		rs__coalesce_gather(conn, req->data.rw.coalesced, os);
 	
 	// Update the request accordingly
 	req->data.rw.address += os->data.rw.data.len;
-	req->data.rw.data.base += os->data.rw.data.len;
+	if (req->data.rw.data.base)
+		req->data.rw.data.base += os->data.rw.data.len;
 	req->data.rw.data.len -= os->data.rw.data.len;
 	
 	// Record the callback (and its data)
 	os->data.rw.cb = req->data.rw.cb;
 	os->cb_data = req->cb_data;
 	
-	// Work out the type of read/write request based on the address and length
-	uint32_t req_type = rs__scp_rw_type(address, os->data.rw.data.len);
-	
-	// Pack the packet just after the initial null padding bytes
-	uv_buf_t packet;
-	packet.base = os->packet.base + 2;
-	
 	// Pack the packet ready for transmission
-	if (os->type == RS__REQ_READ) {
-		uv_buf_t empty;
-		empty.base = NULL;
-		empty.len = 0;
-		rs__pack_scp_packet(&packet,
-		                    conn->scp_data_length,
-		                    req->dest_addr,
-		                    req->dest_cpu,
-		                    RS__SCP_CMD_READ,
-		                    os->seq_num,
-		                    3,
-		                    address,
-		                    os->data.rw.data.len,
-		                    req_type,
-		                    empty);
+	if (os->type == RS__REQ_FILL)
+		rs__pack_queued_fill(conn, req, os, address);
+	else
+		rs__pack_queued_rw(conn, req, os, address);
+	
+	// The last packet has been sent if the remaining data is empty
+	if (req->data.rw.data.len <= 0) {
+		req->data.rw.state->queued = false;
+		return true;
 	} else {
-		rs__pack_scp_packet(&packet,
-		                    conn->scp_data_length,
-		                    req->dest_addr,
-		                    req->dest_cpu,
-		                    RS__SCP_CMD_WRITE,
-		                    os->seq_num,
-		                    3,
-		                    address,
-		                    os->data.rw.data.len,
-		                    req_type,
-		                    os->data.rw.data);
+		return false;
 	}
+}
+
+
+void
+rs__remove_active_rw(rs_conn_t *conn, rs__rw_state_t *state)
+{
+	unsigned int i;
+	for (i = 0; i < conn->n_active_rws; i++)
+		if (conn->active_rws[i].data.rw.state == state)
+			break;
+	if (i == conn->n_active_rws)
+		return;
 	
-	// Update the length of the outstanding packet (including the two padding
-	// bytes)
-	os->packet.len = packet.len + 2;
+	// Keep the remaining requests in queue order
+	memmove(&(conn->active_rws[i]), &(conn->active_rws[i + 1]),
+	        (conn->n_active_rws - i - 1) * sizeof(rs__req_t));
+	conn->n_active_rws--;
 	
-	// The last packet has been sent if the remaining data is empty
-	return req->data.rw.data.len <= 0;
+	// Keep the round-robin position pointing at the same next request
+	if (i < conn->next_active_rw)
+		conn->next_active_rw--;
+	if (conn->next_active_rw >= conn->n_active_rws)
+		conn->next_active_rw = 0;
+}
+
+
+/**
+ * Move reads/writes from the head of the request queue into the set of active
+ * requests while there is room (stopping at the first SCP packet).
+ */
+static void
+rs__admit_active_rws(rs_conn_t *conn)
+{
+	while (conn->n_active_rws < conn->interleave) {
+		rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue);
+		if (!req || req->type == RS__REQ_SCP_PACKET)
+			break;
+		
+		// Reads and writes require a state to track their packets in flight
+		rs__rw_state_t *state = rs__alloc_rw_state(conn);
+		if (!state)
+			break;
+		
+		rs__req_t *active = &(conn->active_rws[conn->n_active_rws++]);
+		*active = *req;
+		active->data.rw.state = state;
+		rs__q_remove(conn->request_queue);
+	}
+}
+
+
+/**
+ * Pick the next active read/write to send a packet for, in round-robin order,
+ * or NULL if every active request's destination is at its in-flight limit.
+ */
+static rs__req_t *
+rs__next_active_rw(rs_conn_t *conn)
+{
+	unsigned int i;
+	for (i = 0; i < conn->n_active_rws; i++) {
+		unsigned int n = (conn->next_active_rw + i) % conn->n_active_rws;
+		rs__req_t *req = &(conn->active_rws[n]);
+		
+		if (conn->max_per_dest &&
+		    rs__dest_in_flight(conn, req->dest_addr) >= conn->max_per_dest)
+			continue;
+		
+		conn->next_active_rw = (n + 1) % conn->n_active_rws;
+		return req;
+	}
+	
+	return NULL;
 }
 
 
 void
 rs__process_request_queue(rs_conn_t *conn)
 {
-	int i;
+	// Don't start anything new while the connection is being freed
+	if (conn->free)
+		return;
+	
+	// When batching is enabled, the packets dispatched below are sent together
+	bool batch = rs__batch_begin(conn);
 	
 	// Process as many packets as possible before running out
 	while (1) {
-		// Find a free outstanding slot
-		rs__outstanding_t *os = NULL;
-		for (i = 0; i < conn->n_outstanding; i++) {
-			if (!conn->outstanding[i].active &&
-			    !conn->outstanding[i].send_req_active) {
-				os = &(conn->outstanding[i]);
-				break;
-			}
+		// Find a request to send (high-priority requests first) and a free
+		// outstanding slot, stopping if there is no available slot (within the
+		// window) or request
+		if (!conn->free_outstanding)
+			break;
+		rs__req_t *req = (rs__req_t *)rs__q_peek(conn->hp_request_queue);
+		bool high_priority = req != NULL;
+		if (!req) {
+			// An SCP packet at the head of the queue is sent once it would have
+			// been admitted to the active set, otherwise the next active
+			// read/write is chosen.
+			rs__admit_active_rws(conn);
+			req = (rs__req_t *)rs__q_peek(conn->request_queue);
+			if (!req || req->type != RS__REQ_SCP_PACKET ||
+			    conn->n_active_rws >= conn->interleave)
+				req = rs__next_active_rw(conn);
 		}
 		
-		// Find a request to send
-		rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue);
+		// Requests whose deadline has passed are abandoned rather than sent
+		if (req && req->deadline && req->deadline <= uv_now(conn->loop)) {
+			rs__cancel_handle(conn, req->handle, RS_EDEADLINE);
+			continue;
+		}
 		
-		// Stop if there is no available slot or request
-		if (!os || !req)
-			return;
+		if (!req || !rs__cwnd_available(conn, high_priority) ||
+		    !rs__pacer_available(conn))
+			break;
+		
+		rs__outstanding_t *os = rs__alloc_outstanding(conn);
+		if (high_priority) {
+			os->high_priority = true;
+			conn->n_hp_slots_in_use++;
+		}
 		
 		// Place the request int the outstanding slot
 		switch (req->type) {
 			case RS__REQ_SCP_PACKET:
 				rs__process_queued_scp_packet(conn, req, os);
-				rs__q_remove(conn->request_queue);
+				rs__q_remove(high_priority ? conn->hp_request_queue
+				                           : conn->request_queue);
 				break;
 				
 			case RS__REQ_READ:
 			case RS__REQ_WRITE:
+			case RS__REQ_FILL:
 				if (rs__process_queued_rw(conn, req, os))
-					rs__q_remove(conn->request_queue);
+					rs__remove_active_rw(conn, req->data.rw.state);
 				break;
 		}
 		
 		// Transmit the packet
 		rs__attempt_transmission(conn, os);
 	}
+	
+	if (batch)
+		rs__batch_end(conn);
 }
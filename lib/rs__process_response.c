@@ -51,72 +51,67 @@ rs__process_response_scp_packet(rs_conn_t *conn, rs__outstanding_t *os,
 }
 
 
-void
+bool
 rs__process_response_rw(rs_conn_t *conn, rs__outstanding_t *os,
                         uv_buf_t buf)
 {
-	int i;
-	
 	// Unpack the packet
-	unsigned int n_args = 0;
-	uint16_t cmd_rc;
-	uint16_t seq_num;
 	uv_buf_t data;
-	rs__unpack_scp_packet(buf,
-	                      &cmd_rc,
-	                      &seq_num,
-	                      &n_args, NULL, NULL, NULL,
-	                      &data);
+	uint16_t cmd_rc = rs__unpack_rw_response(buf, &data);
 	
 	// Check the response was OK and fail if not
 	if (cmd_rc != RS__SCP_CMD_OK) {
 		rs__cancel_outstanding(conn, os, RS_EBAD_RC, cmd_rc);
-		return;
+		return true;
 	}
+	rs__stats_traffic(conn, os)->n_bytes += os->data.rw.data.len;
 	
-	// If reading, copy the received data into the user supplied buffer
+	// If reading, copy the received data into the user supplied buffer (if the
+	// data was received directly into the user's buffer, only the header is
+	// supplied and so no data is copied)
 	if (os->type == RS__REQ_READ) {
 		size_t data_len = MIN(os->data.rw.data.len, data.len);
 		memcpy(os->data.rw.data.base, data.base, data_len);
 		os->data.rw.data.len = data_len;  // Not actually used anywhere
 	}
 	
-	// Determine if this is the last outstanding command in the request.
-	bool last_outstanding = true;
-	// Look for any *other* outstanding commands which are part of this request
-	// which are still active.
-	for (i = 0; i < conn->n_outstanding; i++) {
-		if (&(conn->outstanding[i]) != os &&
-		    conn->outstanding[i].active &&
-		    conn->outstanding[i].type == os->type &&
-		    conn->outstanding[i].data.rw.id == os->data.rw.id) {
-			last_outstanding = false;
-		}
-	}
-	// Check to see if this command relates to the command at the head of the
-	// request queue.
-	rs__req_t *req = (rs__req_t *)rs__q_peek(conn->request_queue);
-	if (req && req->type == os->type && req->data.rw.id == os->data.rw.id)
-		last_outstanding = false;
+	// This slot is no longer in flight on behalf of the request
+	rs__rw_state_t *state = os->data.rw.state;
+	rs__rw_state_remove(state, os);
 	
-	// If this was the last outstanding command, call the users callback.
-	if (last_outstanding) {
+	// If this was the last outstanding command (and no further packets remain to
+	// be sent), call the users callback.
+	if (state->n_outstanding == 0 && !state->queued) {
+		rs__free_rw_state(conn, state);
 		os->data.rw.cb(conn, false,
 		               cmd_rc,
 		               os->data.rw.orig_data,
 		               os->cb_data);
 	}
+	
+	return false;
 }
 
 
 void
 rs__process_response(rs_conn_t *conn, rs__outstanding_t *os, uv_buf_t buf)
 {
+	// Check for earlier packets to the same chip which appear to have been lost
+	// (before the timeout, which records when this packet was sent, is stopped).
+	// The lost packet's sequence number is noted since the slot may be reused
+	// by the callbacks called below.
+	rs__outstanding_t *lost = rs__fast_retransmit_response(conn, os);
+	uint16_t lost_seq_num = lost ? lost->seq_num : 0;
+	
 	// Stop the timeout timer
-	if (uv_is_active((uv_handle_t *)&(os->timer_handle)))
-		uv_timer_stop(&(os->timer_handle));
+	rs__timer_stop(conn, os);
+	
+	rs__stats_traffic(conn, os)->n_responses++;
+	rs__rtt_response(conn, os);
+	rs__cwnd_response(conn, os);
 	
 	// Deal with the packet depending on its type
+	bool released = false;
 	switch (os->type) {
 		case RS__REQ_SCP_PACKET:
 			rs__process_response_scp_packet(conn, os, buf);
@@ -124,12 +119,21 @@ rs__process_response(rs_conn_t *conn, rs__outstanding_t *os, uv_buf_t buf)
 		
 		case RS__REQ_READ:
 		case RS__REQ_WRITE:
-			rs__process_response_rw(conn, os, buf);
+		case RS__REQ_FILL:
+			released = rs__process_response_rw(conn, os, buf);
 			break;
 	}
 	
-	// Mark this outstanding slot as inactive again and trigger queue processing
-	// since we just freed up an outstanding slot.
-	os->active = false;
+	// Mark this outstanding slot as inactive again (unless it was cancelled while
+	// processing the response) and trigger queue processing since we just freed
+	// up an outstanding slot. If a send request is still pending, the slot will
+	// be freed once it completes.
+	if (!released && os->active && !os->cancelled) {
+		os->active = false;
+		if (!os->send_req_active)
+			rs__free_outstanding(conn, os);
+	}
+	if (lost)
+		rs__fast_retransmit(conn, lost, lost_seq_num);
 	rs__process_request_queue(conn);
 }
@@ -1,34 +1,69 @@
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include <rs__queue.h>
 
 /**
- * Calculate the pointer to the rs__q_entry_t in the given block at the
- * specified index.
+ * Calculate the pointer to the entry at the specified position in the queue
+ * (where position 0 is the tail).
  *
  * @param rs__q_t *q
- * @param rs__q_block_t *blk
- * @param int entry
- * @returns rs__q_entry_t *
+ * @param size_t i
+ * @returns char *
  */
-#define BLOCK_ENTRY(q, blk, entry) \
-	((rs__q_entry_t *)((char *)((blk)->block) + ((entry) * ((q)->data_size))))
+#define ENTRY(q, i) \
+	((q)->entries + ((((q)->tail + (i)) & ((q)->size - 1)) * (q)->data_size))
+
 
 /**
- * Initialise the entries of a block of queue entries as a linked list.
- * Also marks the entry as empty.
- * Doesn't initialise the last "next" pointer.
+ * Move the contents of the queue into a newly allocated ring of the given size
+ * (which must be large enough to hold them).
+ *
+ * @returns false (leaving the queue unchanged) if out of memory.
  */
-void
-rs__q_block_init(rs__q_t *q, rs__q_block_t *block) {
-	size_t i;
-	for (i = 0; i < block->size; i++) {
-		BLOCK_ENTRY(q, block, i)->empty = true;
-		
-		if (i < block->size - 1)
-			BLOCK_ENTRY(q, block, i)->next = BLOCK_ENTRY(q, block, i + 1);
-	}
+static bool
+rs__q_resize(rs__q_t *q, size_t size)
+{
+	char *entries = malloc(size * q->data_size);
+	if (!entries)
+		return false;
+	
+	// Copy the entries up to the end of the old ring and then any which wrapped
+	// around to its start such that the new ring starts at the tail.
+	size_t n_first = q->size - q->tail;
+	if (n_first > q->length)
+		n_first = q->length;
+	memcpy(entries, ENTRY(q, 0), n_first * q->data_size);
+	memcpy(entries + (n_first * q->data_size),
+	       q->entries,
+	       (q->length - n_first) * q->data_size);
+	
+	free(q->entries);
+	q->entries = entries;
+	q->size = size;
+	q->tail = 0;
+	return true;
+}
+
+
+/**
+ * Shrink the ring once it would hold no more than a quarter of its size worth
+ * of entries, halving it until it is more than a quarter full. Since it is then
+ * no more than half full, it won't be immediately grown again. If the
+ * allocation fails the larger ring is simply kept.
+ *
+ * @param length The number of entries the ring must be able to hold (which may
+ *               differ from the current length by one in either direction).
+ */
+static void
+rs__q_shrink(rs__q_t *q, size_t length)
+{
+	size_t size = q->size;
+	while (size > RS__Q_MIN_SIZE && length <= size / 4)
+		size /= 2;
+	if (size != q->size)
+		rs__q_resize(q, size);
 }
 
 
@@ -40,29 +75,16 @@ rs__q_init(size_t data_size)
 	
 	q->data_size = data_size;
 	
-	// Allocate the initial block of queue entries
-	q->blocks = malloc(sizeof(rs__q_block_t));
-	if (!q->blocks) {
+	// Allocate the initial ring of queue entries
+	q->size = RS__Q_MIN_SIZE;
+	q->entries = malloc(q->size * q->data_size);
+	if (!q->entries) {
 		free(q);
 		return NULL;
 	}
-	q->blocks->next = NULL;
-	q->blocks->size = RS__Q_FIRST_BLOCK_SIZE;
-	q->blocks->block = calloc(RS__Q_FIRST_BLOCK_SIZE, q->data_size);
-	if (!q->blocks->block) {
-		free(q->blocks);
-		free(q);
-		return NULL;
-	}
-	
-	// Initialise the block as a closed loop
-	rs__q_block_init(q, q->blocks);
-	BLOCK_ENTRY(q, q->blocks, q->blocks->size - 1)->next =
-		BLOCK_ENTRY(q, q->blocks, 0);
 	
-	// Set the head and tail to point to the same (empty) entries
-	q->head = (rs__q_entry_t *)q->blocks->block;
-	q->tail = (rs__q_entry_t *)q->blocks->block;
+	q->tail = 0;
+	q->length = 0;
 	
 	return q;
 }
@@ -71,50 +93,70 @@ rs__q_init(size_t data_size)
 void *
 rs__q_insert(rs__q_t *q)
 {
-	// Allocate more buffer space if the queue would become full upon inserting
-	// this item
-	if (!q->head->next->empty) {
-		// Allocate storage for the new block, making the new allocation twice as
-		// large as the last one.
-		rs__q_block_t *new_block = malloc(sizeof(rs__q_block_t));
-		if (!new_block) return NULL;
-		new_block->size = q->blocks->size * 2;
-		new_block->block = calloc(new_block->size, q->data_size);
-		if (!new_block->block) {
-			// Fail
-			free(new_block);
-			return NULL;
-		}
-		
-		// Initialise the new block and insert it into the queue's linked list
-		rs__q_block_init(q, new_block);
-		BLOCK_ENTRY(q, new_block, new_block->size - 1)->next = q->head->next;
-		q->head->next = (rs__q_entry_t *)new_block->block;
-		
-		// Insert the new block into to the linked list of blocks
-		new_block->next = q->blocks;
-		q->blocks = new_block;
-	}
+	if (!rs__q_reserve(q, 1))
+		return NULL;
+	
+	void *entry = rs__q_reserved(q, 0);
+	rs__q_commit(q, 1);
+	return entry;
+}
+
+
+bool
+rs__q_reserve(rs__q_t *q, size_t n)
+{
+	rs__q_shrink(q, q->length + n);
+	if (q->length + n <= q->size)
+		return true;
 	
-	// Advance the head of the queue and return the entry which was previously at
-	// the head.
-	rs__q_entry_t *entry = q->head;
-	entry->empty = false;
-	q->head = q->head->next;
-	return (void *)entry;
+	// Grow the ring by doubling its size until it is large enough
+	size_t size = q->size;
+	while (size < q->length + n) {
+		if (size * 2 < size)
+			return false;  // Overflow
+		size *= 2;
+	}
+	return rs__q_resize(q, size);
+}
+
+
+void *
+rs__q_reserved(rs__q_t *q, size_t i)
+{
+	return (void *)ENTRY(q, q->length + i);
+}
+
+
+void
+rs__q_commit(rs__q_t *q, size_t n)
+{
+	q->length += n;
 }
 
 
 void *
 rs__q_remove(rs__q_t *q)
 {
-	rs__q_entry_t *entry = q->tail;
+	if (!q->length)
+		return NULL;
+	
+	// Shrink before removing the entry such that it is moved along with the
+	// others (and so remains valid until the next call)
+	rs__q_shrink(q, q->length - 1);
 	
-	// Advance the tail of the queue and return the entry if it is not empty.
-	if (!entry->empty) {
-		entry->empty = true;
-		q->tail = q->tail->next;
-		return (void *)entry;
+	// Advance the tail of the queue and return the entry there
+	void *entry = (void *)ENTRY(q, 0);
+	q->tail = (q->tail + 1) & (q->size - 1);
+	q->length--;
+	return entry;
+}
+
+
+void *
+rs__q_peek(rs__q_t *q)
+{
+	if (q->length) {
+		return (void *)ENTRY(q, 0);
 	} else {
 		return NULL;
 	}
@@ -122,10 +164,21 @@ rs__q_remove(rs__q_t *q)
 
 
 void *
-rs__q_peek(rs__q_t *q)
+rs__q_peek_newest(rs__q_t *q)
 {
-	if (!q->tail->empty) {
-		return (void *)q->tail;
+	if (q->length) {
+		return (void *)ENTRY(q, q->length - 1);
+	} else {
+		return NULL;
+	}
+}
+
+
+void *
+rs__q_peek_at(rs__q_t *q, size_t i)
+{
+	if (i < q->length) {
+		return (void *)ENTRY(q, i);
 	} else {
 		return NULL;
 	}
@@ -133,16 +186,63 @@ rs__q_peek(rs__q_t *q)
 
 
 void
-rs__q_free(rs__q_t *q)
+rs__q_remove_at(rs__q_t *q, size_t i)
 {
-	// Free the queue blocks
-	while (q->blocks) {
-		rs__q_block_t *block = q->blocks;
-		free(block->block);
-		q->blocks = block->next;
-		free(block);
+	if (i < q->length / 2) {
+		// Shuffle the older entries along to fill the gap and advance the tail
+		// (such that removing the oldest entry takes constant time)
+		for (; i > 0; i--)
+			memcpy(ENTRY(q, i), ENTRY(q, i - 1), q->data_size);
+		q->tail = (q->tail + 1) & (q->size - 1);
+	} else {
+		// Shuffle the newer entries along to fill the gap
+		for (; i + 1 < q->length; i++)
+			memcpy(ENTRY(q, i), ENTRY(q, i + 1), q->data_size);
 	}
+	q->length--;
 	
-	// Free the queue structure
+	rs__q_shrink(q, q->length);
+}
+
+
+size_t
+rs__q_remove_if(rs__q_t *q, bool (*match)(void *entry, void *data), void *data,
+                void *removed)
+{
+	// Keep the remaining entries in order, packing them towards the tail in a
+	// single sweep
+	size_t i;
+	size_t n_kept = 0;
+	size_t n_removed = 0;
+	for (i = 0; i < q->length; i++) {
+		char *entry = ENTRY(q, i);
+		if (match(entry, data)) {
+			memcpy((char *)removed + (n_removed * q->data_size), entry,
+			       q->data_size);
+			n_removed++;
+		} else {
+			if (n_kept != i)
+				memcpy(ENTRY(q, n_kept), entry, q->data_size);
+			n_kept++;
+		}
+	}
+	q->length = n_kept;
+	
+	rs__q_shrink(q, q->length);
+	return n_removed;
+}
+
+
+size_t
+rs__q_length(rs__q_t *q)
+{
+	return q->length;
+}
+
+
+void
+rs__q_free(rs__q_t *q)
+{
+	free(q->entries);
 	free(q);
 }
@@ -1,82 +1,54 @@
 /**
- * An growable FIFO queue.
+ * A growable FIFO queue.
  *
- * This queue is designed to hold an ordered queue of user-defined structs. To
- * achieve this, users must define their structs to contain an rs__q_entry_t as
- * their first element. This value will be used internally to manage the queue
- * and should not be used directly by users.
+ * This queue holds an ordered queue of fixed-size user-defined structs in a
+ * single contiguous ring buffer whose size is always a power of two. The ring
+ * doubles in size when full and, so that a burst of insertions does not
+ * hold on to memory once drained, halves when entries are inserted or removed
+ * while it is no more than a quarter full.
+ *
+ * Pointers to entries returned by any of the functions below (including
+ * entries which have just been removed) remain valid only until the next call
+ * to rs__q_insert, rs__q_reserve, rs__q_remove, rs__q_remove_at,
+ * rs__q_remove_if or rs__q_free since these may move the queue's contents.
  */
 
 #ifndef RS_QUEUE_H
 #define RS_QUEUE_H
 
+#include <stddef.h>
 #include <stdbool.h>
 
 /**
- * The size to use for the initial allocation of queue entries.
- */
-#define RS__Q_FIRST_BLOCK_SIZE 8
-
-
-/**
- * An entry in a queue.
+ * The smallest size (in entries) to which the queue is allocated. Must be a
+ * power of two.
  */
-struct rs__q_entry;
-typedef struct rs__q_entry rs__q_entry_t;
-struct rs__q_entry {
-	// Is this entry empty?
-	bool empty;
-	
-	// Pointers forming a linked-list between entries in the queue.
-	rs__q_entry_t *next;
-};
+#define RS__Q_MIN_SIZE 8
 
-/**
- * A linked list of blocks of memory allocated to storing rs__q_entry_t. These
- * blocks are immediately followed by a user-defined block of data.
- */
-struct rs__q_block;
-typedef struct rs__q_block rs__q_block_t;
-struct rs__q_block {
-	// Pointer to the allocated block
-	void *block;
-	
-	// Size of the block (in entries)
-	size_t size;
-	
-	// Pointer to the next allocated block or NULL if no more blocks are
-	// allocated.
-	rs__q_block_t *next;
-};
 
 /**
  * Data type which represents the queue.
  */
 typedef struct rs__q {
-	// Size of each entry in the queue (including the size of the rs__q_entry_t).
+	// Size of each entry in the queue
 	size_t data_size;
 	
-	// Pointers to the head and tail of the queue. Items are inserted into the
-	// head of the queue and taken from the tail. If tail points to an empty
-	// entry, the queue is empty. The head must always point to an empty entry.
-	// When an item is inserted the new head becomes head->next. If the new head
-	// is not empty, the queue must be enlarged. The tail points at the next entry
-	// to remove and when an item is removed, the new tail becomes tail->next. If
-	// the tail is empty, head == tail and the queue is empty.
-	rs__q_entry_t *head;
-	rs__q_entry_t *tail;
+	// The ring buffer of entries and its size (in entries, a power of two)
+	char *entries;
+	size_t size;
 	
-	// A linked list of blocks of memory allocated to support the queue
-	rs__q_block_t *blocks;
+	// The index (in entries) of the next entry to be removed and the number of
+	// entries currently in the queue. Entries are inserted at index
+	// (tail + length) modulo the size.
+	size_t tail;
+	size_t length;
 } rs__q_t;
 
 
 /**
  * Allocate a new queue in memory.
  *
- * @param data_size Size of the data blocks to be contained in the queue. Users
- *                  must include a rs__q_entry_t as the first entry in each data
- *                  block.
+ * @param data_size Size of the data blocks to be contained in the queue.
  * @returns a pointer to a newly allocated queue structure or NULL on failure.
  * This structure must be freed using rs__q_free.
  */
@@ -91,6 +63,30 @@ rs__q_t *rs__q_init(size_t data_size);
 void *rs__q_insert(rs__q_t *q);
 
 
+/**
+ * Ensure the queue has space for n more entries such that n entries may be
+ * inserted using rs__q_reserved and rs__q_commit without any further
+ * allocation.
+ *
+ * Returns false on failure.
+ */
+bool rs__q_reserve(rs__q_t *q, size_t n);
+
+
+/**
+ * Get a pointer to the ith (from 0) entry reserved by rs__q_reserve. The entry
+ * does not become part of the queue until a corresponding call to
+ * rs__q_commit.
+ */
+void *rs__q_reserved(rs__q_t *q, size_t i);
+
+
+/**
+ * Append the first n reserved entries to the queue (in order).
+ */
+void rs__q_commit(rs__q_t *q, size_t n);
+
+
 /**
  * Attempt to remove an entry into the queue.
  *
@@ -106,6 +102,43 @@ void *rs__q_remove(rs__q_t *q);
 void *rs__q_peek(rs__q_t *q);
 
 
+/**
+ * Get a pointer to the entry most recently inserted into the queue (without
+ * removing it) or NULL if empty.
+ */
+void *rs__q_peek_newest(rs__q_t *q);
+
+
+/**
+ * Get a pointer to the ith (from 0, the next to be removed) entry in the queue
+ * (without removing it) or NULL if the queue has no ith entry.
+ */
+void *rs__q_peek_at(rs__q_t *q, size_t i);
+
+/**
+ * Remove the ith (from 0, the next to be removed) entry from the queue, keeping
+ * the remaining entries in order. The entry is overwritten and so must be
+ * copied first if still required. The queue must have an ith entry.
+ */
+void rs__q_remove_at(rs__q_t *q, size_t i);
+
+/**
+ * Remove every entry for which match(entry, data) returns true, keeping the
+ * remaining entries in order. The removed entries are copied, in order, into
+ * the array removed which must have room for all of them. The match function
+ * must not modify the queue.
+ *
+ * @returns The number of entries removed.
+ */
+size_t rs__q_remove_if(rs__q_t *q, bool (*match)(void *entry, void *data),
+                       void *data, void *removed);
+
+/**
+ * Get the number of entries in the queue.
+ */
+size_t rs__q_length(rs__q_t *q);
+
+
 /**
  * Free all memory associated with a queue.
  */
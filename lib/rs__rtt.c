@@ -0,0 +1,114 @@
+/**
+ * Internal functions for round-trip time estimation and adaptive
+ * retransmission timeouts.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+// Nanoseconds per msec
+#define RS__NS_PER_MS 1000000ull
+
+// The clock granularity (nsec) assumed when computing timeouts (that of libuv
+// timers)
+#define RS__RTT_GRANULARITY RS__NS_PER_MS
+
+
+/**
+ * Clamp a timeout to the connection's limits.
+ */
+static uint64_t
+rs__clamp_rto(rs_conn_t *conn, uint64_t rto)
+{
+	return MIN(MAX(rto, conn->min_rto), conn->max_rto);
+}
+
+
+uint64_t
+rs__rto(rs_conn_t *conn)
+{
+	return conn->adaptive_timeout ? conn->rto : conn->timeout;
+}
+
+
+void
+rs__rtt_sent(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// Always recorded such that adaptive timeouts may be enabled at any time
+	os->send_time = uv_hrtime();
+}
+
+
+void
+rs__rtt_response(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// As in Karn's algorithm, responses to retransmitted packets are not
+	// sampled since it is not known which transmission they respond to.
+	if (os->n_tries != 1)
+		return;
+	
+	uint64_t rtt = uv_hrtime() - os->send_time;
+	rs__stats_rtt(conn, rtt);
+	
+	if (!conn->adaptive_timeout)
+		return;
+	
+	if (!conn->have_rtt) {
+		conn->srtt = rtt;
+		conn->rttvar = rtt / 2;
+		conn->have_rtt = true;
+	} else {
+		uint64_t delta = (conn->srtt > rtt) ? conn->srtt - rtt : rtt - conn->srtt;
+		conn->rttvar = (3 * conn->rttvar + delta) / 4;
+		conn->srtt = (7 * conn->srtt + rtt) / 8;
+	}
+	
+	uint64_t rto = conn->srtt + MAX(RS__RTT_GRANULARITY, 4 * conn->rttvar);
+	conn->rto = rs__clamp_rto(conn, (rto + RS__NS_PER_MS - 1) / RS__NS_PER_MS);
+}
+
+
+void
+rs__rtt_timeout(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (!conn->adaptive_timeout)
+		return;
+	
+	// When many packets are outstanding, several may time out together (e.g.
+	// due to a burst of loss). Only back off once per such burst: packets sent
+	// before the last back off were waiting on the old timeout.
+	if (os->send_time < conn->rto_backoff_time)
+		return;
+	
+	conn->rto = rs__clamp_rto(conn, conn->rto * 2);
+	conn->rto_backoff_time = uv_hrtime();
+}
+
+
+void
+rs_set_adaptive_timeout(rs_conn_t *conn, bool enable,
+                        uint64_t min_timeout, uint64_t max_timeout)
+{
+	conn->adaptive_timeout = enable;
+	conn->min_rto = min_timeout;
+	conn->max_rto = max_timeout;
+	
+	conn->have_rtt = false;
+	conn->rto = rs__clamp_rto(conn, conn->timeout);
+	conn->rto_backoff_time = 0;
+}
+
+
+uint64_t
+rs_get_timeout(rs_conn_t *conn)
+{
+	return rs__rto(conn);
+}
@@ -0,0 +1,270 @@
+/**
+ * Vectored reads and writes which gather many segments into as few requests as
+ * possible and report their completion with a single callback.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+struct rs__rwv;
+
+/**
+ * A run of consecutive segments which are read/written by a single request.
+ */
+typedef struct {
+	// The vectored read/write this run belongs to
+	struct rs__rwv *rwv;
+	
+	// The index of the first segment in the run and the number of segments
+	unsigned int first_seg;
+	unsigned int n_segs;
+	
+	// A temporary buffer holding the data of the whole run or NULL if the
+	// segments' buffers are adjacent and thus used directly.
+	char *bounce;
+} rs__rwv_run_t;
+
+
+/**
+ * State of a vectored read/write.
+ */
+typedef struct rs__rwv {
+	// The number of runs yet to complete
+	unsigned int n_pending;
+	
+	// Is this a write?
+	bool write;
+	
+	// The error of the first segment to fail (or 0)
+	int error;
+	
+	// The group every run is queued as part of
+	rs__group_t group;
+	
+	// The user's connection, segments, callback and callback data
+	rs_conn_t *conn;
+	rs_rw_seg_t *segs;
+	unsigned int n_segs;
+	rs_rwv_cb cb;
+	void *cb_data;
+	
+	// One entry per run (at most one per segment)
+	rs__rwv_run_t runs[];
+} rs__rwv_t;
+
+
+/**
+ * Release one of the pending runs (or the hold taken while queueing), calling
+ * the user's callback once none remain.
+ */
+static void
+rs__rwv_release(rs__rwv_t *rwv)
+{
+	if (--rwv->n_pending)
+		return;
+	
+	// Copy what is needed before freeing the state since the callback may make
+	// further requests.
+	rs__rwv_t done = *rwv;
+	free(rwv);
+	done.cb(done.conn, done.error, done.segs, done.n_segs, done.cb_data);
+}
+
+
+/**
+ * Callback on completion of a single run of a vectored read/write.
+ */
+static void
+rs__rwv_run_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+               void *cb_data)
+{
+	rs__rwv_run_t *run = (rs__rwv_run_t *)cb_data;
+	rs__rwv_t *rwv = run->rwv;
+	
+	if (error && !rwv->error)
+		rwv->error = error;
+	
+	// Record the result against every segment in the run (copying read data out
+	// of the temporary buffer)
+	size_t offset = 0;
+	unsigned int i;
+	for (i = run->first_seg; i < run->first_seg + run->n_segs; i++) {
+		rs_rw_seg_t *seg = &(rwv->segs[i]);
+		seg->error = error;
+		seg->cmd_rc = cmd_rc;
+		if (run->bounce && !rwv->write && !error)
+			memcpy(seg->data.base, run->bounce + offset, seg->data.len);
+		offset += seg->data.len;
+	}
+	free(run->bounce);
+	
+	rs__rwv_release(rwv);
+}
+
+
+/**
+ * Can a segment be read/written by the same request as the one before it?
+ */
+static bool
+rs__rwv_adjacent(const rs_rw_seg_t *prev, const rs_rw_seg_t *seg)
+{
+	return prev->dest_addr == seg->dest_addr &&
+	       prev->dest_cpu == seg->dest_cpu &&
+	       prev->address + prev->data.len == seg->address;
+}
+
+
+/**
+ * Queue a single run of segments.
+ *
+ * @returns 0 if successfully queued, non-zero otherwise.
+ */
+static int
+rs__rwv_queue_run(rs__rwv_t *rwv, rs__rwv_run_t *run)
+{
+	rs_rw_seg_t *segs = &(rwv->segs[run->first_seg]);
+	
+	// Work out the total length and whether the buffers are adjacent too
+	size_t len = 0;
+	bool contiguous = true;
+	unsigned int i;
+	for (i = 0; i < run->n_segs; i++) {
+		if (i > 0 && segs[i - 1].data.base + segs[i - 1].data.len !=
+		             segs[i].data.base)
+			contiguous = false;
+		len += segs[i].data.len;
+	}
+	
+	uv_buf_t data;
+	data.len = len;
+	run->bounce = NULL;
+	if (contiguous) {
+		data.base = segs[0].data.base;
+	} else {
+		run->bounce = malloc(len);
+		if (!run->bounce)
+			return -1;
+		data.base = run->bounce;
+		
+		// Gather the data to write
+		if (rwv->write) {
+			size_t offset = 0;
+			for (i = 0; i < run->n_segs; i++) {
+				memcpy(run->bounce + offset, segs[i].data.base, segs[i].data.len);
+				offset += segs[i].data.len;
+			}
+		}
+	}
+	
+	int (*rw_fn)(rs_conn_t *, uint16_t, uint8_t, uint32_t, uv_buf_t,
+	             rs_rw_cb, void *) = rwv->write ? rs_write : rs_read;
+	rwv->conn->next_group = &(rwv->group);
+	if (rw_fn(rwv->conn, segs[0].dest_addr, segs[0].dest_cpu,
+	          segs[0].address, data, rs__rwv_run_cb, run)) {
+		free(run->bounce);
+		return -1;
+	}
+	
+	return 0;
+}
+
+
+/**
+ * Queue a vectored read or write.
+ */
+static int
+rs__rwv(rs_conn_t *conn,
+        bool write,
+        rs_rw_seg_t *segs,
+        unsigned int n_segs,
+        rs_rwv_cb cb,
+        void *cb_data)
+{
+	rs__rwv_t *rwv = malloc(sizeof(rs__rwv_t) + n_segs * sizeof(rs__rwv_run_t));
+	if (!rwv)
+		return -1;
+	rwv->n_pending = 1; // Held until all runs are queued
+	rwv->write = write;
+	rwv->error = 0;
+	rwv->conn = conn;
+	rwv->segs = segs;
+	rwv->n_segs = n_segs;
+	rwv->cb = cb;
+	rwv->cb_data = cb_data;
+	rs__group_init(conn, &(rwv->group));
+	
+	unsigned int i;
+	for (i = 0; i < n_segs; i++)
+		segs[i].error = 0;
+	
+	// Queue each run of adjacent segments as a single read/write
+	unsigned int n_runs = 0;
+	unsigned int first_seg = 0;
+	while (first_seg < n_segs) {
+		rs__rwv_run_t *run = &(rwv->runs[n_runs]);
+		run->rwv = rwv;
+		run->first_seg = first_seg;
+		run->n_segs = 1;
+		while (first_seg + run->n_segs < n_segs &&
+		       rs__rwv_adjacent(&(segs[first_seg + run->n_segs - 1]),
+		                        &(segs[first_seg + run->n_segs])))
+			run->n_segs++;
+		
+		// Counted before queueing in case the run fails immediately
+		rwv->n_pending++;
+		if (rs__rwv_queue_run(rwv, run)) {
+			rwv->n_pending--;
+			
+			// Couldn't queue any more runs, fail the remaining segments once those
+			// queued complete
+			if (n_runs == 0) {
+				free(rwv);
+				return -1;
+			}
+			rwv->error = UV_ENOMEM;
+			for (i = first_seg; i < n_segs; i++)
+				segs[i].error = UV_ENOMEM;
+			break;
+		}
+		
+		n_runs++;
+		first_seg += run->n_segs;
+	}
+	
+	// Release the hold on completion
+	rs__rwv_release(rwv);
+	
+	return 0;
+}
+
+
+int
+rs_writev(rs_conn_t *conn,
+          rs_rw_seg_t *segs,
+          unsigned int n_segs,
+          rs_rwv_cb cb,
+          void *cb_data)
+{
+	return rs__rwv(conn, true, segs, n_segs, cb, cb_data);
+}
+
+
+int
+rs_readv(rs_conn_t *conn,
+         rs_rw_seg_t *segs,
+         unsigned int n_segs,
+         rs_rwv_cb cb,
+         void *cb_data)
+{
+	return rs__rwv(conn, false, segs, n_segs, cb, cb_data);
+}
@@ -13,24 +13,25 @@
 
 
 /**
- * Format of an SDP and SCP packet header.
+ * Pack the SDP header and the SCP cmd_rc field.
  */
-typedef struct {
-	// SDP headder
-	uint8_t flags;
-	uint8_t tag;
-	uint8_t dest_port_cpu;
-	uint8_t srce_port_cpu;
-	uint16_t dest_addr;
-	uint16_t srce_addr;
+static void
+rs__pack_sdp_scp_header(char *buf,
+                        uint16_t dest_addr,
+                        uint8_t dest_cpu,
+                        uint16_t cmd_rc)
+{
+	// SDP header
+	buf[RS__SDP_OFFSET_FLAGS] = (char)0x87;  // Always require a reply
+	buf[RS__SDP_OFFSET_TAG] = (char)0xFF;
+	buf[RS__SDP_OFFSET_DEST_PORT_CPU] = (char)(dest_cpu & 0x1F);  // Port zero
+	buf[RS__SDP_OFFSET_SRCE_PORT_CPU] = (char)0xFF;
+	rs__put_le16(buf + RS__SDP_OFFSET_DEST_ADDR, dest_addr);
+	rs__put_le16(buf + RS__SDP_OFFSET_SRCE_ADDR, 0);  // (0, 0)
 	
-	// SCP headder
-	uint16_t cmd_rc;
-	uint16_t seq_num;
-	uint32_t arg1;
-	uint32_t arg2;
-	uint32_t arg3;
-} sdp_scp_header_t;
+	// SCP header
+	rs__put_le16(buf + RS__SCP_OFFSET_CMD_RC, cmd_rc);
+}
 
 
 rs__scp_rw_type_t
@@ -45,6 +46,16 @@ rs__scp_rw_type(uint32_t address, uint32_t length)
 }
 
 
+void
+rs__pack_rw_template(char *buf,
+                     uint16_t dest_addr,
+                     uint8_t dest_cpu,
+                     uint16_t cmd_rc)
+{
+	rs__pack_sdp_scp_header(buf, dest_addr, dest_cpu, cmd_rc);
+}
+
+
 void
 rs__pack_scp_packet(uv_buf_t *buf,
                     size_t scp_data_length,
@@ -58,26 +69,15 @@ rs__pack_scp_packet(uv_buf_t *buf,
                     uint32_t arg3,
                     uv_buf_t data)
 {
-	// Set up the header
-	sdp_scp_header_t header;
-	
-	// SDP header
-	header.flags = 0x87;  // Always require a reply
-	header.tag = 0xFF;
-	header.dest_port_cpu = dest_cpu & 0x1F;  // Port zero
-	header.srce_port_cpu = 0xFF;
-	header.dest_addr = dest_addr;
-	header.srce_addr = 0;  // (0, 0)
-	
-	// SCP header
-	header.cmd_rc = cmd_rc;
-	header.seq_num = seq_num;
-	header.arg1 = arg1;
-	header.arg2 = arg2;
-	header.arg3 = arg3;
-	
-	// Copy the header into the buffer
-	memcpy(buf->base, &header, sizeof(sdp_scp_header_t));
+	// Pack the header
+	rs__pack_sdp_scp_header(buf->base, dest_addr, dest_cpu, cmd_rc);
+	rs__put_le16(buf->base + RS__SCP_OFFSET_SEQ_NUM, seq_num);
+	if (n_args >= 1)
+		rs__put_le32(buf->base + RS__SCP_OFFSET_ARG(1), arg1);
+	if (n_args >= 2)
+		rs__put_le32(buf->base + RS__SCP_OFFSET_ARG(2), arg2);
+	if (n_args >= 3)
+		rs__put_le32(buf->base + RS__SCP_OFFSET_ARG(3), arg3);
 	
 	// Truncate the payload
 	data.len = MIN(data.len, scp_data_length);
@@ -94,8 +94,7 @@ rs__pack_scp_packet(uv_buf_t *buf,
 uint16_t
 rs__unpack_scp_packet_seq_num(uv_buf_t buf)
 {
-	sdp_scp_header_t *header = (sdp_scp_header_t *)buf.base;
-	return header->seq_num;
+	return rs__get_le16(buf.base + RS__SCP_OFFSET_SEQ_NUM);
 }
 
 
@@ -109,11 +108,9 @@ rs__unpack_scp_packet(uv_buf_t buf,
                       uint32_t *arg3,
                       uv_buf_t *data)
 {
-	sdp_scp_header_t *header = (sdp_scp_header_t *)buf.base;
-	
 	// Unpack basic SCP fields
-	*cmd_rc = header->cmd_rc;
-	*seq_num = header->seq_num;
+	*cmd_rc = rs__get_le16(buf.base + RS__SCP_OFFSET_CMD_RC);
+	*seq_num = rs__get_le16(buf.base + RS__SCP_OFFSET_SEQ_NUM);
 	
 	// Truncate n_args if the packet is too short
 	if (buf.len <= RS__SIZEOF_SCP_PACKET(0, 0))
@@ -127,11 +124,11 @@ rs__unpack_scp_packet(uv_buf_t buf,
 	
 	// Unpack arguments (if present)
 	if (*n_args >= 1)
-		*arg1 = header->arg1;
+		*arg1 = rs__get_le32(buf.base + RS__SCP_OFFSET_ARG(1));
 	if (*n_args >= 2)
-		*arg2 = header->arg2;
+		*arg2 = rs__get_le32(buf.base + RS__SCP_OFFSET_ARG(2));
 	if (*n_args >= 3)
-		*arg3 = header->arg3;
+		*arg3 = rs__get_le32(buf.base + RS__SCP_OFFSET_ARG(3));
 	
 	// Setup the pointers to the data
 	data->base = buf.base + RS__SIZEOF_SCP_PACKET(*n_args, 0);
@@ -30,12 +30,29 @@
 	)
 
 
+/**
+ * Byte offsets of the fields of an SCP packet wrapped in an SDP packet. All
+ * multi-byte fields are little-endian.
+ */
+#define RS__SDP_OFFSET_FLAGS 0
+#define RS__SDP_OFFSET_TAG 1
+#define RS__SDP_OFFSET_DEST_PORT_CPU 2
+#define RS__SDP_OFFSET_SRCE_PORT_CPU 3
+#define RS__SDP_OFFSET_DEST_ADDR 4
+#define RS__SDP_OFFSET_SRCE_ADDR 6
+#define RS__SCP_OFFSET_CMD_RC 8
+#define RS__SCP_OFFSET_SEQ_NUM 10
+#define RS__SCP_OFFSET_ARG(n) (12 + (4 * ((n) - 1)))
+
+
 /**
  * SCP cmd_rc numbers.
  */
 typedef enum {
+	RS__SCP_CMD_VER = 0,
 	RS__SCP_CMD_READ = 2,
 	RS__SCP_CMD_WRITE = 3,
+	RS__SCP_CMD_FILL = 5,
 	RS__SCP_CMD_OK = 128,
 } rs__scp_cmd_rc_t;
 
@@ -50,6 +67,44 @@ typedef enum {
 } rs__scp_rw_type_t;
 
 
+/**
+ * Read and write little-endian fields in a packet buffer (regardless of the
+ * host's byte order or alignment requirements).
+ */
+static inline void
+rs__put_le16(char *buf, uint16_t value)
+{
+	buf[0] = (char)(value & 0xFF);
+	buf[1] = (char)((value >> 8) & 0xFF);
+}
+
+static inline void
+rs__put_le32(char *buf, uint32_t value)
+{
+	buf[0] = (char)(value & 0xFF);
+	buf[1] = (char)((value >> 8) & 0xFF);
+	buf[2] = (char)((value >> 16) & 0xFF);
+	buf[3] = (char)((value >> 24) & 0xFF);
+}
+
+static inline uint16_t
+rs__get_le16(const char *buf)
+{
+	const uint8_t *b = (const uint8_t *)buf;
+	return (uint16_t)(b[0] | (b[1] << 8));
+}
+
+static inline uint32_t
+rs__get_le32(const char *buf)
+{
+	const uint8_t *b = (const uint8_t *)buf;
+	return (uint32_t)b[0] |
+	       ((uint32_t)b[1] << 8) |
+	       ((uint32_t)b[2] << 16) |
+	       ((uint32_t)b[3] << 24);
+}
+
+
 /**
  * Given an address and read/write length, select the appropriate read/write
  * type.
@@ -89,6 +144,70 @@ void rs__pack_scp_packet(uv_buf_t *buf,
                          uv_buf_t data);
 
 
+/**
+ * Pack the parts of a CMD_READ/CMD_WRITE packet header which are the same for
+ * every packet of a read/write: the SDP header and SCP cmd_rc. The remaining
+ * fields are filled in for each packet using rs__pack_rw_packet.
+ *
+ * @param buf A buffer with space for at least RS__SIZEOF_SCP_PACKET(3, 0)
+ *            bytes.
+ * @param dest_addr The chip to send the packet to (x<<8 | y).
+ * @param dest_cpu The core to send the packet to.
+ * @param cmd_rc RS__SCP_CMD_READ or RS__SCP_CMD_WRITE.
+ */
+void rs__pack_rw_template(char *buf,
+                          uint16_t dest_addr,
+                          uint8_t dest_cpu,
+                          uint16_t cmd_rc);
+
+
+/**
+ * Complete a read/write packet header previously set up by
+ * rs__pack_rw_template with the fields which differ between packets. The
+ * packet has exactly three arguments and its length is always
+ * RS__SIZEOF_SCP_PACKET(3, 0) (any write data is sent from elsewhere).
+ *
+ * @param buf The buffer containing the template.
+ * @param seq_num The sequence number of the packet
+ * @param address The address to read/write (arg1)
+ * @param length The number of bytes to read/write (arg2)
+ * @param type The unit size of the read/write (arg3)
+ */
+static inline void
+rs__pack_rw_packet(char *buf,
+                   uint16_t seq_num,
+                   uint32_t address,
+                   uint32_t length,
+                   rs__scp_rw_type_t type)
+{
+	rs__put_le16(buf + RS__SCP_OFFSET_SEQ_NUM, seq_num);
+	rs__put_le32(buf + RS__SCP_OFFSET_ARG(1), address);
+	rs__put_le32(buf + RS__SCP_OFFSET_ARG(2), length);
+	rs__put_le32(buf + RS__SCP_OFFSET_ARG(3), (uint32_t)type);
+}
+
+
+/**
+ * Unpack a response to a CMD_READ/CMD_WRITE packet. Such responses have no
+ * arguments and, for reads, the data read as their payload.
+ *
+ * Warning: It is the caller's responsibility to check that the packet is at
+ * least RS__SIZEOF_SCP_PACKET(0, 0) bytes long.
+ *
+ * @param buf The buffer containing the packet.
+ * @param data A buffer whose base and length will be set according to the size
+ *             of the payload, pointing within the supplied buffer.
+ * @returns The response's cmd_rc.
+ */
+static inline uint16_t
+rs__unpack_rw_response(uv_buf_t buf, uv_buf_t *data)
+{
+	data->base = buf.base + RS__SIZEOF_SCP_PACKET(0, 0);
+	data->len = buf.len - RS__SIZEOF_SCP_PACKET(0, 0);
+	return rs__get_le16(buf.base + RS__SCP_OFFSET_CMD_RC);
+}
+
+
 /**
  * Unpack the sequence number from an SCP packet in a buffer.
  *
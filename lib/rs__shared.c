@@ -0,0 +1,347 @@
+/**
+ * Shared transports: a single UDP socket used by many connections.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+#include <rs__scp.h>
+
+
+/**
+ * Do two socket addresses refer to the same address and port?
+ */
+static bool
+rs__sockaddr_eq(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return false;
+	
+	if (a->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+		return a6->sin6_port == b6->sin6_port &&
+		       memcmp(&(a6->sin6_addr), &(b6->sin6_addr),
+		              sizeof(a6->sin6_addr)) == 0;
+	} else {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+		return a4->sin_port == b4->sin_port &&
+		       a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	}
+}
+
+
+/**
+ * Hash a socket's address and port.
+ */
+static uint32_t
+rs__sockaddr_hash(const struct sockaddr *addr)
+{
+	uint32_t hash;
+	if (addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)addr;
+		uint32_t words[4];
+		memcpy(words, &(a6->sin6_addr), sizeof(words));
+		hash = words[0] ^ words[1] ^ words[2] ^ words[3] ^ a6->sin6_port;
+	} else {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *)addr;
+		hash = a4->sin_addr.s_addr ^ ((uint32_t)a4->sin_port << 16);
+	}
+	
+	// Mix the bits such that the low bits used to select a bucket depend on the
+	// whole address (Knuth's multiplicative hash)
+	hash *= 2654435761u;
+	return hash ^ (hash >> 16);
+}
+
+
+/**
+ * Get the bucket of a transport's table of connections for an address.
+ */
+static rs_conn_t **
+rs__transport_bucket(rs_transport_t *transport, const struct sockaddr *addr)
+{
+	return &(transport->conns[rs__sockaddr_hash(addr) & transport->conns_mask]);
+}
+
+
+/**
+ * Find the connection a datagram received from the given address is destined
+ * for.
+ *
+ * When several connections share the address, the one awaiting a response
+ * with the datagram's sequence number is chosen (see rs__assign_seq_num).
+ *
+ * @returns NULL if no connection uses the address or, when several do, if none
+ *          is awaiting the datagram (e.g. a late duplicate response), in which
+ *          case it is dropped.
+ */
+static rs_conn_t *
+rs__transport_find_conn(rs_transport_t *transport,
+                        const struct sockaddr *addr,
+                        uv_buf_t buf, ssize_t nread)
+{
+	rs_conn_t *conn;
+	for (conn = *rs__transport_bucket(transport, addr);
+	     conn;
+	     conn = conn->transport_next)
+		if (rs__sockaddr_eq(conn->addr, addr))
+			break;
+	
+	// Only one connection uses most addresses
+	if (!conn || conn->transport_sibling == conn)
+		return conn;
+	
+	if (nread < RS__SIZEOF_SCP_PACKET(0, 0) + 2)
+		return NULL;
+	uint16_t seq_num = rs__get_le16(buf.base + 2 + RS__SCP_OFFSET_SEQ_NUM);
+	rs_conn_t *sibling = conn;
+	do {
+		if (rs__find_outstanding(sibling, seq_num))
+			return sibling;
+		sibling = sibling->transport_sibling;
+	} while (sibling != conn);
+	
+	return NULL;
+}
+
+
+/**
+ * Double the number of buckets in a transport's table of connections. If out
+ * of memory, the table is left as it is.
+ */
+static void
+rs__transport_grow(rs_transport_t *transport)
+{
+	unsigned int n_buckets = (transport->conns_mask + 1) * 2;
+	rs_conn_t **conns = calloc(n_buckets, sizeof(rs_conn_t *));
+	if (!conns)
+		return;
+	
+	rs_conn_t **old_conns = transport->conns;
+	unsigned int old_n_buckets = transport->conns_mask + 1;
+	transport->conns = conns;
+	transport->conns_mask = n_buckets - 1;
+	
+	unsigned int i;
+	for (i = 0; i < old_n_buckets; i++) {
+		while (old_conns[i]) {
+			rs_conn_t *conn = old_conns[i];
+			old_conns[i] = conn->transport_next;
+			
+			rs_conn_t **bucket = rs__transport_bucket(transport, conn->addr);
+			conn->transport_next = *bucket;
+			*bucket = conn;
+		}
+	}
+	
+	free(old_conns);
+}
+
+
+void
+rs__transport_add(rs_transport_t *transport, rs_conn_t *conn)
+{
+	// Keep the table no more than fully loaded
+	if (transport->n_conns >= transport->conns_mask + 1)
+		rs__transport_grow(transport);
+	
+	rs_conn_t **bucket = rs__transport_bucket(transport, conn->addr);
+	
+	// Join any other connections sharing the address
+	rs_conn_t *other;
+	for (other = *bucket; other; other = other->transport_next) {
+		if (rs__sockaddr_eq(other->addr, conn->addr)) {
+			conn->transport_sibling = other->transport_sibling;
+			other->transport_sibling = conn;
+			break;
+		}
+	}
+	
+	conn->transport_next = *bucket;
+	*bucket = conn;
+	transport->n_conns++;
+}
+
+
+void
+rs__transport_remove(rs_transport_t *transport, rs_conn_t *conn)
+{
+	rs_conn_t **link = rs__transport_bucket(transport, conn->addr);
+	while (*link && *link != conn)
+		link = &((*link)->transport_next);
+	
+	if (*link) {
+		*link = conn->transport_next;
+		conn->transport_next = NULL;
+		transport->n_conns--;
+		
+		// Leave the list of connections sharing the address
+		rs_conn_t *prev = conn;
+		while (prev->transport_sibling != conn)
+			prev = prev->transport_sibling;
+		prev->transport_sibling = conn->transport_sibling;
+		conn->transport_sibling = conn;
+	}
+}
+
+
+/**
+ * Callback on closing a transport's UDP handle: frees the transport.
+ */
+static void
+rs__transport_udp_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_transport_t *transport = (rs_transport_t *)handle->data;
+	
+	rs_free_cb cb = transport->free_cb;
+	void *cb_data = transport->free_cb_data;
+	
+	free(transport->recv_buf);
+	free(transport->conns);
+	free(transport);
+	
+	if (cb)
+		cb(cb_data);
+}
+
+
+/**
+ * Close the transport's socket (and then free the transport) if it has been
+ * freed and no longer has any connections.
+ */
+static void
+rs__transport_try_free(rs_transport_t *transport)
+{
+	if (transport->free && !transport->n_users &&
+	    !uv_is_closing((uv_handle_t *)&(transport->udp_handle)))
+		uv_close((uv_handle_t *)&(transport->udp_handle),
+		         rs__transport_udp_handle_closed_cb);
+}
+
+
+void
+rs__transport_conn_freed(rs_transport_t *transport)
+{
+	transport->n_users--;
+	rs__transport_try_free(transport);
+}
+
+
+/**
+ * Allocate the transport's receive buffer for an arriving datagram.
+ */
+static void
+rs__transport_recv_alloc_cb(uv_handle_t *handle,
+                            size_t suggested_size, uv_buf_t *buf)
+{
+	rs_transport_t *transport = (rs_transport_t *)handle->data;
+	buf->base = transport->recv_buf;
+	buf->len = RS__TRANSPORT_RECV_BUF_SIZE;
+}
+
+
+/**
+ * Callback when a datagram arrives on a transport's socket: passes it to the
+ * connection it is destined for.
+ */
+static void
+rs__transport_recv_cb(uv_udp_t *handle,
+                      ssize_t nread, const uv_buf_t *buf,
+                      const struct sockaddr *addr,
+                      unsigned int flags)
+{
+	rs_transport_t *transport = (rs_transport_t *)handle->data;
+	
+	// Nothing to do when libuv indicates there is no more data (addr is NULL)
+	// or on error (which, as for other connections, is ignored).
+	if (nread < 0 || !addr)
+		return;
+	
+	// Datagrams from unknown addresses are ignored
+	rs_conn_t *conn = rs__transport_find_conn(transport, addr, *buf, nread);
+	if (!conn)
+		return;
+	
+	conn->batch_stats.n_recv_syscalls++;
+	conn->batch_stats.n_recv_packets++;
+	
+	// Packets which were too large for the receive buffer cannot be valid
+	// responses and are ignored.
+	if (!(flags & UV_UDP_PARTIAL))
+		rs__recv_datagram(conn, *buf, nread);
+	else
+		conn->stats.n_dropped_malformed++;
+}
+
+
+rs_transport_t *
+rs_transport_init(uv_loop_t *loop, int family)
+{
+	rs_transport_t *transport = malloc(sizeof(rs_transport_t));
+	if (!transport)
+		return NULL;
+	
+	transport->loop = loop;
+	transport->n_conns = 0;
+	transport->n_users = 0;
+	transport->free = false;
+	transport->free_cb = NULL;
+	transport->free_cb_data = NULL;
+	
+	transport->next_seq_num = 0;
+	transport->conns_mask = RS__TRANSPORT_MIN_BUCKETS - 1;
+	transport->conns = calloc(RS__TRANSPORT_MIN_BUCKETS, sizeof(rs_conn_t *));
+	transport->recv_buf = malloc(RS__TRANSPORT_RECV_BUF_SIZE);
+	if (!transport->conns || !transport->recv_buf ||
+	    uv_udp_init(loop, &(transport->udp_handle))) {
+		free(transport->conns);
+		free(transport->recv_buf);
+		free(transport);
+		return NULL;
+	}
+	transport->udp_handle.data = (void *)transport;
+	
+	// Bind the socket to an arbitrary local port and start receiving. From here
+	// on, the transport is freed asynchronously on failure since its handle must
+	// be closed.
+	struct sockaddr_storage local_addr;
+	int err;
+	if (family == AF_INET6)
+		err = uv_ip6_addr("::", 0, (struct sockaddr_in6 *)&local_addr);
+	else
+		err = uv_ip4_addr("0.0.0.0", 0, (struct sockaddr_in *)&local_addr);
+	if (!err)
+		err = uv_udp_bind(&(transport->udp_handle),
+		                  (struct sockaddr *)&local_addr, 0);
+	if (!err)
+		err = uv_udp_recv_start(&(transport->udp_handle),
+		                        rs__transport_recv_alloc_cb,
+		                        rs__transport_recv_cb);
+	if (err) {
+		rs_transport_free(transport, NULL, NULL);
+		return NULL;
+	}
+	
+	return transport;
+}
+
+
+void
+rs_transport_free(rs_transport_t *transport, rs_free_cb cb, void *cb_data)
+{
+	transport->free = true;
+	transport->free_cb = cb;
+	transport->free_cb_data = cb_data;
+	rs__transport_try_free(transport);
+}
@@ -0,0 +1,72 @@
+/**
+ * Connection statistics.
+ */
+
+#include <sys/socket.h>
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+rs_traffic_stats_t *
+rs__stats_traffic(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	switch (os->type) {
+		case RS__REQ_READ:
+			return &(conn->stats.read);
+		
+		case RS__REQ_WRITE:
+		case RS__REQ_FILL:
+			return &(conn->stats.write);
+		
+		default:
+			return &(conn->stats.scp_packet);
+	}
+}
+
+
+void
+rs__stats_rtt(rs_conn_t *conn, uint64_t rtt)
+{
+	// Find the histogram bucket: floor(log2(usec))
+	uint64_t us = rtt / 1000;
+	unsigned int bucket = 0;
+	while ((us >>= 1) && bucket < RS_N_RTT_BUCKETS - 1)
+		bucket++;
+	conn->stats.rtt_histogram[bucket]++;
+	
+	if (!conn->stats.n_rtt_samples || rtt < conn->stats.rtt_min)
+		conn->stats.rtt_min = rtt;
+	if (rtt > conn->stats.rtt_max)
+		conn->stats.rtt_max = rtt;
+	conn->stats.rtt_total += rtt;
+	conn->stats.n_rtt_samples++;
+}
+
+
+void
+rs_get_stats(rs_conn_t *conn, rs_stats_t *stats)
+{
+	*stats = conn->stats;
+	stats->syscalls = conn->batch_stats;
+	
+	stats->queue_depth = rs__q_length(conn->request_queue) +
+	                     rs__q_length(conn->hp_request_queue) +
+	                     conn->n_active_rws;
+	stats->n_in_flight = conn->n_slots_in_use;
+	stats->window = rs_get_window(conn);
+}
+
+
+void
+rs_reset_stats(rs_conn_t *conn)
+{
+	memset(&(conn->stats), 0, sizeof(conn->stats));
+	memset(&(conn->batch_stats), 0, sizeof(conn->batch_stats));
+}
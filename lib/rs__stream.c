@@ -0,0 +1,246 @@
+/**
+ * Streaming reads which deliver data in order through a bounded ring of
+ * buffers.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+static void rs__stream_process(rs_stream_t *stream);
+
+
+/**
+ * Callback on completion of the read of a single chunk.
+ */
+static void
+rs__stream_read_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+                   void *cb_data)
+{
+	rs__stream_buf_t *buf = (rs__stream_buf_t *)cb_data;
+	rs_stream_t *stream = buf->stream;
+	
+	stream->n_reading--;
+	
+	// Once the stream has failed, the remaining chunks are simply discarded
+	if (stream->failed) {
+		buf->state = RS__STREAM_BUF_FREE;
+	} else {
+		buf->state = RS__STREAM_BUF_READY;
+		buf->error = error;
+		buf->cmd_rc = cmd_rc;
+	}
+	
+	rs__stream_process(stream);
+}
+
+
+/**
+ * Deliver the next chunk if it (and all before it) have been read.
+ *
+ * @returns true if a callback was made.
+ */
+static bool
+rs__stream_deliver(rs_stream_t *stream)
+{
+	if (stream->failed || stream->next_deliver == stream->next_read)
+		return false;
+	
+	rs__stream_buf_t *buf =
+		&(stream->bufs[stream->next_deliver % stream->n_bufs]);
+	if (buf->state != RS__STREAM_BUF_READY)
+		return false;
+	
+	stream->next_deliver++;
+	
+	if (buf->error) {
+		// Report the failure as the final callback
+		stream->failed = true;
+		buf->state = RS__STREAM_BUF_FREE;
+		uv_buf_t empty;
+		empty.base = NULL;
+		empty.len = 0;
+		stream->cb(stream->conn, stream, buf->error, buf->cmd_rc,
+		           buf->address, empty, true, stream->cb_data);
+	} else {
+		buf->state = RS__STREAM_BUF_HELD;
+		stream->n_held++;
+		stream->cb(stream->conn, stream, 0, 0, buf->address, buf->data,
+		           stream->next_deliver == stream->n_chunks, stream->cb_data);
+	}
+	
+	return true;
+}
+
+
+/**
+ * Start reading the next chunk if its buffer is free.
+ *
+ * @returns true if a read was started (or failed to start).
+ */
+static bool
+rs__stream_read(rs_stream_t *stream)
+{
+	if (stream->failed || stream->next_read == stream->n_chunks)
+		return false;
+	
+	rs__stream_buf_t *buf = &(stream->bufs[stream->next_read % stream->n_bufs]);
+	if (buf->state != RS__STREAM_BUF_FREE)
+		return false;
+	
+	size_t offset = stream->next_read * stream->chunk_size;
+	buf->address = stream->address + offset;
+	buf->data.len = MIN(stream->chunk_size, stream->length - offset);
+	stream->next_read++;
+	
+	buf->state = RS__STREAM_BUF_READING;
+	stream->n_reading++;
+	
+	// Nothing more is read once the stream's group has been cancelled (or its
+	// connection freed)
+	int error = stream->group->error;
+	if (!error) {
+		stream->conn->next_group = stream->group;
+		if (rs_read(stream->conn, stream->dest_addr, stream->dest_cpu,
+		            buf->address, buf->data, rs__stream_read_cb, buf))
+			error = UV_ENOMEM;
+	}
+	if (error) {
+		// Fail the stream when this chunk comes to be delivered
+		stream->n_reading--;
+		buf->state = RS__STREAM_BUF_READY;
+		buf->error = error;
+		buf->cmd_rc = 0;
+	}
+	
+	return true;
+}
+
+
+/**
+ * Deliver as many chunks and start as many reads as possible, freeing the
+ * stream once it is finished with.
+ */
+static void
+rs__stream_process(rs_stream_t *stream)
+{
+	// Callbacks made below may release buffers or complete reads, the work
+	// resulting from which is picked up by the loop below.
+	if (stream->processing)
+		return;
+	stream->processing = true;
+	
+	bool progress;
+	do {
+		progress = false;
+		while (rs__stream_deliver(stream))
+			progress = true;
+		while (rs__stream_read(stream))
+			progress = true;
+	} while (progress);
+	
+	stream->processing = false;
+	
+	// Once nothing more will be read, there is nothing left to cancel
+	if (stream->group == &(stream->own_group) && !stream->n_reading &&
+	    (stream->failed || stream->next_read == stream->n_chunks))
+		rs__group_unregister(stream->conn, stream->group);
+	
+	bool finished = stream->failed || stream->next_deliver == stream->n_chunks;
+	if (finished && !stream->n_reading && !stream->n_held) {
+		free(stream->buf_data);
+		free(stream->bufs);
+		free(stream);
+	}
+}
+
+
+int
+rs_read_stream(rs_conn_t *conn,
+               uint16_t dest_addr,
+               uint8_t dest_cpu,
+               uint32_t address,
+               size_t length,
+               size_t chunk_size,
+               unsigned int n_bufs,
+               rs_stream_cb cb,
+               void *cb_data)
+{
+	// A stream started as part of another operation (see rs_read_to_fd) joins
+	// its group rather than having its own
+	rs__group_t *group = rs__group_take(conn);
+	
+	if (!length || !n_bufs)
+		return -1;
+	
+	if (!chunk_size)
+		chunk_size = conn->n_outstanding * conn->scp_data_length;
+	
+	rs_stream_t *stream = malloc(sizeof(rs_stream_t));
+	if (!stream)
+		return -1;
+	stream->buf_data = malloc(n_bufs * chunk_size);
+	stream->bufs = malloc(n_bufs * sizeof(rs__stream_buf_t));
+	if (!stream->buf_data || !stream->bufs) {
+		free(stream->buf_data);
+		free(stream->bufs);
+		free(stream);
+		return -1;
+	}
+	
+	stream->conn = conn;
+	stream->dest_addr = dest_addr;
+	stream->dest_cpu = dest_cpu;
+	stream->address = address;
+	stream->length = length;
+	stream->chunk_size = chunk_size;
+	stream->n_bufs = n_bufs;
+	stream->n_chunks = (length + chunk_size - 1) / chunk_size;
+	stream->next_read = 0;
+	stream->next_deliver = 0;
+	stream->n_reading = 0;
+	stream->n_held = 0;
+	stream->failed = false;
+	stream->processing = false;
+	stream->cb = cb;
+	stream->cb_data = cb_data;
+	
+	stream->group = group;
+	if (!group) {
+		stream->group = &(stream->own_group);
+		rs__group_init(conn, stream->group);
+		rs__group_register(conn, stream->group);
+	}
+	
+	unsigned int i;
+	for (i = 0; i < n_bufs; i++) {
+		stream->bufs[i].stream = stream;
+		stream->bufs[i].state = RS__STREAM_BUF_FREE;
+		stream->bufs[i].data.base = stream->buf_data + (i * chunk_size);
+	}
+	
+	// Start reading, the callbacks take care of the rest
+	rs__stream_process(stream);
+	
+	return 0;
+}
+
+
+void
+rs_stream_release(rs_stream_t *stream, uv_buf_t data)
+{
+	rs__stream_buf_t *buf =
+		&(stream->bufs[(data.base - stream->buf_data) / stream->chunk_size]);
+	buf->state = RS__STREAM_BUF_FREE;
+	stream->n_held--;
+	
+	rs__stream_process(stream);
+}
@@ -0,0 +1,461 @@
+/**
+ * Thread-safe request submission via a lock-free queue drained on the event
+ * loop thread.
+ */
+
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Push a request onto a lock-free stack (from any thread).
+ *
+ * @returns True if the stack was previously empty.
+ */
+static bool
+rs__ts_push(rs__ts_req_t **stack, rs__ts_req_t *ts)
+{
+	// Once pushed, the request may be popped (and modified) by another thread
+	// at any time and so the old head is tracked separately
+	rs__ts_req_t *head = __atomic_load_n(stack, __ATOMIC_RELAXED);
+	do {
+		ts->next = head;
+	} while (!__atomic_compare_exchange_n(stack, &head, ts, true,
+	                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	return !head;
+}
+
+
+/**
+ * Take every request from a lock-free stack, returning them oldest first.
+ *
+ * Since the whole stack is taken at once, there is no ABA problem.
+ */
+static rs__ts_req_t *
+rs__ts_pop_all(rs__ts_req_t **stack)
+{
+	rs__ts_req_t *ts = __atomic_exchange_n(stack, NULL, __ATOMIC_ACQUIRE);
+	
+	// Reverse the list
+	rs__ts_req_t *oldest = NULL;
+	while (ts) {
+		rs__ts_req_t *next = ts->next;
+		ts->next = oldest;
+		oldest = ts;
+		ts = next;
+	}
+	
+	return oldest;
+}
+
+
+/**
+ * Place a completed request in its callback queue, waking the queue's thread if
+ * the queue was previously empty (if the queue was not empty, the thread has
+ * already been woken and has not yet run the queue).
+ */
+static void
+rs__ts_complete(rs__ts_req_t *ts)
+{
+	rs_cb_queue_t *cb_queue = ts->cb_queue;
+	if (!rs__ts_push(&(cb_queue->completed), ts))
+		return;
+	
+	if (cb_queue->has_async) {
+		uv_async_send(&(cb_queue->async_handle));
+	} else {
+		// Signalling with the mutex held ensures the wakeup cannot fall between a
+		// waiter finding the queue empty and starting to wait
+		uv_mutex_lock(&(cb_queue->mutex));
+		uv_cond_signal(&(cb_queue->cond));
+		uv_mutex_unlock(&(cb_queue->mutex));
+	}
+}
+
+
+/**
+ * Callback on completion of an SCP packet submitted with a callback queue.
+ */
+static void
+rs__ts_scp_packet_cb(rs_conn_t *conn,
+                     int error,
+                     uint16_t cmd_rc,
+                     unsigned int n_args,
+                     uint32_t arg1,
+                     uint32_t arg2,
+                     uint32_t arg3,
+                     uv_buf_t data,
+                     void *cb_data)
+{
+	rs__ts_req_t *ts = (rs__ts_req_t *)cb_data;
+	ts->conn = conn;
+	ts->error = error;
+	ts->cmd_rc = cmd_rc;
+	ts->n_args = n_args;
+	ts->arg1 = arg1;
+	ts->arg2 = arg2;
+	ts->arg3 = arg3;
+	ts->data = data;
+	rs__ts_complete(ts);
+}
+
+
+/**
+ * Callback on completion of a read/write submitted with a callback queue.
+ */
+static void
+rs__ts_rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+             void *cb_data)
+{
+	rs__ts_req_t *ts = (rs__ts_req_t *)cb_data;
+	ts->conn = conn;
+	ts->error = error;
+	ts->cmd_rc = cmd_rc;
+	ts->data = data;
+	rs__ts_complete(ts);
+}
+
+
+/**
+ * Pass a request to the loop thread (from any thread).
+ */
+static void
+rs__ts_submit(rs_conn_t *conn, rs__ts_req_t *ts, rs_handle_t *handle_out)
+{
+	// The handle is allocated now so that the submitting thread may pass it on
+	// (the request may complete as soon as it is pushed below)
+	ts->req.handle = rs__new_handle(conn);
+	if (handle_out)
+		*handle_out = ts->req.handle;
+	
+	// Divert the completion via the callback queue (if one is used)
+	if (ts->cb_queue) {
+		ts->cb_data = ts->req.cb_data;
+		ts->req.cb_data = ts;
+		if (ts->req.type == RS__REQ_SCP_PACKET) {
+			ts->cb.scp_packet = ts->req.data.scp_packet.cb;
+			ts->req.data.scp_packet.cb = rs__ts_scp_packet_cb;
+		} else {
+			ts->cb.rw = ts->req.data.rw.cb;
+			ts->req.data.rw.cb = rs__ts_rw_cb;
+		}
+	}
+	
+	rs__ts_push(&(conn->ts_reqs), ts);
+	
+	// Many signals may be coalesced into a single callback
+	uv_async_send(&(conn->async_handle));
+}
+
+
+void
+rs__async_cb(uv_async_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	if (conn->free)
+		return;
+	
+	// Queue every submitted request before processing the queue once
+	rs__queue_threadsafe(conn);
+	rs__process_request_queue(conn);
+}
+
+
+void
+rs__queue_threadsafe(rs_conn_t *conn)
+{
+	rs__ts_req_t *ts = rs__ts_pop_all(&(conn->ts_reqs));
+	if (!ts)
+		return;
+	
+	// Reserve space for all of the requests in each queue at once. If this
+	// fails, the requests are inserted individually instead (and those for which
+	// there is no memory are cancelled).
+	size_t n_reqs[2] = {0, 0};
+	rs__ts_req_t *counted;
+	for (counted = ts; counted; counted = counted->next)
+		n_reqs[counted->high_priority]++;
+	bool reserved = rs__q_reserve(conn->request_queue, n_reqs[0]) &&
+	                rs__q_reserve(conn->hp_request_queue, n_reqs[1]);
+	size_t n_inserted[2] = {0, 0};
+	
+	while (ts) {
+		rs__ts_req_t *next = ts->next;
+		
+		// Once completed via a callback queue, the request may be freed at any
+		// time by the thread running the queue.
+		rs_cb_queue_t *cb_queue = ts->cb_queue;
+		
+		rs__q_t *queue = ts->high_priority ? conn->hp_request_queue
+		                                   : conn->request_queue;
+		rs__req_t *req;
+		if (reserved)
+			req = (rs__req_t *)rs__q_reserved(
+				queue, n_inserted[ts->high_priority]++);
+		else
+			req = (rs__req_t *)rs__q_insert(queue);
+		if (req) {
+			*req = ts->req;
+			req->deadline = 0;
+		} else {
+			rs__cancel_queued(conn, &(ts->req), UV_ENOMEM);
+		}
+		
+		// When completing via a callback queue, the request is returned to the
+		// queue (and freed from there) on completion
+		if (!cb_queue)
+			free(ts);
+		
+		ts = next;
+	}
+	
+	if (reserved) {
+		rs__q_commit(conn->request_queue, n_reqs[0]);
+		rs__q_commit(conn->hp_request_queue, n_reqs[1]);
+	}
+}
+
+
+void
+rs__cancel_threadsafe(rs_conn_t *conn, int error)
+{
+	rs__ts_req_t *ts = rs__ts_pop_all(&(conn->ts_reqs));
+	while (ts) {
+		rs__ts_req_t *next = ts->next;
+		rs_cb_queue_t *cb_queue = ts->cb_queue;
+		rs__cancel_queued(conn, &(ts->req), error);
+		if (!cb_queue)
+			free(ts);
+		ts = next;
+	}
+}
+
+
+int
+rs_send_scp_threadsafe(rs_conn_t *conn,
+                       rs_cb_queue_t *cb_queue,
+                       rs_priority_t priority,
+                       uint16_t dest_addr,
+                       uint8_t dest_cpu,
+                       uint16_t cmd_rc,
+                       unsigned int n_args_send,
+                       unsigned int n_args_recv,
+                       uint32_t arg1,
+                       uint32_t arg2,
+                       uint32_t arg3,
+                       uv_buf_t data,
+                       size_t data_max_len,
+                       rs_send_scp_cb cb,
+                       void *cb_data,
+                       rs_handle_t *handle_out)
+{
+	rs__ts_req_t *ts = malloc(sizeof(rs__ts_req_t));
+	if (!ts)
+		return -1;
+	
+	ts->high_priority = priority == RS_PRIORITY_HIGH;
+	ts->cb_queue = cb_queue;
+	
+	rs__req_t *req = &(ts->req);
+	req->type = RS__REQ_SCP_PACKET;
+	req->dest_addr = dest_addr;
+	req->dest_cpu = dest_cpu;
+	req->data.scp_packet.cmd_rc = cmd_rc;
+	req->data.scp_packet.n_args_send = n_args_send;
+	req->data.scp_packet.n_args_recv = n_args_recv;
+	req->data.scp_packet.arg1 = arg1;
+	req->data.scp_packet.arg2 = arg2;
+	req->data.scp_packet.arg3 = arg3;
+	req->data.scp_packet.data = data;
+	req->data.scp_packet.data_max_len = data_max_len;
+	req->data.scp_packet.cb = cb;
+	req->cb_data = cb_data;
+	
+	rs__ts_submit(conn, ts, handle_out);
+	
+	return 0;
+}
+
+
+/**
+ * Submit a read or write from any thread.
+ */
+static int
+rs__rw_threadsafe(rs_conn_t *conn,
+                  rs_cb_queue_t *cb_queue,
+                  rs__req_type_t type,
+                  uint16_t dest_addr,
+                  uint8_t dest_cpu,
+                  uint32_t address,
+                  uv_buf_t data,
+                  rs_rw_cb cb,
+                  void *cb_data,
+                  rs_handle_t *handle_out)
+{
+	rs__ts_req_t *ts = malloc(sizeof(rs__ts_req_t));
+	if (!ts)
+		return -1;
+	
+	ts->high_priority = false;
+	ts->cb_queue = cb_queue;
+	
+	rs__req_t *req = &(ts->req);
+	req->type = type;
+	req->dest_addr = dest_addr;
+	req->dest_cpu = dest_cpu;
+	req->data.rw.state = NULL;
+	req->data.rw.address = address;
+	req->data.rw.data = data;
+	req->data.rw.orig_data = data;
+	req->data.rw.coalesced = NULL;
+	req->data.rw.cb = cb;
+	req->cb_data = cb_data;
+	
+	rs__ts_submit(conn, ts, handle_out);
+	
+	return 0;
+}
+
+
+int
+rs_write_threadsafe(rs_conn_t *conn,
+                    rs_cb_queue_t *cb_queue,
+                    uint16_t dest_addr,
+                    uint8_t dest_cpu,
+                    uint32_t address,
+                    uv_buf_t data,
+                    rs_rw_cb cb,
+                    void *cb_data,
+                    rs_handle_t *handle_out)
+{
+	return rs__rw_threadsafe(conn, cb_queue, RS__REQ_WRITE, dest_addr, dest_cpu,
+	                         address, data, cb, cb_data, handle_out);
+}
+
+
+int
+rs_read_threadsafe(rs_conn_t *conn,
+                   rs_cb_queue_t *cb_queue,
+                   uint16_t dest_addr,
+                   uint8_t dest_cpu,
+                   uint32_t address,
+                   uv_buf_t data,
+                   rs_rw_cb cb,
+                   void *cb_data,
+                   rs_handle_t *handle_out)
+{
+	return rs__rw_threadsafe(conn, cb_queue, RS__REQ_READ, dest_addr, dest_cpu,
+	                         address, data, cb, cb_data, handle_out);
+}
+
+
+/**
+ * Run a callback queue belonging to an event loop when woken.
+ */
+static void
+rs__cb_queue_async_cb(uv_async_t *handle)
+{
+	rs_cb_queue_run((rs_cb_queue_t *)handle->data);
+}
+
+
+rs_cb_queue_t *
+rs_cb_queue_init(uv_loop_t *loop)
+{
+	rs_cb_queue_t *cb_queue = malloc(sizeof(rs_cb_queue_t));
+	if (!cb_queue)
+		return NULL;
+	
+	cb_queue->completed = NULL;
+	cb_queue->has_async = loop != NULL;
+	
+	if (loop) {
+		if (uv_async_init(loop, &(cb_queue->async_handle),
+		                  rs__cb_queue_async_cb)) {
+			free(cb_queue);
+			return NULL;
+		}
+		cb_queue->async_handle.data = (void *)cb_queue;
+	} else {
+		if (uv_mutex_init(&(cb_queue->mutex))) {
+			free(cb_queue);
+			return NULL;
+		}
+		if (uv_cond_init(&(cb_queue->cond))) {
+			uv_mutex_destroy(&(cb_queue->mutex));
+			free(cb_queue);
+			return NULL;
+		}
+	}
+	
+	return cb_queue;
+}
+
+
+unsigned int
+rs_cb_queue_run(rs_cb_queue_t *cb_queue)
+{
+	unsigned int n_calls = 0;
+	
+	rs__ts_req_t *ts = rs__ts_pop_all(&(cb_queue->completed));
+	while (ts) {
+		rs__ts_req_t *next = ts->next;
+		
+		if (ts->req.type == RS__REQ_SCP_PACKET)
+			ts->cb.scp_packet(ts->conn, ts->error, ts->cmd_rc, ts->n_args,
+			                  ts->arg1, ts->arg2, ts->arg3, ts->data,
+			                  ts->cb_data);
+		else
+			ts->cb.rw(ts->conn, ts->error, ts->cmd_rc, ts->data, ts->cb_data);
+		
+		free(ts);
+		n_calls++;
+		ts = next;
+	}
+	
+	return n_calls;
+}
+
+
+unsigned int
+rs_cb_queue_wait(rs_cb_queue_t *cb_queue)
+{
+	uv_mutex_lock(&(cb_queue->mutex));
+	while (!__atomic_load_n(&(cb_queue->completed), __ATOMIC_ACQUIRE))
+		uv_cond_wait(&(cb_queue->cond), &(cb_queue->mutex));
+	uv_mutex_unlock(&(cb_queue->mutex));
+	
+	return rs_cb_queue_run(cb_queue);
+}
+
+
+/**
+ * Free a callback queue belonging to an event loop once its handle is closed.
+ */
+static void
+rs__cb_queue_closed_cb(uv_handle_t *handle)
+{
+	free(handle->data);
+}
+
+
+void
+rs_cb_queue_free(rs_cb_queue_t *cb_queue)
+{
+	if (cb_queue->has_async) {
+		uv_close((uv_handle_t *)&(cb_queue->async_handle),
+		         rs__cb_queue_closed_cb);
+	} else {
+		uv_cond_destroy(&(cb_queue->cond));
+		uv_mutex_destroy(&(cb_queue->mutex));
+		free(cb_queue);
+	}
+}
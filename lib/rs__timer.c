@@ -0,0 +1,127 @@
+/**
+ * Internal functions for tracking packet timeouts using a single timer per
+ * connection.
+ */
+
+#include <sys/socket.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+
+/**
+ * Remove a slot from the list of pending timeouts.
+ */
+static void
+rs__timer_unlink(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	if (os->timer_prev)
+		os->timer_prev->timer_next = os->timer_next;
+	else
+		conn->timers_head = os->timer_next;
+	
+	if (os->timer_next)
+		os->timer_next->timer_prev = os->timer_prev;
+	else
+		conn->timers_tail = os->timer_prev;
+	
+	os->timer_armed = false;
+}
+
+
+void
+rs__timer_start(rs_conn_t *conn, rs__outstanding_t *os, uint64_t timeout)
+{
+	if (os->timer_armed)
+		rs__timer_unlink(conn, os);
+	
+	uint64_t now = uv_now(conn->loop);
+	os->deadline = now + timeout;
+	
+	// Insert into the list in deadline order, searching from the tail since
+	// the new deadline is almost always the latest.
+	rs__outstanding_t *prev = conn->timers_tail;
+	while (prev && prev->deadline > os->deadline)
+		prev = prev->timer_prev;
+	
+	os->timer_prev = prev;
+	if (prev) {
+		os->timer_next = prev->timer_next;
+		prev->timer_next = os;
+	} else {
+		os->timer_next = conn->timers_head;
+		conn->timers_head = os;
+	}
+	if (os->timer_next)
+		os->timer_next->timer_prev = os;
+	else
+		conn->timers_tail = os;
+	os->timer_armed = true;
+	
+	// Only (re)start the timer if it would otherwise expire too late
+	uint64_t expiry = conn->timers_head->deadline;
+	if (!uv_is_active((uv_handle_t *)&(conn->timer_handle)) ||
+	    expiry < conn->timer_expiry) {
+		conn->timer_expiry = expiry;
+		uv_timer_start(&(conn->timer_handle), rs__timer_cb,
+		               (expiry > now) ? expiry - now : 0, 0);
+	}
+}
+
+
+void
+rs__timer_start_rto(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	uint64_t timeout = rs__rto(conn);
+	
+	// Requests with a deadline give up (rather than retransmit) on reaching it
+	if (os->req_deadline) {
+		uint64_t now = uv_now(conn->loop);
+		timeout = MIN(timeout,
+		              (os->req_deadline > now) ? os->req_deadline - now : 0);
+	}
+	
+	rs__timer_start(conn, os, timeout);
+}
+
+
+void
+rs__timer_stop(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// The timer itself is left running: if it expires before the next deadline
+	// it is simply restarted.
+	if (os->timer_armed)
+		rs__timer_unlink(conn, os);
+}
+
+
+void
+rs__timer_cb(uv_timer_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	uint64_t now = uv_now(conn->loop);
+	
+	// Deal with every packet which has timed out. Stop if a callback frees the
+	// connection.
+	while (conn->timers_head && conn->timers_head->deadline <= now &&
+	       !conn->free) {
+		rs__outstanding_t *os = conn->timers_head;
+		rs__timer_unlink(conn, os);
+		rs__packet_timeout(conn, os);
+	}
+	
+	// Wait for the next deadline (unless the timer was restarted while handling
+	// the timeouts above)
+	if (conn->timers_head && !conn->free &&
+	    !uv_is_active((uv_handle_t *)&(conn->timer_handle))) {
+		conn->timer_expiry = conn->timers_head->deadline;
+		uv_timer_start(&(conn->timer_handle), rs__timer_cb,
+		               (conn->timer_expiry > now) ? conn->timer_expiry - now : 0,
+		               0);
+	}
+}
@@ -16,6 +16,12 @@
 #include <rs__internal.h>
 #include <rs__scp.h>
 
+#ifdef RS__ZERO_COPY_RECV
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
 
 void
 rs__attempt_transmission(rs_conn_t *conn, rs__outstanding_t *os)
@@ -26,19 +32,16 @@ rs__attempt_transmission(rs_conn_t *conn, rs__outstanding_t *os)
 		return;
 	
 	if (++os->n_tries <= conn->n_tries) {
-		// Attempt to transmit
-		os->send_req_active = true;
-		int err = uv_udp_send(&(os->send_req),
-		                      &(conn->udp_handle),
-		                      &(os->packet), 1,
-		                      conn->addr,
-		                      rs__udp_send_cb);
-		if (err) {
-			// Transmission failiure: clean up
-			os->send_req_active = false;
-			rs__cancel_outstanding(conn, os, err, -1);
-			return;
-		}
+		rs__rtt_sent(conn, os);
+		os->n_later_responses = 0;
+		rs__stats_traffic(conn, os)->n_packets_sent++;
+		rs__pacer_sent(conn, os);
+		if (os->n_tries > 1)
+			conn->stats.n_retransmissions++;
+		
+		// Send the packet as part of a batch if one is being accumulated
+		if (!rs__batch_add(conn, os))
+			rs__send_packet(conn, os);
 	} else {
 		// Maximum number of attempts made, fail and clean up.
 		rs__cancel_outstanding(conn, os, RS_ETIMEOUT, -1);
@@ -47,13 +50,57 @@ rs__attempt_transmission(rs_conn_t *conn, rs__outstanding_t *os)
 
 
 void
-rs__timer_cb(uv_timer_t *handle)
+rs__send_packet(rs_conn_t *conn, rs__outstanding_t *os)
 {
-	rs__outstanding_t *os = (rs__outstanding_t *)handle->data;
+	// Attempt to transmit the packet buffer followed by the payload (if any) as a
+	// single datagram (or the gathered buffers of a coalesced write).
+#ifdef RS__IO_URING
+	if (conn->uring) {
+		rs__uring_queue_send(conn, os);
+		rs__uring_submit(conn);
+		conn->batch_stats.n_send_syscalls++;
+		return;
+	}
+#endif
+	
+	uv_buf_t bufs[2];
+	bufs[0] = os->packet;
+	bufs[1] = os->payload;
+	os->send_req_active = true;
+	int err = uv_udp_send(os->send_req,
+	                      conn->send_handle,
+	                      os->n_gather ? os->gather : bufs,
+	                      os->n_gather ? os->n_gather
+	                                   : (os->payload.len ? 2 : 1),
+	                      conn->addr,
+	                      rs__udp_send_cb);
+	if (err) {
+		// Transmission failiure: clean up
+		os->send_req_active = false;
+		rs__cancel_outstanding(conn, os, err, -1);
+		return;
+	}
+	
+	conn->batch_stats.n_send_syscalls++;
+	conn->batch_stats.n_send_packets++;
+}
+
+
+void
+rs__packet_timeout(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	// Requests whose deadline has passed are abandoned
+	if (os->req_deadline && uv_now(conn->loop) >= os->req_deadline) {
+		rs__cancel_outstanding(conn, os, RS_EDEADLINE, -1);
+		return;
+	}
 	
 	// The packet didn't arrive, attempt retransmission (which will fail if done
 	// too many times)
-	rs__attempt_transmission(os->conn, os);
+	conn->stats.n_timeouts++;
+	rs__rtt_timeout(conn, os);
+	rs__cwnd_timeout(conn, os);
+	rs__attempt_transmission(conn, os);
 }
 
 
@@ -78,6 +125,7 @@ rs__udp_send_cb(uv_udp_send_t *req, int status)
 	if (os->active && os->cancelled) {
 		os->active = false;
 		os->cancelled = false;
+		rs__free_outstanding(conn, os);
 		
 		// Now that the slot is nolonger active, we may potentially handle new
 		// requests.
@@ -85,21 +133,23 @@ rs__udp_send_cb(uv_udp_send_t *req, int status)
 		return;
 	}
 	
+	// If a response has already arrived back, the slot can now be freed and we
+	// should simply process the queue as requests waiting for a slot would be
+	// waiting on the send_req_active flag clearing.
+	if (!os->active) {
+		rs__free_outstanding(conn, os);
+		rs__process_request_queue(conn);
+		return;
+	}
+	
 	// If something went wrong, cancel the request
 	if (status != 0) {
 		rs__cancel_outstanding(os->conn, os, status, -1);
 		return;
 	}
 	
-	// The packet has been dispatched
-	if (os->active)
-		// Setup a timeout for the response
-		uv_timer_start(&(os->timer_handle), rs__timer_cb, conn->timeout, 0);
-	else
-		// A response has already arrived back thus we should simply process the
-		// queue as users waiting for this slot would be waiting on the
-		// send_req_active flag clearing.
-		rs__process_request_queue(conn);
+	// The packet has been dispatched, setup a timeout for the response
+	rs__timer_start_rto(conn, os);
 }
 
 
@@ -107,16 +157,64 @@ void
 rs__udp_recv_alloc_cb(uv_handle_t *handle,
                       size_t suggested_size, uv_buf_t *buf)
 {
-	// XXX: Just use malloc for now...
-	buf->base = malloc(suggested_size);
+	rs_conn_t *conn = (rs_conn_t *)(handle->data);
+	
+	// Use a buffer from the pool if possible. Since no valid SCP packet can be
+	// larger than recv_buf_size, the (much larger) suggested size is ignored.
+	if (conn->n_free_recv_bufs)
+		buf->base = conn->free_recv_bufs[--conn->n_free_recv_bufs];
+	else
+		buf->base = malloc(conn->recv_buf_size);
 	
 	if (buf->base)
-		buf->len = suggested_size;
+		buf->len = conn->recv_buf_size;
 	else
 		buf->len = 0;
 }
 
 
+void
+rs__free_recv_buf(rs_conn_t *conn, char *base)
+{
+	if (base >= conn->recv_bufs &&
+	    base < conn->recv_bufs + (conn->recv_buf_size * RS__N_RECV_BUFS))
+		conn->free_recv_bufs[conn->n_free_recv_bufs++] = base;
+	else
+		free(base);
+}
+
+
+void
+rs__recv_datagram(rs_conn_t *conn, uv_buf_t buf, ssize_t nread)
+{
+	// Ignore anything which isn't long enough to be an SCP packet (note that 2
+	// empty bytes are included in the start of every SCP packet). This also skips
+	// cases when the length is 0 meaning "no more data" or <0 meaning some kind
+	// of error has ocurred. Note that receive errors are rare and very difficult
+	// to interpret so we consider them safe to ignore.
+	if (nread < RS__SIZEOF_SCP_PACKET(0, 0) + 2) {
+		if (nread > 0)
+			conn->stats.n_dropped_malformed++;
+		return;
+	}
+	
+	// Skip past empty padding bytes to get to the packet
+	buf.base += 2;
+	buf.len = nread - 2;
+	
+	// Check to see if a packet with this sequence number is outstanding (if
+	// not, the packet is ignored too)
+	uint16_t seq_num = rs__unpack_scp_packet_seq_num(buf);
+	rs__outstanding_t *os = rs__find_outstanding(conn, seq_num);
+	if (os) {
+		conn->expected_seq_num = seq_num + 1;
+		rs__process_response(conn, os, buf);
+	} else {
+		conn->stats.n_dropped_unmatched++;
+	}
+}
+
+
 void
 rs__udp_recv_cb(uv_udp_t *handle,
                 ssize_t nread, const uv_buf_t *buf,
@@ -125,33 +223,396 @@ rs__udp_recv_cb(uv_udp_t *handle,
 {
 	rs_conn_t *conn = (rs_conn_t *)(handle->data);
 	
-	int i;
+	conn->batch_stats.n_recv_syscalls++;
+	if (addr)
+		conn->batch_stats.n_recv_packets++;
 	
-	// Ignore anything which isn't long enough to be an SCP packet (note that 2
-	// empty bytes are included in the start of every SCP packet). This also skips
-	// cases when the length is 0 meaning "no more data" or <0 meaning some kind
-	// of error has ocurred. Note that receive errors are rare and very difficult
-	// to interpret so we consider them safe to ignore.
-	if (nread >= RS__SIZEOF_SCP_PACKET(0, 0) + 2) {
-		// Skip past empty padding bytes to get to the packet
-		uv_buf_t buf_ = *buf;
-		buf_.base += 2;
-		buf_.len = nread - 2;
-		
-		// Check to see if a packet with this sequence number is outstanding (if
-		// not, the packet is ignored too)
-		uint16_t seq_num = rs__unpack_scp_packet_seq_num(buf_);
+	// Packets which were too large for the receive buffer cannot be valid
+	// responses and are ignored.
+	if (!(flags & UV_UDP_PARTIAL))
+		rs__recv_datagram(conn, *buf, nread);
+	else
+		conn->stats.n_dropped_malformed++;
+	
+	// Return the receive buffer to the pool
+	rs__free_recv_buf(conn, buf->base);
+}
+
+
+#ifdef RS__ZERO_COPY_RECV
+
+/**
+ * Callback on closing the receive poll handle.
+ *
+ * Closes the duplicated socket descriptor and attempts to complete the freeing
+ * process.
+ */
+static void
+rs__recv_poll_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	close(conn->recv_fd);
+	conn->recv_poll_handle_closed = true;
+	rs_free(conn, NULL, NULL);
+}
+
+
+/**
+ * Prepare to receive a datagram expected to be the response with the given
+ * sequence number.
+ *
+ * If the response is for an outstanding CMD_READ, the datagram is scattered
+ * such that its header lands in msg->header and its payload directly in the
+ * user's buffer, with anything beyond the expected payload length landing in a
+ * receive buffer.
+ *
+ * @returns false if no receive buffer could be allocated.
+ */
+static bool
+rs__recv_msg_prepare(rs_conn_t *conn, rs__recv_msg_t *m, uint16_t seq_num,
+                     struct msghdr *msg)
+{
+	// Work out where the payload of the expected response should go
+	m->seq_num = seq_num;
+	m->os = rs__find_outstanding(conn, seq_num);
+	if (m->os && m->os->type != RS__REQ_READ)
+		m->os = NULL;
+	
+	rs__udp_recv_alloc_cb((uv_handle_t *)&(conn->udp_handle),
+	                      conn->recv_buf_size, &(m->buf));
+	if (!m->buf.base)
+		return false;
+	
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_iov = m->iov;
+	if (m->os) {
+		m->iov[0].iov_base = m->header;
+		m->iov[0].iov_len = sizeof(m->header);
+		m->iov[1].iov_base = m->os->data.rw.data.base;
+		m->iov[1].iov_len = m->os->data.rw.data.len;
+		m->iov[2].iov_base = m->buf.base;
+		m->iov[2].iov_len = m->buf.len;
+		msg->msg_iovlen = 3;
+	} else {
+		m->iov[0].iov_base = m->buf.base;
+		m->iov[0].iov_len = m->buf.len;
+		msg->msg_iovlen = 1;
+	}
+	
+	return true;
+}
+
+
+/**
+ * Reassemble a datagram received according to rs__recv_msg_prepare in its
+ * receive buffer if it turns out not to be the expected response.
+ *
+ * This must be done for every datagram received by a system call before any
+ * of them are processed: until then, the parts of the user's buffers they were
+ * scattered into are still ours to read. (The expected slot's part of the
+ * user's buffer may have been overwritten in the process but will be written
+ * again when its own response arrives.) Datagrams too large to reassemble are
+ * marked as truncated.
+ */
+static void
+rs__recv_msg_reassemble(rs__recv_msg_t *m, size_t nread, int *flags)
+{
+	const size_t header_len = sizeof(m->header);
+	uv_buf_t buf = m->buf;
+	
+	if (!m->os || (*flags & MSG_TRUNC))
+		return;
+	
+	if (nread >= header_len) {
+		uv_buf_t header;
+		header.base = m->header + 2;
+		header.len = header_len - 2;
+		if (rs__unpack_scp_packet_seq_num(header) == m->seq_num)
+			return;
+	}
+	
+	// Some other datagram arrived: reassemble it in the receive buffer if it
+	// will fit (otherwise it is too large to be valid).
+	m->os = NULL;
+	if (nread > buf.len) {
+		*flags |= MSG_TRUNC;
+		return;
+	}
+	
+	size_t scattered_len = MIN(nread - MIN(nread, header_len),
+	                           m->iov[1].iov_len);
+	size_t overflow_len = nread - MIN(nread, header_len) - scattered_len;
+	memmove(buf.base + header_len + scattered_len, buf.base, overflow_len);
+	memcpy(buf.base + header_len, m->iov[1].iov_base, scattered_len);
+	memcpy(buf.base, m->header, MIN(nread, header_len));
+}
+
+
+/**
+ * Process a datagram received according to rs__recv_msg_prepare (and
+ * reassembled by rs__recv_msg_reassemble) and release its receive buffer.
+ */
+static void
+rs__recv_msg_complete(rs_conn_t *conn, rs__recv_msg_t *m,
+                      size_t nread, int flags)
+{
+	const size_t header_len = sizeof(m->header);
+	rs__outstanding_t *os = m->os;
+	uv_buf_t buf = m->buf;
+	
+	// Packets which were too large for the receive buffers cannot be valid
+	// responses and are ignored.
+	if (flags & MSG_TRUNC) {
+		conn->stats.n_dropped_malformed++;
+		rs__free_recv_buf(conn, buf.base);
+		return;
+	}
+	
+	if (os) {
+		// The expected response arrived. When several datagrams are received at
+		// once, its slot may have been completed or cancelled by processing an
+		// earlier one (e.g. a duplicate), in which case its part of the user's
+		// buffer may no longer be ours: the datagram is dropped.
+		rs__free_recv_buf(conn, buf.base);
+		if (rs__find_outstanding(conn, m->seq_num) != os) {
+			conn->stats.n_dropped_unmatched++;
+			return;
+		}
 		
-		for (i = 0; i < conn->n_outstanding; i++) {
-			rs__outstanding_t *os = conn->outstanding + i;
-			if (os->active && os->seq_num == seq_num) {
-				rs__process_response(conn, os, buf_);
-				break;
-			}
+		// Its payload is already in the user's buffer: process just the header.
+		uv_buf_t header;
+		header.base = m->header + 2;
+		header.len = header_len - 2;
+		conn->expected_seq_num = m->seq_num + 1;
+		rs__process_response(conn, os, header);
+		return;
+	}
+	
+	rs__recv_datagram(conn, buf, nread);
+	rs__free_recv_buf(conn, buf.base);
+}
+
+
+/**
+ * Receive datagrams from the connection's socket using a single system call.
+ *
+ * When batching is enabled, up to RS__RECV_BATCH_SIZE datagrams are received
+ * using recvmmsg with the kth datagram expected to be the response with the
+ * kth sequence number after the last one received. Otherwise a single
+ * datagram is received using recvmsg.
+ *
+ * @returns false if no more datagrams are waiting to be received.
+ */
+static bool
+rs__recvmsg(rs_conn_t *conn)
+{
+	rs__recv_msg_t *m = conn->recv_msgs;
+	struct mmsghdr msgs[RS__RECV_BATCH_SIZE];
+	
+	unsigned int n_msgs = 1;
+#ifdef RS__BATCHING
+	if (conn->batching)
+		n_msgs = RS__RECV_BATCH_SIZE;
+#endif
+	
+	unsigned int i;
+	for (i = 0; i < n_msgs; i++)
+		if (!rs__recv_msg_prepare(conn, &(m[i]),
+		                          conn->expected_seq_num + i,
+		                          &(msgs[i].msg_hdr)))
+			break;
+	n_msgs = i;
+	if (!n_msgs)
+		return false;
+	
+	int n_recv;
+	do {
+#ifdef RS__BATCHING
+		if (n_msgs > 1) {
+			n_recv = recvmmsg(conn->recv_fd, msgs, n_msgs, MSG_DONTWAIT, NULL);
+		} else
+#endif
+		{
+			ssize_t nread = recvmsg(conn->recv_fd, &(msgs[0].msg_hdr),
+			                        MSG_DONTWAIT);
+			msgs[0].msg_len = nread;
+			n_recv = (nread < 0) ? -1 : 1;
 		}
+	} while (n_recv < 0 && errno == EINTR);
+	
+	conn->batch_stats.n_recv_syscalls++;
+	
+	// Stop when no more data is available (or on error: as with the libuv
+	// receive path, errors are ignored)
+	if (n_recv < 0)
+		n_recv = 0;
+	conn->batch_stats.n_recv_packets += n_recv;
+	
+	// Responses arriving out of order are reassembled before anything is
+	// processed (which may complete the slots whose buffers they landed in)
+	for (i = 0; i < (unsigned int)n_recv; i++)
+		rs__recv_msg_reassemble(&(m[i]), msgs[i].msg_len,
+		                        &(msgs[i].msg_hdr.msg_flags));
+	
+	for (i = 0; i < n_msgs; i++) {
+		// Stop processing if a callback freed the connection
+		if (i < n_recv && !conn->free)
+			rs__recv_msg_complete(conn, &(m[i]), msgs[i].msg_len,
+			                      msgs[i].msg_hdr.msg_flags);
+		else
+			rs__free_recv_buf(conn, m[i].buf.base);
 	}
 	
-	// Free receive buffer
-	if (buf->base)
-		free(buf->base);
+	// If fewer datagrams than requested arrived, the socket has been drained
+	return n_recv == n_msgs;
+}
+
+
+/**
+ * Callback when the connection's socket becomes readable.
+ */
+static void
+rs__recv_poll_cb(uv_poll_t *handle, int status, int events)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	
+	int i;
+	for (i = 0; i < RS__MAX_RECV_PER_POLL && !conn->free; i++)
+		if (!rs__recvmsg(conn))
+			break;
 }
+
+
+int
+rs__recv_start(rs_conn_t *conn)
+{
+	int err;
+	
+	// No descriptor (or poll handle) exists until the socket is bound
+	conn->recv_fd = -1;
+	
+	// Bind the socket to an arbitrary local port (as libuv would do implicitly
+	// when receiving) such that a socket descriptor exists to receive from.
+	struct sockaddr_storage local_addr;
+	if (conn->addr->sa_family == AF_INET6)
+		err = uv_ip6_addr("::", 0, (struct sockaddr_in6 *)&local_addr);
+	else
+		err = uv_ip4_addr("0.0.0.0", 0, (struct sockaddr_in *)&local_addr);
+	if (err)
+		return err;
+	err = uv_udp_bind(&(conn->udp_handle), (struct sockaddr *)&local_addr, 0);
+	if (err)
+		return err;
+	
+	uv_os_fd_t fd;
+	err = uv_fileno((uv_handle_t *)&(conn->udp_handle), &fd);
+	if (err)
+		return err;
+	
+	conn->recv_fd = dup(fd);
+	if (conn->recv_fd < 0)
+		return uv_translate_sys_error(errno);
+	
+	err = uv_poll_init(conn->loop, &(conn->recv_poll_handle), conn->recv_fd);
+	if (err) {
+		close(conn->recv_fd);
+		conn->recv_fd = -1;
+		return err;
+	}
+	conn->recv_poll_handle.data = (void *)conn;
+	conn->recv_poll_handle_closed = false;
+	
+	return uv_poll_start(&(conn->recv_poll_handle), UV_READABLE,
+	                     rs__recv_poll_cb);
+}
+
+
+void
+rs__recv_stop(rs_conn_t *conn)
+{
+	if (!uv_is_closing((uv_handle_t *)&(conn->recv_poll_handle)))
+		uv_close((uv_handle_t *)&(conn->recv_poll_handle),
+		         rs__recv_poll_handle_closed_cb);
+	
+#ifdef RS__IO_URING
+	rs__uring_stop(conn);
+#endif
+}
+
+
+unsigned int
+rs__recv_abort(rs_conn_t *conn, uv_close_cb close_cb)
+{
+	if (conn->recv_fd < 0)
+		return 0;
+	
+	// Closing the handle stops polling straight away so the descriptor may be
+	// closed immediately
+	uv_close((uv_handle_t *)&(conn->recv_poll_handle), close_cb);
+	close(conn->recv_fd);
+	return 1;
+}
+
+
+bool
+rs__recv_closed(rs_conn_t *conn)
+{
+#ifdef RS__IO_URING
+	if (conn->uring)
+		return false;
+#endif
+	
+	return conn->recv_poll_handle_closed;
+}
+
+
+#ifdef RS__IO_URING
+void
+rs__recv_pause(rs_conn_t *conn)
+{
+	uv_poll_stop(&(conn->recv_poll_handle));
+}
+
+
+void
+rs__recv_resume(rs_conn_t *conn)
+{
+	if (!uv_is_closing((uv_handle_t *)&(conn->recv_poll_handle)))
+		uv_poll_start(&(conn->recv_poll_handle), UV_READABLE, rs__recv_poll_cb);
+}
+#endif
+
+#else
+
+int
+rs__recv_start(rs_conn_t *conn)
+{
+	return uv_udp_recv_start(&(conn->udp_handle),
+	                         rs__udp_recv_alloc_cb,
+	                         rs__udp_recv_cb);
+}
+
+
+void
+rs__recv_stop(rs_conn_t *conn)
+{
+	uv_udp_recv_stop(&(conn->udp_handle));
+}
+
+
+unsigned int
+rs__recv_abort(rs_conn_t *conn, uv_close_cb close_cb)
+{
+	// Closing the UDP handle suffices
+	return 0;
+}
+
+
+bool
+rs__recv_closed(rs_conn_t *conn)
+{
+	// No handles other than the UDP handle are used
+	return true;
+}
+
+#endif
@@ -0,0 +1,568 @@
+/**
+ * An io_uring based transport for Linux which sends and receives packets with
+ * far fewer system calls than libuv's UDP API (see rs_enable_io_uring).
+ *
+ * The ring is driven directly via the io_uring system calls (no liburing
+ * dependency) and integrated into the connection's event loop by an eventfd
+ * which the kernel signals whenever completions are posted.
+ */
+
+#include <sys/socket.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <uv.h>
+
+#include <rs.h>
+#include <rs__internal.h>
+
+#ifdef RS__IO_URING
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+/**
+ * The user_data of the multishot receive and of requests to cancel it. Sends
+ * use the address of their outstanding slot.
+ */
+#define RS__URING_RECV 1
+#define RS__URING_CANCEL 2
+
+/**
+ * The buffer group ID of the provided receive buffers.
+ */
+#define RS__URING_BGID 0
+
+
+/**
+ * The message header of a packet being sent by an outstanding slot.
+ */
+typedef struct {
+	struct msghdr msg;
+	struct iovec iov[2];
+} rs__uring_send_t;
+
+
+struct rs__uring {
+	// The ring's file descriptor and its (single) mapping of the submission and
+	// completion queue rings along with the array of submission queue entries
+	int ring_fd;
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	
+	// The submission queue. Entries up to sq_local_tail have been prepared but
+	// are only made visible to the kernel by rs__uring_submit.
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_local_tail;
+	
+	// The completion queue
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	
+	// Ring of RS__URING_N_RECV_BUFS receive buffers (each of buf_size bytes)
+	// registered with the kernel, which picks buffers from it as datagrams
+	// arrive, and the tail of the ring as last written.
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_size;
+	char *bufs;
+	size_t buf_size;
+	uint16_t buf_ring_tail;
+	
+	// Message header template for the multishot receive. Is it armed (i.e. may
+	// it produce further completions)? Set if the kernel rejected it, in which
+	// case responses are received via recv_poll_handle instead.
+	struct msghdr recv_msg;
+	bool recv_armed;
+	bool recv_failed;
+	
+	// Eventfd signalled by the kernel when completions are posted and the poll
+	// handle which watches it
+	int event_fd;
+	uv_poll_t poll_handle;
+	
+	// Set once the ring is being torn down
+	bool stopping;
+	
+	// The number of sends submitted whose completions have not been reaped
+	unsigned int n_sends;
+	
+	// Message headers for each outstanding slot's send (n_outstanding entries)
+	rs__uring_send_t sends[];
+};
+
+
+static int
+rs__io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+rs__io_uring_enter(int fd, unsigned int to_submit)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+
+static int
+rs__io_uring_register(int fd, unsigned int opcode, void *arg,
+                      unsigned int nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+/**
+ * Translate the errno of a failed io_uring system call made while setting up a
+ * ring into a libuv error code, treating a lack of kernel support (e.g. an old
+ * kernel or io_uring being disabled by a sysctl or seccomp) as UV_ENOTSUP.
+ */
+static int
+rs__uring_setup_error(void)
+{
+	if (errno == ENOSYS || errno == EINVAL || errno == EPERM)
+		return UV_ENOTSUP;
+	return uv_translate_sys_error(errno);
+}
+
+
+/**
+ * Release all of the resources held by a ring (which need not have been fully
+ * set up).
+ */
+static void
+rs__uring_destroy(rs__uring_t *u)
+{
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+	if (u->event_fd >= 0)
+		close(u->event_fd);
+	if (u->rings)
+		munmap(u->rings, u->rings_size);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->buf_ring)
+		munmap(u->buf_ring, u->buf_ring_size);
+	free(u->bufs);
+	free(u);
+}
+
+
+/**
+ * Return a receive buffer to the kernel.
+ */
+static void
+rs__uring_recycle(rs__uring_t *u, uint16_t bid)
+{
+	struct io_uring_buf *buf =
+		&(u->buf_ring->bufs[u->buf_ring_tail & (RS__URING_N_RECV_BUFS - 1)]);
+	buf->addr = (uintptr_t)(u->bufs + (bid * u->buf_size));
+	buf->len = u->buf_size;
+	buf->bid = bid;
+	
+	u->buf_ring_tail++;
+	__atomic_store_n(&(u->buf_ring->tail), u->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Get a (zeroed) submission queue entry to fill in. The submission queue has
+ * room for a send from every outstanding slot and the receive-related entries,
+ * so never overflows.
+ */
+static struct io_uring_sqe *
+rs__uring_get_sqe(rs__uring_t *u)
+{
+	unsigned int index = u->sq_local_tail++ & u->sq_mask;
+	struct io_uring_sqe *sqe = &(u->sqes[index]);
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	return sqe;
+}
+
+
+/**
+ * Queue the multishot receive which delivers every arriving datagram into a
+ * provided buffer.
+ */
+static void
+rs__uring_arm_recv(rs__uring_t *u)
+{
+	struct io_uring_sqe *sqe = rs__uring_get_sqe(u);
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->fd = 0;
+	sqe->addr = (uintptr_t)&(u->recv_msg);
+	sqe->len = 1;
+	sqe->buf_group = RS__URING_BGID;
+	sqe->user_data = RS__URING_RECV;
+	
+	u->recv_armed = true;
+}
+
+
+/**
+ * Set up a new ring for a connection.
+ *
+ * @returns 0 on success or a libuv error code.
+ */
+static int
+rs__uring_setup(rs_conn_t *conn, rs__uring_t *u)
+{
+	// The submission queue holds a send for every slot plus a receive and a
+	// cancellation. The completion queue additionally holds a completion for
+	// every receive buffer, so it never overflows either.
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = (2 * (conn->n_outstanding + 2)) + RS__URING_N_RECV_BUFS;
+	u->ring_fd = rs__io_uring_setup(conn->n_outstanding + 2, &p);
+	if (u->ring_fd < 0)
+		return rs__uring_setup_error();
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		return UV_ENOTSUP;
+	
+	// Map the rings
+	u->rings_size = MAX(p.sq_off.array + (p.sq_entries * sizeof(unsigned int)),
+	                    p.cq_off.cqes + (p.cq_entries *
+	                                     sizeof(struct io_uring_cqe)));
+	u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE,
+	                MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->rings == MAP_FAILED) {
+		u->rings = NULL;
+		return uv_translate_sys_error(errno);
+	}
+	
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return uv_translate_sys_error(errno);
+	}
+	
+	char *rings = (char *)u->rings;
+	u->sq_head = (unsigned int *)(rings + p.sq_off.head);
+	u->sq_tail = (unsigned int *)(rings + p.sq_off.tail);
+	u->sq_array = (unsigned int *)(rings + p.sq_off.array);
+	u->sq_mask = *(unsigned int *)(rings + p.sq_off.ring_mask);
+	u->sq_local_tail = *(u->sq_tail);
+	u->cq_head = (unsigned int *)(rings + p.cq_off.head);
+	u->cq_tail = (unsigned int *)(rings + p.cq_off.tail);
+	u->cq_mask = *(unsigned int *)(rings + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+	
+	// The socket is registered such that the kernel need not look it up for
+	// every operation
+	int fds[1] = {conn->recv_fd};
+	if (rs__io_uring_register(u->ring_fd, IORING_REGISTER_FILES, fds, 1) < 0)
+		return rs__uring_setup_error();
+	
+	// Register the receive buffers. Each holds the recvmsg output header and
+	// source address followed by the largest valid datagram.
+	u->buf_size = sizeof(struct io_uring_recvmsg_out) +
+	              sizeof(struct sockaddr_storage) +
+	              conn->recv_buf_size;
+	u->bufs = malloc(RS__URING_N_RECV_BUFS * u->buf_size);
+	if (!u->bufs)
+		return UV_ENOMEM;
+	
+	u->buf_ring_size = RS__URING_N_RECV_BUFS * sizeof(struct io_uring_buf);
+	u->buf_ring = mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->buf_ring == MAP_FAILED) {
+		u->buf_ring = NULL;
+		return uv_translate_sys_error(errno);
+	}
+	
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->buf_ring;
+	reg.ring_entries = RS__URING_N_RECV_BUFS;
+	reg.bgid = RS__URING_BGID;
+	if (rs__io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING,
+	                          &reg, 1) < 0)
+		return rs__uring_setup_error();
+	
+	uint16_t bid;
+	for (bid = 0; bid < RS__URING_N_RECV_BUFS; bid++)
+		rs__uring_recycle(u, bid);
+	
+	memset(&(u->recv_msg), 0, sizeof(u->recv_msg));
+	u->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	
+	// Completions are signalled via an eventfd which the event loop polls
+	u->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->event_fd < 0)
+		return uv_translate_sys_error(errno);
+	if (rs__io_uring_register(u->ring_fd, IORING_REGISTER_EVENTFD,
+	                          &(u->event_fd), 1) < 0)
+		return rs__uring_setup_error();
+	
+	return 0;
+}
+
+
+/**
+ * Callback once the eventfd poll handle has closed: releases the ring and
+ * attempts to complete the freeing process.
+ */
+static void
+rs__uring_poll_handle_closed_cb(uv_handle_t *handle)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	rs__uring_destroy(conn->uring);
+	conn->uring = NULL;
+	rs_free(conn, NULL, NULL);
+}
+
+
+/**
+ * Close the ring once it is being torn down and the kernel no longer holds any
+ * references to the connection's memory.
+ */
+static void
+rs__uring_try_close(rs_conn_t *conn)
+{
+	rs__uring_t *u = conn->uring;
+	if (u->stopping && !u->recv_armed && !u->n_sends &&
+	    !uv_is_closing((uv_handle_t *)&(u->poll_handle)))
+		uv_close((uv_handle_t *)&(u->poll_handle),
+		         rs__uring_poll_handle_closed_cb);
+}
+
+
+/**
+ * Deal with a completion of the multishot receive.
+ */
+static void
+rs__uring_recv_complete(rs_conn_t *conn, struct io_uring_cqe *cqe)
+{
+	rs__uring_t *u = conn->uring;
+	
+	// The receive must be re-armed once it stops producing completions (e.g.
+	// when every receive buffer is in use).
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		u->recv_armed = false;
+		
+		// If the kernel does not support multishot receives, fall back on
+		// receiving via the poll handle.
+		if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED &&
+		    !u->stopping) {
+			u->recv_failed = true;
+			rs__recv_resume(conn);
+		}
+	}
+	
+	if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER))
+		return;
+	
+	uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	char *buf = u->bufs + (bid * u->buf_size);
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+	
+	conn->batch_stats.n_recv_packets++;
+	
+	// Packets which were too large for the receive buffer cannot be valid
+	// responses and are ignored. Nothing more is processed once the connection
+	// is being freed.
+	if (out->flags & MSG_TRUNC) {
+		conn->stats.n_dropped_malformed++;
+	} else if (!conn->free) {
+		uv_buf_t data;
+		data.base = buf + sizeof(*out) + u->recv_msg.msg_namelen;
+		data.len = out->payloadlen;
+		rs__recv_datagram(conn, data, out->payloadlen);
+	}
+	
+	rs__uring_recycle(u, bid);
+}
+
+
+/**
+ * Callback when the kernel has signalled the eventfd: processes all posted
+ * completions.
+ */
+static void
+rs__uring_poll_cb(uv_poll_t *handle, int status, int events)
+{
+	rs_conn_t *conn = (rs_conn_t *)handle->data;
+	rs__uring_t *u = conn->uring;
+	
+	// Reset the eventfd first such that completions posted while processing
+	// wake the loop again
+	uint64_t n_events;
+	if (read(u->event_fd, &n_events, sizeof(n_events)) < 0 && errno != EAGAIN)
+		return;
+	conn->batch_stats.n_recv_syscalls++;
+	
+	// Each completion is consumed before it is processed since processing may
+	// queue further entries (though it never frees the ring).
+	unsigned int head = *(u->cq_head);
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+		
+		if (cqe.user_data == RS__URING_RECV) {
+			rs__uring_recv_complete(conn, &cqe);
+		} else if (cqe.user_data != RS__URING_CANCEL) {
+			// A send completed: deal with it exactly as a libuv send callback
+			rs__outstanding_t *os = (rs__outstanding_t *)(uintptr_t)cqe.user_data;
+			u->n_sends--;
+			rs__udp_send_cb(os->send_req, (cqe.res < 0) ? cqe.res : 0);
+		}
+	}
+	
+	if (u->stopping) {
+		rs__uring_try_close(conn);
+	} else {
+		if (!u->recv_armed && !u->recv_failed)
+			rs__uring_arm_recv(u);
+		rs__uring_submit(conn);
+	}
+}
+
+
+void
+rs__uring_queue_send(rs_conn_t *conn, rs__outstanding_t *os)
+{
+	rs__uring_t *u = conn->uring;
+	rs__uring_send_t *send = &(u->sends[RS__OUTSTANDING_INDEX(conn, os)]);
+	
+	// The packet buffer is followed by the payload (if any), or the gathered
+	// buffers of a coalesced write are sent (libuv's uv_buf_t has the same
+	// layout as struct iovec on Unix)
+	memset(&(send->msg), 0, sizeof(send->msg));
+	send->iov[0].iov_base = os->packet.base;
+	send->iov[0].iov_len = os->packet.len;
+	send->iov[1].iov_base = os->payload.base;
+	send->iov[1].iov_len = os->payload.len;
+	send->msg.msg_name = (void *)conn->addr;
+	send->msg.msg_namelen = (conn->addr->sa_family == AF_INET6)
+	                        ? sizeof(struct sockaddr_in6)
+	                        : sizeof(struct sockaddr_in);
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = os->payload.len ? 2 : 1;
+	if (os->n_gather) {
+		send->msg.msg_iov = (struct iovec *)os->gather;
+		send->msg.msg_iovlen = os->n_gather;
+	}
+	
+	struct io_uring_sqe *sqe = rs__uring_get_sqe(u);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = 0;
+	sqe->addr = (uintptr_t)&(send->msg);
+	sqe->len = 1;
+	sqe->user_data = (uintptr_t)os;
+	
+	os->send_req_active = true;
+	u->n_sends++;
+	conn->batch_stats.n_send_packets++;
+}
+
+
+void
+rs__uring_submit(rs_conn_t *conn)
+{
+	rs__uring_t *u = conn->uring;
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	
+	unsigned int n = u->sq_local_tail - __atomic_load_n(u->sq_head,
+	                                                    __ATOMIC_ACQUIRE);
+	if (!n)
+		return;
+	
+	// Any entries the kernel does not consume (e.g. for want of memory) remain
+	// in the submission queue and are submitted next time
+	int err;
+	do {
+		err = rs__io_uring_enter(u->ring_fd, n);
+	} while (err < 0 && errno == EINTR);
+}
+
+
+void
+rs__uring_stop(rs_conn_t *conn)
+{
+	rs__uring_t *u = conn->uring;
+	if (!u || u->stopping)
+		return;
+	
+	u->stopping = true;
+	
+	if (u->recv_armed) {
+		struct io_uring_sqe *sqe = rs__uring_get_sqe(u);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = RS__URING_RECV;
+		sqe->user_data = RS__URING_CANCEL;
+		rs__uring_submit(conn);
+	}
+	
+	rs__uring_try_close(conn);
+}
+#endif
+
+
+int
+rs_enable_io_uring(rs_conn_t *conn)
+{
+#ifdef RS__IO_URING
+	if (conn->uring)
+		return 0;
+	
+	// Connections using a shared transport do not have a socket of their own
+	if (conn->transport)
+		return UV_ENOTSUP;
+	
+	// The transport may not be changed while packets are in flight
+	if (conn->n_slots_in_use || conn->batch_open)
+		return UV_EBUSY;
+	
+	rs__uring_t *u = calloc(1, sizeof(rs__uring_t) +
+	                           (conn->n_outstanding * sizeof(rs__uring_send_t)));
+	if (!u)
+		return UV_ENOMEM;
+	u->ring_fd = -1;
+	u->event_fd = -1;
+	
+	int err = rs__uring_setup(conn, u);
+	if (!err)
+		err = uv_poll_init(conn->loop, &(u->poll_handle), u->event_fd);
+	if (err) {
+		rs__uring_destroy(u);
+		return err;
+	}
+	u->poll_handle.data = (void *)conn;
+	uv_poll_start(&(u->poll_handle), UV_READABLE, rs__uring_poll_cb);
+	
+	// Responses now arrive via the ring
+	rs__recv_pause(conn);
+	conn->uring = u;
+	rs__uring_arm_recv(u);
+	rs__uring_submit(conn);
+	
+	return 0;
+#else
+	return UV_ENOTSUP;
+#endif
+}
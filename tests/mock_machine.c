@@ -83,6 +83,24 @@ typedef struct {
  */
 #define MM__RW_LENGTH(p) (((sdp_scp_header_t *)(p))->arg2)
 
+/**
+ * Unpack the transfer unit (an RS__RW_TYPE_*) from a read/write packet.
+ */
+#define MM__RW_TYPE(p) (((sdp_scp_header_t *)(p))->arg3)
+
+/**
+ * Unpack the word and length from a fill packet (whose address is as for a
+ * read/write packet).
+ */
+#define MM__FILL_WORD(p) (((sdp_scp_header_t *)(p))->arg2)
+#define MM__FILL_LENGTH(p) (((sdp_scp_header_t *)(p))->arg3)
+
+/**
+ * The version number and string reported in response to CMD_VER.
+ */
+#define MM__VER_NUM 133
+#define MM__VER_STRING "Mock machine"
+
 /**
  * Unpack the number of correctly-responded-to requests from a read/write packet
  * according to the definitions at the top of the headder file.
@@ -166,6 +184,13 @@ static void mm__pack_response_generic(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
                                       uv_buf_t *buf);
 
 
+/**
+ * Internal function: Respond to CMD_VER as SC&MP would.
+ */
+static void mm__pack_response_ver(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                                  uv_buf_t *buf);
+
+
 /**
  * Internal function: Read some data back.
  */
@@ -180,6 +205,13 @@ static void mm__pack_response_write(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
                                     uv_buf_t *buf);
 
 
+/**
+ * Internal function: Fill some memory with a word.
+ */
+static void mm__pack_response_fill(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                                   uv_buf_t *buf);
+
+
 mm_t *
 mm_init(uv_loop_t *loop)
 {
@@ -205,6 +237,8 @@ mm_init(uv_loop_t *loop)
 	mm->reqs = NULL;
 	mm->rws = NULL;
 	
+	mm->sver = false;
+	
 	return mm;
 }
 
@@ -270,6 +304,7 @@ mm_get_rw(mm_t *mm, unsigned int id)
 		rw->write_count[i] = 0;
 	}
 	rw->n_responses_sent = 0;
+	rw->n_word_responses = 0;
 	
 	// Insert into the linked list
 	rw->next = mm->rws;
@@ -340,8 +375,11 @@ mm__recv_cb(uv_udp_t *handle,
 	// See if the packet changed since the last attempt
 	if (req->buf.len != nread - 2 ||
 	    memcmp(req->buf.base, buf->base + 2, nread - 2)) {
-		// If so, copy it in
-		req->n_changes++;
+		// If so, copy it in. A different packet reusing a sequence number (e.g.
+		// from a new connection) is a new request and so its attempts are counted
+		// afresh.
+		if (req->n_changes++)
+			req->n_tries = 0;
 		memcpy(req->buf.base, buf->base + 2, nread - 2);
 		req->buf.len = nread - 2;
 	}
@@ -356,7 +394,8 @@ mm__recv_cb(uv_udp_t *handle,
 	
 	// Special case for read/writes
 	bool is_rw = MM__CMD_RC(req->buf.base) == RS__SCP_CMD_READ ||
-	             MM__CMD_RC(req->buf.base) == RS__SCP_CMD_WRITE;
+	             MM__CMD_RC(req->buf.base) == RS__SCP_CMD_WRITE ||
+	             MM__CMD_RC(req->buf.base) == RS__SCP_CMD_FILL;
 	if (is_rw) {
 		mm_rw_t *rw = mm_get_rw(mm, MM__RW_ID(req->buf.base));
 		// Start responding slowly only after a specified number of attempts
@@ -402,6 +441,17 @@ mm__timer_cb(uv_timer_t *timer_handle)
 			mm__pack_response_write(mm, req, resp, &buf);
 			break;
 		
+		case RS__SCP_CMD_FILL:
+			mm__pack_response_fill(mm, req, resp, &buf);
+			break;
+		
+		case RS__SCP_CMD_VER:
+			if (mm->sver) {
+				mm__pack_response_ver(mm, req, resp, &buf);
+				break;
+			}
+			// Otherwise echo the packet as usual
+		
 		default:
 			mm__pack_response_generic(mm, req, resp, &buf);
 			break;
@@ -450,6 +500,29 @@ mm__pack_response_generic(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
 }
 
 
+static void
+mm__pack_response_ver(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                      uv_buf_t *buf)
+{
+	// Generate a response packet based on the request's header with three
+	// arguments followed by the version string (including 2 bytes padding)
+	const char ver_string[] = MM__VER_STRING;
+	buf->len = RS__SIZEOF_SCP_PACKET(3, sizeof(ver_string)) + 2;
+	buf->base = malloc(buf->len);
+	if (!buf->base) abort();
+	memset(buf->base, 0, 2);
+	memcpy(buf->base + 2, req->buf.base, RS__SIZEOF_SCP_PACKET(0, 0));
+	memcpy(buf->base + 2 + RS__SIZEOF_SCP_PACKET(3, 0),
+	       ver_string, sizeof(ver_string));
+	
+	sdp_scp_header_t *header = (sdp_scp_header_t *)(buf->base + 2);
+	header->cmd_rc = RS__SCP_CMD_OK;
+	header->arg1 = 0; // Chip (0, 0), CPU 0
+	header->arg2 = (MM__VER_NUM << 16) | MM_SCP_DATA_LENGTH;
+	header->arg3 = 0; // Build date
+}
+
+
 static void
 mm__pack_response_read(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
                        uv_buf_t *buf)
@@ -492,6 +565,8 @@ mm__pack_response_read(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
 	
 	// Count the number of responses dealt with
 	rw->n_responses_sent++;
+	if (MM__RW_TYPE(p) == RS__RW_TYPE_WORD)
+		rw->n_word_responses++;
 }
 
 
@@ -537,6 +612,51 @@ mm__pack_response_write(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
 		if (rw->write_count[addr] < 255)
 			rw->write_count[addr]++;
 	
+	// Count the number of responses dealt with
+	rw->n_responses_sent++;
+	if (MM__RW_TYPE(p) == RS__RW_TYPE_WORD)
+		rw->n_word_responses++;
+}
+
+
+static void
+mm__pack_response_fill(mm_t *mm, mm_req_t *req, mm_resp_t *resp,
+                       uv_buf_t *buf)
+{
+	void *p = req->buf.base;
+	
+	// Crash if the fill is longer than memory or not word aligned
+	if (MM__RW_ADDR(p) + MM__FILL_LENGTH(p) > MM_MAX_RW ||
+	    (MM__RW_ADDR(p) | MM__FILL_LENGTH(p)) & 3)
+		abort();
+	
+	mm_rw_t *rw = mm_get_rw(mm, MM__RW_ID(req->buf.base));
+	
+	// Generate a response packet, initially based on the request with the
+	// arguments stripped out (including 2 bytes padding)
+	buf->base = malloc(RS__SIZEOF_SCP_PACKET(0, 0) + 2);
+	if (!buf->base) abort();
+	buf->len = RS__SIZEOF_SCP_PACKET(0, 0) + 2;
+	memset(buf->base, 0, 2);
+	memcpy(buf->base + 2, req->buf.base, RS__SIZEOF_SCP_PACKET(0, 0));
+	
+	// Report failiure as required
+	if (MM__RW_N_RESP_BEFORE_ERROR(p) == 255 ||
+	    rw->n_responses_sent != MM__RW_N_RESP_BEFORE_ERROR(p))
+		MM__CMD_RC(buf->base + 2) = RS__SCP_CMD_OK;
+	else
+		MM__CMD_RC(buf->base + 2) = 0;
+	
+	// Fill the 'memory' (in little-endian byte order) and update counters
+	size_t addr;
+	for (addr = MM__RW_ADDR(p);
+	     addr - MM__RW_ADDR(p) < MM__FILL_LENGTH(p);
+	     addr++) {
+		rw->data[addr] = (char)(MM__FILL_WORD(p) >> (8 * (addr & 3)));
+		if (rw->write_count[addr] < 255)
+			rw->write_count[addr]++;
+	}
+	
 	// Count the number of responses dealt with
 	rw->n_responses_sent++;
 }
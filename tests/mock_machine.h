@@ -9,7 +9,9 @@
  *   * Bits 7:0 of dest_addr give the number of attempts which must be made before
  *     a response is sent. If zero, never respond.
  *   * Bits 4:0 of dest_port_cpu give the number of duplicate responses to send
- * * For CMD_READ and CMD_WRITE:
+ * * If the sver flag is set, CMD_VER is answered as SC&MP would, reporting a
+ *   data field length of MM_SCP_DATA_LENGTH (otherwise it is echoed back).
+ * * For CMD_READ, CMD_WRITE and CMD_FILL:
  *   * Bits 15:10 of the address gives a unique identifier to the read/write and
  *     is used count incoming read/write requests related to the same command.
  *   * Bits 23:16 of the address gives the number of successful requests to
@@ -140,6 +142,10 @@ struct mm_rw {
 	// this read/write
 	unsigned int n_responses_sent;
 	
+	// How many of those were responses to word (rather than byte or short)
+	// reads/writes
+	unsigned int n_word_responses;
+	
 	// Link to next or NULL at the end of the list
 	mm_rw_t *next;
 };
@@ -172,6 +178,10 @@ struct mm {
 	
 	// Linked list of read/write block requests
 	mm_rw_t *rws;
+	
+	// Should CMD_VER be answered as SC&MP would (rather than echoed back)?
+	// Initially false.
+	bool sver;
 };
 
 
@@ -10,7 +10,6 @@
 
 // Data type placed in the queue during all tests
 typedef struct {
-	rs__q_entry_t _;
 	int value;
 } my_type_t;
 
@@ -32,6 +31,7 @@ START_TEST (test_empty)
 {
 	// Make sure the queue doesn't peek or remove anything when empty
 	ck_assert(rs__q_peek(q) == NULL);
+	ck_assert(rs__q_peek_newest(q) == NULL);
 	ck_assert(rs__q_remove(q) == NULL);
 	ck_assert(rs__q_peek(q) == NULL);
 	ck_assert(rs__q_remove(q) == NULL);
@@ -55,9 +55,8 @@ START_TEST (test_single_insertion)
 		ck_assert(rs__q_remove(q) == NULL);
 	}
 	
-	// Make sure that only one block was allocated!
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next == NULL);
+	// Make sure that the queue never grew
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
 }
 END_TEST
 
@@ -69,36 +68,43 @@ START_TEST (test_buffer_growth)
 	int i;
 	
 	// Insert a number of items which shouldn't grow the buffer
-	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE - 1; i++) {
+	for (i = 0; i < RS__Q_MIN_SIZE; i++) {
 		my_type_t *e = (my_type_t *)rs__q_insert(q);
 		ck_assert(e);
 		e->value = i;
+		
+		// The newest entry is the one just inserted
+		ck_assert((my_type_t *)rs__q_peek_newest(q) == e);
 	}
 	
-	// Make sure that only one block was allocated!
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next == NULL);
+	// Make sure that the queue didn't grow
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
+	ck_assert_uint_eq(rs__q_length(q), RS__Q_MIN_SIZE);
 	
 	// Insert another item which should grow the buffer
 	my_type_t *e = (my_type_t *)rs__q_insert(q);
 	ck_assert(e);
 	e->value = i++;
 	
-	// A new block should now have been allocated
-	ck_assert(q->blocks);
-	ck_assert(q->blocks->next);
+	// The queue should now have doubled in size (keeping the newest entry at
+	// the end)
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE * 2);
+	ck_assert((my_type_t *)rs__q_peek_newest(q) == e);
+	ck_assert_uint_eq(rs__q_length(q), RS__Q_MIN_SIZE + 1);
 	
-	// Removing things should come out in order
-	for (i = 0; i < RS__Q_FIRST_BLOCK_SIZE; i++) {
+	// Removing things should come out in order (removal may shrink the queue,
+	// moving the entries)
+	for (i = 0; i < RS__Q_MIN_SIZE + 1; i++) {
 		my_type_t *e = (my_type_t *)rs__q_peek(q);
 		ck_assert(e);
 		ck_assert(e->value == i);
-		ck_assert((my_type_t *)rs__q_remove(q) == e);
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == i);
 	}
 	
 	// Nothing should be left
 	ck_assert(rs__q_peek(q) == NULL);
 	ck_assert(rs__q_remove(q) == NULL);
+	ck_assert_uint_eq(rs__q_length(q), 0);
 }
 END_TEST
 
@@ -128,8 +134,8 @@ START_TEST (test_varying_size)
 		for (j = 0; j < i; j++) {
 			my_type_t *e = (my_type_t *)rs__q_peek(q);
 			ck_assert(e);
-			ck_assert(e->value == remove_id++);
-			ck_assert((my_type_t *)rs__q_remove(q) == e);
+			ck_assert(e->value == remove_id);
+			ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
 		}
 	}
 	
@@ -140,6 +146,198 @@ START_TEST (test_varying_size)
 END_TEST
 
 
+START_TEST (test_wrap_growth)
+{
+	// Make sure the queue keeps its order when grown while its contents wrap
+	// around the end of the ring
+	int insert_id = 0;
+	int remove_id = 0;
+	int i;
+	
+	// Move the tail part-way around the ring
+	for (i = 0; i < RS__Q_MIN_SIZE / 2; i++) {
+		((my_type_t *)rs__q_insert(q))->value = insert_id++;
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
+	}
+	
+	// Fill the ring (wrapping around) and then grow it
+	for (i = 0; i < RS__Q_MIN_SIZE * 3; i++) {
+		my_type_t *e = (my_type_t *)rs__q_insert(q);
+		ck_assert(e);
+		e->value = insert_id++;
+	}
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE * 4);
+	
+	while (rs__q_length(q))
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
+	ck_assert_int_eq(remove_id, insert_id);
+}
+END_TEST
+
+
+START_TEST (test_shrink)
+{
+	const int num = 1000;
+	int insert_id = 0;
+	int remove_id = 0;
+	int i;
+	
+	// Grow the queue a long way
+	for (i = 0; i < num; i++) {
+		my_type_t *e = (my_type_t *)rs__q_insert(q);
+		ck_assert(e);
+		e->value = insert_id++;
+	}
+	ck_assert_uint_eq(q->size, 1024);
+	
+	// Removing entries doesn't move the queue while it remains more than a
+	// quarter full
+	for (i = 0; i < num - 257; i++) {
+		my_type_t *e = (my_type_t *)rs__q_peek(q);
+		ck_assert(e->value == remove_id++);
+		ck_assert((my_type_t *)rs__q_remove(q) == e);
+	}
+	ck_assert_uint_eq(q->size, 1024);
+	
+	// The queue should only shrink once it is a quarter full, and then only to
+	// half its size, with the entry removed remaining intact
+	ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
+	ck_assert_uint_eq(q->size, 512);
+	
+	// Inserting and removing around the new size should not cause it to change
+	// size again
+	for (i = 0; i < 10; i++) {
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
+		ck_assert_uint_eq(q->size, 512);
+		((my_type_t *)rs__q_insert(q))->value = insert_id++;
+		ck_assert_uint_eq(q->size, 512);
+	}
+	
+	// Once drained, the queue should be back at its minimum size without
+	// anything further being inserted, keeping the order of the entries
+	while (rs__q_length(q))
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == remove_id++);
+	ck_assert_int_eq(remove_id, insert_id);
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
+	
+	// Removing entries from within the queue also shrinks it
+	for (i = 0; i < num; i++)
+		((my_type_t *)rs__q_insert(q))->value = i;
+	ck_assert_uint_eq(q->size, 1024);
+	while (rs__q_length(q) > 1)
+		rs__q_remove_at(q, 0);
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
+	ck_assert(((my_type_t *)rs__q_peek(q))->value == num - 1);
+}
+END_TEST
+
+
+START_TEST (test_reserve_commit)
+{
+	const int num = 100;
+	int i;
+	
+	// Start with something in the queue
+	((my_type_t *)rs__q_insert(q))->value = 0;
+	
+	// Reserve space for many entries at once
+	ck_assert(rs__q_reserve(q, num));
+	ck_assert_uint_ge(q->size, num + 1);
+	size_t size = q->size;
+	for (i = 0; i < num; i++)
+		((my_type_t *)rs__q_reserved(q, i))->value = i + 1;
+	
+	// Nothing appears in the queue until committed
+	ck_assert_uint_eq(rs__q_length(q), 1);
+	rs__q_commit(q, num);
+	ck_assert_uint_eq(rs__q_length(q), num + 1);
+	ck_assert_uint_eq(q->size, size);
+	
+	// Everything comes out in order
+	for (i = 0; i < num + 1; i++)
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == i);
+	ck_assert(rs__q_peek(q) == NULL);
+	ck_assert(rs__q_remove(q) == NULL);
+	
+	// Reserving space when there already is some changes nothing
+	ck_assert(rs__q_reserve(q, 1));
+	ck_assert(rs__q_reserve(q, 0));
+	ck_assert_uint_eq(rs__q_length(q), 0);
+}
+END_TEST
+
+
+START_TEST (test_remove_at)
+{
+	int i;
+	
+	// Fill the queue such that its contents wrap around the end of the ring
+	for (i = 0; i < RS__Q_MIN_SIZE / 2; i++) {
+		rs__q_insert(q);
+		rs__q_remove(q);
+	}
+	for (i = 0; i < RS__Q_MIN_SIZE; i++)
+		((my_type_t *)rs__q_insert(q))->value = i;
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
+	
+	// Entries can be found by position
+	for (i = 0; i < RS__Q_MIN_SIZE; i++)
+		ck_assert(((my_type_t *)rs__q_peek_at(q, i))->value == i);
+	ck_assert(rs__q_peek_at(q, RS__Q_MIN_SIZE) == NULL);
+	
+	// Removing entries from the middle, start and end keeps the rest in order
+	rs__q_remove_at(q, RS__Q_MIN_SIZE / 2);
+	rs__q_remove_at(q, 0);
+	rs__q_remove_at(q, rs__q_length(q) - 1);
+	ck_assert_uint_eq(rs__q_length(q), RS__Q_MIN_SIZE - 3);
+	
+	// As does removing one nearer the start than the end
+	rs__q_remove_at(q, 1);
+	ck_assert_uint_eq(rs__q_length(q), RS__Q_MIN_SIZE - 4);
+	for (i = 1; i < RS__Q_MIN_SIZE - 1; i++)
+		if (i != 2 && i != RS__Q_MIN_SIZE / 2)
+			ck_assert(((my_type_t *)rs__q_remove(q))->value == i);
+	ck_assert(rs__q_peek(q) == NULL);
+	ck_assert(rs__q_peek_at(q, 0) == NULL);
+}
+END_TEST
+
+
+static bool
+is_odd(void *entry, void *data)
+{
+	(void)data;
+	return ((my_type_t *)entry)->value % 2;
+}
+
+
+START_TEST (test_remove_if)
+{
+	const int num = RS__Q_MIN_SIZE;
+	my_type_t removed[RS__Q_MIN_SIZE];
+	int i;
+	
+	// Fill the queue such that its contents wrap around the end of the ring
+	for (i = 0; i < num / 2; i++) {
+		rs__q_insert(q);
+		rs__q_remove(q);
+	}
+	for (i = 0; i < num; i++)
+		((my_type_t *)rs__q_insert(q))->value = i;
+	ck_assert_uint_eq(q->size, RS__Q_MIN_SIZE);
+	
+	// The matching entries come out in order, as do those remaining
+	ck_assert_uint_eq(rs__q_remove_if(q, is_odd, NULL, removed), num / 2);
+	ck_assert_uint_eq(rs__q_length(q), num / 2);
+	for (i = 0; i < num / 2; i++)
+		ck_assert(removed[i].value == (i * 2) + 1);
+	for (i = 0; i < num / 2; i++)
+		ck_assert(((my_type_t *)rs__q_remove(q))->value == i * 2);
+	ck_assert(rs__q_peek(q) == NULL);
+}
+END_TEST
+
+
 Suite *
 make_queue_suite(void)
 {
@@ -152,6 +350,11 @@ make_queue_suite(void)
 	tcase_add_test(tc_core, test_single_insertion);
 	tcase_add_test(tc_core, test_buffer_growth);
 	tcase_add_test(tc_core, test_varying_size);
+	tcase_add_test(tc_core, test_wrap_growth);
+	tcase_add_test(tc_core, test_shrink);
+	tcase_add_test(tc_core, test_reserve_commit);
+	tcase_add_test(tc_core, test_remove_at);
+	tcase_add_test(tc_core, test_remove_if);
 	
 	// Add each test case to the suite
 	suite_add_tcase(s, tc_core);
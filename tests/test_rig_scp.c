@@ -11,6 +11,7 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 
@@ -314,6 +315,107 @@ rw_cb(rs_conn_t *conn,
 }
 
 
+/**
+ * A data structure to hold details of callbacks from the rig scp library's
+ * rs_readv/rs_writev functions. To be passed as data to the ready-made callback
+ * rwv_cb.
+ */
+struct rwv_cb_data;
+typedef struct rwv_cb_data rwv_cb_data_t;
+struct rwv_cb_data {
+	cb_data_t generic_info;
+	
+	// Store a copy of the arguments supplied
+	rs_conn_t *conn;
+	int error;
+	rs_rw_seg_t *segs;
+	unsigned int n_segs;
+};
+
+
+void
+rwv_cb(rs_conn_t *conn,
+       int error,
+       rs_rw_seg_t *segs,
+       unsigned int n_segs,
+       void *cb_data)
+{
+	rwv_cb_data_t *d = (rwv_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->segs = segs;
+	d->n_segs = n_segs;
+	
+	d->generic_info.n_calls++;
+}
+
+
+/**
+ * A data structure to hold details of callbacks from the rig scp library's
+ * rs_read_stream function. To be passed as data to the ready-made callback
+ * stream_cb which copies each chunk into a buffer and, if release is set,
+ * releases it immediately. The generic callback count is only incremented once
+ * n_chunks_wanted chunks have arrived or the stream has failed.
+ */
+struct stream_cb_data;
+typedef struct stream_cb_data stream_cb_data_t;
+struct stream_cb_data {
+	cb_data_t generic_info;
+	
+	bool release;
+	unsigned int n_chunks_wanted;
+	
+	// The buffer the data is copied into and the one-past-the-end address of
+	// the data received so far
+	unsigned char *base;
+	uint32_t start_address;
+	uint32_t end_address;
+	
+	// Chunks received and not released
+	unsigned int n_held;
+	uv_buf_t held[4];
+	
+	// Store a copy of the last arguments supplied
+	rs_stream_t *stream;
+	unsigned int n_chunks;
+	int error;
+	bool last;
+};
+
+
+void
+stream_cb(rs_conn_t *conn,
+          rs_stream_t *stream,
+          int error,
+          uint16_t cmd_rc,
+          uint32_t address,
+          uv_buf_t data,
+          bool last,
+          void *cb_data)
+{
+	stream_cb_data_t *d = (stream_cb_data_t *)cb_data;
+	d->stream = stream;
+	d->error = error;
+	d->last = last;
+	
+	if (!error) {
+		// Chunks must arrive in order
+		ck_assert_uint_eq(address, d->end_address);
+		memcpy(d->base + (address - d->start_address), data.base, data.len);
+		d->end_address += data.len;
+		d->n_chunks++;
+		
+		if (d->release)
+			rs_stream_release(stream, data);
+		else
+			d->held[d->n_held++] = data;
+	}
+	
+	if (error || last || d->n_chunks == d->n_chunks_wanted)
+		d->generic_info.n_calls++;
+}
+
+
 /******************************************************************************
  * Test fixture setup/teardown
  ******************************************************************************/
@@ -554,188 +656,1299 @@ END_TEST
 
 
 /**
- * Make sure that a single-packet read command can be sent and received.
+ * Make sure the adaptive retransmission timeout follows the measured round-trip
+ * time and backs off when packets time out.
  */
-START_TEST (test_single_packet_read)
+START_TEST (test_adaptive_timeout)
 {
-	const size_t offset = _i;
-	size_t i;
+	rs_set_adaptive_timeout(conn, true, 1, 4 * TIMEOUT);
 	
-	// Set up some fake data to read back
-	mm_rw_t *rw = mm_get_rw(mm, 0);
-	for (i = 0; i < MM_SCP_DATA_LENGTH; i++) {
-		rw->data[offset + i] = (unsigned char)i;
-	}
+	// Until a round-trip time is measured, the fixed timeout is used
+	ck_assert_uint_eq(rs_get_timeout(conn), TIMEOUT);
 	
 	// Create a callback which we'll wait on for a reply
-	rw_cb_data_t cb_data;
+	send_scp_cb_data_t cb_data;
 	wait_for_cb((cb_data_t *)&cb_data);
 	
-	// Set a buffer to hold the read data
-	unsigned char data_buf[MM_SCP_DATA_LENGTH];
+	// Create an empty payload
 	uv_buf_t data;
-	data.base = (void *)data_buf;
-	data.len = MM_SCP_DATA_LENGTH;
+	data.base = NULL;
+	data.len = 0;
 	
-	uint32_t addr = (offset |  // Start at the given offset
-	                 0u<<10 |  // The RW ID
-	                 255u<<16 | // No errors
-	                 255u<<24); // Respond to all the same speed
+	// Send a packet which is responded to after a quarter of the fixed timeout
+	ck_assert(!rs_send_scp(conn,
+	                       (TIMEOUT/4 << 8) | 1, // Respond to the first attempt
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!cb_data.error);
 	
-	// Send the packet
-	ck_assert(!rs_read(conn,
-	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
-	                   0, // Send no duplicates
-	                   addr,
-	                   data,
-	                   rw_cb, &cb_data));
+	// After a single sample, the timeout should be three times the round-trip
+	// time (the sample plus four times half the sample). The mock machine's
+	// response delay is only accurate to within a msec.
+	uint64_t rto = rs_get_timeout(conn);
+	ck_assert_uint_ge(rto, 3 * (TIMEOUT/4 - 1));
+	ck_assert_uint_lt(rto, TIMEOUT);
 	
-	// Wait for a reply
+	// Send a packet which is never responded to
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_send_scp(conn,
+	                       (0 << 8) | 0, // Never respond
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &cb_data));
 	ck_assert(!wait_for_all_cb());
+	ck_assert(cb_data.error == RS_ETIMEOUT);
 	
-	// Check that the response came back once
-	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	// The timeout should have doubled on every timeout, reaching the limit
+	ck_assert_uint_eq(rs_get_timeout(conn), 4 * TIMEOUT);
 	
-	// Check one request was made in total
-	ck_assert_uint_eq(rw->n_responses_sent, 1);
+	// Disabling adaptive timeouts restores the fixed timeout
+	rs_set_adaptive_timeout(conn, false, 1, 4 * TIMEOUT);
+	ck_assert_uint_eq(rs_get_timeout(conn), TIMEOUT);
+}
+END_TEST
+
+
+/**
+ * Make sure the congestion window grows on clean responses, is capped at the
+ * number of outstanding slots and shrinks when packets time out.
+ */
+START_TEST (test_congestion_control)
+{
+	rs_set_congestion_control(conn, true, 1);
+	ck_assert_uint_eq(rs_get_window(conn), 1);
 	
-	// Check that only the expected data was read, and it was read once.
-	for (i = 0; i < MM_MAX_RW; i++) {
-		if (i >= offset && i < offset + MM_SCP_DATA_LENGTH)
-			ck_assert_uint_eq(rw->read_count[i], 1);
-		else
-			ck_assert_uint_eq(rw->read_count[i], 0);
-		
-		ck_assert_uint_eq(rw->write_count[i], 0);
+	// Create a callback which we'll wait on for a reply
+	send_scp_cb_data_t cb_data;
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Each clean response from a window's worth of packets grows the window by
+	// one, up to the number of outstanding slots
+	unsigned int i;
+	for (i = 0; i < 2 * N_OUTSTANDING; i++) {
+		wait_for_cb((cb_data_t *)&cb_data);
+		ck_assert(!rs_send_scp(conn,
+		                       (1 << 8) | 1, // Respond after 1 msec and one attempt
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       data,
+		                       data.len,
+		                       send_scp_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert(!cb_data.error);
 	}
+	ck_assert_uint_eq(rs_get_window(conn), N_OUTSTANDING);
 	
-	// Check the data read is as expected
-	ck_assert(cb_data.conn == conn);
+	// A timeout halves the window
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       data,
+	                       data.len,
+	                       send_scp_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
 	ck_assert(!cb_data.error);
-	ck_assert(cb_data.data.base == data.base);
-	ck_assert(cb_data.data.len == data.len);
-	ck_assert(memcmp(cb_data.data.base, rw->data + offset, data.len) == 0);
+	ck_assert_uint_eq(rs_get_window(conn), N_OUTSTANDING / 2);
 	
-	// Check that only one request was sent to the mock machine and that it was as
-	// expected.
-	mm_req_t *req = mm_get_req(mm, 0);
-	ck_assert(req);
-	ck_assert(mm->reqs == req);
-	ck_assert(req->next == NULL);
-	ck_assert_uint_eq(req->n_changes, 1);
-	ck_assert_uint_eq(req->n_tries, 1);
-	ck_assert_uint_eq(UNPACK_RW_ADDR(req->buf.base), addr);
-	ck_assert_uint_eq(UNPACK_RW_LENGTH(req->buf.base), MM_SCP_DATA_LENGTH);
-	ck_assert_uint_eq(UNPACK_RW_TYPE(req->buf.base),
-	                  rs__scp_rw_type(offset, MM_SCP_DATA_LENGTH));
+	// Disabling congestion control makes all slots available again
+	rs_set_congestion_control(conn, false, 1);
+	ck_assert_uint_eq(rs_get_window(conn), N_OUTSTANDING);
 }
 END_TEST
 
 
 /**
- * Make sure that a single-packet write command can be sent and received.
+ * Make sure that a lost packet is retransmitted as soon as a later packet to
+ * the same chip is responded to when fast retransmission is enabled.
  */
-START_TEST (test_single_packet_write)
+START_TEST (test_fast_retransmit)
 {
-	const size_t offset = _i;
+	rs_set_fast_retransmit(conn, 1);
+	
+	// Number of packets to send
+	const size_t n_packets = 3 * N_OUTSTANDING;
+	const size_t length = MM_SCP_DATA_LENGTH * n_packets;
+	
 	size_t i;
 	
-	// Get a reference to the memory block we're going to write to
+	// Set up some fake data to read back
 	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++) {
+		rw->data[i] = (unsigned char)i;
+	}
+	
+	// Every packet is responded to on its second attempt but, by pretending an
+	// attempt has already been made for the sequence numbers after the first
+	// packet's (including any skipped while the first remains outstanding), only
+	// the first packet is lost.
+	for (i = 1; i < 2 * n_packets; i++)
+		mm_get_req(mm, i)->n_tries = 1;
 	
 	// Create a callback which we'll wait on for a reply
 	rw_cb_data_t cb_data;
 	wait_for_cb((cb_data_t *)&cb_data);
 	
-	// Set a buffer with some dummy data to write
-	unsigned char data_buf[MM_SCP_DATA_LENGTH];
-	for (i = 0; i < MM_SCP_DATA_LENGTH; i++)
-		data_buf[i] = (unsigned char)i;
+	// Set a buffer to hold the read data
+	unsigned char data_buf[length];
 	uv_buf_t data;
 	data.base = (void *)data_buf;
-	data.len = MM_SCP_DATA_LENGTH;
+	data.len = length;
 	
-	// Send the packet
-	uint32_t addr = (offset |  // Start at the given offset
+	uint32_t addr = (0 |  // Start at the start
 	                 0u<<10 |  // The RW ID
 	                 255u<<16 | // No errors
 	                 255u<<24); // Respond to all the same speed
-	ck_assert(!rs_write(conn,
-	                    (1 << 8) | 1, // Respond after 1 msec and one attempt
-	                    0, // Send no duplicates
-	                    addr,
-	                    data,
-	                    rw_cb, &cb_data));
 	
-	// Wait for a reply
+	// Send the read
+	ck_assert(!rs_read(conn,
+	                   (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                   0, // Send no duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &cb_data));
+	
+	// Wait for a reply: the lost packet should not have had to time out
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
 	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	ck_assert_int_lt(time_after - time_before, TIMEOUT);
 	
-	// Check that the response came back once
+	// Check the read succeeded
 	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
-	
-	// Check one request was made in total
-	ck_assert_uint_eq(rw->n_responses_sent, 1);
-	
-	// Check that only the expected data was written, and it was written once.
-	for (i = 0; i < MM_MAX_RW; i++) {
-		if (i >= offset && i < offset + MM_SCP_DATA_LENGTH)
-			ck_assert_uint_eq(rw->write_count[i], 1);
-		else
-			ck_assert_uint_eq(rw->write_count[i], 0);
-		
-		ck_assert_uint_eq(rw->read_count[i], 0);
-	}
-	
-	// Check the data written was correct
-	ck_assert(memcmp(rw->data + offset, data_buf, data.len) == 0);
-	
-	// Check the response is as expected
 	ck_assert(cb_data.conn == conn);
 	ck_assert(!cb_data.error);
-	ck_assert(cb_data.data.base == data.base);
-	ck_assert(cb_data.data.len == data.len);
-	
-	// Check that only one request was sent to the mock machine and that it was as
-	// expected.
-	mm_req_t *req = mm_get_req(mm, 0);
-	ck_assert(req);
-	ck_assert(mm->reqs == req);
-	ck_assert(req->next == NULL);
-	ck_assert_uint_eq(req->n_changes, 1);
-	ck_assert_uint_eq(req->n_tries, 1);
-	ck_assert_uint_eq(UNPACK_RW_ADDR(req->buf.base), addr);
-	ck_assert_uint_eq(UNPACK_RW_LENGTH(req->buf.base), MM_SCP_DATA_LENGTH);
-	ck_assert_uint_eq(UNPACK_RW_TYPE(req->buf.base),
-	                  rs__scp_rw_type(offset, MM_SCP_DATA_LENGTH));
+	for (i = 0; i < length; i++)
+		ck_assert_uint_eq(data_buf[i], (unsigned char)i);
+	
+	// Only the lost packet should have been retransmitted
+	ck_assert_uint_eq(mm_get_req(mm, 0)->n_tries, 2);
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_fast_retransmissions, 1);
+	ck_assert_uint_eq(stats.n_retransmissions, 1);
+	ck_assert_uint_eq(stats.n_timeouts, 0);
 }
 END_TEST
 
 
 /**
- * Make sure that if several packets are sent at once they are carried out in
- * parallel. Also checks that duplicate response packets are ignored.
+ * State shared by the callbacks of test_fast_retransmit_reuse.
  */
-START_TEST (test_multiple_scp)
-{
-	// Number parallel rounds worth of packets to send
-	const unsigned int n_rounds = 3;
+typedef struct {
+	send_scp_cb_data_t cb_data;
 	
-	// Number of packets to send at once
-	const unsigned int n_packets = N_OUTSTANDING * n_rounds;
+	// The request to cancel when this callback is called
+	rs_handle_t cancel;
 	
-	unsigned int i;
+	// Where the replacement request's callback reports
+	send_scp_cb_data_t *replacement;
+} cancel_requeue_cb_data_t;
+
+
+void
+cancel_requeue_cb(rs_conn_t *conn,
+                  int error,
+                  uint16_t cmd_rc,
+                  unsigned int n_args,
+                  uint32_t arg1,
+                  uint32_t arg2,
+                  uint32_t arg3,
+                  uv_buf_t data,
+                  void *cb_data)
+{
+	cancel_requeue_cb_data_t *d = (cancel_requeue_cb_data_t *)cb_data;
+	send_scp_cb(conn, error, cmd_rc, n_args, arg1, arg2, arg3, data,
+	            &(d->cb_data));
+	
+	// Cancel the lost request and send another in its place (which is given the
+	// slot just freed)
+	ck_assert(!rs_cancel(conn, d->cancel));
+	uv_buf_t no_data;
+	no_data.base = NULL;
+	no_data.len = 0;
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       no_data,
+	                       0,
+	                       send_scp_cb, d->replacement));
+}
+
+
+/**
+ * Make sure that a slot chosen for fast retransmission is not retransmitted if
+ * a callback reuses it for a new packet before the retransmission is made.
+ */
+START_TEST (test_fast_retransmit_reuse)
+{
+	rs_set_fast_retransmit(conn, 1);
+	
+	// On the second iteration, the test is repeated with system call batching
+	// enabled (where supported) under which the replacement packet is sent, and
+	// its timeout started, before the callback returns.
+	if (_i)
+		rs_set_batching(conn, true);
+	
+	// The first packet is lost but the second and the replacement for the first
+	// are responded to on their first attempt.
+	mm_get_req(mm, 1)->n_tries = 1;
+	mm_get_req(mm, 2)->n_tries = 1;
+	
+	send_scp_cb_data_t lost_cb_data;
+	cancel_requeue_cb_data_t cb_data;
+	send_scp_cb_data_t replacement_cb_data;
+	wait_for_cb((cb_data_t *)&lost_cb_data);
+	wait_for_cb((cb_data_t *)&cb_data.cb_data);
+	wait_for_cb((cb_data_t *)&replacement_cb_data);
+	cb_data.replacement = &replacement_cb_data;
 	
 	// Create an empty payload
-	uv_buf_t data;
-	data.base = NULL;
-	data.len = 0;
-	
-	// Create a set of callbacks which we'll wait on for replies
-	send_scp_cb_data_t cb_data[n_packets];
-	for (i = 0; i < n_packets; i++)
-		wait_for_cb((cb_data_t *)&(cb_data[i]));
+	uv_buf_t no_data;
+	no_data.base = NULL;
+	no_data.len = 0;
 	
-	// Send lots of packets at once
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       no_data,
+	                       0,
+	                       send_scp_cb, &lost_cb_data));
+	cb_data.cancel = rs_get_handle(conn);
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       no_data,
+	                       0,
+	                       cancel_requeue_cb, &cb_data));
+	
+	ck_assert(!wait_for_all_cb());
+	ck_assert(lost_cb_data.error == RS_ECANCELLED);
+	ck_assert(!cb_data.cb_data.error);
+	ck_assert(!replacement_cb_data.error);
+	
+	// The replacement was sent just once and nothing was fast retransmitted
+	ck_assert_uint_eq(mm_get_req(mm, 2)->n_tries, 2);
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_fast_retransmissions, 0);
+	ck_assert_uint_eq(stats.n_retransmissions, 0);
+}
+END_TEST
+
+
+/**
+ * Make sure the connection statistics count the traffic sent and received.
+ */
+START_TEST (test_stats)
+{
+	rs_stats_t stats;
+	size_t i;
+	
+	// Create an empty payload
+	uv_buf_t no_data;
+	no_data.base = NULL;
+	no_data.len = 0;
+	
+	// Send an SCP packet which is only responded to on its second attempt
+	send_scp_cb_data_t scp_cb_data;
+	wait_for_cb((cb_data_t *)&scp_cb_data);
+	ck_assert(!rs_send_scp(conn,
+	                       (1 << 8) | 2, // Respond after 1 msec and two attempts
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       no_data,
+	                       no_data.len,
+	                       send_scp_cb, &scp_cb_data));
+	
+	// Its packet (only) should be in flight
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.queue_depth, 0);
+	ck_assert_uint_eq(stats.n_in_flight, 1);
+	ck_assert_uint_eq(stats.window, N_OUTSTANDING);
+	
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!scp_cb_data.error);
+	
+	// Read two packets, some of whose responses are duplicated, and write one
+	const size_t length = 2 * MM_SCP_DATA_LENGTH;
+	unsigned char data_buf[length];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	uint32_t addr = (0 |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	rw_cb_data_t read_cb_data;
+	wait_for_cb((cb_data_t *)&read_cb_data);
+	ck_assert(!rs_read(conn,
+	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                   2, // Send some duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &read_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!read_cb_data.error);
+	
+	rw_cb_data_t write_cb_data;
+	wait_for_cb((cb_data_t *)&write_cb_data);
+	data.len = MM_SCP_DATA_LENGTH;
+	ck_assert(!rs_write(conn,
+	                    (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                    0, // Send no duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &write_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!write_cb_data.error);
+	
+	// Wait for any stray duplicates to arrive
+	wait_for_cb((cb_data_t *)&scp_cb_data);
+	ck_assert(!rs_send_scp(conn,
+	                       (TIMEOUT/4 << 8) | 1, // Respond after a while
+	                       0, // Send no duplicates
+	                       0, // An arbitrary cmd_rc
+	                       0, 0, 0, 0, 0, // No arguments
+	                       no_data,
+	                       no_data.len,
+	                       send_scp_cb, &scp_cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.scp_packet.n_packets_sent, 3);
+	ck_assert_uint_eq(stats.scp_packet.n_responses, 2);
+	ck_assert_uint_eq(stats.scp_packet.n_bytes, 0);
+	ck_assert_uint_eq(stats.read.n_packets_sent, 2);
+	ck_assert_uint_eq(stats.read.n_responses, 2);
+	ck_assert_uint_eq(stats.read.n_bytes, length);
+	ck_assert_uint_eq(stats.write.n_packets_sent, 1);
+	ck_assert_uint_eq(stats.write.n_responses, 1);
+	ck_assert_uint_eq(stats.write.n_bytes, MM_SCP_DATA_LENGTH);
+	ck_assert_uint_eq(stats.n_retransmissions, 1);
+	ck_assert_uint_eq(stats.n_timeouts, 1);
+	ck_assert_uint_eq(stats.n_failed, 0);
+	ck_assert_uint_eq(stats.n_dropped_malformed, 0);
+	ck_assert_uint_eq(stats.n_dropped_unmatched, 4);
+	ck_assert_uint_eq(stats.syscalls.n_send_packets, 6);
+	
+	// Every response except the retransmitted one gives a round-trip time
+	uint64_t n_samples = 0;
+	for (i = 0; i < RS_N_RTT_BUCKETS; i++)
+		n_samples += stats.rtt_histogram[i];
+	ck_assert_uint_eq(stats.n_rtt_samples, 4);
+	ck_assert_uint_eq(n_samples, stats.n_rtt_samples);
+	ck_assert_uint_le(stats.rtt_min, stats.rtt_max);
+	ck_assert_uint_ge(stats.rtt_total, stats.rtt_min * stats.n_rtt_samples);
+	ck_assert_uint_le(stats.rtt_total, stats.rtt_max * stats.n_rtt_samples);
+	ck_assert_uint_lt(stats.rtt_max, (TIMEOUT + FUDGE) * 1000000ull);
+	
+	// Resetting clears the counters
+	rs_reset_stats(conn);
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.read.n_packets_sent, 0);
+	ck_assert_uint_eq(stats.n_rtt_samples, 0);
+	ck_assert_uint_eq(stats.syscalls.n_send_packets, 0);
+	ck_assert_uint_eq(stats.window, N_OUTSTANDING);
+}
+END_TEST
+
+
+/**
+ * Make sure high-priority SCP packets are not stuck behind bulk transfers when
+ * a slot is reserved for them.
+ */
+START_TEST (test_priority)
+{
+	// Offset for the data in memory
+	const size_t offset = 10;
+	
+	// Number of packets in the bulk read
+	const size_t n_packets = 3;
+	const size_t length = MM_SCP_DATA_LENGTH * n_packets;
+	
+	rs_set_priority_reserve(conn, 1);
+	
+	// Start a slow bulk read (not waited for until later)
+	rw_cb_data_t rw_cb_data;
+	rw_cb_data.generic_info.n_calls = 0;
+	unsigned char data_buf[length];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_read(conn,
+	                   (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
+	                   0, // Send no duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &rw_cb_data));
+	
+	// Send a high-priority packet which should be sent immediately using the
+	// reserved slot
+	send_scp_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	uv_buf_t no_data;
+	no_data.base = NULL;
+	no_data.len = 0;
+	ck_assert(!rs_send_scp_priority(conn, RS_PRIORITY_HIGH,
+	                                (1 << 8) | 1, // Respond after 1 msec
+	                                0, // Send no duplicates
+	                                0, // An arbitrary cmd_rc
+	                                0, 0, 0, 0, 0, // No arguments
+	                                no_data,
+	                                no_data.len,
+	                                send_scp_cb, &cb_data));
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	ck_assert(!cb_data.error);
+	ck_assert_int_lt(time_after - time_before, TIMEOUT/4);
+	
+	// The bulk read, using only the unreserved slot, should still be in progress
+	ck_assert_uint_eq(rw_cb_data.generic_info.n_calls, 0);
+	
+	// Wait for the bulk read which should take one round per packet since only
+	// one slot is available to it
+	wait_for_cb((cb_data_t *)&rw_cb_data);
+	ck_assert(!wait_for_all_cb());
+	time_after = uv_now(loop);
+	ck_assert(!rw_cb_data.error);
+	ck_assert_int_ge(time_after - time_before,
+	                 (TIMEOUT/2) * (n_packets - 1));
+}
+END_TEST
+
+
+/**
+ * Make sure vectored reads (_i == 0) and writes (_i == 1) merge adjacent
+ * segments into full packets and complete with a single callback.
+ */
+START_TEST (test_rwv)
+{
+	bool write = _i;
+	size_t i;
+	
+	// Three segments covering two packets' worth of adjacent addresses (but not
+	// adjacent buffers) in one block and a short segment in another block.
+	const size_t offset = 12;
+	const size_t lengths[4] = {MM_SCP_DATA_LENGTH / 2,
+	                           MM_SCP_DATA_LENGTH / 2,
+	                           MM_SCP_DATA_LENGTH,
+	                           8};
+	unsigned char bufs[4][MM_SCP_DATA_LENGTH];
+	rs_rw_seg_t segs[4];
+	size_t addr_offset = offset;
+	for (i = 0; i < 4; i++) {
+		segs[i].dest_addr = (1 << 8) | 1; // Respond after 1 msec and one attempt
+		segs[i].dest_cpu = 0; // Send no duplicates
+		segs[i].address = (addr_offset |  // Start at the given offset
+		                   (i == 3 ? 1u : 0u)<<10 |  // The RW ID
+		                   255u<<16 | // No errors
+		                   255u<<24); // Respond to all the same speed
+		segs[i].data.base = (void *)bufs[i];
+		segs[i].data.len = lengths[i];
+		segs[i].error = -1;
+		addr_offset = (i == 2) ? 0 : addr_offset + lengths[i];
+	}
+	
+	// Set up some fake data to read back/write
+	mm_rw_t *rws[2] = {mm_get_rw(mm, 0), mm_get_rw(mm, 1)};
+	for (i = 0; i < MM_MAX_RW; i++) {
+		rws[0]->data[i] = (unsigned char)i;
+		rws[1]->data[i] = (unsigned char)(i + 100);
+	}
+	for (i = 0; i < 4; i++)
+		memset(bufs[i], write ? 0xA0 + i : 0, MM_SCP_DATA_LENGTH);
+	
+	// Create a callback which we'll wait on for a reply
+	rwv_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	if (write)
+		ck_assert(!rs_writev(conn, segs, 4, rwv_cb, &cb_data));
+	else
+		ck_assert(!rs_readv(conn, segs, 4, rwv_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	// Check the single callback reported success for every segment
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.segs == segs);
+	ck_assert_uint_eq(cb_data.n_segs, 4);
+	for (i = 0; i < 4; i++)
+		ck_assert(!segs[i].error);
+	
+	// The adjacent segments should have been merged into full packets
+	ck_assert_uint_eq(rws[0]->n_responses_sent, 2);
+	ck_assert_uint_eq(rws[1]->n_responses_sent, 1);
+	
+	// Check the right data was read/written
+	size_t len = 0;
+	for (i = 0; i < 3; i++) {
+		if (write) {
+			size_t j;
+			for (j = 0; j < lengths[i]; j++)
+				ck_assert_uint_eq((unsigned char)rws[0]->data[offset + len + j],
+				                  0xA0 + i);
+		} else {
+			ck_assert(memcmp(bufs[i], rws[0]->data + offset + len,
+			                 lengths[i]) == 0);
+		}
+		len += lengths[i];
+	}
+	if (write)
+		ck_assert_uint_eq((unsigned char)rws[1]->data[0], 0xA3);
+	else
+		ck_assert(memcmp(bufs[3], rws[1]->data, lengths[3]) == 0);
+	for (i = 0; i < MM_MAX_RW; i++) {
+		uint8_t count = (i >= offset && i < offset + len) ? 1 : 0;
+		ck_assert_uint_eq(write ? rws[0]->write_count[i]
+		                        : rws[0]->read_count[i], count);
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure streaming reads deliver data in order and stop reading while the
+ * consumer holds every buffer (_i == 1) rather than releasing them immediately
+ * (_i == 0).
+ */
+START_TEST (test_read_stream)
+{
+	// Offset for the data in memory
+	const size_t offset = 12;
+	
+	// Four chunks of two packets each, the last being half a packet short
+	const size_t chunk_size = 2 * MM_SCP_DATA_LENGTH;
+	const size_t n_chunks = 4;
+	const size_t length = (chunk_size * n_chunks) - MM_SCP_DATA_LENGTH / 2;
+	const unsigned int n_bufs = 2;
+	
+	size_t i;
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++)
+		rw->data[offset + i] = (unsigned char)i;
+	
+	unsigned char data_buf[length];
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	stream_cb_data_t cb_data;
+	cb_data.release = !_i;
+	cb_data.n_chunks_wanted = cb_data.release ? n_chunks : n_bufs;
+	cb_data.base = data_buf;
+	cb_data.start_address = addr;
+	cb_data.end_address = addr;
+	cb_data.n_held = 0;
+	cb_data.n_chunks = 0;
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_read_stream(conn,
+	                          (1 << 8) | 1, // Respond after 1 msec
+	                          0, // Send no duplicates
+	                          addr,
+	                          length,
+	                          chunk_size,
+	                          n_bufs,
+	                          stream_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!cb_data.error);
+	
+	if (!cb_data.release) {
+		// While both buffers are held, no more chunks should be read (allowing
+		// plenty of time for any stray reads to complete)
+		send_scp_cb_data_t scp_cb_data;
+		wait_for_cb((cb_data_t *)&scp_cb_data);
+		uv_buf_t no_data;
+		no_data.base = NULL;
+		no_data.len = 0;
+		ck_assert(!rs_send_scp(conn,
+		                       (TIMEOUT/4 << 8) | 1, // Respond after a while
+		                       0, // Send no duplicates
+		                       0, // An arbitrary cmd_rc
+		                       0, 0, 0, 0, 0, // No arguments
+		                       no_data,
+		                       no_data.len,
+		                       send_scp_cb, &scp_cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_uint_eq(cb_data.n_chunks, n_bufs);
+		ck_assert(!cb_data.last);
+		ck_assert_uint_eq(rw->n_responses_sent, n_bufs * 2);
+		
+		// Releasing the buffers allows the stream to complete
+		cb_data.release = true;
+		wait_for_cb((cb_data_t *)&cb_data);
+		for (i = 0; i < cb_data.n_held; i++)
+			rs_stream_release(cb_data.stream, cb_data.held[i]);
+		ck_assert(!wait_for_all_cb());
+		ck_assert(!cb_data.error);
+	}
+	
+	// Check everything was read once, in order
+	ck_assert(cb_data.last);
+	ck_assert_uint_eq(cb_data.n_chunks, n_chunks);
+	ck_assert_uint_eq(cb_data.end_address - addr, length);
+	ck_assert_uint_eq(rw->n_responses_sent, n_chunks * 2);
+	ck_assert(memcmp(data_buf, rw->data + offset, length) == 0);
+}
+END_TEST
+
+
+/**
+ * Make sure that blocks can be read into a file (_i == 0) and written from a
+ * file (_i == 1) through more chunks than there are buffers.
+ */
+START_TEST (test_file)
+{
+	// Offset for the data in memory and of the block within the file
+	const size_t offset = 12;
+	const int64_t file_offset = 100;
+	
+	// Six chunks (each a window of packets), the last being half a packet short
+	const size_t chunk_size = N_OUTSTANDING * MM_SCP_DATA_LENGTH;
+	const size_t n_chunks = 6;
+	const size_t length = (chunk_size * n_chunks) - MM_SCP_DATA_LENGTH / 2;
+	
+	size_t i;
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	unsigned char data_buf[length];
+	for (i = 0; i < length; i++)
+		data_buf[i] = (unsigned char)(i * 7);
+	
+	FILE *f = tmpfile();
+	ck_assert(f);
+	int fd = fileno(f);
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	if (!_i) {
+		memcpy(rw->data + offset, data_buf, length);
+		ck_assert(!rs_read_to_fd(conn,
+		                         (1 << 8) | 1, // Respond after 1 msec
+		                         0, // Send no duplicates
+		                         addr, length,
+		                         fd, file_offset,
+		                         rw_cb, &cb_data));
+	} else {
+		ck_assert_int_eq(pwrite(fd, data_buf, length, file_offset), length);
+		ck_assert(!rs_write_from_fd(conn,
+		                            (1 << 8) | 1, // Respond after 1 msec
+		                            0, // Send no duplicates
+		                            addr, length,
+		                            fd, file_offset,
+		                            rw_cb, &cb_data));
+	}
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == NULL);
+	ck_assert_uint_eq(cb_data.data.len, length);
+	
+	// Check every byte was transferred once
+	ck_assert_uint_eq(rw->n_responses_sent, n_chunks * N_OUTSTANDING);
+	for (i = 0; i < MM_MAX_RW; i++) {
+		unsigned int count = (i >= offset && i < offset + length) ? 1 : 0;
+		ck_assert_uint_eq(rw->read_count[i], _i ? 0 : count);
+		ck_assert_uint_eq(rw->write_count[i], _i ? count : 0);
+	}
+	
+	if (!_i) {
+		unsigned char file_buf[length];
+		ck_assert_int_eq(pread(fd, file_buf, length, file_offset), length);
+		ck_assert(memcmp(file_buf, data_buf, length) == 0);
+	} else {
+		ck_assert(memcmp(rw->data + offset, data_buf, length) == 0);
+		
+		// A file which ends before the end of the block fails the write
+		wait_for_cb((cb_data_t *)&cb_data);
+		ck_assert(!rs_write_from_fd(conn,
+		                            (1 << 8) | 1, // Respond after 1 msec
+		                            0, // Send no duplicates
+		                            addr, length,
+		                            fd, file_offset + chunk_size,
+		                            rw_cb, &cb_data));
+		ck_assert(!wait_for_all_cb());
+		ck_assert_int_eq(cb_data.error, UV_EOF);
+	}
+	
+	fclose(f);
+}
+END_TEST
+
+
+/**
+ * State of a worker thread used by test_threadsafe.
+ */
+#define N_WORKERS 2
+#define N_WORKER_READS 8
+typedef struct {
+	// The worker's thread (and its identity, as seen by the thread itself) and
+	// the event loop's thread
+	uv_thread_t thread;
+	uv_thread_t self;
+	uv_thread_t loop_thread;
+	
+	// The callback queue to complete via (or NULL to complete on the loop).
+	// If use_loop is set, the queue belongs to the worker's own event loop,
+	// otherwise the worker blocks waiting for callbacks.
+	rs_cb_queue_t *cb_queue;
+	bool use_loop;
+	uv_loop_t loop;
+	
+	// The offset of this worker's reads, the buffers read into and the reads'
+	// handles
+	size_t offset;
+	unsigned char bufs[N_WORKER_READS][MM_SCP_DATA_LENGTH];
+	rs_handle_t handles[N_WORKER_READS];
+	
+	// Number of callbacks made, the number made on the wrong thread and the
+	// number reporting an error. Accessed atomically.
+	unsigned int n_done;
+	unsigned int n_wrong_thread;
+	unsigned int n_errors;
+	
+	// Set (atomically) once the worker has finished
+	bool finished;
+} worker_t;
+
+
+static void
+worker_rw_cb(rs_conn_t *conn, int error, uint16_t cmd_rc, uv_buf_t data,
+             void *cb_data)
+{
+	worker_t *w = (worker_t *)cb_data;
+	
+	// Callbacks must be made by the worker when it uses a callback queue
+	uv_thread_t self = uv_thread_self();
+	if (!uv_thread_equal(&self, w->cb_queue ? &(w->self) : &(w->loop_thread)))
+		__atomic_add_fetch(&(w->n_wrong_thread), 1, __ATOMIC_SEQ_CST);
+	if (error)
+		__atomic_add_fetch(&(w->n_errors), 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&(w->n_done), 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void
+worker_main(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	
+	w->self = uv_thread_self();
+	
+	unsigned int i;
+	for (i = 0; i < N_WORKER_READS; i++) {
+		uv_buf_t data;
+		data.base = (void *)w->bufs[i];
+		data.len = MM_SCP_DATA_LENGTH;
+		uint32_t addr = ((w->offset + i * MM_SCP_DATA_LENGTH) | // Offset
+		                 0u<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		if (rs_read_threadsafe(conn, w->cb_queue,
+		                       (1 << 8) | 1, // Respond after 1 msec
+		                       0, // Send no duplicates
+		                       addr,
+		                       data,
+		                       worker_rw_cb, w,
+		                       &(w->handles[i])))
+			__atomic_add_fetch(&(w->n_errors), 1, __ATOMIC_SEQ_CST);
+	}
+	
+	// Wait for the callbacks (which, when made on the event loop thread, are
+	// simply polled for)
+	while (__atomic_load_n(&(w->n_done), __ATOMIC_SEQ_CST) +
+	       __atomic_load_n(&(w->n_errors), __ATOMIC_SEQ_CST) < N_WORKER_READS) {
+		if (w->use_loop)
+			uv_run(&(w->loop), UV_RUN_ONCE);
+		else if (w->cb_queue && !rs_cb_queue_wait(w->cb_queue))
+			__atomic_add_fetch(&(w->n_errors), 1, __ATOMIC_SEQ_CST);
+	}
+	
+	// A queue belonging to a loop is freed by the loop's thread
+	if (w->use_loop) {
+		rs_cb_queue_free(w->cb_queue);
+		w->cb_queue = NULL;
+		if (uv_run(&(w->loop), UV_RUN_DEFAULT) || uv_loop_close(&(w->loop)))
+			__atomic_add_fetch(&(w->n_errors), 1, __ATOMIC_SEQ_CST);
+	}
+	
+	__atomic_store_n(&(w->finished), true, __ATOMIC_SEQ_CST);
+}
+
+
+/**
+ * Make sure requests can be submitted from other threads and that their
+ * callbacks are made on the loop thread (_i == 0) or the submitting thread,
+ * either blocked waiting for them (_i == 1) or running its own event loop
+ * (_i == 2).
+ */
+START_TEST (test_threadsafe)
+{
+	size_t i;
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < MM_MAX_RW; i++)
+		rw->data[i] = (unsigned char)i;
+	
+	worker_t workers[N_WORKERS];
+	for (i = 0; i < N_WORKERS; i++) {
+		worker_t *w = &(workers[i]);
+		w->loop_thread = uv_thread_self();
+		w->use_loop = _i == 2;
+		if (w->use_loop)
+			ck_assert(!uv_loop_init(&(w->loop)));
+		w->cb_queue = _i ? rs_cb_queue_init(w->use_loop ? &(w->loop) : NULL)
+		                 : NULL;
+		ck_assert(!_i || w->cb_queue);
+		w->offset = i * N_WORKER_READS * MM_SCP_DATA_LENGTH;
+		w->n_done = 0;
+		w->n_wrong_thread = 0;
+		w->n_errors = 0;
+		w->finished = false;
+		ck_assert(!uv_thread_create(&(w->thread), worker_main, w));
+	}
+	
+	// Run the event loop until every worker has finished (which will not happen
+	// if the requests never make it to the loop)
+	bool finished = false;
+	while (!finished) {
+		uv_run(loop, UV_RUN_NOWAIT);
+		finished = true;
+		for (i = 0; i < N_WORKERS; i++) {
+			if (!__atomic_load_n(&(workers[i].finished), __ATOMIC_SEQ_CST))
+				finished = false;
+		}
+	}
+	
+	for (i = 0; i < N_WORKERS; i++) {
+		worker_t *w = &(workers[i]);
+		ck_assert(!uv_thread_join(&(w->thread)));
+		ck_assert_uint_eq(w->n_done, N_WORKER_READS);
+		ck_assert_uint_eq(w->n_errors, 0);
+		ck_assert_uint_eq(w->n_wrong_thread, 0);
+		ck_assert(memcmp(w->bufs, rw->data + w->offset, sizeof(w->bufs)) == 0);
+		if (w->cb_queue)
+			rs_cb_queue_free(w->cb_queue);
+	}
+	ck_assert_uint_eq(rw->n_responses_sent, N_WORKERS * N_WORKER_READS);
+	
+	// Every request was given its own handle, even when submitted concurrently
+	size_t j;
+	for (i = 0; i < N_WORKERS * N_WORKER_READS; i++) {
+		rs_handle_t handle = workers[i / N_WORKER_READS]
+		                     .handles[i % N_WORKER_READS];
+		ck_assert(handle != 0);
+		for (j = 0; j < i; j++)
+			ck_assert(handle != workers[j / N_WORKER_READS]
+			                    .handles[j % N_WORKER_READS]);
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure reads to different chips overlap when interleaving is enabled and
+ * that the per-destination limit is respected.
+ */
+START_TEST (test_interleave)
+{
+	// Offset for the data in memory
+	const size_t offset = 10;
+	
+	// Number of packets in the slow bulk read (more than the window)
+	const size_t n_packets = 2 * N_OUTSTANDING;
+	const size_t length = MM_SCP_DATA_LENGTH * n_packets;
+	
+	// Limit each chip to fewer packets than the window such that the slow read
+	// cannot occupy every slot
+	rs_set_interleave(conn, 2, N_OUTSTANDING - 1);
+	
+	// Start a slow bulk read (not waited for until later)
+	rw_cb_data_t slow_cb_data;
+	slow_cb_data.generic_info.n_calls = 0;
+	unsigned char slow_buf[length];
+	uv_buf_t slow_data;
+	slow_data.base = (void *)slow_buf;
+	slow_data.len = length;
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_read(conn,
+	                   (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
+	                   0, // Send no duplicates
+	                   addr,
+	                   slow_data,
+	                   rw_cb, &slow_cb_data));
+	
+	// A single-packet read to another chip queued behind it should be sent
+	// straight away rather than once the slow read's packets have all been sent
+	rw_cb_data_t fast_cb_data;
+	wait_for_cb((cb_data_t *)&fast_cb_data);
+	unsigned char fast_buf[MM_SCP_DATA_LENGTH];
+	uv_buf_t fast_data;
+	fast_data.base = (void *)fast_buf;
+	fast_data.len = MM_SCP_DATA_LENGTH;
+	ck_assert(!rs_read(conn,
+	                   (1 << 8) | 1, // Respond after 1 msec
+	                   0, // Send no duplicates
+	                   addr,
+	                   fast_data,
+	                   rw_cb, &fast_cb_data));
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	ck_assert(!fast_cb_data.error);
+	ck_assert_int_lt(time_after - time_before, TIMEOUT/4);
+	ck_assert_uint_eq(slow_cb_data.generic_info.n_calls, 0);
+	
+	// The slow read should still complete
+	wait_for_cb((cb_data_t *)&slow_cb_data);
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!slow_cb_data.error);
+	
+	// With only one packet in flight per chip, a read should take one round per
+	// packet despite the window being larger. The mock machine's response delay
+	// is only accurate to within a msec.
+	slow_data.len = MM_SCP_DATA_LENGTH * 3;
+	wait_for_cb((cb_data_t *)&slow_cb_data);
+	uv_update_time(loop);
+	time_before = uv_now(loop);
+	ck_assert(!rs_read(conn,
+	                   (TIMEOUT/4 << 8) | 1, // Respond after a quarter timeout
+	                   0, // Send no duplicates
+	                   addr,
+	                   slow_data,
+	                   rw_cb, &slow_cb_data));
+	ck_assert(!wait_for_all_cb());
+	time_after = uv_now(loop);
+	ck_assert(!slow_cb_data.error);
+	ck_assert_int_ge(time_after - time_before, 3 * (TIMEOUT/4 - 1));
+	
+	// Single-packet reads leave the active set as soon as they are sent but
+	// still count towards the limit while in flight
+	const unsigned int max_per_dest = 1;
+	const unsigned int n_reads = 4 * N_OUTSTANDING;
+	rs_set_interleave(conn, 4, max_per_dest);
+	rw_cb_data_t small_cb_data[n_reads];
+	unsigned char small_bufs[n_reads][4];
+	unsigned int i;
+	for (i = 0; i < n_reads; i++) {
+		wait_for_cb((cb_data_t *)&(small_cb_data[i]));
+		uv_buf_t data;
+		data.base = (void *)small_bufs[i];
+		data.len = 4;
+		ck_assert(!rs_read(conn,
+		                   (1 << 8) | 1, // Respond after 1 msec
+		                   0, // Send no duplicates
+		                   addr + (i * 4),
+		                   data,
+		                   rw_cb, &(small_cb_data[i])));
+	}
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_in_flight, max_per_dest);
+	while (uv_run(loop, UV_RUN_ONCE)) {
+		rs_get_stats(conn, &stats);
+		ck_assert_uint_le(stats.n_in_flight, max_per_dest);
+		if (small_cb_data[n_reads - 1].generic_info.n_calls)
+			break;
+	}
+	ck_assert(!wait_for_all_cb());
+	for (i = 0; i < n_reads; i++) {
+		ck_assert_uint_eq(small_cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!small_cb_data[i].error);
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure that a single-packet read command can be sent and received.
+ */
+START_TEST (test_single_packet_read)
+{
+	const size_t offset = _i;
+	size_t i;
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < MM_SCP_DATA_LENGTH; i++) {
+		rw->data[offset + i] = (unsigned char)i;
+	}
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer to hold the read data
+	unsigned char data_buf[MM_SCP_DATA_LENGTH];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = MM_SCP_DATA_LENGTH;
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Send the packet
+	ck_assert(!rs_read(conn,
+	                   (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                   0, // Send no duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// Check one request was made in total
+	ck_assert_uint_eq(rw->n_responses_sent, 1);
+	
+	// Check that only the expected data was read, and it was read once.
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + MM_SCP_DATA_LENGTH)
+			ck_assert_uint_eq(rw->read_count[i], 1);
+		else
+			ck_assert_uint_eq(rw->read_count[i], 0);
+		
+		ck_assert_uint_eq(rw->write_count[i], 0);
+	}
+	
+	// Check the data read is as expected
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	ck_assert(memcmp(cb_data.data.base, rw->data + offset, data.len) == 0);
+	
+	// Check that only one request was sent to the mock machine and that it was as
+	// expected.
+	mm_req_t *req = mm_get_req(mm, 0);
+	ck_assert(req);
+	ck_assert(mm->reqs == req);
+	ck_assert(req->next == NULL);
+	ck_assert_uint_eq(req->n_changes, 1);
+	ck_assert_uint_eq(req->n_tries, 1);
+	ck_assert_uint_eq(UNPACK_RW_ADDR(req->buf.base), addr);
+	ck_assert_uint_eq(UNPACK_RW_LENGTH(req->buf.base), MM_SCP_DATA_LENGTH);
+	ck_assert_uint_eq(UNPACK_RW_TYPE(req->buf.base),
+	                  rs__scp_rw_type(offset, MM_SCP_DATA_LENGTH));
+}
+END_TEST
+
+
+/**
+ * Make sure that a single-packet write command can be sent and received.
+ */
+START_TEST (test_single_packet_write)
+{
+	const size_t offset = _i;
+	size_t i;
+	
+	// Get a reference to the memory block we're going to write to
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer with some dummy data to write
+	unsigned char data_buf[MM_SCP_DATA_LENGTH];
+	for (i = 0; i < MM_SCP_DATA_LENGTH; i++)
+		data_buf[i] = (unsigned char)i;
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = MM_SCP_DATA_LENGTH;
+	
+	// Send the packet
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_write(conn,
+	                    (1 << 8) | 1, // Respond after 1 msec and one attempt
+	                    0, // Send no duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// Check one request was made in total
+	ck_assert_uint_eq(rw->n_responses_sent, 1);
+	
+	// Check that only the expected data was written, and it was written once.
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + MM_SCP_DATA_LENGTH)
+			ck_assert_uint_eq(rw->write_count[i], 1);
+		else
+			ck_assert_uint_eq(rw->write_count[i], 0);
+		
+		ck_assert_uint_eq(rw->read_count[i], 0);
+	}
+	
+	// Check the data written was correct
+	ck_assert(memcmp(rw->data + offset, data_buf, data.len) == 0);
+	
+	// Check the response is as expected
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	
+	// Check that only one request was sent to the mock machine and that it was as
+	// expected.
+	mm_req_t *req = mm_get_req(mm, 0);
+	ck_assert(req);
+	ck_assert(mm->reqs == req);
+	ck_assert(req->next == NULL);
+	ck_assert_uint_eq(req->n_changes, 1);
+	ck_assert_uint_eq(req->n_tries, 1);
+	ck_assert_uint_eq(UNPACK_RW_ADDR(req->buf.base), addr);
+	ck_assert_uint_eq(UNPACK_RW_LENGTH(req->buf.base), MM_SCP_DATA_LENGTH);
+	ck_assert_uint_eq(UNPACK_RW_TYPE(req->buf.base),
+	                  rs__scp_rw_type(offset, MM_SCP_DATA_LENGTH));
+}
+END_TEST
+
+
+/**
+ * Make sure that write packets (whose payload is sent directly from the user's
+ * buffer) are retransmitted intact.
+ */
+START_TEST (test_single_packet_write_retransmit)
+{
+	size_t i;
+	
+	// Get a reference to the memory block we're going to write to
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer with some dummy data to write
+	unsigned char data_buf[MM_SCP_DATA_LENGTH];
+	for (i = 0; i < MM_SCP_DATA_LENGTH; i++)
+		data_buf[i] = (unsigned char)i;
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = MM_SCP_DATA_LENGTH;
+	
+	// Send the packet
+	uint32_t addr = (0u |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_write(conn,
+	                    (1 << 8) | N_TRIES, // Respond after 1 msec and after
+	                                        // the maximum number of tries
+	                                        // before failure
+	                    0, // Send no duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &cb_data));
+	
+	// Wait for a reply
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once and succeeded
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	
+	// Check the data written was correct
+	ck_assert(memcmp(rw->data, data_buf, data.len) == 0);
+	
+	// Check that every attempt sent an identical and complete packet
+	mm_req_t *req = mm_get_req(mm, 0);
+	ck_assert(req);
+	ck_assert(mm->reqs == req);
+	ck_assert(req->next == NULL);
+	ck_assert_uint_eq(req->n_changes, 1);
+	ck_assert_uint_eq(req->n_tries, N_TRIES);
+	ck_assert_uint_eq(req->buf.len,
+	                  RS__SIZEOF_SCP_PACKET(3, MM_SCP_DATA_LENGTH));
+}
+END_TEST
+
+
+/**
+ * Make sure that if several packets are sent at once they are carried out in
+ * parallel. Also checks that duplicate response packets are ignored.
+ */
+START_TEST (test_multiple_scp)
+{
+	// Number parallel rounds worth of packets to send
+	const unsigned int n_rounds = 3;
+	
+	// Number of packets to send at once
+	const unsigned int n_packets = N_OUTSTANDING * n_rounds;
+	
+	unsigned int i;
+	
+	// Create an empty payload
+	uv_buf_t data;
+	data.base = NULL;
+	data.len = 0;
+	
+	// Create a set of callbacks which we'll wait on for replies
+	send_scp_cb_data_t cb_data[n_packets];
+	for (i = 0; i < n_packets; i++)
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+	
+	// Send lots of packets at once
 	for (i = 0; i < n_packets; i++)
 		ck_assert(!rs_send_scp(conn,
 		                       (TIMEOUT/2 << 8) | 1, // Respond after half the
@@ -753,43 +1966,212 @@ START_TEST (test_multiple_scp)
 	ck_assert(!wait_for_all_cb());
 	uint64_t time_after = uv_now(loop);
 	
-	// Check that the time required was such that it would only be possible of
-	// multiple commands were sent in parallel.
-	ck_assert_int_lt(time_after - time_before, (TIMEOUT/2) * n_rounds + FUDGE);
+	// Check that the time required was such that it would only be possible of
+	// multiple commands were sent in parallel.
+	ck_assert_int_lt(time_after - time_before, (TIMEOUT/2) * n_rounds + FUDGE);
+	
+	for (i = 0; i < n_packets; i++) {
+		// Check that the responses came back once
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		
+		// Check that the packet didn't fail and has the right argument
+		ck_assert(cb_data[i].conn == conn);
+		ck_assert(!cb_data[i].error);
+		ck_assert_uint_eq(cb_data[i].cmd_rc, 0);
+		ck_assert_uint_eq(cb_data[i].n_args, 1);
+		ck_assert_uint_eq(cb_data[i].arg1, i);
+		ck_assert(cb_data[i].data.base == data.base);
+		ck_assert(cb_data[i].data.len == data.len);
+		
+		// Check that one request the relevent sequence number was sent to the mock
+		// machine and that it was as expected.
+		mm_req_t *req = mm_get_req(mm, i);
+		ck_assert(req);
+		ck_assert_uint_eq(req->n_changes, 1);
+		ck_assert_uint_eq(req->n_tries, 1);
+		ck_assert_uint_eq(req->buf.len, RS__SIZEOF_SCP_PACKET(1, 0));
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure that a multi-packet read command can be sent and received. Also
+ * checks that duplicate response packets are ignored.
+ */
+START_TEST (test_multiple_packet_read)
+{
+	// Offset for the data in memory
+	const size_t offset = 12;
+	
+	// Number parallel rounds worth of packets to send
+	const unsigned int n_rounds = 3;
+	
+	// Number of packets to send
+	const size_t n_packets = n_rounds * N_OUTSTANDING;
+	
+	// Length of the read request selected to require the specified number of
+	// rounds, with the last round being half-length
+	const size_t length = (MM_SCP_DATA_LENGTH * n_packets)
+	                      - MM_SCP_DATA_LENGTH / 2;
+	
+	size_t i;
+	
+	// Set up some fake data to read back
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	for (i = 0; i < length; i++) {
+		rw->data[offset + i] = (unsigned char)i;
+	}
+	
+	// On the second iteration, the test is repeated with system call batching
+	// enabled and on the third using io_uring (where supported)
+	bool batching = (_i == 1 && rs_set_batching(conn, true) == 0) ||
+	                (_i == 2 && rs_enable_io_uring(conn) == 0);
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	// Set a buffer to hold the read data
+	unsigned char data_buf[length];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	
+	// Send the packet
+	ck_assert(!rs_read(conn,
+	                   (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
+	                   3, // Send some duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &cb_data));
+	
+	// Wait for a reply
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	ck_assert(!wait_for_all_cb());
+	uint64_t time_after = uv_now(loop);
+	
+	// Check that the time required was such that it would only be possible of
+	// multiple commands were sent in parallel.
+	ck_assert_int_lt(time_after - time_before, (TIMEOUT/2) * n_rounds + FUDGE);
+	
+	// Check every packet was sent exactly once and, when batching, that some
+	// were sent together
+	rs_batch_stats_t stats;
+	rs_get_batch_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_send_packets, n_packets);
+	if (batching)
+		ck_assert_uint_lt(stats.n_send_syscalls, stats.n_send_packets);
+	else
+		ck_assert_uint_eq(stats.n_send_syscalls, stats.n_send_packets);
+	
+	// Check that the response came back once
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	// Check the right number of requests were sent
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	
+	// Check that only the expected data was read, and it was read once.
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + length)
+			ck_assert_uint_eq(rw->read_count[i], 1);
+		else
+			ck_assert_uint_eq(rw->read_count[i], 0);
+		
+		ck_assert_uint_eq(rw->write_count[i], 0);
+	}
+	
+	// Check the data read is as expected
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	ck_assert(memcmp(cb_data.data.base, rw->data + offset, data.len) == 0);
+}
+END_TEST
+
+
+/**
+ * Make sure that responses arriving out of order are all accepted, including
+ * when received together with system call batching enabled (_i == 1).
+ */
+START_TEST (test_reordered_read)
+{
+	const size_t length = MM_SCP_DATA_LENGTH;
+	
+	size_t i;
+	
+	if (_i == 1)
+		rs_set_batching(conn, true);
+	
+	// Two reads of different blocks, the first responding more slowly than the
+	// second
+	rw_cb_data_t cb_data[2];
+	unsigned char data_bufs[2][length];
+	for (i = 0; i < 2; i++) {
+		mm_rw_t *rw = mm_get_rw(mm, i);
+		memset(rw->data, i + 1, length);
+		
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		uv_buf_t data;
+		data.base = (void *)data_bufs[i];
+		data.len = length;
+		uint32_t addr = (0 |  // Start at the start
+		                 i<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		ck_assert(!rs_read(conn,
+		                   i ? (1 << 8) | 1  // Respond after 1 msec
+		                     : (5 << 8) | 1, // Respond after 5 msec
+		                   0, // Send no duplicates
+		                   addr,
+		                   data,
+		                   rw_cb, &(cb_data[i])));
+	}
+	
+	// Once both requests have arrived, block the loop until both responses are
+	// due. They are then sent in one go, the second first, and so arrive at the
+	// socket together (to be received by a single system call when batching).
+	unsigned int n_reqs = 0;
+	while (n_reqs < 2) {
+		ck_assert(uv_run(loop, UV_RUN_ONCE));
+		mm_req_t *req;
+		for (n_reqs = 0, req = mm->reqs; req; req = req->next)
+			n_reqs++;
+	}
+	usleep(20 * 1000);
+	
+	ck_assert(!wait_for_all_cb());
 	
-	for (i = 0; i < n_packets; i++) {
-		// Check that the responses came back once
+	// Both reads completed without retransmission and received the right data
+	for (i = 0; i < 2; i++) {
 		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
-		
-		// Check that the packet didn't fail and has the right argument
-		ck_assert(cb_data[i].conn == conn);
 		ck_assert(!cb_data[i].error);
-		ck_assert_uint_eq(cb_data[i].cmd_rc, 0);
-		ck_assert_uint_eq(cb_data[i].n_args, 1);
-		ck_assert_uint_eq(cb_data[i].arg1, i);
-		ck_assert(cb_data[i].data.base == data.base);
-		ck_assert(cb_data[i].data.len == data.len);
-		
-		// Check that one request the relevent sequence number was sent to the mock
-		// machine and that it was as expected.
-		mm_req_t *req = mm_get_req(mm, i);
-		ck_assert(req);
-		ck_assert_uint_eq(req->n_changes, 1);
-		ck_assert_uint_eq(req->n_tries, 1);
-		ck_assert_uint_eq(req->buf.len, RS__SIZEOF_SCP_PACKET(1, 0));
+		ck_assert(memcmp(data_bufs[i], mm_get_rw(mm, i)->data, length) == 0);
 	}
+	
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_retransmissions, 0);
+	ck_assert_uint_eq(stats.n_dropped_unmatched, 0);
 }
 END_TEST
 
 
 /**
- * Make sure that a multi-packet read command can be sent and received. Also
+ * Make sure that a multi-packet write command can be sent and received. Also
  * checks that duplicate response packets are ignored.
  */
-START_TEST (test_multiple_packet_read)
+START_TEST (test_multiple_packet_write)
 {
 	// Offset for the data in memory
-	const size_t offset = 10;
+	const size_t offset = 12;
 	
 	// Number parallel rounds worth of packets to send
 	const unsigned int n_rounds = 3;
@@ -804,34 +2186,37 @@ START_TEST (test_multiple_packet_read)
 	
 	size_t i;
 	
-	// Set up some fake data to read back
+	// Get a reference to the memory block we're going to write to
 	mm_rw_t *rw = mm_get_rw(mm, 0);
-	for (i = 0; i < length; i++) {
-		rw->data[offset + i] = (unsigned char)i;
-	}
+	
+	// On the second iteration, the test is repeated with system call batching
+	// enabled and on the third using io_uring (where supported)
+	bool batching = (_i == 1 && rs_set_batching(conn, true) == 0) ||
+	                (_i == 2 && rs_enable_io_uring(conn) == 0);
 	
 	// Create a callback which we'll wait on for a reply
 	rw_cb_data_t cb_data;
 	wait_for_cb((cb_data_t *)&cb_data);
 	
-	// Set a buffer to hold the read data
+	// Set a buffer with some dummy data to write
 	unsigned char data_buf[length];
+	for (i = 0; i < length; i++)
+		data_buf[i] = (unsigned char)i;
 	uv_buf_t data;
 	data.base = (void *)data_buf;
 	data.len = length;
 	
+	// Send the packet
 	uint32_t addr = (offset |  // Start at the given offset
 	                 0u<<10 |  // The RW ID
 	                 255u<<16 | // No errors
 	                 255u<<24); // Respond to all the same speed
-	
-	// Send the packet
-	ck_assert(!rs_read(conn,
-	                   (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
-	                   3, // Send some duplicates
-	                   addr,
-	                   data,
-	                   rw_cb, &cb_data));
+	ck_assert(!rs_write(conn,
+	                    (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
+	                    3, // Send some duplicates
+	                    addr,
+	                    data,
+	                    rw_cb, &cb_data));
 	
 	// Wait for a reply
 	uv_update_time(loop);
@@ -843,115 +2228,648 @@ START_TEST (test_multiple_packet_read)
 	// multiple commands were sent in parallel.
 	ck_assert_int_lt(time_after - time_before, (TIMEOUT/2) * n_rounds + FUDGE);
 	
+	// Check every packet was sent exactly once and, when batching, that some
+	// were sent together
+	rs_batch_stats_t stats;
+	rs_get_batch_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_send_packets, n_packets);
+	if (batching)
+		ck_assert_uint_lt(stats.n_send_syscalls, stats.n_send_packets);
+	else
+		ck_assert_uint_eq(stats.n_send_syscalls, stats.n_send_packets);
+	
 	// Check that the response came back once
 	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
 	
-	// Check the right number of requests were sent
+	// Check the right number of packets were used
 	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
 	
-	// Check that only the expected data was read, and it was read once.
+	// Check that only the expected data was written, and it was written once.
 	for (i = 0; i < MM_MAX_RW; i++) {
 		if (i >= offset && i < offset + length)
-			ck_assert_uint_eq(rw->read_count[i], 1);
+			ck_assert_uint_eq(rw->write_count[i], 1);
 		else
-			ck_assert_uint_eq(rw->read_count[i], 0);
+			ck_assert_uint_eq(rw->write_count[i], 0);
 		
-		ck_assert_uint_eq(rw->write_count[i], 0);
+		ck_assert_uint_eq(rw->read_count[i], 0);
 	}
 	
-	// Check the data read is as expected
+	// Check the data written was correct
+	ck_assert(memcmp(rw->data + offset, data_buf, data.len) == 0);
+	
+	// Check the response is as expected
 	ck_assert(cb_data.conn == conn);
 	ck_assert(!cb_data.error);
 	ck_assert(cb_data.data.base == data.base);
 	ck_assert(cb_data.data.len == data.len);
-	ck_assert(memcmp(cb_data.data.base, rw->data + offset, data.len) == 0);
 }
 END_TEST
 
 
 /**
- * Make sure that a multi-packet write command can be sent and received. Also
- * checks that duplicate response packets are ignored.
+ * Make sure that fills use a single CMD_FILL for their word-aligned body and
+ * writes for any unaligned bytes at either end.
+ */
+START_TEST (test_fill)
+{
+	// On the first iteration, the block starts and ends part way through a word,
+	// on the second it is word aligned.
+	const size_t offset = _i ? 12 : 10;
+	const size_t length = _i ? 64 : 61;
+	const unsigned int n_packets = _i ? 1 : 3;
+	const uint32_t word = 0xDEADBEEF;
+	
+	size_t i;
+	
+	// Get a reference to the memory block we're going to fill
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_fill(conn,
+	                   (1 << 8) | 1, // Respond after 1 msec
+	                   0, // Send no duplicates
+	                   addr,
+	                   word,
+	                   length,
+	                   rw_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	// Check the right number of packets were used
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	
+	// Check that only the block was filled, once, with the bytes of the word
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + length) {
+			ck_assert_uint_eq(rw->write_count[i], 1);
+			ck_assert_uint_eq((uint8_t)rw->data[i],
+			                  (word >> (8 * (i % 4))) & 0xFF);
+		} else {
+			ck_assert_uint_eq(rw->write_count[i], 0);
+		}
+	}
+	
+	// Check the response is as expected
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == NULL);
+	ck_assert(cb_data.data.len == length);
+	
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.write.n_packets_sent, n_packets);
+	ck_assert_uint_eq(stats.write.n_bytes, length);
+}
+END_TEST
+
+
+/**
+ * Make sure that multi-packet reads and writes which start and end part way
+ * through a word use byte/short accesses only for their unaligned ends.
+ */
+START_TEST (test_unaligned_rw)
+{
+	// On the first iteration a read is performed, on the second a write
+	bool write = _i;
+	
+	// The block starts one byte before a word boundary and ends two bytes after
+	// one, giving a byte head, (whole packets of) word body and short tail.
+	const size_t offset = 11;
+	const unsigned int n_word_packets = 3;
+	const size_t length = 1 + (MM_SCP_DATA_LENGTH * n_word_packets) + 2;
+	const unsigned int n_packets = n_word_packets + 2;
+	
+	size_t i;
+	
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// Some data to read back or write
+	unsigned char data_buf[length];
+	for (i = 0; i < length; i++) {
+		rw->data[offset + i] = (unsigned char)i;
+		data_buf[i] = write ? (unsigned char)(length - i) : 0;
+	}
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!(write ? rs_write : rs_read)(conn,
+	                                        (1 << 8) | 1, // Respond after 1 msec
+	                                        0, // Send no duplicates
+	                                        addr,
+	                                        data,
+	                                        rw_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	// Check only the head and tail used non-word accesses
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	ck_assert_uint_eq(rw->n_word_responses, n_word_packets);
+	
+	// Check that only the expected data was accessed, and it was accessed once
+	for (i = 0; i < MM_MAX_RW; i++) {
+		bool in_block = i >= offset && i < offset + length;
+		ck_assert_uint_eq(write ? rw->write_count[i] : rw->read_count[i],
+		                  in_block ? 1 : 0);
+		ck_assert_uint_eq(write ? rw->read_count[i] : rw->write_count[i], 0);
+	}
+	
+	// Check the response is as expected
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	ck_assert(memcmp(data_buf, rw->data + offset, length) == 0);
+}
+END_TEST
+
+
+/**
+ * Make sure that small writes to adjacent memory which wait in the queue are
+ * coalesced into full packets and that every write's callback is called.
+ */
+START_TEST (test_write_coalescing)
+{
+	// Offset for the data in memory
+	const size_t offset = 12;
+	
+	// The first N_OUTSTANDING writes are sent immediately, the remainder wait in
+	// the queue and are coalesced into a whole number of full packets
+	const size_t write_len = MM_SCP_DATA_LENGTH / 4;
+	const unsigned int n_writes = N_OUTSTANDING + 12;
+	const unsigned int n_packets = N_OUTSTANDING + 3;
+	const size_t length = write_len * n_writes;
+	
+	unsigned int i;
+	
+	// Get a reference to the memory block we're going to write to
+	mm_rw_t *rw = mm_get_rw(mm, 0);
+	
+	// On the second iteration, the test is repeated with system call batching
+	// enabled (where supported)
+	if (_i)
+		rs_set_batching(conn, true);
+	
+	rs_set_write_coalescing(conn, true);
+	
+	// Some dummy data to write, with each write's buffer placed in reverse order
+	// in memory so that no two writes' buffers are adjacent
+	unsigned char data_buf[length];
+	for (i = 0; i < length; i++)
+		data_buf[i] = (unsigned char)i;
+	unsigned char write_bufs[n_writes][write_len + 1];
+	
+	rw_cb_data_t cb_data[n_writes];
+	uv_buf_t data[n_writes];
+	for (i = 0; i < n_writes; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		data[i].base = (void *)write_bufs[n_writes - i - 1];
+		data[i].len = write_len;
+		memcpy(data[i].base, data_buf + (i * write_len), write_len);
+		
+		uint32_t addr = ((offset + (i * write_len)) | // Write after the last
+		                 0u<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		ck_assert(!rs_write(conn,
+		                    (1 << 8) | 1, // Respond after 1 msec
+		                    0, // Send no duplicates
+		                    addr,
+		                    data[i],
+		                    rw_cb, &(cb_data[i])));
+	}
+	
+	ck_assert(!wait_for_all_cb());
+	
+	// Check the writes were coalesced
+	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.write.n_packets_sent, n_packets);
+	ck_assert_uint_eq(stats.write.n_bytes, length);
+	
+	// Check that only the expected data was written, and it was written once.
+	for (i = 0; i < MM_MAX_RW; i++) {
+		if (i >= offset && i < offset + length)
+			ck_assert_uint_eq(rw->write_count[i], 1);
+		else
+			ck_assert_uint_eq(rw->write_count[i], 0);
+	}
+	ck_assert(memcmp(rw->data + offset, data_buf, length) == 0);
+	
+	// Check every write completed with its own buffer
+	for (i = 0; i < n_writes; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(cb_data[i].conn == conn);
+		ck_assert(!cb_data[i].error);
+		ck_assert(cb_data[i].data.base == data[i].base);
+		ck_assert(cb_data[i].data.len == data[i].len);
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure that a pacer limits the rate at which packets are sent, both for a
+ * single connection and when shared by several.
+ */
+START_TEST (test_pacing)
+{
+	// On the first iteration, one connection's packets are counted, on the
+	// second two connections (to different mock machines) share a pacer counting
+	// bytes.
+	const unsigned int n_conns = _i ? 2 : 1;
+	bool bytes = _i;
+	
+	// Offset for the data in memory
+	const size_t offset = 12;
+	
+	// Packets are read in full and, being all the same length, cost the same
+	const size_t n_packets = 12;
+	const size_t length = MM_SCP_DATA_LENGTH * (n_packets / n_conns);
+	const uint64_t packet_cost = bytes ? RS__SIZEOF_SCP_PACKET(3, 0) + 2 : 1;
+	
+	// Once the initial burst is used, the remaining packets are sent at the
+	// given rate (packets/s), allowing for the last packet of a burst being sent
+	// on credit when counting bytes
+	const uint64_t rate = 250;
+	const uint64_t burst = 2;
+	const uint64_t min_time = ((n_packets - burst - 1) * 1000) / rate;
+	
+	unsigned int i;
+	size_t j;
+	
+	rs_pacer_t *pacer = rs_pacer_init(loop, rate * packet_cost,
+	                                  burst * packet_cost, bytes);
+	ck_assert(pacer);
+	
+	// A second mock machine stands in for a second board
+	mm_t *mms[2] = {mm, NULL};
+	rs_conn_t *conns[2] = {conn, NULL};
+	if (n_conns > 1) {
+		mms[1] = mm_init(loop);
+		ck_assert(mms[1]);
+		struct sockaddr_storage conn_addr2;
+		int namelen = sizeof(struct sockaddr_storage);
+		mm_getsockname(mms[1], (struct sockaddr *)&conn_addr2, &namelen);
+		conns[1] = rs_init(loop,
+		                   (struct sockaddr *)&conn_addr2,
+		                   MM_SCP_DATA_LENGTH,
+		                   TIMEOUT,
+		                   N_TRIES,
+		                   N_OUTSTANDING);
+		ck_assert(conns[1]);
+	}
+	
+	// Set up some fake data to read back and the buffers to read it into
+	unsigned char data_buf[n_conns][length];
+	rw_cb_data_t cb_data[n_conns];
+	for (i = 0; i < n_conns; i++) {
+		mm_rw_t *rw = mm_get_rw(mms[i], 0);
+		for (j = 0; j < length; j++)
+			rw->data[offset + j] = (unsigned char)(i + j);
+		
+		rs_set_pacer(conns[i], pacer);
+	}
+	
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	
+	for (i = 0; i < n_conns; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		uv_buf_t data;
+		data.base = (void *)data_buf[i];
+		data.len = length;
+		uint32_t addr = (offset |  // Start at the given offset
+		                 0u<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		ck_assert(!rs_read(conns[i],
+		                   (1 << 8) | 1, // Respond after 1 msec
+		                   0, // Send no duplicates
+		                   addr,
+		                   data,
+		                   rw_cb, &(cb_data[i])));
+	}
+	
+	ck_assert(!wait_for_all_cb());
+	uv_update_time(loop);
+	uint64_t time_after = uv_now(loop);
+	
+	// Check the packets were spread out over (at least) the expected time
+	ck_assert_uint_ge(time_after - time_before, min_time);
+	ck_assert_uint_lt(time_after - time_before, min_time + FUDGE);
+	
+	uint64_t n_pacing_delays = 0;
+	for (i = 0; i < n_conns; i++) {
+		// Check the reads completed correctly
+		mm_rw_t *rw = mm_get_rw(mms[i], 0);
+		ck_assert_uint_eq(rw->n_responses_sent, n_packets / n_conns);
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(!cb_data[i].error);
+		ck_assert(memcmp(data_buf[i], rw->data + offset, length) == 0);
+		
+		rs_stats_t stats;
+		rs_get_stats(conns[i], &stats);
+		n_pacing_delays += stats.n_pacing_delays;
+		
+		rs_set_pacer(conns[i], NULL);
+	}
+	ck_assert_uint_gt(n_pacing_delays, 0);
+	
+	rs_pacer_free(pacer, NULL, NULL);
+	if (n_conns > 1) {
+		rs_free(conns[1], NULL, NULL);
+		mm_free(mms[1]);
+	}
+}
+END_TEST
+
+
+/**
+ * Make sure that requests can be cancelled (or given a deadline) both while
+ * their packets are in flight and while still queued, and that requests queued
+ * behind them then proceed.
+ */
+START_TEST (test_cancel)
+{
+	// On the first iteration, the in-flight read is cancelled, on the second the
+	// queued read is cancelled (followed by the in-flight read) and on the third
+	// the in-flight read is given a deadline.
+	
+	// The first read never gets a response and fills the window, the second
+	// waits behind it
+	const size_t length = MM_SCP_DATA_LENGTH * N_OUTSTANDING * 3;
+	unsigned char data_bufs[2][length];
+	rw_cb_data_t cb_data[2];
+	rs_handle_t handles[2];
+	
+	unsigned int i;
+	
+	ck_assert(rs_get_handle(conn) == 0);
+	
+	for (i = 0; i < 2; i++) {
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		uv_buf_t data;
+		data.base = (void *)data_bufs[i];
+		data.len = length;
+		uint32_t addr = (0 |  // Start at the start
+		                 i<<10 |  // The RW ID
+		                 255u<<16 | // No errors
+		                 255u<<24); // Respond to all the same speed
+		ck_assert(!rs_read(conn,
+		                   i ? (1 << 8) | 1  // Respond after 1 msec
+		                     : (0 << 8) | 0, // Never respond
+		                   0, // Send no duplicates
+		                   addr,
+		                   data,
+		                   rw_cb, &(cb_data[i])));
+		handles[i] = rs_get_handle(conn);
+		ck_assert(handles[i] != 0);
+	}
+	ck_assert(handles[0] != handles[1]);
+	
+	uv_update_time(loop);
+	uint64_t time_before = uv_now(loop);
+	
+	if (_i == 0) {
+		// The callback is called straight away
+		ck_assert(!rs_cancel(conn, handles[0]));
+		ck_assert_uint_eq(cb_data[0].generic_info.n_calls, 1);
+		ck_assert(cb_data[0].error == RS_ECANCELLED);
+	} else if (_i == 1) {
+		ck_assert(!rs_cancel(conn, handles[1]));
+		ck_assert_uint_eq(cb_data[1].generic_info.n_calls, 1);
+		ck_assert(cb_data[1].error == RS_ECANCELLED);
+		ck_assert(!rs_cancel(conn, handles[0]));
+		ck_assert(cb_data[0].error == RS_ECANCELLED);
+	} else {
+		ck_assert(!rs_set_deadline(conn, handles[0], time_before + TIMEOUT / 4));
+		ck_assert_uint_eq(cb_data[0].generic_info.n_calls, 0);
+	}
+	
+	ck_assert(!wait_for_all_cb());
+	uv_update_time(loop);
+	uint64_t time_after = uv_now(loop);
+	
+	// The first read failed once, without waiting for any timeouts
+	ck_assert_uint_eq(cb_data[0].generic_info.n_calls, 1);
+	ck_assert(cb_data[0].error == (_i == 2 ? RS_EDEADLINE : RS_ECANCELLED));
+	ck_assert_uint_lt(time_after - time_before, TIMEOUT);
+	if (_i == 2)
+		ck_assert_uint_ge(time_after - time_before, TIMEOUT / 4);
+	
+	// The second read either completed or was never sent
+	mm_rw_t *rw = mm_get_rw(mm, 1);
+	ck_assert_uint_eq(cb_data[1].generic_info.n_calls, 1);
+	if (_i == 1) {
+		ck_assert_uint_eq(rw->n_responses_sent, 0);
+	} else {
+		ck_assert(!cb_data[1].error);
+		ck_assert(memcmp(data_bufs[1], rw->data, length) == 0);
+	}
+	
+	// Completed requests can no longer be cancelled
+	for (i = 0; i < 2; i++) {
+		ck_assert(rs_cancel(conn, handles[i]));
+		ck_assert(rs_set_deadline(conn, handles[i], 0));
+	}
+	ck_assert(rs_cancel(conn, 0));
+	
+	rs_stats_t stats;
+	rs_get_stats(conn, &stats);
+	ck_assert_uint_eq(stats.n_timeouts, 0);
+}
+END_TEST
+
+
+/**
+ * Make sure operations made up of many requests can be cancelled as a whole
+ * using the handle returned by rs_get_handle: a vectored read (_i == 0), a
+ * stream (_i == 1), a stream given a deadline while reading (_i == 2), a write
+ * from a file (_i == 3) and a read into a file (_i == 4). Also make sure
+ * requests submitted from another thread can be cancelled before the loop has
+ * handled them (_i == 5) and that a vectored read of very many segments is
+ * cancelled quickly (_i == 6).
  */
-START_TEST (test_multiple_packet_write)
+START_TEST (test_cancel_composite)
 {
-	// Offset for the data in memory
-	const size_t offset = 10;
-	
-	// Number parallel rounds worth of packets to send
-	const unsigned int n_rounds = 3;
-	
-	// Number of packets to send
-	const size_t n_packets = n_rounds * N_OUTSTANDING;
-	
-	// Length of the read request selected to require the specified number of
-	// rounds, with the last round being half-length
-	const size_t length = (MM_SCP_DATA_LENGTH * n_packets)
-	                      - MM_SCP_DATA_LENGTH / 2;
-	
-	size_t i;
-	
-	// Get a reference to the memory block we're going to write to
-	mm_rw_t *rw = mm_get_rw(mm, 0);
-	
-	// Create a callback which we'll wait on for a reply
-	rw_cb_data_t cb_data;
-	wait_for_cb((cb_data_t *)&cb_data);
-	
-	// Set a buffer with some dummy data to write
+	const size_t length = 8 * MM_SCP_DATA_LENGTH;
 	unsigned char data_buf[length];
-	for (i = 0; i < length; i++)
-		data_buf[i] = (unsigned char)i;
-	uv_buf_t data;
-	data.base = (void *)data_buf;
-	data.len = length;
-	
-	// Send the packet
-	uint32_t addr = (offset |  // Start at the given offset
+	uint32_t addr = (0 |  // Start at the start
 	                 0u<<10 |  // The RW ID
 	                 255u<<16 | // No errors
 	                 255u<<24); // Respond to all the same speed
-	ck_assert(!rs_write(conn,
-	                    (TIMEOUT/2 << 8) | 1, // Respond after half the timeout
-	                    3, // Send some duplicates
-	                    addr,
-	                    data,
-	                    rw_cb, &cb_data));
+	uint16_t never = (0 << 8) | 0; // Never respond
+	
+	memset(data_buf, 0, length);
+	FILE *f = tmpfile();
+	ck_assert(f);
+	int fd = fileno(f);
+	ck_assert_int_eq(pwrite(fd, data_buf, length, 0), length);
+	
+	// Enough segments that cancelling them one at a time (each time searching
+	// the queue afresh) would take seconds
+	const size_t n_many = 20000;
+	rs_rw_seg_t *segs = malloc(n_many * sizeof(rs_rw_seg_t));
+	ck_assert(segs);
+	size_t n_segs = _i == 6 ? n_many : 2;
+	unsigned char *many_buf = _i == 6 ? malloc(n_many * 4) : NULL;
+	rwv_cb_data_t rwv_cb_data;
+	stream_cb_data_t stream_cb_data;
+	rw_cb_data_t rw_cb_data;
+	cb_data_t *generic_info;
+	rs_handle_t handle;
 	
-	// Wait for a reply
-	uv_update_time(loop);
-	uint64_t time_before = uv_now(loop);
-	ck_assert(!wait_for_all_cb());
-	uint64_t time_after = uv_now(loop);
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
 	
-	// Check that the time required was such that it would only be possible of
-	// multiple commands were sent in parallel.
-	ck_assert_int_lt(time_after - time_before, (TIMEOUT/2) * n_rounds + FUDGE);
+	stream_cb_data.release = true;
+	stream_cb_data.n_chunks_wanted = length / MM_SCP_DATA_LENGTH;
+	stream_cb_data.base = data_buf;
+	stream_cb_data.start_address = addr;
+	stream_cb_data.end_address = addr;
+	stream_cb_data.n_held = 0;
+	stream_cb_data.n_chunks = 0;
 	
-	// Check that the response came back once
-	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	size_t i;
+	switch (_i) {
+		case 0:
+			// Two segments which cannot be merged (and so are read separately)
+			for (i = 0; i < 2; i++) {
+				segs[i].dest_addr = never;
+				segs[i].dest_cpu = 0;
+				segs[i].address = addr + (i * 2 * MM_SCP_DATA_LENGTH);
+				segs[i].data.base = (void *)(data_buf + (i * MM_SCP_DATA_LENGTH));
+				segs[i].data.len = MM_SCP_DATA_LENGTH;
+			}
+			generic_info = (cb_data_t *)&rwv_cb_data;
+			wait_for_cb(generic_info);
+			ck_assert(!rs_readv(conn, segs, 2, rwv_cb, &rwv_cb_data));
+			break;
+		
+		case 1:
+		case 2:
+			generic_info = (cb_data_t *)&stream_cb_data;
+			wait_for_cb(generic_info);
+			ck_assert(!rs_read_stream(conn,
+			                          _i == 1 ? never
+			                                  : (TIMEOUT/4 << 8) | 1,
+			                          0, addr, length,
+			                          MM_SCP_DATA_LENGTH, 1,
+			                          stream_cb, &stream_cb_data));
+			break;
+		
+		case 3:
+		case 4:
+			generic_info = (cb_data_t *)&rw_cb_data;
+			wait_for_cb(generic_info);
+			if (_i == 3)
+				ck_assert(!rs_write_from_fd(conn, never, 0, addr, length, fd, 0,
+				                            rw_cb, &rw_cb_data));
+			else
+				ck_assert(!rs_read_to_fd(conn, never, 0, addr, length, fd, 0,
+				                         rw_cb, &rw_cb_data));
+			break;
+		
+		case 5:
+			generic_info = (cb_data_t *)&rw_cb_data;
+			wait_for_cb(generic_info);
+			ck_assert(!rs_read_threadsafe(conn, NULL, never, 0, addr, data,
+			                              rw_cb, &rw_cb_data, &handle));
+			break;
+		
+		default:
+			// Many small segments, none of which can be merged
+			ck_assert(many_buf);
+			for (i = 0; i < n_segs; i++) {
+				segs[i].dest_addr = never;
+				segs[i].dest_cpu = 0;
+				segs[i].address = addr + (i * 8);
+				segs[i].data.base = (void *)(many_buf + (i * 4));
+				segs[i].data.len = 4;
+			}
+			generic_info = (cb_data_t *)&rwv_cb_data;
+			wait_for_cb(generic_info);
+			ck_assert(!rs_readv(conn, segs, n_segs, rwv_cb, &rwv_cb_data));
+			break;
+	}
 	
-	// Check the right number of packets were used
-	ck_assert_uint_eq(rw->n_responses_sent, n_packets);
+	if (_i != 5) {
+		handle = rs_get_handle(conn);
+		ck_assert(handle != 0);
+	}
 	
-	// Check that only the expected data was written, and it was written once.
-	for (i = 0; i < MM_MAX_RW; i++) {
-		if (i >= offset && i < offset + length)
-			ck_assert_uint_eq(rw->write_count[i], 1);
-		else
-			ck_assert_uint_eq(rw->write_count[i], 0);
+	// Each operation is cancelled (or fails at its deadline) as a whole
+	if (_i == 2) {
+		uv_update_time(loop);
+		ck_assert(!rs_set_deadline(conn, handle,
+		                           uv_now(loop) + TIMEOUT/2 + TIMEOUT/8));
+	} else {
+		uint64_t time_before = uv_hrtime();
+		ck_assert(!rs_cancel(conn, handle));
+		uint64_t time_after = uv_hrtime();
+		if (_i == 6)
+			ck_assert_uint_lt(time_after - time_before, 250 * 1000000ull);
+	}
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(generic_info->n_calls, 1);
+	
+	switch (_i) {
+		case 0:
+		case 6:
+			ck_assert(rwv_cb_data.error == RS_ECANCELLED);
+			for (i = 0; i < n_segs; i++)
+				ck_assert(segs[i].error == RS_ECANCELLED);
+			break;
 		
-		ck_assert_uint_eq(rw->read_count[i], 0);
+		case 1:
+		case 2:
+			ck_assert(stream_cb_data.last);
+			if (_i == 1) {
+				ck_assert(stream_cb_data.error == RS_ECANCELLED);
+				ck_assert_uint_eq(stream_cb_data.n_chunks, 0);
+			} else {
+				// Chunks read after the deadline was set are given it too
+				ck_assert(stream_cb_data.error == RS_EDEADLINE);
+				ck_assert_uint_ge(stream_cb_data.n_chunks, 1);
+				ck_assert_uint_lt(stream_cb_data.n_chunks,
+				                  length / MM_SCP_DATA_LENGTH);
+			}
+			break;
+		
+		default:
+			ck_assert(rw_cb_data.error == RS_ECANCELLED);
+			break;
 	}
 	
-	// Check the data written was correct
-	ck_assert(memcmp(rw->data + offset, data_buf, data.len) == 0);
+	// A write from a file is cancelled before anything is sent
+	if (_i == 3)
+		ck_assert(mm->reqs == NULL);
 	
-	// Check the response is as expected
-	ck_assert(cb_data.conn == conn);
-	ck_assert(!cb_data.error);
-	ck_assert(cb_data.data.base == data.base);
-	ck_assert(cb_data.data.len == data.len);
+	// The operation has completed and so can't be cancelled again
+	ck_assert(rs_cancel(conn, handle));
+	ck_assert(rs_set_deadline(conn, handle, 0));
+	
+	free(segs);
+	free(many_buf);
+	fclose(f);
 }
 END_TEST
 
@@ -1177,6 +3095,477 @@ START_TEST (test_read_fail)
 END_TEST
 
 
+/**
+ * Callback data for test_read_fail_requeue.
+ */
+typedef struct {
+	rw_cb_data_t rw_cb_data;
+	send_scp_cb_data_t *scp_cb_data;
+} read_fail_requeue_cb_data_t;
+
+
+/**
+ * Read callback which sends an SCP packet from within the callback.
+ */
+static void
+read_fail_requeue_cb(rs_conn_t *conn, int error, uint16_t cmd_rc,
+                     uv_buf_t data, void *cb_data)
+{
+	read_fail_requeue_cb_data_t *d = (read_fail_requeue_cb_data_t *)cb_data;
+	rw_cb(conn, error, cmd_rc, data, &(d->rw_cb_data));
+	
+	uv_buf_t no_data = {0};
+	ck_assert(!rs_send_scp(conn, (0 << 8) | 1, 0, 0, 0, 0, 0, 0, 0,
+	                       no_data, 0, send_scp_cb, d->scp_cb_data));
+}
+
+
+/**
+ * Make sure that a request made from the callback of a read which failed with
+ * a bad response is unaffected by the release of the failed read's slot (which
+ * the new request may re-use).
+ */
+START_TEST (test_read_fail_requeue)
+{
+	send_scp_cb_data_t scp_cb_data;
+	read_fail_requeue_cb_data_t cb_data;
+	cb_data.scp_cb_data = &scp_cb_data;
+	wait_for_cb((cb_data_t *)&(cb_data.rw_cb_data));
+	wait_for_cb((cb_data_t *)&scp_cb_data);
+	
+	char data_buf[MM_SCP_DATA_LENGTH];
+	uv_buf_t data;
+	data.base = data_buf;
+	data.len = sizeof(data_buf);
+	
+	uint32_t addr = (0u<<10 |  // The RW ID
+	                 0u<<16 |  // Return an error on the 1st reply
+	                 255u<<24); // Respond to all the same speed
+	ck_assert(!rs_read(conn,
+	                   (0 << 8) | 1, // Always reply instantly
+	                   0, // Send no duplicates
+	                   addr,
+	                   data,
+	                   read_fail_requeue_cb, &cb_data));
+	
+	ck_assert(!wait_for_all_cb());
+	
+	// The read failed once and the SCP packet completed successfully
+	ck_assert_uint_eq(cb_data.rw_cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.rw_cb_data.error == RS_EBAD_RC);
+	ck_assert_uint_eq(scp_cb_data.generic_info.n_calls, 1);
+	ck_assert(!scp_cb_data.error);
+}
+END_TEST
+
+
+
+/**
+ * Callback data for test_init_auto, recording the connection and a copy of the
+ * parameters reported.
+ */
+typedef struct {
+	cb_data_t generic_info;
+	
+	rs_conn_t *conn;
+	int error;
+	bool have_params;
+	rs_auto_params_t params;
+} auto_cb_data_t;
+
+
+static void
+auto_cb(rs_conn_t *conn, int error, const rs_auto_params_t *params,
+        void *cb_data)
+{
+	auto_cb_data_t *d = (auto_cb_data_t *)cb_data;
+	d->conn = conn;
+	d->error = error;
+	d->have_params = params != NULL;
+	if (params)
+		d->params = *params;
+	
+	d->generic_info.n_calls++;
+}
+
+
+/**
+ * Make sure rs_init_auto discovers the machine's data field length, chooses
+ * sensible parameters and produces a working connection (_i == 0) or reports
+ * an error if the machine does not respond (_i == 1).
+ */
+START_TEST (test_init_auto)
+{
+	const unsigned int max_outstanding = 4;
+	
+	mm->sver = true;
+	
+	uint32_t probe_address = (0 |  // Start at the beginning
+	                          0u<<10 |  // The RW ID
+	                          255u<<16 | // No errors
+	                          255u<<24); // Respond to all the same speed
+	
+	auto_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	ck_assert(!rs_init_auto(loop,
+	                        (struct sockaddr *)&conn_addr,
+	                        _i ? 0 // Never respond
+	                           : (1 << 8) | 1, // Respond after 1 msec
+	                        probe_address,
+	                        N_TRIES,
+	                        max_outstanding,
+	                        auto_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	
+	if (_i) {
+		ck_assert(!cb_data.conn);
+		ck_assert_int_eq(cb_data.error, RS_ETIMEOUT);
+		ck_assert(!cb_data.have_params);
+		return;
+	}
+	
+	ck_assert(cb_data.conn);
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.have_params);
+	
+	// The data length comes from CMD_VER and the timeout allows for the
+	// (roughly 1 msec) round-trip time
+	ck_assert_uint_eq(cb_data.params.scp_data_length, MM_SCP_DATA_LENGTH);
+	ck_assert_uint_gt(cb_data.params.rtt, 0);
+	ck_assert_uint_gt(cb_data.params.timeout, cb_data.params.rtt / 1000000);
+	ck_assert_uint_ge(cb_data.params.n_outstanding, 1);
+	ck_assert_uint_le(cb_data.params.n_outstanding, max_outstanding);
+	ck_assert_uint_gt(cb_data.params.throughput, 0);
+	
+	// The connection works, sending full-length packets (using a different RW
+	// ID to the probing reads so that packets reusing their sequence numbers
+	// are not mistaken for retransmissions)
+	uint32_t addr = (0 |  // Start at the beginning
+	                 1u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	mm_rw_t *rw = mm_get_rw(mm, 1);
+	unsigned char data_buf[2 * MM_SCP_DATA_LENGTH];
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = sizeof(data_buf);
+	rw_cb_data_t rw_cb_data;
+	wait_for_cb((cb_data_t *)&rw_cb_data);
+	unsigned int n_responses_before = rw->n_responses_sent;
+	ck_assert(!rs_read(cb_data.conn,
+	                   (1 << 8) | 1, // Respond after 1 msec
+	                   0, // Send no duplicates
+	                   addr,
+	                   data,
+	                   rw_cb, &rw_cb_data));
+	ck_assert(!wait_for_all_cb());
+	ck_assert(!rw_cb_data.error);
+	ck_assert_uint_eq(rw->n_responses_sent - n_responses_before, 2);
+	ck_assert(memcmp(data_buf, rw->data, data.len) == 0);
+	
+	rs_free(cb_data.conn, NULL, NULL);
+}
+END_TEST
+
+
+/**
+ * Make sure a pool routes requests to the nearest connection and that striped
+ * reads and writes arrive intact with a single callback.
+ */
+START_TEST (test_pool)
+{
+	bool write = _i;
+	
+	// Offset for the data in memory
+	const size_t offset = 12;
+	
+	// Number of packets to send, split into stripes of two packets
+	const size_t n_packets = 6;
+	const size_t stripe_size = 2 * MM_SCP_DATA_LENGTH;
+	const size_t length = MM_SCP_DATA_LENGTH * n_packets;
+	
+	size_t i;
+	
+	// A second mock machine stands in for a second board (the connections must
+	// not share a mock machine since they use independent sequence numbers).
+	mm_t *mm2 = mm_init(loop);
+	ck_assert(mm2);
+	struct sockaddr_storage conn_addr2;
+	int namelen = sizeof(struct sockaddr_storage);
+	mm_getsockname(mm2, (struct sockaddr *)&conn_addr2, &namelen);
+	
+	// Create a pool of connections to both mock machines, nominally attached to
+	// chips (0, 0) and (48, 0).
+	const struct sockaddr *addrs[2] = {(struct sockaddr *)&conn_addr,
+	                                   (struct sockaddr *)&conn_addr2};
+	const uint16_t eth_addrs[2] = {0x0000, 0x3000};
+	rs_pool_t *pool = rs_pool_init(loop, 2, addrs, eth_addrs,
+	                               MM_SCP_DATA_LENGTH, TIMEOUT, N_TRIES,
+	                               N_OUTSTANDING);
+	ck_assert(pool);
+	rs_pool_set_striping(pool, 2, stripe_size);
+	
+	// Check routing picks the nearest Ethernet chip
+	ck_assert(rs_pool_get_conn(pool, 0x0101) == rs_pool_get_conn(pool, 0x0000));
+	ck_assert(rs_pool_get_conn(pool, 0x3201) == rs_pool_get_conn(pool, 0x3000));
+	ck_assert(rs_pool_get_conn(pool, 0x0000) != rs_pool_get_conn(pool, 0x3000));
+	
+	// Set up some fake data to read back (from either machine) or to write
+	mm_rw_t *rws[2] = {mm_get_rw(mm, 0), mm_get_rw(mm2, 0)};
+	unsigned char data_buf[length];
+	for (i = 0; i < length; i++) {
+		rws[0]->data[offset + i] = (unsigned char)i;
+		rws[1]->data[offset + i] = (unsigned char)i;
+		data_buf[i] = (unsigned char)(length - i);
+	}
+	uv_buf_t data;
+	data.base = (void *)data_buf;
+	data.len = length;
+	
+	// Create a callback which we'll wait on for a reply
+	rw_cb_data_t cb_data;
+	wait_for_cb((cb_data_t *)&cb_data);
+	
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	if (write)
+		ck_assert(!rs_pool_write(pool, (1 << 8) | 1, 0, addr, data,
+		                         rw_cb, &cb_data));
+	else
+		ck_assert(!rs_pool_read(pool, (1 << 8) | 1, 0, addr, data,
+		                        rw_cb, &cb_data));
+	ck_assert(!wait_for_all_cb());
+	
+	// Check that the response came back once, via the nearest connection
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.conn == rs_pool_get_conn(pool, (1 << 8) | 1));
+	ck_assert(!cb_data.error);
+	ck_assert(cb_data.data.base == data.base);
+	ck_assert(cb_data.data.len == data.len);
+	
+	// Check the stripes alternated between the machines, starting with the
+	// nearest, and that the data is intact
+	ck_assert_uint_eq(rws[0]->n_responses_sent, 4);
+	ck_assert_uint_eq(rws[1]->n_responses_sent, 2);
+	for (i = 0; i < length; i += stripe_size)
+		ck_assert(memcmp(data_buf + i,
+		                 rws[(i / stripe_size) % 2]->data + offset + i,
+		                 stripe_size) == 0);
+	rs_handle_t handle = rs_pool_get_handle(pool);
+	ck_assert(handle != 0);
+	
+	// A striped request which is never responded to is cancelled as a whole,
+	// its callback being called just once
+	cb_data.generic_info.n_calls = 0;
+	if (write)
+		ck_assert(!rs_pool_write(pool, (0 << 8) | 0, 0, addr, data,
+		                         rw_cb, &cb_data));
+	else
+		ck_assert(!rs_pool_read(pool, (0 << 8) | 0, 0, addr, data,
+		                        rw_cb, &cb_data));
+	ck_assert(rs_pool_get_handle(pool) != handle);
+	handle = rs_pool_get_handle(pool);
+	ck_assert(!rs_pool_set_deadline(pool, handle, 0));
+	ck_assert(!rs_pool_cancel(pool, handle));
+	ck_assert_uint_eq(cb_data.generic_info.n_calls, 1);
+	ck_assert(cb_data.error == RS_ECANCELLED);
+	ck_assert(rs_pool_cancel(pool, handle));
+	
+	rs_pool_free(pool, NULL, NULL);
+	mm_free(mm2);
+}
+END_TEST
+
+
+/**
+ * Callback on a transport being freed: counts calls.
+ */
+static void
+transport_free_cb(void *cb_data)
+{
+	(*(unsigned int *)cb_data)++;
+}
+
+
+/**
+ * Make sure connections sharing a transport each receive their own responses
+ * (even though they use overlapping sequence numbers) and that the transport
+ * is only freed once its connections have been.
+ */
+START_TEST (test_shared_transport)
+{
+	// Offset for the data in memory
+	const size_t offset = 10;
+	const size_t length = MM_SCP_DATA_LENGTH * 4;
+	
+	size_t i;
+	
+	// A second mock machine stands in for a second board
+	mm_t *mm2 = mm_init(loop);
+	ck_assert(mm2);
+	struct sockaddr_storage conn_addr2;
+	int namelen = sizeof(struct sockaddr_storage);
+	mm_getsockname(mm2, (struct sockaddr *)&conn_addr2, &namelen);
+	
+	// Since responses are matched to connections by their source address, the
+	// machines (which listen on all interfaces) must be addressed via the
+	// loopback interface.
+	struct sockaddr_in addrs[2];
+	ck_assert(!uv_ip4_addr(
+		"127.0.0.1", ntohs(((struct sockaddr_in *)&conn_addr)->sin_port),
+		&(addrs[0])));
+	ck_assert(!uv_ip4_addr(
+		"127.0.0.1", ntohs(((struct sockaddr_in *)&conn_addr2)->sin_port),
+		&(addrs[1])));
+	
+	rs_transport_t *transport = rs_transport_init(loop, AF_INET);
+	ck_assert(transport);
+	rs_conn_t *conns[2];
+	for (i = 0; i < 2; i++) {
+		conns[i] = rs_init_shared(transport, (struct sockaddr *)&(addrs[i]),
+		                          MM_SCP_DATA_LENGTH, TIMEOUT, N_TRIES,
+		                          N_OUTSTANDING);
+		ck_assert(conns[i]);
+	}
+	
+	// Give each machine different data to read back
+	mm_rw_t *rws[2] = {mm_get_rw(mm, 0), mm_get_rw(mm2, 0)};
+	for (i = 0; i < length; i++) {
+		rws[0]->data[offset + i] = (unsigned char)i;
+		rws[1]->data[offset + i] = (unsigned char)(length - i);
+	}
+	
+	// Read from both machines at once
+	unsigned char data_bufs[2][length];
+	rw_cb_data_t cb_data[2];
+	uint32_t addr = (offset |  // Start at the given offset
+	                 0u<<10 |  // The RW ID
+	                 255u<<16 | // No errors
+	                 255u<<24); // Respond to all the same speed
+	for (i = 0; i < 2; i++) {
+		uv_buf_t data;
+		data.base = (void *)data_bufs[i];
+		data.len = length;
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_read(conns[i], (1 << 8) | 1, 0, addr, data,
+		                   rw_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	
+	// Each read completed once via its own connection with its own machine's
+	// data
+	for (i = 0; i < 2; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(cb_data[i].conn == conns[i]);
+		ck_assert(!cb_data[i].error);
+		ck_assert(memcmp(data_bufs[i], rws[i]->data + offset, length) == 0);
+		
+		rs_stats_t stats;
+		rs_get_stats(conns[i], &stats);
+		ck_assert_uint_eq(stats.n_dropped_unmatched, 0);
+	}
+	
+	// Freeing the transport before its connections have been freed must defer
+	// freeing until they have been
+	unsigned int n_transport_frees = 0;
+	rs_transport_free(transport, transport_free_cb, &n_transport_frees);
+	rs_free(conns[0], NULL, NULL);
+	uv_run(loop, UV_RUN_NOWAIT);
+	ck_assert_uint_eq(n_transport_frees, 0);
+	rs_free(conns[1], NULL, NULL);
+	while (!n_transport_frees)
+		uv_run(loop, UV_RUN_ONCE);
+	ck_assert_uint_eq(n_transport_frees, 1);
+	
+	mm_free(mm2);
+}
+END_TEST
+
+
+/**
+ * Make sure that several connections on a transport sharing a remote address
+ * never have the same sequence number outstanding (as their responses can
+ * only be told apart by sequence number) and so each receives its own data
+ * when they read at the same time.
+ */
+START_TEST (test_shared_address)
+{
+	const size_t length = MM_SCP_DATA_LENGTH * 2 * N_OUTSTANDING;
+	
+	size_t i;
+	
+	// Responses are matched to connections by their source address and so the
+	// machine must be addressed via the loopback interface.
+	struct sockaddr_in addr;
+	ck_assert(!uv_ip4_addr(
+		"127.0.0.1", ntohs(((struct sockaddr_in *)&conn_addr)->sin_port),
+		&addr));
+	
+	rs_transport_t *transport = rs_transport_init(loop, AF_INET);
+	ck_assert(transport);
+	rs_conn_t *conns[2];
+	for (i = 0; i < 2; i++) {
+		conns[i] = rs_init_shared(transport, (struct sockaddr *)&addr,
+		                          MM_SCP_DATA_LENGTH, TIMEOUT, N_TRIES,
+		                          N_OUTSTANDING);
+		ck_assert(conns[i]);
+	}
+	
+	// Each connection reads different data (via a different RW ID)
+	mm_rw_t *rws[2] = {mm_get_rw(mm, 1), mm_get_rw(mm, 2)};
+	for (i = 0; i < length; i++) {
+		rws[0]->data[i] = (unsigned char)i;
+		rws[1]->data[i] = (unsigned char)(length - i);
+	}
+	
+	// Read via both connections at once
+	unsigned char data_bufs[2][length];
+	rw_cb_data_t cb_data[2];
+	for (i = 0; i < 2; i++) {
+		uint32_t rw_addr = (0 |  // Start at the beginning
+		                    (uint32_t)(i + 1) << 10 |  // The RW ID
+		                    255u<<16 | // No errors
+		                    255u<<24); // Respond to all the same speed
+		uv_buf_t data;
+		data.base = (void *)data_bufs[i];
+		data.len = length;
+		wait_for_cb((cb_data_t *)&(cb_data[i]));
+		ck_assert(!rs_read(conns[i], (1 << 8) | 1, 0, rw_addr, data,
+		                   rw_cb, &(cb_data[i])));
+	}
+	ck_assert(!wait_for_all_cb());
+	
+	// Each read completed once via its own connection with its own data
+	for (i = 0; i < 2; i++) {
+		ck_assert_uint_eq(cb_data[i].generic_info.n_calls, 1);
+		ck_assert(cb_data[i].conn == conns[i]);
+		ck_assert(!cb_data[i].error);
+		ck_assert(memcmp(data_bufs[i], rws[i]->data, length) == 0);
+		ck_assert_uint_eq(rws[i]->n_responses_sent, length / MM_SCP_DATA_LENGTH);
+		
+		rs_stats_t stats;
+		rs_get_stats(conns[i], &stats);
+		ck_assert_uint_eq(stats.n_dropped_unmatched, 0);
+		ck_assert_uint_eq(stats.n_retransmissions, 0);
+	}
+	
+	// The machine never saw two different packets with the same sequence
+	// number
+	for (i = 0; i < 4 * length / MM_SCP_DATA_LENGTH; i++)
+		ck_assert_uint_le(mm_get_req(mm, i)->n_changes, 1);
+	
+	for (i = 0; i < 2; i++)
+		rs_free(conns[i], NULL, NULL);
+	unsigned int n_transport_frees = 0;
+	rs_transport_free(transport, transport_free_cb, &n_transport_frees);
+	while (!n_transport_frees)
+		uv_run(loop, UV_RUN_ONCE);
+}
+END_TEST
+
 
 Suite *
 make_rig_scp_suite(void)
@@ -1190,14 +3579,38 @@ make_rig_scp_suite(void)
 	tcase_add_loop_test(tc_core, test_single_scp, 0, 4);
 	tcase_add_test(tc_core, test_single_scp_timeout);
 	tcase_add_test(tc_core, test_single_scp_retransmit);
+	tcase_add_test(tc_core, test_adaptive_timeout);
+	tcase_add_test(tc_core, test_congestion_control);
+	tcase_add_test(tc_core, test_fast_retransmit);
+	tcase_add_loop_test(tc_core, test_fast_retransmit_reuse, 0, 2);
+	tcase_add_test(tc_core, test_stats);
+	tcase_add_test(tc_core, test_priority);
+	tcase_add_test(tc_core, test_interleave);
+	tcase_add_loop_test(tc_core, test_rwv, 0, 2);
+	tcase_add_loop_test(tc_core, test_read_stream, 0, 2);
+	tcase_add_loop_test(tc_core, test_file, 0, 2);
+	tcase_add_loop_test(tc_core, test_threadsafe, 0, 3);
 	tcase_add_loop_test(tc_core, test_single_packet_read, 0, 4);
 	tcase_add_loop_test(tc_core, test_single_packet_write, 0, 4);
+	tcase_add_test(tc_core, test_single_packet_write_retransmit);
 	tcase_add_test(tc_core, test_multiple_scp);
-	tcase_add_test(tc_core, test_multiple_packet_read);
-	tcase_add_test(tc_core, test_multiple_packet_write);
+	tcase_add_loop_test(tc_core, test_multiple_packet_read, 0, 3);
+	tcase_add_loop_test(tc_core, test_reordered_read, 0, 2);
+	tcase_add_loop_test(tc_core, test_multiple_packet_write, 0, 3);
+	tcase_add_loop_test(tc_core, test_write_coalescing, 0, 2);
+	tcase_add_loop_test(tc_core, test_pacing, 0, 2);
+	tcase_add_loop_test(tc_core, test_cancel, 0, 3);
+	tcase_add_loop_test(tc_core, test_cancel_composite, 0, 7);
+	tcase_add_loop_test(tc_core, test_fill, 0, 2);
+	tcase_add_loop_test(tc_core, test_unaligned_rw, 0, 2);
 	tcase_add_test(tc_core, test_non_obstructing);
 	tcase_add_test(tc_core, test_read_timeout);
 	tcase_add_test(tc_core, test_read_fail);
+	tcase_add_test(tc_core, test_read_fail_requeue);
+	tcase_add_loop_test(tc_core, test_pool, 0, 2);
+	tcase_add_loop_test(tc_core, test_init_auto, 0, 2);
+	tcase_add_test(tc_core, test_shared_transport);
+	tcase_add_test(tc_core, test_shared_address);
 	
 	
 	// Add each test case to the suite
@@ -296,6 +296,79 @@ START_TEST (test_pack_scp_packet)
 END_TEST
 
 
+START_TEST (test_pack_rw_packet)
+{
+	// Create buffers large enough for a read/write packet header
+	char rw_buf_data[RS__SIZEOF_SCP_PACKET(3, 0)];
+	char buf_data[RS__SIZEOF_SCP_PACKET(3, 0)];
+	uv_buf_t buf;
+	buf.base = buf_data;
+	buf.len = 0;
+	
+	uv_buf_t empty;
+	empty.base = NULL;
+	empty.len = 0;
+	
+	// The template and the packet should match the generic packing function
+	// exactly
+	rs__pack_rw_template(rw_buf_data, 0xA55A, 7, 0xDEAD);
+	rs__pack_rw_packet(rw_buf_data, 0xBEEF,
+	                   0x11213141, 0x12223242, RS__RW_TYPE_WORD);
+	rs__pack_scp_packet(&buf, 256,
+	                    0xA55A, 7,
+	                    0xDEAD, 0xBEEF,
+	                    3, 0x11213141, 0x12223242, RS__RW_TYPE_WORD,
+	                    empty);
+	ck_assert_uint_eq(buf.len, RS__SIZEOF_SCP_PACKET(3, 0));
+	ck_assert(memcmp(rw_buf_data, buf_data, buf.len) == 0);
+	
+	// Ensure the fields are little-endian
+	ck_assert(memcmp(rw_buf_data, packet, 12) == 0);
+	ck_assert(memcmp(rw_buf_data + 12, "\x41\x31\x21\x11", 4) == 0);
+	ck_assert(memcmp(rw_buf_data + 16, "\x42\x32\x22\x12", 4) == 0);
+	ck_assert(memcmp(rw_buf_data + 20, "\x02\x00\x00\x00", 4) == 0);
+	
+	// Re-packing the same template with different fields should only change
+	// those fields
+	rs__pack_rw_packet(rw_buf_data, 0x1234,
+	                   0xCAFEF00D, 0x100, RS__RW_TYPE_BYTE);
+	rs__pack_scp_packet(&buf, 256,
+	                    0xA55A, 7,
+	                    0xDEAD, 0x1234,
+	                    3, 0xCAFEF00D, 0x100, RS__RW_TYPE_BYTE,
+	                    empty);
+	ck_assert(memcmp(rw_buf_data, buf_data, buf.len) == 0);
+}
+END_TEST
+
+
+START_TEST (test_unpack_rw_response)
+{
+	// Create a buffer large enough for the largest packet
+	char buf_data[packet_len];
+	uv_buf_t buf;
+	uv_buf_t data;
+	
+	// Without a payload
+	memcpy(buf_data, packet_no_arg_no_data, packet_no_arg_no_data_len);
+	buf.base = buf_data;
+	buf.len = packet_no_arg_no_data_len;
+	ck_assert_uint_eq(rs__unpack_rw_response(buf, &data), 0xDEAD);
+	ck_assert_uint_eq(data.len, 0);
+	
+	// With a payload, the arguments are treated as data
+	memcpy(buf_data, packet, packet_len);
+	buf.len = packet_len;
+	ck_assert_uint_eq(rs__unpack_rw_response(buf, &data), 0xDEAD);
+	ck_assert(data.base == buf_data + 12);
+	ck_assert_uint_eq(data.len, 16);
+	
+	// Ensure the data didn't get modified
+	ck_assert(memcmp(buf_data, packet, packet_len) == 0);
+}
+END_TEST
+
+
 Suite *
 make_scp_suite(void)
 {
@@ -308,6 +381,8 @@ make_scp_suite(void)
 	tcase_add_test(tc_core, test_unpack_scp_packet);
 	tcase_add_test(tc_core, test_unpack_scp_packet_seq_num);
 	tcase_add_test(tc_core, test_pack_scp_packet);
+	tcase_add_test(tc_core, test_pack_rw_packet);
+	tcase_add_test(tc_core, test_unpack_rw_response);
 	
 	// Add each test case to the suite
 	suite_add_tcase(s, tc_core);